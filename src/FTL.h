@@ -59,11 +59,22 @@
 // Default: -60 (one minute before a full hour)
 #define GCdelay (-60)
 
+// Pause between two slices of the garbage collection [milliseconds]
+#define GC_SLICE_PAUSE 10
+
+// Domains and strings are only compacted if at least 1/N of them can be removed
+#define COMPACT_MIN_FRACTION 8
+
 // How many client connection do we accept at once?
 #define MAXCONNS 255
 
-// Over how many queries do we iterate at most when trying to find a match?
-#define MAXITER 1000
+// Minimum number of entries of the per-client DNS cache if it is size-limited
+#define PER_CLIENT_CACHE_MIN 1024
+
+// Maximum number of pre-forked TCP workers. This is half of the processes
+// dnsmasq allows for handling TCP connections (MAX_PROCS) so some remain
+// available for connections arriving while all workers are busy
+#define TCP_WORKERS_MAX 30
 
 // How many hours do we want to store in FTL's memory? [hours]
 #define MAXLOGAGE 24
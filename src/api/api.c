@@ -30,6 +30,10 @@
 #include "../database/query-table.h"
 // in_auditlist()
 #include "../database/gravity-db.h"
+// domain_index_filter_info()
+#include "../database/domain-index.h"
+// rate_limited_clients()
+#include "../ratelimit.h"
 // struct overTime
 #include "../overTime.h"
 // Version information
@@ -245,12 +249,14 @@ void getTopDomains(const char *client_message, const int *sock)
 
 	for(int domainID=0; domainID < counters->domains; domainID++)
 	{
-		// Get domain pointer
-		const domainsData* domain = getDomain(domainID, true);
-		if(domain == NULL)
+		temparray[domainID][0] = domainID;
+		temparray[domainID][1] = 0;
+
+		// Get domain pointer, skipping slots freed by compaction
+		const domainsData* domain = getDomain(domainID, false);
+		if(domain == NULL || domain->magic != MAGICBYTE)
 			continue;
 
-		temparray[domainID][0] = domainID;
 		if(blocked)
 			temparray[domainID][1] = domain->blockedcount;
 		else
@@ -307,9 +313,9 @@ void getTopDomains(const char *client_message, const int *sock)
 	{
 		// Get sorted index
 		const int domainID = temparray[i][0];
-		// Get domain pointer
-		const domainsData* domain = getDomain(domainID, true);
-		if(domain == NULL)
+		// Get domain pointer, skipping slots freed by compaction
+		const domainsData* domain = getDomain(domainID, false);
+		if(domain == NULL || domain->magic != MAGICBYTE)
 			continue;
 
 		// Skip this domain if there is a filter on it
@@ -779,9 +785,9 @@ void getAllQueries(const char *client_message, const int *sock)
 		// Iterate through all known domains
 		for(int domainID = 0; domainID < counters->domains; domainID++)
 		{
-			// Get domain pointer
-			const domainsData* domain = getDomain(domainID, true);
-			if(domain == NULL)
+			// Get domain pointer, skipping slots freed by compaction
+			const domainsData* domain = getDomain(domainID, false);
+			if(domain == NULL || domain->magic != MAGICBYTE)
 				continue;
 
 			// Try to match the requested string
@@ -858,15 +864,17 @@ void getAllQueries(const char *client_message, const int *sock)
 
 	}
 
-	int ibeg = 0, num;
+	// Queries are identified by increasing IDs, the oldest query in memory
+	// has ID queries_head
+	const int iend = counters->queries_head + counters->queries;
+	int ibeg = counters->queries_head, num;
 	// Test for integer that specifies number of entries to be shown
 	if(sscanf(client_message, "%*[^(](%i)", &num) > 0)
 	{
 		// User wants a different number of requests
-		// Don't allow a start index that is smaller than zero
-		ibeg = counters->queries-num;
-		if(ibeg < 0)
-			ibeg = 0;
+		// Don't allow a start index that is smaller than the oldest query
+		if(num < counters->queries)
+			ibeg = iend - num;
 	}
 
 	// Get potentially existing filtering flags
@@ -885,7 +893,7 @@ void getAllQueries(const char *client_message, const int *sock)
 	}
 	clearSetupVarsArray();
 
-	for(int queryID = ibeg; queryID < counters->queries; queryID++)
+	for(int queryID = ibeg; queryID < iend; queryID++)
 	{
 		const queriesData* query = getQuery(queryID, true);
 		// Check if this query has been create while in maximum privacy mode
@@ -1016,7 +1024,12 @@ void getAllQueries(const char *client_message, const int *sock)
 		if ((query->status == QUERY_REGEX || query->status == QUERY_REGEX_CNAME) &&
 		    config.privacylevel < PRIVACY_HIDE_DOMAINS)
 		{
-			unsigned int cacheID = findCacheID(query->domainID, query->clientID, query->type);
+			// Only look up the cache entry, this must not create a new one.
+			// Queries imported from the database were cached before the
+			// groups of their client were known
+			int cacheID = lookup_dns_cache_hash(query->domainID, getCacheGroupset(query->clientID), query->type);
+			if(cacheID < 0)
+				cacheID = lookup_dns_cache_hash(query->domainID, -1 - query->clientID, query->type);
 			DNSCacheData *dns_cache = getDNSCache(cacheID, true);
 			if(dns_cache != NULL)
 				regex_idx = dns_cache->black_regex_idx;
@@ -1121,7 +1134,8 @@ void getRecentBlocked(const char *client_message, const int *sock)
 
 	// Find most recently blocked query
 	int found = 0;
-	for(int queryID = counters->queries - 1; queryID > 0 ; queryID--)
+	const int ibeg = counters->queries_head;
+	for(int queryID = ibeg + counters->queries - 1; queryID >= ibeg; queryID--)
 	{
 		const queriesData* query = getQuery(queryID, true);
 		if(query == NULL)
@@ -1228,6 +1242,123 @@ void getDBstats(const int *sock)
 	}
 }
 
+void getPerClientCacheInfo(const int *sock)
+{
+	if(istelnet[*sock])
+		ssend(*sock, "size: %i\nmax: %u\nhits: %u\nmisses: %u\nevictions: %u\ngroup-sets: %i\n",
+		             counters->dns_cache_size, config.per_client_cache_size,
+		             counters->dns_cache_stats.hits,
+		             counters->dns_cache_stats.misses,
+		             counters->dns_cache_stats.evictions,
+		             counters->groupsets);
+	else {
+		pack_int32(*sock, counters->dns_cache_size);
+		pack_int32(*sock, config.per_client_cache_size);
+		pack_int32(*sock, counters->dns_cache_stats.hits);
+		pack_int32(*sock, counters->dns_cache_stats.misses);
+		pack_int32(*sock, counters->dns_cache_stats.evictions);
+		pack_int32(*sock, counters->groupsets);
+	}
+}
+
+void getGCStats(const int *sock)
+{
+	if(istelnet[*sock])
+	{
+		ssend(*sock, "slices: %u\nremoved: %u\nlast-slice-us: %u\nmax-lock-hold-us: %u\n",
+		             counters->gc_stats.slices,
+		             counters->gc_stats.removed,
+		             counters->gc_stats.last_usec,
+		             counters->gc_stats.max_usec);
+		ssend(*sock, "compactions: %u\nremoved-domains: %u\nremoved-cache-entries: %u\nreclaimed-domain-bytes: %u\nreclaimed-string-bytes: %u\n",
+		             counters->compaction.runs,
+		             counters->compaction.domains,
+		             counters->compaction.cache_entries,
+		             counters->compaction.domain_bytes,
+		             counters->compaction.string_bytes);
+	}
+	else {
+		pack_int32(*sock, counters->gc_stats.slices);
+		pack_int32(*sock, counters->gc_stats.removed);
+		pack_int32(*sock, counters->gc_stats.last_usec);
+		pack_int32(*sock, counters->gc_stats.max_usec);
+		pack_int32(*sock, counters->compaction.runs);
+		pack_int32(*sock, counters->compaction.domains);
+		pack_int32(*sock, counters->compaction.cache_entries);
+		pack_int32(*sock, counters->compaction.domain_bytes);
+		pack_int32(*sock, counters->compaction.string_bytes);
+	}
+}
+
+void getListFilterStats(const int *sock)
+{
+	unsigned int keys = 0u;
+	size_t bytes = 0u;
+	domain_index_filter_info(&keys, &bytes);
+
+	if(istelnet[*sock])
+	{
+		ssend(*sock, "domains: %u\nbytes: %zu\nbits-per-domain: %.2f\n",
+		             keys, bytes, keys > 0u ? 8.0*bytes/keys : 0.0);
+		ssend(*sock, "hits: %u\nmisses: %u\nfalse-positives: %u\n",
+		             counters->list_filter.hits,
+		             counters->list_filter.misses,
+		             counters->list_filter.false_positives);
+	}
+	else {
+		pack_int32(*sock, keys);
+		pack_int32(*sock, bytes);
+		pack_int32(*sock, counters->list_filter.hits);
+		pack_int32(*sock, counters->list_filter.misses);
+		pack_int32(*sock, counters->list_filter.false_positives);
+	}
+}
+
+void getRateLimitStats(const int *sock)
+{
+	const unsigned int clients = rate_limited_clients();
+	const unsigned int subnets = rate_limited_subnets();
+
+	if(istelnet[*sock])
+	{
+		ssend(*sock, "refused-queries: %u\nlimited-clients: %u\nlimited-subnets: %u\n",
+		             counters->rate_limit.queries,
+		             counters->rate_limit.clients,
+		             counters->rate_limit.subnets);
+		ssend(*sock, "active-clients: %u\nactive-subnets: %u\n", clients, subnets);
+	}
+	else {
+		pack_int32(*sock, counters->rate_limit.queries);
+		pack_int32(*sock, counters->rate_limit.clients);
+		pack_int32(*sock, counters->rate_limit.subnets);
+		pack_int32(*sock, clients);
+		pack_int32(*sock, subnets);
+	}
+}
+
+void getTCPWorkerStats(const int *sock)
+{
+	if(istelnet[*sock])
+	{
+		ssend(*sock, "pool-size: %u\nworkers: %u\nbusy: %u\nstarted: %u\n",
+		             config.tcp_workers,
+		             counters->tcp_pool.workers,
+		             counters->tcp_pool.busy,
+		             counters->tcp_pool.started);
+		ssend(*sock, "pooled-connections: %u\nforked-connections: %u\n",
+		             counters->tcp_pool.pooled,
+		             counters->tcp_pool.forked);
+	}
+	else {
+		pack_int32(*sock, config.tcp_workers);
+		pack_int32(*sock, counters->tcp_pool.workers);
+		pack_int32(*sock, counters->tcp_pool.busy);
+		pack_int32(*sock, counters->tcp_pool.started);
+		pack_int32(*sock, counters->tcp_pool.pooled);
+		pack_int32(*sock, counters->tcp_pool.forked);
+	}
+}
+
 void getClientsOverTime(const int *sock)
 {
 	int sendit = -1, until = OVERTIME_SLOTS;
@@ -1310,7 +1441,7 @@ void getClientsOverTime(const int *sock)
 			// Also skip clients with no active counts at all (may be old IPv6 addresses)
 			if(client->count == 0)
 				continue;
-			const int thisclient = client->overTime[slot];
+			const int thisclient = get_client_overTime(clientID, slot);
 
 			if(istelnet[*sock])
 				ssend(*sock, " %i", thisclient);
@@ -1400,7 +1531,8 @@ void getUnknownQueries(const int *sock)
 	if(config.privacylevel >= PRIVACY_HIDE_DOMAINS)
 		return;
 
-	for(int queryID = 0; queryID < counters->queries; queryID++)
+	const int iend = counters->queries_head + counters->queries;
+	for(int queryID = counters->queries_head; queryID < iend; queryID++)
 	{
 		const queriesData* query = getQuery(queryID, true);
 
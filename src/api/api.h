@@ -27,6 +27,11 @@ void getClientID(const int *sock);
 void getVersion(const int *sock);
 void getDBstats(const int *sock);
 void getUnknownQueries(const int *sock);
+void getPerClientCacheInfo(const int *sock);
+void getGCStats(const int *sock);
+void getListFilterStats(const int *sock);
+void getRateLimitStats(const int *sock);
+void getTCPWorkerStats(const int *sock);
 
 // DNS resolver methods (dnsmasq_interface.c)
 void getCacheInformation(const int *sock);
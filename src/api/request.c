@@ -32,23 +32,28 @@ void process_request(const char *client_message, int *sock)
 	EOT[1] = 0x00;
 	bool processed = false;
 
+	// Read-only requests only take the shared lock so they can be processed
+	// concurrently. They must not modify anything in shared memory
 	if(command(client_message, ">stats"))
 	{
 		processed = true;
-		lock_shm();
+		lock_shm_read();
 		getStats(sock);
-		unlock_shm();
+		unlock_shm_read();
 	}
 	else if(command(client_message, ">overTime"))
 	{
 		processed = true;
-		lock_shm();
+		lock_shm_read();
 		getOverTime(sock);
-		unlock_shm();
+		unlock_shm_read();
 	}
 	else if(command(client_message, ">top-domains") || command(client_message, ">top-ads"))
 	{
 		processed = true;
+		// Exclusive lock: the audit list is checked using the shared
+		// gravity database connection and the setupVars.conf parser
+		// keeps its state in globals, neither may be used concurrently
 		lock_shm();
 		getTopDomains(client_message, sock);
 		unlock_shm();
@@ -56,6 +61,7 @@ void process_request(const char *client_message, int *sock)
 	else if(command(client_message, ">top-clients"))
 	{
 		processed = true;
+		// Exclusive lock: setupVars.conf parsing is not reentrant
 		lock_shm();
 		getTopClients(client_message, sock);
 		unlock_shm();
@@ -63,27 +69,28 @@ void process_request(const char *client_message, int *sock)
 	else if(command(client_message, ">forward-dest"))
 	{
 		processed = true;
-		lock_shm();
+		lock_shm_read();
 		getUpstreamDestinations(client_message, sock);
-		unlock_shm();
+		unlock_shm_read();
 	}
 	else if(command(client_message, ">forward-names"))
 	{
 		processed = true;
-		lock_shm();
+		lock_shm_read();
 		getUpstreamDestinations(">forward-dest unsorted", sock);
-		unlock_shm();
+		unlock_shm_read();
 	}
 	else if(command(client_message, ">querytypes"))
 	{
 		processed = true;
-		lock_shm();
+		lock_shm_read();
 		getQueryTypes(sock);
-		unlock_shm();
+		unlock_shm_read();
 	}
 	else if(command(client_message, ">getallqueries"))
 	{
 		processed = true;
+		// Exclusive lock: setupVars.conf parsing is not reentrant
 		lock_shm();
 		getAllQueries(client_message, sock);
 		unlock_shm();
@@ -91,9 +98,9 @@ void process_request(const char *client_message, int *sock)
 	else if(command(client_message, ">recentBlocked"))
 	{
 		processed = true;
-		lock_shm();
+		lock_shm_read();
 		getRecentBlocked(client_message, sock);
-		unlock_shm();
+		unlock_shm_read();
 	}
 	else if(command(client_message, ">clientID"))
 	{
@@ -118,6 +125,7 @@ void process_request(const char *client_message, int *sock)
 	else if(command(client_message, ">ClientsoverTime"))
 	{
 		processed = true;
+		// Exclusive lock: setupVars.conf parsing is not reentrant
 		lock_shm();
 		getClientsOverTime(sock);
 		unlock_shm();
@@ -125,6 +133,7 @@ void process_request(const char *client_message, int *sock)
 	else if(command(client_message, ">client-names"))
 	{
 		processed = true;
+		// Exclusive lock: setupVars.conf parsing is not reentrant
 		lock_shm();
 		getClientNames(sock);
 		unlock_shm();
@@ -132,9 +141,9 @@ void process_request(const char *client_message, int *sock)
 	else if(command(client_message, ">unknown"))
 	{
 		processed = true;
-		lock_shm();
+		lock_shm_read();
 		getUnknownQueries(sock);
-		unlock_shm();
+		unlock_shm_read();
 	}
 	else if(command(client_message, ">cacheinfo"))
 	{
@@ -143,6 +152,41 @@ void process_request(const char *client_message, int *sock)
 		getCacheInformation(sock);
 		unlock_shm();
 	}
+	else if(command(client_message, ">per-client-cache"))
+	{
+		processed = true;
+		lock_shm_read();
+		getPerClientCacheInfo(sock);
+		unlock_shm_read();
+	}
+	else if(command(client_message, ">gc-stats"))
+	{
+		processed = true;
+		lock_shm_read();
+		getGCStats(sock);
+		unlock_shm_read();
+	}
+	else if(command(client_message, ">list-filter"))
+	{
+		processed = true;
+		lock_shm_read();
+		getListFilterStats(sock);
+		unlock_shm_read();
+	}
+	else if(command(client_message, ">rate-limit"))
+	{
+		processed = true;
+		lock_shm_read();
+		getRateLimitStats(sock);
+		unlock_shm_read();
+	}
+	else if(command(client_message, ">tcp-workers"))
+	{
+		processed = true;
+		lock_shm_read();
+		getTCPWorkerStats(sock);
+		unlock_shm_read();
+	}
 	else if(command(client_message, ">reresolve"))
 	{
 		processed = true;
@@ -496,12 +496,53 @@ void read_FTLconf(void)
 		config.rate_limit.interval = interval;
 	}
 
+	// A rate of zero queries per zero seconds disables rate-limiting
+	if(config.rate_limit.interval == 0)
+		config.rate_limit.count = 0;
+
 	if(config.rate_limit.count > 0)
 		logg("   RATE_LIMIT: Rate-limiting client making more than %u queries in %u second%s",
 		     config.rate_limit.count, config.rate_limit.interval, config.rate_limit.interval == 1 ? "" : "s");
 	else
 		logg("   RATE_LIMIT: Disabled");
 
+	// RATE_LIMIT_SUBNET
+	// Aggregate limit shared by all clients of the same subnet
+	// defaults to: disabled
+	config.rate_limit.subnet.count = 0;
+	config.rate_limit.subnet.interval = 0;
+	buffer = parse_FTLconf(fp, "RATE_LIMIT_SUBNET");
+
+	count = 0, interval = 0;
+	if(buffer != NULL && sscanf(buffer, "%u/%u", &count, &interval) == 2 && interval > 0)
+	{
+		config.rate_limit.subnet.count = count;
+		config.rate_limit.subnet.interval = interval;
+	}
+
+	// RATE_LIMIT_SUBNET_PREFIX
+	// Prefix lengths of the IPv4 and IPv6 subnets used by RATE_LIMIT_SUBNET
+	// defaults to: 24/64
+	config.rate_limit.subnet.prefix_v4 = 24;
+	config.rate_limit.subnet.prefix_v6 = 64;
+	buffer = parse_FTLconf(fp, "RATE_LIMIT_SUBNET_PREFIX");
+
+	unsigned int prefix_v4 = 0, prefix_v6 = 0;
+	if(buffer != NULL && sscanf(buffer, "%u/%u", &prefix_v4, &prefix_v6) == 2 &&
+	   prefix_v4 <= 32 && prefix_v6 <= 128)
+	{
+		config.rate_limit.subnet.prefix_v4 = prefix_v4;
+		config.rate_limit.subnet.prefix_v6 = prefix_v6;
+	}
+
+	if(config.rate_limit.subnet.count > 0)
+		logg("   RATE_LIMIT_SUBNET: Rate-limiting /%u (IPv4) and /%u (IPv6) subnets making more than %u queries in %u second%s",
+		     config.rate_limit.subnet.prefix_v4, config.rate_limit.subnet.prefix_v6,
+		     config.rate_limit.subnet.count, config.rate_limit.subnet.interval,
+		     config.rate_limit.subnet.interval == 1 ? "" : "s");
+	else
+		logg("   RATE_LIMIT_SUBNET: Disabled");
+
 	// REPLY_ADDR4
 	// Use a specific IP address instead of automatically detecting the
 	// IPv4 interface address a query arrived on
@@ -690,6 +731,69 @@ void read_FTLconf(void)
 
 	logg("   CHECK_DISK: Warning if certain disk usage exceeds %d%%", config.check.disk);
 
+	// PER_CLIENT_CACHE_SIZE
+	// Maximum number of blocking verdicts (per domain, client and query
+	// type) kept in memory. The least recently used entries are evicted
+	// when this limit is reached. Zero disables the limit
+	// defaults to: 65536 entries
+	config.per_client_cache_size = 65536;
+	buffer = parse_FTLconf(fp, "PER_CLIENT_CACHE_SIZE");
+
+	uval = 0;
+	if(buffer != NULL && sscanf(buffer, "%u", &uval))
+	{
+		// Ensure a minimum size so eviction does not thrash the cache
+		if(uval > 0 && uval < PER_CLIENT_CACHE_MIN)
+			uval = PER_CLIENT_CACHE_MIN;
+		config.per_client_cache_size = uval;
+	}
+
+	if(config.per_client_cache_size > 0)
+		logg("   PER_CLIENT_CACHE_SIZE: Keeping up to %u blocking verdicts", config.per_client_cache_size);
+	else
+		logg("   PER_CLIENT_CACHE_SIZE: Unlimited");
+
+	// GC_SLICE
+	// The garbage collection removes expired queries in slices of at most
+	// this many queries or microseconds and releases the lock in between.
+	// Compacting domains and strings is split into slices the same way,
+	// counting entries instead of queries. Zero disables the corresponding
+	// limit
+	// defaults to: 1000 queries / 1000 microseconds
+	config.gc_slice.queries = 1000;
+	config.gc_slice.usec = 1000;
+	buffer = parse_FTLconf(fp, "GC_SLICE");
+
+	unsigned int slice_queries = 0, slice_usec = 0;
+	if(buffer != NULL && sscanf(buffer, "%u/%u", &slice_queries, &slice_usec) == 2)
+	{
+		config.gc_slice.queries = slice_queries;
+		config.gc_slice.usec = slice_usec;
+	}
+
+	if(config.gc_slice.queries > 0 || config.gc_slice.usec > 0)
+		logg("   GC_SLICE: Removing at most %u queries or for %u microseconds at once (0 = unlimited)",
+		     config.gc_slice.queries, config.gc_slice.usec);
+	else
+		logg("   GC_SLICE: Disabled, removing all expired queries at once");
+
+	// TCP_WORKERS
+	// Number of pre-forked workers handling TCP connections. A connection
+	// arriving while all workers are busy is handled by a process forked
+	// for this connection only. Zero forks a process for every connection
+	// defaults to: 0 (disabled)
+	config.tcp_workers = 0;
+	buffer = parse_FTLconf(fp, "TCP_WORKERS");
+
+	uval = 0;
+	if(buffer != NULL && sscanf(buffer, "%u", &uval))
+		config.tcp_workers = uval < TCP_WORKERS_MAX ? uval : TCP_WORKERS_MAX;
+
+	if(config.tcp_workers > 0)
+		logg("   TCP_WORKERS: Handling TCP connections with up to %u pre-forked workers", config.tcp_workers);
+	else
+		logg("   TCP_WORKERS: Disabled, forking for every TCP connection");
+
 	// Read DEBUG_... setting from pihole-FTL.conf
 	read_debuging_settings(fp);
 
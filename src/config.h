@@ -70,10 +70,22 @@ typedef struct {
 	unsigned int delay_startup;
 	unsigned int network_expire;
 	unsigned int block_ttl;
+	unsigned int per_client_cache_size;
+	unsigned int tcp_workers;
 	struct {
 		unsigned int count;
 		unsigned int interval;
+		struct {
+			unsigned int count;
+			unsigned int interval;
+			unsigned char prefix_v4;
+			unsigned char prefix_v6;
+		} subnet;
 	} rate_limit;
+	struct {
+		unsigned int queries;
+		unsigned int usec;
+	} gc_slice;
 	enum debug_flags debug;
 	time_t DBinterval;
 	struct {
@@ -83,7 +95,7 @@ typedef struct {
 		struct in6_addr v6;
 	} reply_addr;
 } ConfigStruct;
-ASSERT_SIZEOF(ConfigStruct, 88, 80, 80);
+ASSERT_SIZEOF(ConfigStruct, 112, 108, 108);
 
 typedef struct {
 	const char* conf;
@@ -205,6 +205,11 @@ static void terminate_threads(void)
 	logg("Waiting for threads to join");
 	for(int i = 0; i < THREADS_MAX; i++)
 	{
+		// Skip threads which have not been started, e.g., the DNS client
+		// thread when name resolution is disabled
+		if(threads[i] == 0)
+			continue;
+
 		if(thread_cancellable[i])
 		{
 			logg("Thread %s (%d) is idle, terminating it.",
@@ -55,7 +55,7 @@ static void recompute_aliasclient(const int aliasclientID)
 	// Reset this alias-client
 	aliasclient->count = 0;
 	aliasclient->blockedcount = 0;
-	memset(aliasclient->overTime, 0, sizeof(aliasclient->overTime));
+	reset_client_overTime(aliasclientID);
 
 	// Loop over all existing clients to find which clients are associated to this one
 	for(int clientID = 0; clientID < counters->clients; clientID++)
@@ -87,8 +87,8 @@ static void recompute_aliasclient(const int aliasclientID)
 		// Add counts of this client to the alias-client
 		aliasclient->count += client->count;
 		aliasclient->blockedcount += client->blockedcount;
-		for(int idx = 0; idx < OVERTIME_SLOTS; idx++)
-			aliasclient->overTime[idx] += client->overTime[idx];
+		for(unsigned int idx = 0; idx < OVERTIME_SLOTS; idx++)
+			change_client_overTime(aliasclientID, idx, get_client_overTime(clientID, idx));
 	}
 }
 
@@ -341,7 +341,7 @@ void reimport_aliasclients(sqlite3 *db)
 		// Reset this alias-client
 		client->count = 0;
 		client->blockedcount = 0;
-		memset(client->overTime, 0, sizeof(client->overTime));
+		reset_client_overTime(clientID);
 	}
 
 	// Import aliasclients from database table
@@ -0,0 +1,575 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  In-memory client table index routines
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#include "../FTL.h"
+#include "client-index.h"
+// logg()
+#include "../log.h"
+// struct config
+#include "../config.h"
+// timer_start()
+#include "../timers.h"
+// inet_pton()
+#include <arpa/inet.h>
+
+// Initial number of entries, nodes and string bytes allocated
+#define CLIENT_INDEX_MIN_SIZE 64u
+
+// An entry of the client table. Entries describing the same subnet are
+// chained together, the head of the chain has the highest ID
+typedef struct {
+	int id;
+	// Next entry of the same subnet, -1 at the end of the chain
+	int next;
+	// Position of the address text and of the comma-separated group IDs in
+	// the string arena
+	uint32_t textpos;
+	uint32_t groupspos;
+} clientEntry;
+
+// Node of a path-compressed binary radix tree. The first bits of key are the
+// prefix of this node, all children share it. Nodes without entries are only
+// inserted where two subtrees diverge
+typedef struct {
+	uint8_t key[16];
+	int child[2];
+	// First entry of this subnet, -1 if no entry describes it
+	int entry;
+	uint8_t bits;
+} radixNode;
+
+typedef struct {
+	// Entries in the order of their IDs
+	clientEntry *entries;
+	unsigned int count;
+	unsigned int size;
+	// Node 0 is the root of the IPv4 tree, node 1 the root of the IPv6 tree
+	radixNode *nodes;
+	unsigned int num_nodes;
+	unsigned int nodes_size;
+	// Open addressing hash table (kept at most half full) mapping the text of
+	// an entry to the entry index + 1. Zero marks an unused slot. This covers
+	// MAC addresses, host names and interfaces which are all stored in the
+	// same column of the client table
+	uint32_t *names;
+	unsigned int names_size;
+	// String arena, position 0 is always the empty string
+	char *strings;
+	size_t strings_len;
+	size_t strings_size;
+} clientIndex;
+
+// The index is private to this process. TCP workers inherit it when forking.
+// It is replaced the same way as the domain index, see domain-index.c
+static clientIndex *client_index = NULL;
+static clientIndex *next_index = NULL;
+static clientIndex *old_index = NULL;
+
+// Private prototypes
+static void free_client_index(clientIndex *idx);
+static uint32_t name_hash(const char *name) __attribute__ ((pure));
+static int find_name(const clientIndex *idx, const char *name) __attribute__ ((pure));
+static int find_entry(const clientIndex *idx, const int id) __attribute__ ((pure));
+
+static void free_client_index(clientIndex *idx)
+{
+	if(idx == NULL)
+		return;
+
+	if(idx->entries != NULL)
+		free(idx->entries);
+	if(idx->nodes != NULL)
+		free(idx->nodes);
+	if(idx->names != NULL)
+		free(idx->names);
+	if(idx->strings != NULL)
+		free(idx->strings);
+	free(idx);
+}
+
+// Append a string to the arena, returns its position or UINT32_MAX on error
+static uint32_t add_string(clientIndex *idx, const char *str, const size_t len)
+{
+	if(idx->strings_len + len + 1u > idx->strings_size)
+	{
+		size_t size = idx->strings_size > 0u ? idx->strings_size : CLIENT_INDEX_MIN_SIZE;
+		while(idx->strings_len + len + 1u > size)
+			size *= 2u;
+		char *strings = realloc(idx->strings, size);
+		if(strings == NULL)
+			return UINT32_MAX;
+		idx->strings = strings;
+		idx->strings_size = size;
+	}
+
+	const uint32_t pos = idx->strings_len;
+	memcpy(idx->strings + pos, str, len);
+	idx->strings[pos + len] = '\0';
+	idx->strings_len += len + 1u;
+	return pos;
+}
+
+// Get a new node, returns -1 on error
+static int new_node(clientIndex *idx, const uint8_t key[16], const uint8_t bits)
+{
+	if(idx->num_nodes == idx->nodes_size)
+	{
+		const unsigned int size = idx->nodes_size > 0u ? 2u*idx->nodes_size : CLIENT_INDEX_MIN_SIZE;
+		radixNode *nodes = realloc(idx->nodes, size*sizeof(radixNode));
+		if(nodes == NULL)
+			return -1;
+		idx->nodes = nodes;
+		idx->nodes_size = size;
+	}
+
+	radixNode *node = &idx->nodes[idx->num_nodes];
+	memset(node, 0, sizeof(*node));
+	// Only the prefix of the key is stored
+	for(unsigned int i = 0u; i < bits/8u; i++)
+		node->key[i] = key[i];
+	if(bits % 8u)
+		node->key[bits/8u] = key[bits/8u] & (uint8_t)(0xFFu << (8u - bits % 8u));
+	node->bits = bits;
+	node->child[0] = node->child[1] = node->entry = -1;
+	return idx->num_nodes++;
+}
+
+static inline unsigned int get_bit(const uint8_t key[16], const unsigned int bit)
+{
+	return (key[bit/8u] >> (7u - bit % 8u)) & 1u;
+}
+
+// Number of leading bits two keys have in common, at most max_bits
+static unsigned int __attribute__ ((pure)) common_bits(const uint8_t a[16], const uint8_t b[16], const unsigned int max_bits)
+{
+	unsigned int bits = 0u;
+	while(bits < max_bits && a[bits/8u] == b[bits/8u] && bits + 8u <= max_bits)
+		bits += 8u;
+	while(bits < max_bits && get_bit(a, bits) == get_bit(b, bits))
+		bits++;
+	return bits;
+}
+
+// Add an entry describing the subnet key/bits to the tree below root
+static bool insert_subnet(clientIndex *idx, const int root, const uint8_t key[16],
+                          const uint8_t bits, const int entry)
+{
+	int cur = root;
+	while(true)
+	{
+		// The key matches the first bits of the current node
+		if(idx->nodes[cur].bits == bits)
+		{
+			// Entries are added in the order of their IDs, so the
+			// highest ID is always at the head of the chain
+			idx->entries[entry].next = idx->nodes[cur].entry;
+			idx->nodes[cur].entry = entry;
+			return true;
+		}
+
+		const unsigned int branch = get_bit(key, idx->nodes[cur].bits);
+		const int child = idx->nodes[cur].child[branch];
+		if(child < 0)
+		{
+			const int leaf = new_node(idx, key, bits);
+			if(leaf < 0)
+				return false;
+			idx->nodes[leaf].entry = entry;
+			idx->nodes[cur].child[branch] = leaf;
+			return true;
+		}
+
+		const uint8_t child_bits = idx->nodes[child].bits;
+		const unsigned int common = common_bits(key, idx->nodes[child].key,
+		                                        bits < child_bits ? bits : child_bits);
+		if(common == child_bits)
+		{
+			// Descend into the child
+			cur = child;
+			continue;
+		}
+
+		// The key diverges from the child's prefix (or ends within it),
+		// insert a node at the common prefix between the two
+		const int split = new_node(idx, key, common);
+		if(split < 0)
+			return false;
+		idx->nodes[split].child[get_bit(idx->nodes[child].key, common)] = child;
+		idx->nodes[cur].child[branch] = split;
+		if(common == bits)
+		{
+			idx->nodes[split].entry = entry;
+		}
+		else
+		{
+			const int leaf = new_node(idx, key, bits);
+			if(leaf < 0)
+				return false;
+			idx->nodes[leaf].entry = entry;
+			idx->nodes[split].child[get_bit(key, common)] = leaf;
+		}
+		return true;
+	}
+}
+
+// Parse an address or subnet of the client table the same way as
+// subnet_match() does. Returns false for everything else (MAC addresses, host
+// names, interfaces, ...)
+static bool parse_subnet(const char *text, uint8_t key[16], uint8_t *bits, bool *ipv6)
+{
+	*ipv6 = strchr(text, ':') != NULL;
+	int cidr = *ipv6 ? 128 : 32;
+	char *addr = NULL;
+	const int rt = sscanf(text, "%m[^/]/%i", &addr, &cidr);
+	if(rt < 1 || addr == NULL)
+		return false;
+
+	struct in6_addr saddr = {{{ 0 }}};
+	const int valid = inet_pton(*ipv6 ? AF_INET6 : AF_INET, addr, &saddr);
+	free(addr);
+
+	// Subnets without any bits never match
+	if(valid != 1 || cidr <= 0)
+		return false;
+
+	if(cidr > (*ipv6 ? 128 : 32))
+		cidr = *ipv6 ? 128 : 32;
+
+	memcpy(key, saddr.s6_addr, 16);
+	*bits = (uint8_t)cidr;
+	return true;
+}
+
+// Case-insensitive FNV-1a hash
+static uint32_t name_hash(const char *name)
+{
+	uint32_t hash = 2166136261u;
+	for(const unsigned char *p = (const unsigned char*)name; *p != '\0'; p++)
+	{
+		hash ^= (uint32_t)tolower(*p);
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+// Find the entry with the given text, -1 if there is none
+static int find_name(const clientIndex *idx, const char *name)
+{
+	const unsigned int mask = idx->names_size - 1u;
+	for(unsigned int slot = name_hash(name) & mask; idx->names[slot] != 0u; slot = (slot + 1u) & mask)
+	{
+		const int entry = idx->names[slot] - 1;
+		if(strcasecmp(idx->strings + idx->entries[entry].textpos, name) == 0)
+			return entry;
+	}
+	return -1;
+}
+
+static bool build_names(clientIndex *idx)
+{
+	idx->names_size = CLIENT_INDEX_MIN_SIZE;
+	while(idx->names_size < 2u*idx->count)
+		idx->names_size *= 2u;
+	idx->names = calloc(idx->names_size, sizeof(uint32_t));
+	if(idx->names == NULL)
+		return false;
+
+	const unsigned int mask = idx->names_size - 1u;
+	for(unsigned int i = 0u; i < idx->count; i++)
+	{
+		// Keep the lowest ID if the same text is used more than once
+		const char *name = idx->strings + idx->entries[i].textpos;
+		if(find_name(idx, name) > -1)
+			continue;
+
+		unsigned int slot = name_hash(name) & mask;
+		while(idx->names[slot] != 0u)
+			slot = (slot + 1u) & mask;
+		idx->names[slot] = i + 1u;
+	}
+	return true;
+}
+
+// Find the entry with the given ID, -1 if there is none
+static int find_entry(const clientIndex *idx, const int id)
+{
+	unsigned int lo = 0u, hi = idx->count;
+	while(lo < hi)
+	{
+		const unsigned int mid = lo + (hi - lo)/2u;
+		if(idx->entries[mid].id < id)
+			lo = mid + 1u;
+		else
+			hi = mid;
+	}
+	return lo < idx->count && idx->entries[lo].id == id ? (int)lo : -1;
+}
+
+// Read all entries of the client table and add them to the tree
+static bool load_clients(sqlite3 *db, clientIndex *idx)
+{
+	sqlite3_stmt *stmt = NULL;
+	int rc = sqlite3_prepare_v2(db, "SELECT id, ip FROM client ORDER BY id;", -1, &stmt, NULL);
+	if(rc != SQLITE_OK)
+	{
+		logg("client_index_prepare(client) - SQL error prepare: %s", sqlite3_errstr(rc));
+		return false;
+	}
+
+	while((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+	{
+		const char *text = (const char*)sqlite3_column_text(stmt, 1);
+		if(text == NULL)
+			continue;
+
+		if(idx->count == idx->size)
+		{
+			const unsigned int size = idx->size > 0u ? 2u*idx->size : CLIENT_INDEX_MIN_SIZE;
+			clientEntry *entries = realloc(idx->entries, size*sizeof(clientEntry));
+			if(entries == NULL)
+				break;
+			idx->entries = entries;
+			idx->size = size;
+		}
+
+		const int entry = idx->count;
+		clientEntry *ce = &idx->entries[entry];
+		ce->id = sqlite3_column_int(stmt, 0);
+		ce->next = -1;
+		ce->groupspos = 0u;
+		ce->textpos = add_string(idx, text, strlen(text));
+		if(ce->textpos == UINT32_MAX)
+			break;
+		idx->count++;
+
+		uint8_t key[16], bits = 0u;
+		bool ipv6 = false;
+		if(parse_subnet(text, key, &bits, &ipv6) &&
+		   !insert_subnet(idx, ipv6 ? 1 : 0, key, bits, entry))
+			break;
+	}
+	sqlite3_finalize(stmt);
+
+	if(rc != SQLITE_DONE)
+	{
+		if(rc == SQLITE_ROW)
+			logg("ERROR: Memory allocation failed in client_index_prepare()");
+		else
+			logg("client_index_prepare(client) - SQL error step: %s", sqlite3_errstr(rc));
+		return false;
+	}
+
+	return build_names(idx);
+}
+
+// Read the groups of all clients into comma-separated lists of group IDs
+static bool load_groups(sqlite3 *db, clientIndex *idx)
+{
+	sqlite3_stmt *stmt = NULL;
+	int rc = sqlite3_prepare_v2(db, "SELECT client_id, group_id FROM client_by_group "
+	                                "ORDER BY client_id, group_id;", -1, &stmt, NULL);
+	if(rc != SQLITE_OK)
+	{
+		logg("client_index_prepare(client_by_group) - SQL error prepare: %s", sqlite3_errstr(rc));
+		return false;
+	}
+
+	// The groups of one client are consecutive rows, so they are appended to
+	// the arena one after another to form a single string
+	int last_entry = -1;
+	while((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+	{
+		const int entry = find_entry(idx, sqlite3_column_int(stmt, 0));
+		if(entry < 0)
+			continue;
+
+		char group[16];
+		const int len = snprintf(group, sizeof(group), "%d", sqlite3_column_int(stmt, 1));
+		if(entry == last_entry)
+		{
+			// Replace the terminating zero by a comma
+			idx->strings[idx->strings_len - 1u] = ',';
+			if(add_string(idx, group, len) == UINT32_MAX)
+				break;
+		}
+		else
+		{
+			const uint32_t pos = add_string(idx, group, len);
+			if(pos == UINT32_MAX)
+				break;
+			idx->entries[entry].groupspos = pos;
+			last_entry = entry;
+		}
+	}
+	sqlite3_finalize(stmt);
+
+	if(rc != SQLITE_DONE)
+	{
+		if(rc == SQLITE_ROW)
+			logg("ERROR: Memory allocation failed in client_index_prepare()");
+		else
+			logg("client_index_prepare(client_by_group) - SQL error step: %s", sqlite3_errstr(rc));
+		return false;
+	}
+
+	return true;
+}
+
+// Load the client table into memory. IP addresses and subnets are stored in
+// radix trees for longest-prefix matching, everything else in a hash table.
+// The new index is not used before client_index_publish() is called, the
+// current index is kept if the new one cannot be built
+bool client_index_prepare(sqlite3 *db)
+{
+	timer_start(CLIENTS_TIMER);
+
+	clientIndex *idx = calloc(1, sizeof(clientIndex));
+	const uint8_t zero[16] = { 0 };
+	if(idx == NULL || add_string(idx, "", 0u) != 0u ||
+	   new_node(idx, zero, 0u) != 0 || new_node(idx, zero, 0u) != 1)
+	{
+		logg("ERROR: Memory allocation failed in client_index_prepare()");
+		free_client_index(idx);
+		return false;
+	}
+
+	if(!load_clients(db, idx) || !load_groups(db, idx))
+	{
+		logg("Failed to load client table into memory, keeping previous clients");
+		free_client_index(idx);
+		return false;
+	}
+
+	// Replace a prepared index which has not been published
+	free_client_index(next_index);
+	next_index = idx;
+
+	if(config.debug & DEBUG_CLIENTS)
+		logg("Loaded %u clients (%u subnet nodes) in %.1f msec",
+		     idx->count, idx->num_nodes, timer_elapsed_msec(CLIENTS_TIMER));
+
+	return true;
+}
+
+// Replace the current index by the prepared one (if any). The caller has to
+// hold the shared memory lock
+void client_index_publish(void)
+{
+	if(next_index == NULL)
+		return;
+
+	free_client_index(old_index);
+	old_index = client_index;
+	client_index = next_index;
+	next_index = NULL;
+}
+
+// Free the index replaced by client_index_publish()
+void client_index_release(void)
+{
+	free_client_index(old_index);
+	old_index = NULL;
+}
+
+bool client_index_available(void)
+{
+	return client_index != NULL;
+}
+
+// Find the longest subnet in the client table containing the given address
+bool client_index_subnet(const char *ip, clientSubnet *match)
+{
+	memset(match, 0, sizeof(*match));
+	match->id = -1;
+	if(client_index == NULL)
+		return false;
+
+	const bool ipv6 = strchr(ip, ':') != NULL;
+	struct in6_addr saddr = {{{ 0 }}};
+	if(inet_pton(ipv6 ? AF_INET6 : AF_INET, ip, &saddr) != 1)
+	{
+		logg("Malformed FTL IP address: %s", ip);
+		return false;
+	}
+
+	const clientIndex *idx = client_index;
+	const unsigned int max_bits = ipv6 ? 128u : 32u;
+	int cur = ipv6 ? 1 : 0, best = -1;
+	while(true)
+	{
+		const radixNode *node = &idx->nodes[cur];
+		if(node->entry > -1)
+			best = cur;
+		if(node->bits >= max_bits)
+			break;
+
+		const int child = node->child[get_bit(saddr.s6_addr, node->bits)];
+		if(child < 0)
+			break;
+		const uint8_t child_bits = idx->nodes[child].bits;
+		if(common_bits(saddr.s6_addr, idx->nodes[child].key, child_bits) != child_bits)
+			break;
+		cur = child;
+	}
+
+	if(best < 0)
+		return false;
+
+	const radixNode *node = &idx->nodes[best];
+	const clientEntry *chosen = &idx->entries[node->entry];
+	match->id = chosen->id;
+	match->bits = node->bits;
+	match->text = idx->strings + chosen->textpos;
+	for(int e = node->entry; e > -1; e = idx->entries[e].next)
+		match->count++;
+
+	// Collect all IDs in ascending order so ambiguous subnets can be reported
+	if(match->count > 1)
+	{
+		const size_t size = 12u*match->count;
+		match->ids = calloc(size, sizeof(char));
+		if(match->ids == NULL)
+			return true;
+		size_t pos = size - 1u;
+		for(int e = node->entry; e > -1; e = idx->entries[e].next)
+		{
+			char id[13];
+			const int len = snprintf(id, sizeof(id), e == node->entry ? "%d" : "%d,",
+			                         idx->entries[e].id);
+			pos -= len;
+			memcpy(match->ids + pos, id, len);
+		}
+		memmove(match->ids, match->ids + pos, size - pos);
+	}
+
+	return true;
+}
+
+// Find the ID of the entry matching a MAC address, host name or interface
+// (prefixed by INTERFACE_SEP) case-insensitively, -1 if there is none
+int client_index_find(const char *name)
+{
+	if(client_index == NULL)
+		return -1;
+
+	const int entry = find_name(client_index, name);
+	return entry > -1 ? client_index->entries[entry].id : -1;
+}
+
+// Get the comma-separated group IDs of an entry, an empty string if it is not
+// assigned to any group
+const char *client_index_groups(const int id)
+{
+	if(client_index == NULL)
+		return "";
+
+	const int entry = find_entry(client_index, id);
+	return entry > -1 ? client_index->strings + client_index->entries[entry].groupspos : "";
+}
@@ -0,0 +1,40 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  In-memory client table index prototypes
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+#ifndef CLIENT_INDEX_H
+#define CLIENT_INDEX_H
+
+// type sqlite3
+#include "sqlite3.h"
+
+// Longest subnet of the client table containing an address
+typedef struct {
+	// ID of the chosen entry, the highest one if several entries describe
+	// the same subnet
+	int id;
+	// Number of entries describing this subnet
+	int count;
+	// Prefix length of the subnet
+	int bits;
+	// Address as written in the client table
+	const char *text;
+	// Comma-separated IDs of all entries describing this subnet. Only set
+	// (and to be freed by the caller) if there is more than one
+	char *ids;
+} clientSubnet;
+
+bool client_index_prepare(sqlite3 *db);
+void client_index_publish(void);
+void client_index_release(void);
+bool client_index_available(void) __attribute__ ((pure));
+bool client_index_subnet(const char *ip, clientSubnet *match);
+int client_index_find(const char *name) __attribute__ ((pure));
+const char *client_index_groups(const int id) __attribute__ ((pure));
+
+#endif //CLIENT_INDEX_H
@@ -0,0 +1,1070 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  In-memory domain list index routines
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#include "../FTL.h"
+#include "domain-index.h"
+// logg()
+#include "../log.h"
+// struct config
+#include "../config.h"
+// hashStr()
+#include "../shmem.h"
+// timer_start()
+#include "../timers.h"
+// ASSERT_SIZEOF
+#include "../static_assert.h"
+// mmap()
+#include <sys/mman.h>
+
+// Suffix of the compiled snapshot stored next to the gravity database
+#define INDEX_FILE_SUFFIX ".index"
+#define INDEX_FILE_MAGIC "FTLINDEX"
+// Increase this whenever the file layout or the hash function changes
+#define INDEX_FILE_VERSION 3u
+
+// Identity of a database file the snapshot has been compiled from
+typedef struct {
+	uint64_t ino;
+	int64_t size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+} indexSource;
+ASSERT_SIZEOF(indexSource, 32, 32, 32);
+
+// Header of the snapshot file. It is followed by the group IDs, the filter
+// fingerprints and, for every list, the group bitmaps, the hash table, the hashes, the string positions and
+// the string arena. Every section is padded to a multiple of eight bytes. The
+// checksum covers everything after the header
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t num_groups;
+	uint32_t words;
+	uint32_t filter_block_length;
+	uint64_t checksum;
+	uint64_t size;
+	uint64_t filter_seed;
+	uint32_t filter_keys;
+	uint32_t reserved;
+	// gravity.db and its write-ahead log (if any)
+	indexSource source[2];
+	struct {
+		uint32_t count;
+		uint32_t table_size;
+		uint64_t strings_len;
+	} lists[NUM_INDEXED_LISTS];
+} indexFileHeader;
+ASSERT_SIZEOF(indexFileHeader, 184, 184, 184);
+
+// Initial number of hash table slots of a list (has to be a power of two)
+#define INDEX_MIN_SIZE 1024u
+
+// Number of attempts to construct the xor filter with different seeds before
+// giving up. Construction succeeds with a probability of almost 100% per seed
+// unless there are duplicate keys
+#define FILTER_MAX_ATTEMPTS 64
+
+// The domains of one list are stored back to back in a string arena. Every
+// domain has a bitmap of the groups it is enabled for. An open addressing hash
+// table (kept at most half full) maps domains to their entry. Unused slots are
+// zero, used slots store the entry index + 1
+typedef struct {
+	uint32_t *table;
+	uint32_t *hashes;
+	uint32_t *strpos;
+	uint64_t *groups;
+	char *strings;
+	size_t strings_len;
+	size_t strings_size;
+	unsigned int count;
+	unsigned int size;
+	unsigned int table_size;
+} domainList;
+
+typedef struct {
+	domainList lists[NUM_INDEXED_LISTS];
+	// Sorted IDs of all enabled groups, the position is the group's bit
+	int *group_ids;
+	unsigned int num_groups;
+	// Number of 64-bit words per group bitmap
+	unsigned int words;
+	unsigned int generation;
+	// Xor filter over the domains of all lists (8-bit fingerprints). Three
+	// blocks of block_length fingerprints each. A domain which is not on any
+	// list is rejected with a probability of 1 - 1/256 without touching the
+	// hash tables. There is no filter when block_length is zero
+	struct {
+		uint8_t *fingerprints;
+		uint64_t seed;
+		uint32_t block_length;
+		uint32_t keys;
+	} filter;
+	// Snapshot file the index is mapped from (if any)
+	void *map;
+	size_t map_size;
+} domainIndex;
+
+// The index is private to this process. TCP workers inherit it when forking.
+// A new index is built by domain_index_prepare() while the current one is
+// still in use and replaces it in domain_index_publish(). The previous index
+// is freed by domain_index_release() once no query can use it anymore
+static domainIndex *domain_index = NULL;
+static domainIndex *next_index = NULL;
+static domainIndex *old_index = NULL;
+static unsigned int last_generation = 0u;
+
+static const char *listname[NUM_INDEXED_LISTS] = { "gravity", "blacklist", "whitelist", "wildcard" };
+// Wildcard blacklist entries are stored in the domainlist table. There is no
+// view for them, see WILDCARD_BLACKLIST_FROM
+static const char *querystr[NUM_INDEXED_LISTS] = {
+	"SELECT domain, group_id FROM vw_gravity;",
+	"SELECT domain, group_id FROM vw_blacklist;",
+	"SELECT domain, group_id FROM vw_whitelist;",
+	"SELECT domain, domainlist_by_group.group_id FROM "WILDCARD_BLACKLIST_FROM";"
+};
+
+// Private prototypes
+static void free_domain_index(domainIndex *idx);
+static int cmp_group_id(const void *a, const void *b) __attribute__ ((pure));
+static int group_bit(const domainIndex *idx, const int group_id) __attribute__ ((pure));
+static int find_entry(const domainList *dl, const char *domain, const uint32_t hash) __attribute__ ((pure));
+static bool filter_contains(const domainIndex *idx, const uint64_t key) __attribute__ ((pure));
+
+static void free_domain_index(domainIndex *idx)
+{
+	if(idx == NULL)
+		return;
+
+	// All arrays of a mapped index point into the mapping
+	if(idx->map != NULL)
+	{
+		munmap(idx->map, idx->map_size);
+		free(idx);
+		return;
+	}
+
+	for(unsigned int list = 0; list < NUM_INDEXED_LISTS; list++)
+	{
+		domainList *dl = &idx->lists[list];
+		if(dl->table != NULL)
+			free(dl->table);
+		if(dl->hashes != NULL)
+			free(dl->hashes);
+		if(dl->strpos != NULL)
+			free(dl->strpos);
+		if(dl->groups != NULL)
+			free(dl->groups);
+		if(dl->strings != NULL)
+			free(dl->strings);
+	}
+	if(idx->group_ids != NULL)
+		free(idx->group_ids);
+	if(idx->filter.fingerprints != NULL)
+		free(idx->filter.fingerprints);
+	free(idx);
+}
+
+static int cmp_group_id(const void *a, const void *b)
+{
+	const int ga = *(const int*)a;
+	const int gb = *(const int*)b;
+	return (ga > gb) - (ga < gb);
+}
+
+// Get the bit of a group in the group bitmaps, -1 if the group is not enabled
+static int group_bit(const domainIndex *idx, const int group_id)
+{
+	const int *found = bsearch(&group_id, idx->group_ids, idx->num_groups,
+	                           sizeof(int), cmp_group_id);
+	return found != NULL ? found - idx->group_ids : -1;
+}
+
+// Read the IDs of all enabled groups
+static bool load_groups(sqlite3 *db, domainIndex *idx)
+{
+	sqlite3_stmt *stmt = NULL;
+	int rc = sqlite3_prepare_v2(db, "SELECT id FROM \"group\" WHERE enabled = 1 ORDER BY id;", -1, &stmt, NULL);
+	if(rc != SQLITE_OK)
+	{
+		logg("domain_index_prepare(groups) - SQL error prepare: %s", sqlite3_errstr(rc));
+		return false;
+	}
+
+	unsigned int size = 0u;
+	while((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+	{
+		if(idx->num_groups == size)
+		{
+			size += 64u;
+			int *new_ids = realloc(idx->group_ids, size*sizeof(int));
+			if(new_ids == NULL)
+			{
+				logg("ERROR: Memory allocation failed in load_groups()");
+				sqlite3_finalize(stmt);
+				return false;
+			}
+			idx->group_ids = new_ids;
+		}
+		idx->group_ids[idx->num_groups++] = sqlite3_column_int(stmt, 0);
+	}
+	sqlite3_finalize(stmt);
+
+	if(rc != SQLITE_DONE)
+	{
+		logg("domain_index_prepare(groups) - SQL error step: %s", sqlite3_errstr(rc));
+		return false;
+	}
+
+	// We always use at least one word so group bitmaps are never empty
+	idx->words = idx->num_groups > 0u ? (idx->num_groups + 63u) / 64u : 1u;
+	return true;
+}
+
+// Resize the per-entry arrays of a list
+static bool resize_entries(domainList *dl, const unsigned int words, const unsigned int size)
+{
+	uint32_t *hashes = realloc(dl->hashes, size*sizeof(uint32_t));
+	if(hashes != NULL)
+		dl->hashes = hashes;
+	uint32_t *strpos = realloc(dl->strpos, size*sizeof(uint32_t));
+	if(strpos != NULL)
+		dl->strpos = strpos;
+	uint64_t *groups = realloc(dl->groups, (size_t)size*words*sizeof(uint64_t));
+	if(groups != NULL)
+		dl->groups = groups;
+
+	if(hashes == NULL || strpos == NULL || groups == NULL)
+		return false;
+
+	dl->size = size;
+	return true;
+}
+
+// Resize the hash table of a list and re-insert all entries
+static bool resize_table(domainList *dl, const unsigned int table_size)
+{
+	uint32_t *table = calloc(table_size, sizeof(uint32_t));
+	if(table == NULL)
+		return false;
+
+	const uint32_t mask = table_size - 1u;
+	for(unsigned int id = 0; id < dl->count; id++)
+	{
+		uint32_t i = dl->hashes[id] & mask;
+		while(table[i] != 0u)
+			i = (i + 1u) & mask;
+		table[i] = id + 1u;
+	}
+
+	if(dl->table != NULL)
+		free(dl->table);
+	dl->table = table;
+	dl->table_size = table_size;
+	return true;
+}
+
+// Find a domain in a list. Returns the entry index or -1 if not found
+static int find_entry(const domainList *dl, const char *domain, const uint32_t hash)
+{
+	if(dl->table == NULL)
+		return -1;
+
+	const uint32_t mask = dl->table_size - 1u;
+	for(uint32_t i = hash & mask; dl->table[i] != 0u; i = (i + 1u) & mask)
+	{
+		const uint32_t id = dl->table[i] - 1u;
+		if(dl->hashes[id] == hash && strcmp(&dl->strings[dl->strpos[id]], domain) == 0)
+			return id;
+	}
+
+	return -1;
+}
+
+// Add a domain to a list if it is not already known and return its entry index
+static int add_entry(domainList *dl, const unsigned int words, const char *domain)
+{
+	const uint32_t hash = hashStr(domain);
+	const int known = find_entry(dl, domain, hash);
+	if(known > -1)
+		return known;
+
+	// Keep the hash table at most half full
+	if(2u*(dl->count + 1u) > dl->table_size &&
+	   !resize_table(dl, dl->table_size > 0u ? 2u*dl->table_size : INDEX_MIN_SIZE))
+		return -1;
+
+	if(dl->count == dl->size && !resize_entries(dl, words, dl->size > 0u ? 2u*dl->size : INDEX_MIN_SIZE/2u))
+		return -1;
+
+	// Append domain to the string arena
+	const size_t len = strlen(domain) + 1u;
+	if(dl->strings_len + len > dl->strings_size)
+	{
+		size_t new_size = dl->strings_size > 0u ? 2u*dl->strings_size : 16u*INDEX_MIN_SIZE;
+		while(dl->strings_len + len > new_size)
+			new_size *= 2u;
+		// Entries store 32-bit string positions
+		if(new_size > UINT32_MAX)
+			return -1;
+		char *strings = realloc(dl->strings, new_size);
+		if(strings == NULL)
+			return -1;
+		dl->strings = strings;
+		dl->strings_size = new_size;
+	}
+	memcpy(&dl->strings[dl->strings_len], domain, len);
+
+	const unsigned int id = dl->count++;
+	dl->hashes[id] = hash;
+	dl->strpos[id] = dl->strings_len;
+	memset(&dl->groups[(size_t)id*words], 0, words*sizeof(uint64_t));
+	dl->strings_len += len;
+
+	const uint32_t mask = dl->table_size - 1u;
+	uint32_t i = hash & mask;
+	while(dl->table[i] != 0u)
+		i = (i + 1u) & mask;
+	dl->table[i] = id + 1u;
+
+	return id;
+}
+
+// Read one list from the gravity database. Domains in more than one group are
+// returned once per group and share a single entry
+static bool load_list(sqlite3 *db, domainIndex *idx, const enum gravity_tables list)
+{
+	domainList *dl = &idx->lists[list];
+	sqlite3_stmt *stmt = NULL;
+	int rc = sqlite3_prepare_v2(db, querystr[list], -1, &stmt, NULL);
+	if(rc != SQLITE_OK)
+	{
+		logg("domain_index_prepare(%s) - SQL error prepare: %s", listname[list], sqlite3_errstr(rc));
+		return false;
+	}
+
+	while((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+	{
+		// Domains without any group are not used by any client
+		const char *domain = (const char*)sqlite3_column_text(stmt, 0);
+		if(domain == NULL || sqlite3_column_type(stmt, 1) == SQLITE_NULL)
+			continue;
+
+		// Wildcards may be written as "*.example.com" or ".example.com",
+		// both are stored as "example.com"
+		if(list == WILDCARD_BLACKLIST_TABLE)
+		{
+			if(domain[0] == '*')
+				domain++;
+			if(domain[0] == '.')
+				domain++;
+			if(domain[0] == '\0')
+				continue;
+		}
+
+		const int bit = group_bit(idx, sqlite3_column_int(stmt, 1));
+		if(bit < 0)
+			continue;
+
+		const int id = add_entry(dl, idx->words, domain);
+		if(id < 0)
+		{
+			logg("ERROR: Memory allocation failed when loading %s domains", listname[list]);
+			sqlite3_finalize(stmt);
+			return false;
+		}
+		dl->groups[(size_t)id*idx->words + bit/64] |= 1ull << (bit % 64);
+	}
+	sqlite3_finalize(stmt);
+
+	if(rc != SQLITE_DONE)
+	{
+		logg("domain_index_prepare(%s) - SQL error step: %s", listname[list], sqlite3_errstr(rc));
+		return false;
+	}
+
+	return true;
+}
+
+// 64-bit FNV-1a hash of a domain used as the key of the xor filter
+static uint64_t __attribute__ ((pure)) filter_key(const char *domain)
+{
+	uint64_t hash = 14695981039346656037ull;
+	while(*domain != '\0')
+		hash = (hash ^ (unsigned char)*domain++) * 1099511628211ull;
+	return hash;
+}
+
+// Finalizer of MurmurHash3 mixing the key with the seed of the filter
+static uint64_t __attribute__ ((const)) filter_mix(const uint64_t key, const uint64_t seed)
+{
+	uint64_t h = key + seed;
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdull;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ull;
+	h ^= h >> 33;
+	return h;
+}
+
+static uint8_t __attribute__ ((const)) filter_fingerprint(const uint64_t hash)
+{
+	return hash ^ (hash >> 32);
+}
+
+// Get the three slots (one per block) of a hashed key
+static void filter_slots(const uint64_t hash, const uint32_t block_length, uint32_t slots[3])
+{
+	for(unsigned int i = 0; i < 3u; i++)
+	{
+		const uint32_t r = i == 0u ? hash : ((hash << (21u*i)) | (hash >> (64u - 21u*i)));
+		slots[i] = (uint32_t)(((uint64_t)r * block_length) >> 32) + i*block_length;
+	}
+}
+
+static bool filter_contains(const domainIndex *idx, const uint64_t key)
+{
+	// Without a filter, every domain may be on a list
+	if(idx->filter.block_length == 0u)
+		return true;
+
+	const uint64_t hash = filter_mix(key, idx->filter.seed);
+	uint32_t slots[3];
+	filter_slots(hash, idx->filter.block_length, slots);
+	const uint8_t *fp = idx->filter.fingerprints;
+	return filter_fingerprint(hash) == (fp[slots[0]] ^ fp[slots[1]] ^ fp[slots[2]]);
+}
+
+// Construct the xor filter over all domains of all lists by repeatedly
+// peeling slots which are used by a single key. If all keys have been peeled,
+// the fingerprints are assigned in reverse order so that the fingerprints of
+// the three slots of each key xor to the key's fingerprint
+static bool build_filter(domainIndex *idx)
+{
+	// Collect the keys. The exact lists may contain domains which are also on
+	// gravity or on each other, only add them once
+	uint32_t n = 0u;
+	for(unsigned int list = 0; list < NUM_INDEXED_LISTS; list++)
+		n += idx->lists[list].count;
+	if(n == 0u)
+		return true;
+
+	const uint32_t block_length = (32u + (uint32_t)(1.23*n)) / 3u + 1u;
+	const uint32_t length = 3u*block_length;
+	uint64_t *keys = calloc(n, sizeof(uint64_t));
+	uint64_t *xormask = calloc(length, sizeof(uint64_t));
+	uint32_t *count = calloc(length, sizeof(uint32_t));
+	uint32_t *queue = calloc(length, sizeof(uint32_t));
+	uint32_t *stack_slot = calloc(n, sizeof(uint32_t));
+	uint64_t *stack_hash = calloc(n, sizeof(uint64_t));
+	uint8_t *fp = calloc(length, sizeof(uint8_t));
+	bool okay = keys != NULL && xormask != NULL && count != NULL && queue != NULL &&
+	            stack_slot != NULL && stack_hash != NULL && fp != NULL;
+
+	n = 0u;
+	for(unsigned int list = 0; okay && list < NUM_INDEXED_LISTS; list++)
+	{
+		const domainList *dl = &idx->lists[list];
+		for(unsigned int id = 0; id < dl->count; id++)
+		{
+			const char *domain = &dl->strings[dl->strpos[id]];
+			bool known = false;
+			for(unsigned int other = 0; other < list && !known; other++)
+				known = find_entry(&idx->lists[other], domain, dl->hashes[id]) > -1;
+			if(!known)
+				keys[n++] = filter_key(domain);
+		}
+	}
+
+	uint64_t seed = 0u;
+	uint32_t peeled = 0u;
+	for(unsigned int attempt = 0; okay && attempt < FILTER_MAX_ATTEMPTS && peeled < n; attempt++)
+	{
+		// Derive a new seed for every attempt (splitmix64)
+		seed = 0x9e3779b97f4a7c15ull * (attempt + 1u);
+		seed = (seed ^ (seed >> 30)) * 0xbf58476d1ce4e5b9ull;
+		seed = (seed ^ (seed >> 27)) * 0x94d049bb133111ebull;
+		seed ^= seed >> 31;
+
+		memset(xormask, 0, length*sizeof(uint64_t));
+		memset(count, 0, length*sizeof(uint32_t));
+		for(uint32_t i = 0; i < n; i++)
+		{
+			const uint64_t hash = filter_mix(keys[i], seed);
+			uint32_t slots[3];
+			filter_slots(hash, block_length, slots);
+			for(unsigned int j = 0; j < 3u; j++)
+			{
+				xormask[slots[j]] ^= hash;
+				count[slots[j]]++;
+			}
+		}
+
+		uint32_t queued = 0u;
+		for(uint32_t i = 0; i < length; i++)
+			if(count[i] == 1u)
+				queue[queued++] = i;
+
+		peeled = 0u;
+		while(queued > 0u)
+		{
+			// The slot may have lost its last key in the meantime
+			const uint32_t slot = queue[--queued];
+			if(count[slot] != 1u)
+				continue;
+
+			const uint64_t hash = xormask[slot];
+			stack_slot[peeled] = slot;
+			stack_hash[peeled++] = hash;
+
+			uint32_t slots[3];
+			filter_slots(hash, block_length, slots);
+			for(unsigned int j = 0; j < 3u; j++)
+			{
+				xormask[slots[j]] ^= hash;
+				if(--count[slots[j]] == 1u)
+					queue[queued++] = slots[j];
+			}
+		}
+	}
+
+	if(okay && peeled == n)
+	{
+		// Every slot is assigned exactly once and is still zero before
+		for(uint32_t i = n; i-- > 0u;)
+		{
+			uint32_t slots[3];
+			filter_slots(stack_hash[i], block_length, slots);
+			fp[stack_slot[i]] = filter_fingerprint(stack_hash[i]) ^
+			                    fp[slots[0]] ^ fp[slots[1]] ^ fp[slots[2]];
+		}
+
+		idx->filter.fingerprints = fp;
+		idx->filter.seed = seed;
+		idx->filter.block_length = block_length;
+		idx->filter.keys = n;
+		fp = NULL;
+	}
+	else if(okay)
+		logg("WARNING: Failed to construct domain list filter for %u domains", n);
+	else
+		logg("ERROR: Memory allocation failed in build_filter()");
+
+	void *buffers[] = { keys, xormask, count, queue, stack_slot, stack_hash, fp };
+	for(unsigned int i = 0; i < sizeof(buffers)/sizeof(buffers[0]); i++)
+		if(buffers[i] != NULL)
+			free(buffers[i]);
+
+	return okay;
+}
+
+// Read gravity, the exact white- and blacklists and the wildcard blacklist from
+// the database
+static domainIndex *build_index(sqlite3 *db, const int gravity_hint)
+{
+	domainIndex *idx = calloc(1, sizeof(domainIndex));
+	if(idx == NULL)
+	{
+		logg("ERROR: Memory allocation failed in build_index()");
+		return NULL;
+	}
+
+	// Read everything from a consistent snapshot of the database
+	bool okay = sqlite3_exec(db, "BEGIN TRANSACTION;", NULL, NULL, NULL) == SQLITE_OK;
+	okay = okay && load_groups(db, idx);
+
+	// Every list gets a hash table, even if it stays empty, so that snapshots
+	// of empty lists are valid. Avoid rehashing gravity while loading if we
+	// know its size
+	unsigned int gravity_size = INDEX_MIN_SIZE;
+	while(gravity_hint > 0 && gravity_size < 2u*(unsigned int)gravity_hint)
+		gravity_size *= 2u;
+	okay = okay && resize_entries(&idx->lists[GRAVITY_TABLE], idx->words, gravity_size/2u);
+
+	for(enum gravity_tables list = GRAVITY_TABLE; okay && list < NUM_INDEXED_LISTS; list++)
+	{
+		okay = resize_table(&idx->lists[list], list == GRAVITY_TABLE ? gravity_size : INDEX_MIN_SIZE) &&
+		       load_list(db, idx, list);
+	}
+	sqlite3_exec(db, "END TRANSACTION;", NULL, NULL, NULL);
+
+	// Lists are still usable if the filter cannot be built
+	if(okay)
+		build_filter(idx);
+
+	if(!okay)
+	{
+		free_domain_index(idx);
+		return NULL;
+	}
+
+	return idx;
+}
+
+static size_t __attribute__ ((const)) padded(const size_t len)
+{
+	return (len + 7u) & ~(size_t)7u;
+}
+
+// Size of a snapshot file described by its header
+static uint64_t __attribute__ ((pure)) snapshot_size(const indexFileHeader *hdr)
+{
+	uint64_t size = sizeof(indexFileHeader) + padded((uint64_t)hdr->num_groups*sizeof(int32_t)) +
+	                padded(3u*(uint64_t)hdr->filter_block_length);
+	for(unsigned int list = 0; list < NUM_INDEXED_LISTS; list++)
+	{
+		const uint64_t count = hdr->lists[list].count;
+		size += padded(count*hdr->words*sizeof(uint64_t)) +
+		        padded((uint64_t)hdr->lists[list].table_size*sizeof(uint32_t)) +
+		        2u*padded(count*sizeof(uint32_t)) +
+		        padded(hdr->lists[list].strings_len);
+	}
+	return size;
+}
+
+// FNV-1a over 64-bit words. A trailing partial word is padded with zeros so
+// checksumming a section equals checksumming its padded form
+static uint64_t __attribute__ ((pure)) checksum_update(uint64_t hash, const void *buf, const size_t len)
+{
+	const unsigned char *p = buf;
+	size_t i = 0;
+	for(; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t))
+	{
+		uint64_t word;
+		memcpy(&word, p + i, sizeof(word));
+		hash = (hash ^ word) * 1099511628211ull;
+	}
+	if(i < len)
+	{
+		uint64_t word = 0u;
+		memcpy(&word, p + i, len - i);
+		hash = (hash ^ word) * 1099511628211ull;
+	}
+	return hash;
+}
+
+// Get the identity of a file, zero if it does not exist
+static void get_source(const char *file, indexSource *src)
+{
+	struct stat st;
+	memset(src, 0, sizeof(*src));
+	if(stat(file, &st) != 0)
+		return;
+
+	src->ino = st.st_ino;
+	src->size = st.st_size;
+	src->mtime_sec = st.st_mtim.tv_sec;
+	src->mtime_nsec = st.st_mtim.tv_nsec;
+}
+
+// Write one padded section of the snapshot and update the checksum
+static bool write_section(FILE *fp, const void *buf, const size_t len, uint64_t *hash)
+{
+	static const char zeros[8] = { 0 };
+	*hash = checksum_update(*hash, buf, len);
+	return (len == 0u || fwrite(buf, len, 1, fp) == 1) &&
+	       (padded(len) == len || fwrite(zeros, padded(len) - len, 1, fp) == 1);
+}
+
+// Store an index built from the database in a snapshot file. The file is
+// written under a temporary name and atomically moved into place afterwards
+// so processes still mapping the previous snapshot are not affected
+static bool write_snapshot(const char *file, const domainIndex *idx, const indexSource source[2])
+{
+	indexFileHeader hdr = { .version = INDEX_FILE_VERSION };
+	memcpy(hdr.magic, INDEX_FILE_MAGIC, sizeof(hdr.magic));
+	hdr.num_groups = idx->num_groups;
+	hdr.words = idx->words;
+	hdr.filter_block_length = idx->filter.block_length;
+	hdr.filter_seed = idx->filter.seed;
+	hdr.filter_keys = idx->filter.keys;
+	memcpy(hdr.source, source, sizeof(hdr.source));
+	for(unsigned int list = 0; list < NUM_INDEXED_LISTS; list++)
+	{
+		hdr.lists[list].count = idx->lists[list].count;
+		hdr.lists[list].table_size = idx->lists[list].table_size;
+		hdr.lists[list].strings_len = idx->lists[list].strings_len;
+	}
+	hdr.size = snapshot_size(&hdr);
+
+	char *tmpfile = NULL;
+	if(asprintf(&tmpfile, "%s.tmp", file) < 1)
+		return false;
+
+	FILE *fp = fopen(tmpfile, "w");
+	if(fp == NULL)
+	{
+		logg("WARNING: Cannot write domain list snapshot %s: %s", tmpfile, strerror(errno));
+		free(tmpfile);
+		return false;
+	}
+
+	// The header is written again once the checksum is known
+	uint64_t hash = 14695981039346656037ull;
+	bool okay = fwrite(&hdr, sizeof(hdr), 1, fp) == 1;
+	okay = okay && write_section(fp, idx->group_ids, idx->num_groups*sizeof(int32_t), &hash);
+	okay = okay && write_section(fp, idx->filter.fingerprints, 3u*idx->filter.block_length, &hash);
+	for(unsigned int list = 0; okay && list < NUM_INDEXED_LISTS; list++)
+	{
+		const domainList *dl = &idx->lists[list];
+		okay = write_section(fp, dl->groups, (size_t)dl->count*idx->words*sizeof(uint64_t), &hash) &&
+		       write_section(fp, dl->table, dl->table_size*sizeof(uint32_t), &hash) &&
+		       write_section(fp, dl->hashes, dl->count*sizeof(uint32_t), &hash) &&
+		       write_section(fp, dl->strpos, dl->count*sizeof(uint32_t), &hash) &&
+		       write_section(fp, dl->strings, dl->strings_len, &hash);
+	}
+	hdr.checksum = hash;
+	okay = okay && fseek(fp, 0L, SEEK_SET) == 0 && fwrite(&hdr, sizeof(hdr), 1, fp) == 1;
+	okay = (fclose(fp) == 0) && okay;
+	okay = okay && rename(tmpfile, file) == 0;
+
+	if(!okay)
+	{
+		logg("WARNING: Failed to write domain list snapshot %s: %s", file, strerror(errno));
+		unlink(tmpfile);
+	}
+
+	free(tmpfile);
+	return okay;
+}
+
+// Map a snapshot file. Returns NULL if the snapshot does not exist, is
+// damaged or has not been compiled from the current database
+static domainIndex *map_snapshot(const char *file, const indexSource source[2])
+{
+	const int fd = open(file, O_RDONLY);
+	if(fd < 0)
+		return NULL;
+
+	struct stat st;
+	if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(indexFileHeader))
+	{
+		close(fd);
+		return NULL;
+	}
+
+	// Pages are shared with all other processes mapping this file
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED)
+	{
+		logg("WARNING: Cannot map domain list snapshot %s: %s", file, strerror(errno));
+		return NULL;
+	}
+
+	const indexFileHeader *hdr = map;
+	const char *reason = NULL;
+	if(memcmp(hdr->magic, INDEX_FILE_MAGIC, sizeof(hdr->magic)) != 0 ||
+	   hdr->version != INDEX_FILE_VERSION)
+		reason = "unknown format";
+	else if(memcmp(hdr->source, source, sizeof(hdr->source)) != 0)
+		reason = "database changed";
+	else if(hdr->words != (hdr->num_groups > 0u ? (hdr->num_groups + 63u) / 64u : 1u) ||
+	        hdr->size != (uint64_t)st.st_size || snapshot_size(hdr) != hdr->size)
+		reason = "invalid size";
+	for(unsigned int list = 0; reason == NULL && list < NUM_INDEXED_LISTS; list++)
+	{
+		// Hash tables have to be a power of two and must have free slots
+		const uint32_t table_size = hdr->lists[list].table_size;
+		if((table_size & (table_size - 1u)) != 0u || table_size <= hdr->lists[list].count)
+			reason = "invalid hash table";
+	}
+	if(reason == NULL &&
+	   checksum_update(14695981039346656037ull, (const char*)map + sizeof(indexFileHeader),
+	                   hdr->size - sizeof(indexFileHeader)) != hdr->checksum)
+		reason = "checksum mismatch";
+
+	domainIndex *idx = NULL;
+	if(reason == NULL && (idx = calloc(1, sizeof(domainIndex))) == NULL)
+		reason = "out of memory";
+
+	if(reason != NULL)
+	{
+		if(config.debug & DEBUG_DATABASE)
+			logg("Not using domain list snapshot %s: %s", file, reason);
+		munmap(map, st.st_size);
+		return NULL;
+	}
+
+	idx->map = map;
+	idx->map_size = st.st_size;
+	idx->num_groups = hdr->num_groups;
+	idx->words = hdr->words;
+	idx->filter.seed = hdr->filter_seed;
+	idx->filter.block_length = hdr->filter_block_length;
+	idx->filter.keys = hdr->filter_keys;
+
+	// Sections are padded to full words
+	uint64_t *p = (uint64_t*)map + sizeof(indexFileHeader)/sizeof(uint64_t);
+	idx->group_ids = (int*)p;
+	p += padded(idx->num_groups*sizeof(int32_t))/sizeof(uint64_t);
+	idx->filter.fingerprints = (uint8_t*)p;
+	p += padded(3u*idx->filter.block_length)/sizeof(uint64_t);
+	for(unsigned int list = 0; list < NUM_INDEXED_LISTS; list++)
+	{
+		domainList *dl = &idx->lists[list];
+		dl->count = dl->size = hdr->lists[list].count;
+		dl->table_size = hdr->lists[list].table_size;
+		dl->strings_len = dl->strings_size = hdr->lists[list].strings_len;
+		dl->groups = p;
+		p += (size_t)dl->count*idx->words;
+		dl->table = (uint32_t*)p;
+		p += padded(dl->table_size*sizeof(uint32_t))/sizeof(uint64_t);
+		dl->hashes = (uint32_t*)p;
+		p += padded(dl->count*sizeof(uint32_t))/sizeof(uint64_t);
+		dl->strpos = (uint32_t*)p;
+		p += padded(dl->count*sizeof(uint32_t))/sizeof(uint64_t);
+		dl->strings = (char*)p;
+		p += padded(dl->strings_len)/sizeof(uint64_t);
+	}
+
+	return idx;
+}
+
+// Load gravity, the exact white- and blacklists and the wildcard blacklist
+// into memory. A compiled snapshot next to the database is used if it is still
+// up-to-date, otherwise the lists are read from the database and a new
+// snapshot is written. The new index is not used before domain_index_publish()
+// is called, the current index is kept if the new one cannot be built
+bool domain_index_prepare(sqlite3 *db, const char *dbfile, const int gravity_hint)
+{
+	timer_start(LISTS_TIMER);
+
+	char *snapshot = NULL, *walfile = NULL;
+	if(asprintf(&snapshot, "%s"INDEX_FILE_SUFFIX, dbfile) < 1 ||
+	   asprintf(&walfile, "%s-wal", dbfile) < 1)
+	{
+		logg("ERROR: Memory allocation failed in domain_index_prepare()");
+		return false;
+	}
+
+	// Identify the database before reading from it. Should it change while
+	// we read, the next reload compiles a new snapshot
+	indexSource source[2];
+	get_source(dbfile, &source[0]);
+	get_source(walfile, &source[1]);
+	free(walfile);
+
+	const char *origin = "snapshot";
+	domainIndex *idx = map_snapshot(snapshot, source);
+	if(idx == NULL)
+	{
+		origin = "database";
+		idx = build_index(db, gravity_hint);
+		if(idx == NULL)
+		{
+			logg("Failed to load domain lists into memory, keeping previous lists");
+			free(snapshot);
+			return false;
+		}
+
+		// Prefer the shared mapping of the new snapshot over our private copy
+		domainIndex *mapped = NULL;
+		if(write_snapshot(snapshot, idx, source) &&
+		   (mapped = map_snapshot(snapshot, source)) != NULL)
+		{
+			free_domain_index(idx);
+			idx = mapped;
+		}
+	}
+	free(snapshot);
+
+	size_t bytes = idx->map_size;
+	if(idx->map == NULL)
+	{
+		bytes = sizeof(domainIndex) + idx->num_groups*sizeof(int) +
+		        3u*idx->filter.block_length;
+		for(unsigned int list = 0; list < NUM_INDEXED_LISTS; list++)
+		{
+			const domainList *dl = &idx->lists[list];
+			bytes += dl->table_size*sizeof(uint32_t) + dl->strings_size +
+			         dl->size*(2u*sizeof(uint32_t) + idx->words*sizeof(uint64_t));
+		}
+	}
+
+	// Replace a prepared index which has not been published
+	free_domain_index(next_index);
+	next_index = idx;
+
+	char prefix[2] = { 0 };
+	double formated = 0.0;
+	format_memory_size(prefix, bytes, &formated);
+	logg("Loaded %u gravity, %u blacklist, %u whitelist and %u wildcard domains for %u groups from %s in %.1f msec (%.1f %sB%s)",
+	     idx->lists[GRAVITY_TABLE].count, idx->lists[EXACT_BLACKLIST_TABLE].count,
+	     idx->lists[EXACT_WHITELIST_TABLE].count, idx->lists[WILDCARD_BLACKLIST_TABLE].count,
+	     idx->num_groups, origin,
+	     timer_elapsed_msec(LISTS_TIMER), formated, prefix, idx->map != NULL ? ", shared" : "");
+
+	return true;
+}
+
+// Replace the current index by the prepared one (if any). Readers hold the
+// shared memory lock, the caller has to hold it, too, so no query still uses
+// the previous index once the lock is released
+void domain_index_publish(void)
+{
+	if(next_index == NULL)
+		return;
+
+	// The previous generation has to be released before publishing again
+	free_domain_index(old_index);
+	old_index = domain_index;
+
+	next_index->generation = ++last_generation;
+	__atomic_store_n(&domain_index, next_index, __ATOMIC_RELEASE);
+	next_index = NULL;
+}
+
+// Free the index replaced by domain_index_publish()
+void domain_index_release(void)
+{
+	free_domain_index(old_index);
+	old_index = NULL;
+}
+
+// Generation of the current index, zero if no index has been loaded. Group
+// bitmaps have to be recomputed when this changes
+unsigned int domain_index_generation(void)
+{
+	return domain_index != NULL ? domain_index->generation : 0u;
+}
+
+// Number of 64-bit words per group bitmap of the current index
+unsigned int domain_index_words(void)
+{
+	return domain_index != NULL ? domain_index->words : 1u;
+}
+
+// Translate a comma-separated list of group IDs into a group bitmap of
+// domain_index_words() words
+void domain_index_groups(const char *groups, uint64_t *bits)
+{
+	const unsigned int words = domain_index_words();
+	memset(bits, 0, words*sizeof(uint64_t));
+	if(domain_index == NULL || groups == NULL)
+		return;
+
+	const char *p = groups;
+	while(*p != '\0')
+	{
+		char *end = NULL;
+		const long group_id = strtol(p, &end, 10);
+		if(end == p)
+		{
+			// Skip unexpected characters
+			p++;
+			continue;
+		}
+		const int bit = group_bit(domain_index, (int)group_id);
+		if(bit > -1)
+			bits[bit/64] |= 1ull << (bit % 64);
+		p = end;
+	}
+}
+
+// Check if a domain is on a list for any of the given groups. Sets *listed if
+// the domain is on the list at all
+static enum db_result lookup_entry(const enum gravity_tables list, const char *domain,
+                                   const uint32_t hash, const uint64_t *groups, bool *listed)
+{
+	const domainList *dl = &domain_index->lists[list];
+	const int id = find_entry(dl, domain, hash);
+	if(id < 0)
+		return NOT_FOUND;
+	*listed = true;
+
+	const unsigned int words = domain_index->words;
+	const uint64_t *bits = &dl->groups[(size_t)id*words];
+	for(unsigned int w = 0; w < words; w++)
+		if(bits[w] & groups[w])
+			return FOUND;
+
+	return NOT_FOUND;
+}
+
+// Check a domain against the filter before looking it up on any list. Domains
+// rejected by the filter are not on any list and are not looked up at all
+void domain_index_filter(indexedDomain *dom, const char *domain)
+{
+	dom->domain = domain;
+	dom->hash = hashStr(domain);
+	dom->lists = 0u;
+	dom->on_list = false;
+	dom->candidate = true;
+	dom->generation = 0u;
+	if(domain_index == NULL)
+		return;
+
+	dom->generation = domain_index->generation;
+	dom->candidate = filter_contains(domain_index, filter_key(domain));
+	if(dom->candidate)
+		counters->list_filter.hits++;
+	else
+		counters->list_filter.misses++;
+}
+
+// Check if a domain is on a list for any of the given groups. The wildcard
+// blacklist is checked for the domain itself and for every parent domain by
+// walking the label boundaries, i.e., one filter check and at most one lookup
+// per label
+enum db_result domain_index_lookup(const enum gravity_tables list, indexedDomain *dom,
+                                   const uint64_t *groups)
+{
+	if(domain_index == NULL || list >= NUM_INDEXED_LISTS)
+		return LIST_NOT_AVAILABLE;
+
+	// The filter has to be checked again if the lists have been reloaded
+	// since
+	if(dom->generation != domain_index->generation)
+	{
+		const unsigned char lists = dom->lists;
+		domain_index_filter(dom, dom->domain);
+		dom->lists = lists;
+	}
+
+	dom->lists |= 1u << list;
+	if(dom->candidate && lookup_entry(list, dom->domain, dom->hash, groups, &dom->on_list) == FOUND)
+		return FOUND;
+
+	// Skip the walk if there are no wildcards at all
+	if(list != WILDCARD_BLACKLIST_TABLE || domain_index->lists[WILDCARD_BLACKLIST_TABLE].count == 0u)
+		return NOT_FOUND;
+
+	for(const char *suffix = strchr(dom->domain, '.'); suffix != NULL; suffix = strchr(suffix, '.'))
+	{
+		// Skip the dot separating the labels
+		suffix++;
+		if(*suffix == '\0')
+			break;
+		if(!filter_contains(domain_index, filter_key(suffix)))
+			continue;
+		bool listed = false;
+		if(lookup_entry(list, suffix, hashStr(suffix), groups, &listed) == FOUND)
+			return FOUND;
+	}
+
+	return NOT_FOUND;
+}
+
+// Count a false positive of the filter if a domain passed it but is on none of
+// the lists. Nothing is known if not all lists have been looked up, e.g.,
+// because the domain has been found on the whitelist
+void domain_index_count_filter(const indexedDomain *dom)
+{
+	if(domain_index != NULL && dom->candidate && !dom->on_list &&
+	   dom->lists == (1u << NUM_INDEXED_LISTS) - 1u)
+		counters->list_filter.false_positives++;
+}
+
+// Number of domains covered by the filter and the size of the filter in bytes
+void domain_index_filter_info(unsigned int *keys, size_t *bytes)
+{
+	*keys = domain_index != NULL ? domain_index->filter.keys : 0u;
+	*bytes = domain_index != NULL ? 3u*domain_index->filter.block_length : 0u;
+}
@@ -0,0 +1,36 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  In-memory domain list index prototypes
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+#ifndef DOMAIN_INDEX_H
+#define DOMAIN_INDEX_H
+
+// type sqlite3
+#include "sqlite3.h"
+// enum gravity_tables
+#include "gravity-db.h"
+
+// Number of lists held in memory. These are the first entries of enum
+// gravity_tables: GRAVITY_TABLE, EXACT_BLACKLIST_TABLE, EXACT_WHITELIST_TABLE
+// and WILDCARD_BLACKLIST_TABLE. The latter matches a domain and all of its
+// subdomains
+#define NUM_INDEXED_LISTS 4u
+
+bool domain_index_prepare(sqlite3 *db, const char *dbfile, const int gravity_hint);
+void domain_index_publish(void);
+void domain_index_release(void);
+unsigned int domain_index_generation(void) __attribute__ ((pure));
+unsigned int domain_index_words(void) __attribute__ ((pure));
+void domain_index_groups(const char *groups, uint64_t *bits);
+void domain_index_filter(indexedDomain *dom, const char *domain);
+enum db_result domain_index_lookup(const enum gravity_tables list, indexedDomain *dom,
+                                   const uint64_t *groups);
+void domain_index_count_filter(const indexedDomain *dom);
+void domain_index_filter_info(unsigned int *keys, size_t *bytes);
+
+#endif //DOMAIN_INDEX_H
@@ -19,8 +19,10 @@
 #include "../regex_r.h"
 // getstr()
 #include "../shmem.h"
-// SQLite3 prepared statement vectors
-#include "../vector.h"
+// domain_index_lookup()
+#include "domain-index.h"
+// client_index_subnet()
+#include "client-index.h"
 // log_subnet_warning()
 #include "message-table.h"
 // getMACfromIP()
@@ -36,12 +38,14 @@
 // Prefix of interface names in the client table
 #define INTERFACE_SEP ":"
 
-// Process-private prepared statements are used to support multiple forks (might
-// be TCP workers) to use the database simultaneously without corrupting the
-// gravity database
-sqlite3_stmt_vec *whitelist_stmt = NULL;
-sqlite3_stmt_vec *gravity_stmt = NULL;
-sqlite3_stmt_vec *blacklist_stmt = NULL;
+// Process-private group bitmaps of all group sets. They are computed on first
+// use after the in-memory domain lists changed. Forks (might be TCP workers)
+// inherit them
+static uint64_t *groupset_bits = NULL;
+static unsigned int *groupset_bits_generation = NULL;
+static unsigned int groupset_bits_size = 0u;
+static unsigned int groupset_bits_words = 0u;
+static unsigned int groupset_bits_released = 0u;
 
 // Private variables
 static sqlite3 *gravity_db = NULL;
@@ -50,7 +54,7 @@ static sqlite3_stmt* auditlist_stmt = NULL;
 bool gravityDB_opened = false;
 
 // Table names corresponding to the enum defined in gravity-db.h
-static const char* tablename[] = { "vw_gravity", "vw_blacklist", "vw_whitelist", "vw_regex_blacklist", "vw_regex_whitelist" , "" };
+static const char* tablename[] = { "vw_gravity", "vw_blacklist", "vw_whitelist", "domainlist", "vw_regex_blacklist", "vw_regex_whitelist" , "" };
 
 // Prototypes from functions in dnsmasq's source
 extern void rehash(int size);
@@ -87,11 +91,6 @@ void gravityDB_forked(void)
 	gravityDB_opened = false;
 	gravity_db = NULL;
 
-	// Also pretend we have not yet prepared the list statements
-	whitelist_stmt = NULL;
-	blacklist_stmt = NULL;
-	gravity_stmt = NULL;
-
 	// Open the database
 	gravityDB_open();
 }
@@ -179,14 +178,6 @@ bool gravityDB_open(void)
 		logg("gravityDB_open(): Setting busy timeout to %d", DATABASE_BUSY_TIMEOUT);
 	sqlite3_busy_timeout(gravity_db, DATABASE_BUSY_TIMEOUT);
 
-	// Prepare private vector of statements for this process (might be a TCP fork!)
-	if(whitelist_stmt == NULL)
-		whitelist_stmt = new_sqlite3_stmt_vec(counters->clients);
-	if(blacklist_stmt == NULL)
-		blacklist_stmt = new_sqlite3_stmt_vec(counters->clients);
-	if(gravity_stmt == NULL)
-		gravity_stmt = new_sqlite3_stmt_vec(counters->clients);
-
 	// Explicitly set busy handler to zero milliseconds
 	if(config.debug & DEBUG_DATABASE)
 		logg("gravityDB_open(): Setting busy timeout to zero");
@@ -210,20 +201,76 @@ bool gravityDB_reopen(void)
 	return gravityDB_open();
 }
 
-static char* get_client_querystr(const char* table, const char* groups)
+// Open a private read-only connection to the gravity database. New lists are
+// read through it so the connection used while answering queries (and its
+// prepared statements) is never touched from another thread
+sqlite3 *gravityDB_open_private(void)
 {
-	// Build query string with group filtering
-	char *querystr = NULL;
-	if(asprintf(&querystr, "SELECT EXISTS(SELECT domain from %s WHERE domain = ? AND group_id IN (%s));", table, groups) < 1)
+	sqlite3 *db = NULL;
+	int rc = sqlite3_open_v2(FTLfiles.gravity_db, &db, SQLITE_OPEN_READONLY, NULL);
+	if(rc != SQLITE_OK)
 	{
-		logg("get_client_querystr(%s, %s) - asprintf() error", table, groups);
+		logg("gravityDB_open_private() - SQL error: %s", sqlite3_errstr(rc));
+		sqlite3_close(db);
 		return NULL;
 	}
 
-	if(config.debug & DEBUG_DATABASE)
-		logg("get_client_querystr: %s", querystr);
+	sqlite3_busy_timeout(db, DATABASE_BUSY_TIMEOUT);
+	sqlite3_exec(db, "PRAGMA temp_store = MEMORY", NULL, NULL, NULL);
 
-	return querystr;
+	return db;
+}
+
+// Number of gravity domains of the prepared lists
+static int next_gravity_count = DB_FAILED;
+
+// Read gravity, the exact and wildcard lists, the client table and the regex
+// filters into a new generation without holding the shared memory lock.
+// Queries are answered from the current lists until gravityDB_publish_lists()
+// is called
+bool gravityDB_prepare_lists(void)
+{
+	struct stat st;
+	if(stat(FTLfiles.gravity_db, &st) != 0)
+	{
+		logg("gravityDB_prepare_lists(): %s does not exist", FTLfiles.gravity_db);
+		return false;
+	}
+
+	sqlite3 *db = gravityDB_open_private();
+	if(db == NULL)
+	{
+		logg("gravityDB_prepare_lists(): Gravity database not available");
+		return false;
+	}
+
+	next_gravity_count = gravityDB_count(db, GRAVITY_TABLE);
+	bool okay = domain_index_prepare(db, FTLfiles.gravity_db, next_gravity_count);
+	okay &= client_index_prepare(db);
+	prepare_regex(db);
+	sqlite3_close(db);
+
+	return okay;
+}
+
+// Replace the current lists by the prepared ones. This has to be called while
+// holding the shared memory lock after gravityDB_reopen(). Queries in flight
+// hold the lock, too, so they have finished with the previous generation
+void gravityDB_publish_lists(void)
+{
+	counters->gravity = next_gravity_count;
+	domain_index_publish();
+	client_index_publish();
+	publish_regex(true);
+}
+
+// Free the previous generation of lists. Call this after releasing the lock
+// which was held by gravityDB_publish_lists()
+void gravityDB_release_lists(void)
+{
+	domain_index_release();
+	client_index_release();
+	release_regex();
 }
 
 // Determine whether to show IP or hardware address
@@ -253,8 +300,8 @@ static bool get_client_groupids(clientsData* client)
 	client->flags.found_group = false;
 	client->groupspos = 0u;
 
-	// Do not proceed when database is not available
-	if(!gravityDB_opened && !gravityDB_open())
+	// Do not proceed when the client table has not been loaded yet
+	if(!client_index_available())
 	{
 		logg("get_client_groupids(): Gravity database not available");
 		return false;
@@ -263,72 +310,24 @@ static bool get_client_groupids(clientsData* client)
 	if(config.debug & DEBUG_CLIENTS)
 		logg("Querying gravity database for client with IP %s...", ip);
 
-	// Check if client is configured through the client table
-	// This will return nothing if the client is unknown/unconfigured
-	const char *querystr = "SELECT count(id) matching_count, "
-	                       "max(id) chosen_match_id, "
-	                       "ip chosen_match_text, "
-	                       "group_concat(id) matching_ids, "
-	                       "subnet_match(ip,?) matching_bits FROM client "
-	                       "WHERE matching_bits > 0 "
-	                       "GROUP BY matching_bits "
-	                       "ORDER BY matching_bits DESC LIMIT 1;";
-
-	// Prepare query
-	int rc = sqlite3_prepare_v2(gravity_db, querystr, -1, &table_stmt, NULL);
-	if(rc != SQLITE_OK)
-	{
-		logg("get_client_groupids(\"%s\") - SQL error prepare: %s",
-		     ip, sqlite3_errstr(rc));
-		return false;
-	}
-
-	// Bind ipaddr to prepared statement
-	if((rc = sqlite3_bind_text(table_stmt, 1, ip, -1, SQLITE_STATIC)) != SQLITE_OK)
+	// Check if client is configured through the client table using the
+	// longest matching subnet. This will return nothing if the client is
+	// unknown/unconfigured
+	clientSubnet subnet;
+	int chosen_match_id = -1;
+	if(client_index_subnet(ip, &subnet))
 	{
-		logg("get_client_groupids(\"%s\"): Failed to bind ip: %s",
-		     ip, sqlite3_errstr(rc));
-		sqlite3_reset(table_stmt);
-		sqlite3_finalize(table_stmt);
-		return NULL;
-	}
-
-	// Perform query
-	rc = sqlite3_step(table_stmt);
-	int matching_count = 0, chosen_match_id = -1, matching_bits = 0;
-	char *matching_ids = NULL, *chosen_match_text = NULL;
-	if(rc == SQLITE_ROW)
-	{
-		// There is a record for this client in the database,
-		// extract the result (there can be at most one line)
-		matching_count = sqlite3_column_int(table_stmt, 0);
-		chosen_match_id = sqlite3_column_int(table_stmt, 1);
-		chosen_match_text = strdup((const char*)sqlite3_column_text(table_stmt, 2));
-		matching_ids = strdup((const char*)sqlite3_column_text(table_stmt, 3));
-		matching_bits = sqlite3_column_int(table_stmt, 4);
-
-		if(config.debug & DEBUG_CLIENTS && matching_count == 1)
-			// Case matching_count > 1 handled below using logg_subnet_warning()
+		chosen_match_id = subnet.id;
+		if(config.debug & DEBUG_CLIENTS && subnet.count == 1)
+			// Case subnet.count > 1 handled below using logg_subnet_warning()
 			logg("--> Found record for %s in the client table (group ID %d)", ip, chosen_match_id);
 	}
-	else if(rc == SQLITE_DONE)
+	else if(config.debug & DEBUG_CLIENTS)
 	{
-		if(config.debug & DEBUG_CLIENTS)
-			logg("--> No record for %s in the client table", ip);
-	}
-	else
-	{
-		// Error
-		logg("get_client_groupids(\"%s\") - SQL error step: %s",
-		     ip, sqlite3_errstr(rc));
-		gravityDB_finalizeTable();
-		return false;
+		logg("--> No record for %s in the client table", ip);
 	}
 
-	// Finalize statement
-	gravityDB_finalizeTable();
-
-	if(matching_count > 1)
+	if(subnet.count > 1)
 	{
 		// There is more than one configured subnet that matches to current device
 		// with the same number of subnet mask bits. This is likely unintended by
@@ -337,19 +336,17 @@ static bool get_client_groupids(clientsData* client)
 		//   Device 10.8.0.22
 		//   Client 1: 10.8.0.0/24
 		//   Client 2: 10.8.1.0/24
-		logg_subnet_warning(ip, matching_count, matching_ids, matching_bits, chosen_match_text, chosen_match_id);
+		// The warning resolves the client names through the database
+		if(gravityDB_opened || gravityDB_open())
+			logg_subnet_warning(ip, subnet.count, subnet.ids != NULL ? subnet.ids : "",
+			                    subnet.bits, subnet.text, subnet.id);
 	}
 
 	// Free memory if applicable
-	if(matching_ids != NULL)
-	{
-		free(matching_ids);
-		matching_ids = NULL;
-	}
-	if(chosen_match_text != NULL)
+	if(subnet.ids != NULL)
 	{
-		free(chosen_match_text);
-		chosen_match_text = NULL;
+		free(subnet.ids);
+		subnet.ids = NULL;
 	}
 
 	// If we didn't find an IP address match above, try with MAC address matches
@@ -418,58 +415,17 @@ static bool get_client_groupids(clientsData* client)
 
 		// Check if client is configured through the client table
 		// This will return nothing if the client is unknown/unconfigured
-		// We use COLLATE NOCASE to ensure the comparison is done case-insensitive
-		querystr = "SELECT id FROM client WHERE ip = ? COLLATE NOCASE;";
-
-		// Prepare query
-		rc = sqlite3_prepare_v2(gravity_db, querystr, -1, &table_stmt, NULL);
-		if(rc != SQLITE_OK)
+		// The comparison is done case-insensitive
+		chosen_match_id = client_index_find(hwaddr);
+		if(chosen_match_id > -1)
 		{
-			logg("get_client_groupids(%s) - SQL error prepare: %s",
-				querystr, sqlite3_errstr(rc));
-			free(hwaddr); // hwaddr != NULL -> memory has been allocated
-			return false;
-		}
-
-		// Bind hwaddr to prepared statement
-		if((rc = sqlite3_bind_text(table_stmt, 1, hwaddr, -1, SQLITE_STATIC)) != SQLITE_OK)
-		{
-			logg("get_client_groupids(\"%s\", \"%s\"): Failed to bind hwaddr: %s",
-				ip, hwaddr, sqlite3_errstr(rc));
-			sqlite3_reset(table_stmt);
-			sqlite3_finalize(table_stmt);
-			free(hwaddr); // hwaddr != NULL -> memory has been allocated
-			return false;
-		}
-
-		// Perform query
-		rc = sqlite3_step(table_stmt);
-		if(rc == SQLITE_ROW)
-		{
-			// There is a record for this client in the database,
-			// extract the result (there can be at most one line)
-			chosen_match_id = sqlite3_column_int(table_stmt, 0);
-
 			if(config.debug & DEBUG_CLIENTS)
 				logg("--> Found record for %s in the client table (group ID %d)", hwaddr, chosen_match_id);
 		}
-		else if(rc == SQLITE_DONE)
-		{
-			if(config.debug & DEBUG_CLIENTS)
-				logg("--> There is no record for %s in the client table", hwaddr);
-		}
-		else
+		else if(config.debug & DEBUG_CLIENTS)
 		{
-			// Error
-			logg("get_client_groupids(\"%s\", \"%s\") - SQL error step: %s",
-				ip, hwaddr, sqlite3_errstr(rc));
-			gravityDB_finalizeTable();
-			free(hwaddr); // hwaddr != NULL -> memory has been allocated
-			return false;
+			logg("--> There is no record for %s in the client table", hwaddr);
 		}
-
-		// Finalize statement and free allocated memory
-		gravityDB_finalizeTable();
 	}
 
 	// If we did neither find an IP nor a MAC address match above, we try to look
@@ -506,61 +462,17 @@ static bool get_client_groupids(clientsData* client)
 
 		// Check if client is configured through the client table
 		// This will return nothing if the client is unknown/unconfigured
-		// We use COLLATE NOCASE to ensure the comparison is done case-insensitive
-		querystr = "SELECT id FROM client WHERE ip = ? COLLATE NOCASE;";
-
-		// Prepare query
-		rc = sqlite3_prepare_v2(gravity_db, querystr, -1, &table_stmt, NULL);
-		if(rc != SQLITE_OK)
+		// The comparison is done case-insensitive
+		chosen_match_id = client_index_find(hostname);
+		if(chosen_match_id > -1)
 		{
-			logg("get_client_groupids(%s) - SQL error prepare: %s",
-				querystr, sqlite3_errstr(rc));
-			if(hwaddr) free(hwaddr);
-			free(hostname); // hostname != NULL -> memory has been allocated
-			return false;
-		}
-
-		// Bind hostname to prepared statement
-		if((rc = sqlite3_bind_text(table_stmt, 1, hostname, -1, SQLITE_STATIC)) != SQLITE_OK)
-		{
-			logg("get_client_groupids(\"%s\", \"%s\"): Failed to bind hostname: %s",
-				ip, hostname, sqlite3_errstr(rc));
-			sqlite3_reset(table_stmt);
-			sqlite3_finalize(table_stmt);
-			if(hwaddr) free(hwaddr);
-			free(hostname); // hostname != NULL -> memory has been allocated
-			return false;
-		}
-
-		// Perform query
-		rc = sqlite3_step(table_stmt);
-		if(rc == SQLITE_ROW)
-		{
-			// There is a record for this client in the database,
-			// extract the result (there can be at most one line)
-			chosen_match_id = sqlite3_column_int(table_stmt, 0);
-
 			if(config.debug & DEBUG_CLIENTS)
 				logg("--> Found record for %s in the client table (group ID %d)", hostname, chosen_match_id);
 		}
-		else if(rc == SQLITE_DONE)
-		{
-			if(config.debug & DEBUG_CLIENTS)
-				logg("--> There is no record for %s in the client table", hostname);
-		}
-		else
+		else if(config.debug & DEBUG_CLIENTS)
 		{
-			// Error
-			logg("get_client_groupids(\"%s\", \"%s\") - SQL error step: %s",
-				ip, hostname, sqlite3_errstr(rc));
-			gravityDB_finalizeTable();
-			if(hwaddr) free(hwaddr);
-			free(hostname); // hostname != NULL -> memory has been allocated
-			return false;
+			logg("--> There is no record for %s in the client table", hostname);
 		}
-
-		// Finalize statement and free allocated memory
-		gravityDB_finalizeTable();
 	}
 
 	// If we did neither find an IP nor a MAC address and also no host name
@@ -597,65 +509,23 @@ static bool get_client_groupids(clientsData* client)
 
 		// Check if client is configured through the client table using its interface
 		// This will return nothing if the client is unknown/unconfigured
-		// We use the SQLite concatenate operator || to prepace the queried interface by ":"
-		// We use COLLATE NOCASE to ensure the comparison is done case-insensitive
-		querystr = "SELECT id FROM client WHERE ip = '"INTERFACE_SEP"' || ? COLLATE NOCASE;";
-
-		// Prepare query
-		rc = sqlite3_prepare_v2(gravity_db, querystr, -1, &table_stmt, NULL);
-		if(rc != SQLITE_OK)
-		{
-			logg("get_client_groupids(%s) - SQL error prepare: %s",
-				querystr, sqlite3_errstr(rc));
-			if(hwaddr) free(hwaddr);
-			if(hostname) free(hostname);
-			free(interface); // interface != NULL -> memory has been allocated
-			return false;
-		}
-
-		// Bind interface to prepared statement
-		if((rc = sqlite3_bind_text(table_stmt, 1, interface, -1, SQLITE_STATIC)) != SQLITE_OK)
+		// Interfaces are stored prefixed by ":", the comparison is done case-insensitive
+		char *iface = NULL;
+		if(asprintf(&iface, INTERFACE_SEP"%s", interface) > 0)
 		{
-			logg("get_client_groupids(\"%s\", \"%s\"): Failed to bind interface: %s",
-				ip, interface, sqlite3_errstr(rc));
-			sqlite3_reset(table_stmt);
-			sqlite3_finalize(table_stmt);
-			if(hwaddr) free(hwaddr);
-			if(hostname) free(hostname);
-			free(interface); // interface != NULL -> memory has been allocated
-			return false;
+			chosen_match_id = client_index_find(iface);
+			free(iface);
 		}
 
-		// Perform query
-		rc = sqlite3_step(table_stmt);
-		if(rc == SQLITE_ROW)
+		if(chosen_match_id > -1)
 		{
-			// There is a record for this client in the database,
-			// extract the result (there can be at most one line)
-			chosen_match_id = sqlite3_column_int(table_stmt, 0);
-
 			if(config.debug & DEBUG_CLIENTS)
 				logg("--> Found record for interface "INTERFACE_SEP"%s in the client table (group ID %d)", interface, chosen_match_id);
 		}
-		else if(rc == SQLITE_DONE)
-		{
-			if(config.debug & DEBUG_CLIENTS)
-				logg("--> There is no record for interface "INTERFACE_SEP"%s in the client table", interface);
-		}
-		else
+		else if(config.debug & DEBUG_CLIENTS)
 		{
-			// Error
-			logg("get_client_groupids(\"%s\", \"%s\") - SQL error step: %s",
-				ip, interface, sqlite3_errstr(rc));
-			gravityDB_finalizeTable();
-			if(hwaddr) free(hwaddr);
-			if(hostname) free(hostname);
-			free(interface); // interface != NULL -> memory has been allocated
-			return false;
+			logg("--> There is no record for interface "INTERFACE_SEP"%s in the client table", interface);
 		}
-
-		// Finalize statement and free allocated memory
-		gravityDB_finalizeTable();
 	}
 
 	// We use the default group and return early here
@@ -691,65 +561,13 @@ static bool get_client_groupids(clientsData* client)
 		return true;
 	}
 
-	// Build query string to get possible group associations for this particular client
-	// The SQL GROUP_CONCAT() function returns a string which is the concatenation of all
-	// non-NULL values of group_id separated by ','. The order of the concatenated elements
-	// is arbitrary, however, is of no relevance for your use case.
-	// We check using a possibly defined subnet and use the first result
-	querystr = "SELECT GROUP_CONCAT(group_id) FROM client_by_group "
-	           "WHERE client_id = ?;";
-
+	// Get the group associations of the chosen entry of the client table. This
+	// is an empty string if the client is not assigned to any group
 	if(config.debug & DEBUG_CLIENTS)
 		logg("Querying gravity database for client %s (getting groups)", ip);
 
-	// Prepare query
-	rc = sqlite3_prepare_v2(gravity_db, querystr, -1, &table_stmt, NULL);
-	if(rc != SQLITE_OK)
-	{
-		logg("get_client_groupids(\"%s\", \"%s\", %d) - SQL error prepare: %s",
-		     ip, hwaddr, chosen_match_id, sqlite3_errstr(rc));
-		sqlite3_finalize(table_stmt);
-		return false;
-	}
-
-	// Bind hwaddr to prepared statement
-	if((rc = sqlite3_bind_int(table_stmt, 1, chosen_match_id)) != SQLITE_OK)
-	{
-		logg("get_client_groupids(\"%s\", \"%s\", %d): Failed to bind chosen_match_id: %s",
-			ip, hwaddr, chosen_match_id, sqlite3_errstr(rc));
-		sqlite3_reset(table_stmt);
-		sqlite3_finalize(table_stmt);
-		return false;
-	}
-
-	// Perform query
-	rc = sqlite3_step(table_stmt);
-	if(rc == SQLITE_ROW)
-	{
-		// There is a record for this client in the database
-		const char* result = (const char*)sqlite3_column_text(table_stmt, 0);
-		if(result != NULL)
-		{
-			client->groupspos = addstr(result);
-			client->flags.found_group = true;
-		}
-	}
-	else if(rc == SQLITE_DONE)
-	{
-		// Found no record for this client in the database
-		// -> No associated groups
-		client->groupspos = addstr("");
-		client->flags.found_group = true;
-	}
-	else
-	{
-		logg("get_client_groupids(\"%s\", \"%s\", %d) - SQL error step: %s",
-		     ip, hwaddr, chosen_match_id, sqlite3_errstr(rc));
-		gravityDB_finalizeTable();
-		return false;
-	}
-	// Finalize statement
-	gravityDB_finalizeTable();
+	client->groupspos = addstr(client_index_groups(chosen_match_id));
+	client->flags.found_group = true;
 
 	if(config.debug & DEBUG_CLIENTS)
 	{
@@ -840,105 +658,95 @@ char* __attribute__ ((malloc)) get_client_names_from_ids(const char *group_ids)
 	return result;
 }
 
-// Prepare statements for scanning white- and blacklist as well as gravit for one client
-bool gravityDB_prepare_client_statements(clientsData *client)
+// Get the group bitmap of a group set
+static const uint64_t *get_groupset_bitmap(const int groupsetID)
 {
-	// Return early if gravity database is not available
-	if(!gravityDB_opened && !gravityDB_open())
-		return false;
-
-	const char *clientip = getstr(client->ippos);
-
-	if(config.debug & DEBUG_DATABASE)
-		logg("Initializing gravity statements for %s", clientip);
-
-	// Get associated groups for this client (if defined)
-	char *querystr = NULL;
-	if(!client->flags.found_group && !get_client_groupids(client))
-		return false;
+	const groupsetsData *groupset = getGroupset(groupsetID, true);
+	if(groupset == NULL)
+		return NULL;
 
-	// Prepare whitelist statement
-	// We use SELECT EXISTS() as this is known to efficiently use the index
-	// We are only interested in whether the domain exists or not in the
-	// list but don't case about duplicates or similar. SELECT EXISTS(...)
-	// returns true as soon as it sees the first row from the query inside
-	// of EXISTS().
-	if(config.debug & DEBUG_DATABASE)
-		logg("gravityDB_open(): Preparing vw_whitelist statement for client %s", clientip);
-	querystr = get_client_querystr("vw_whitelist", getstr(client->groupspos));
-	sqlite3_stmt* stmt = NULL;
-	int rc = sqlite3_prepare_v2(gravity_db, querystr, -1, &stmt, NULL);
-	if( rc != SQLITE_OK )
-	{
-		logg("gravityDB_open(\"SELECT EXISTS(... vw_whitelist ...)\") - SQL error prepare: %s", sqlite3_errstr(rc));
-		gravityDB_close();
-		return false;
+	const unsigned int words = domain_index_words();
+	const unsigned int generation = domain_index_generation();
+
+	// Start over if the size of the bitmaps changed
+	if(words != groupset_bits_words)
+	{
+		if(groupset_bits != NULL)
+			free(groupset_bits);
+		if(groupset_bits_generation != NULL)
+			free(groupset_bits_generation);
+		groupset_bits = NULL;
+		groupset_bits_generation = NULL;
+		groupset_bits_size = 0u;
+		groupset_bits_words = words;
+	}
+
+	// Ensure we have enough space for this group set
+	if((unsigned int)groupsetID >= groupset_bits_size)
+	{
+		const unsigned int size = counters->groupsets;
+		uint64_t *bits = realloc(groupset_bits, (size_t)size*words*sizeof(uint64_t));
+		if(bits != NULL)
+			groupset_bits = bits;
+		unsigned int *gens = realloc(groupset_bits_generation, size*sizeof(unsigned int));
+		if(gens != NULL)
+			groupset_bits_generation = gens;
+		if(bits == NULL || gens == NULL)
+		{
+			logg("ERROR: Memory allocation failed in get_groupset_bitmap()");
+			return NULL;
+		}
+		memset(&groupset_bits_generation[groupset_bits_size], 0,
+		       (size - groupset_bits_size)*sizeof(unsigned int));
+		groupset_bits_size = size;
 	}
-	whitelist_stmt->set(whitelist_stmt, client->id, stmt);
-	free(querystr);
 
-	// Prepare gravity statement
-	if(config.debug & DEBUG_DATABASE)
-		logg("gravityDB_open(): Preparing vw_gravity statement for client %s", clientip);
-	querystr = get_client_querystr("vw_gravity", getstr(client->groupspos));
-	rc = sqlite3_prepare_v2(gravity_db, querystr, -1, &stmt, NULL);
-	if( rc != SQLITE_OK )
+	// Released group sets may have been reused for different groups
+	if(groupset_bits_released != counters->groupsets_released)
 	{
-		logg("gravityDB_open(\"SELECT EXISTS(... vw_gravity ...)\") - SQL error prepare: %s", sqlite3_errstr(rc));
-		gravityDB_close();
-		return false;
+		memset(groupset_bits_generation, 0, groupset_bits_size*sizeof(unsigned int));
+		groupset_bits_released = counters->groupsets_released;
 	}
-	gravity_stmt->set(gravity_stmt, client->id, stmt);
-	free(querystr);
 
-	// Prepare blacklist statement
-	if(config.debug & DEBUG_DATABASE)
-		logg("gravityDB_open(): Preparing vw_blacklist statement for client %s", clientip);
-	querystr = get_client_querystr("vw_blacklist", getstr(client->groupspos));
-	rc = sqlite3_prepare_v2(gravity_db, querystr, -1, &stmt, NULL);
-	if( rc != SQLITE_OK )
+	uint64_t *bits = &groupset_bits[(size_t)groupsetID*words];
+	if(groupset_bits_generation[groupsetID] != generation)
 	{
-		logg("gravityDB_open(\"SELECT EXISTS(... vw_blacklist ...)\") - SQL error prepare: %s", sqlite3_errstr(rc));
-		gravityDB_close();
-		return false;
+		if(config.debug & DEBUG_DATABASE)
+			logg("Computing group bitmap of group set %d (groups %s)",
+			     groupsetID, getstr(groupset->groupspos));
+
+		domain_index_groups(getstr(groupset->groupspos), bits);
+		groupset_bits_generation[groupsetID] = generation;
 	}
-	blacklist_stmt->set(blacklist_stmt, client->id, stmt);
-	free(querystr);
 
-	return true;
+	return bits;
 }
 
-// Finalize non-NULL prepared statements and set them to NULL for a given client
-static inline void gravityDB_finalize_client_statements(clientsData *client)
+// Forget the groups of a client. They will be read again when the client is
+// seen the next time
+static void gravityDB_forget_client_groups(clientsData *client)
 {
-	if(config.debug & DEBUG_DATABASE)
-		logg("Finalizing gravity statements for %s", getstr(client->ippos));
+	if(client == NULL)
+		return;
 
-	if(whitelist_stmt != NULL &&
-	   whitelist_stmt->get(whitelist_stmt, client->id) != NULL)
-	{
-		sqlite3_finalize(whitelist_stmt->get(whitelist_stmt, client->id));
-		whitelist_stmt->set(whitelist_stmt, client->id, NULL);
-	}
-	if(blacklist_stmt != NULL &&
-	   blacklist_stmt->get(blacklist_stmt, client->id) != NULL)
-	{
-		sqlite3_finalize(blacklist_stmt->get(blacklist_stmt, client->id));
-		blacklist_stmt->set(blacklist_stmt, client->id, NULL);
-	}
-	if(gravity_stmt != NULL &&
-	   gravity_stmt->get(gravity_stmt, client->id) != NULL)
-	{
-		sqlite3_finalize(gravity_stmt->get(gravity_stmt, client->id));
-		gravity_stmt->set(gravity_stmt, client->id, NULL);
-	}
+	if(config.debug & DEBUG_DATABASE)
+		logg("Forgetting groups of client %s", getstr(client->ippos));
 
 	// Unset group found property to trigger a check next time the
 	// client sends a query
-	if(client != NULL)
-	{
-		client->flags.found_group = false;
-	}
+	client->flags.found_group = false;
+	client->groupsetID = -1;
+}
+
+// Find the group set of a client, possibly after reading its groups. Returns -1
+// if the groups cannot be obtained (e.g. no access to the database)
+static int resolve_client_groupset(clientsData *client)
+{
+	if(client->groupsetID < 0 &&
+	   (client->flags.found_group || get_client_groupids(client)))
+		client->groupsetID = findGroupsetID(client->groupspos);
+
+	return client->groupsetID;
 }
 
 // Close gravity database connection
@@ -948,19 +756,14 @@ void gravityDB_close(void)
 	if(!gravityDB_opened)
 		return;
 
-	// Finalize prepared list statements for all clients
+	// Re-read the groups of all clients once the database is available again
 	for(int clientID = 0; clientID < counters->clients; clientID++)
 	{
 		clientsData *client = getClient(clientID, true);
 		if(client != NULL)
-			gravityDB_finalize_client_statements(client);
+			gravityDB_forget_client_groups(client);
 	}
 
-	// Free allocated memory for vectors of prepared client statements
-	free_sqlite3_stmt_vec(&whitelist_stmt);
-	free_sqlite3_stmt_vec(&blacklist_stmt);
-	free_sqlite3_stmt_vec(&gravity_stmt);
-
 	// Finalize audit list statement
 	sqlite3_finalize(auditlist_stmt);
 	auditlist_stmt = NULL;
@@ -973,19 +776,14 @@ void gravityDB_close(void)
 
 // Prepare a SQLite3 statement which can be used by gravityDB_getDomain() to get
 // blocking domains from a table which is specified when calling this function
-bool gravityDB_getTable(const unsigned char list)
+// The statement has to be finalized by the caller
+sqlite3_stmt *gravityDB_getTable(sqlite3 *db, const unsigned char list)
 {
-	if(!gravityDB_opened && !gravityDB_open())
-	{
-		logg("gravityDB_getTable(%u): Gravity database not available", list);
-		return false;
-	}
-
 	// Checking for smaller than GRAVITY_LIST is omitted due to list being unsigned
 	if(list >= UNKNOWN_TABLE)
 	{
 		logg("gravityDB_getTable(%u): Requested list is not known!", list);
-		return false;
+		return NULL;
 	}
 
 	const char *querystr = NULL;
@@ -998,22 +796,24 @@ bool gravityDB_getTable(const unsigned char list)
 		querystr = "SELECT domain, id FROM vw_blacklist GROUP BY id";
 	else if(list == EXACT_WHITELIST_TABLE)
 		querystr = "SELECT domain, id FROM vw_whitelist GROUP BY id";
+	else if(list == WILDCARD_BLACKLIST_TABLE)
+		querystr = "SELECT domain, domainlist.id FROM "WILDCARD_BLACKLIST_FROM" GROUP BY domainlist.id";
 	else if(list == REGEX_BLACKLIST_TABLE)
-		querystr = "SELECT domain, id FROM vw_regex_blacklist GROUP BY id";
+		querystr = "SELECT domain, id, group_concat(group_id) FROM vw_regex_blacklist GROUP BY id";
 	else if(list == REGEX_WHITELIST_TABLE)
-		querystr = "SELECT domain, id FROM vw_regex_whitelist GROUP BY id";
+		querystr = "SELECT domain, id, group_concat(group_id) FROM vw_regex_whitelist GROUP BY id";
 
 	// Prepare SQLite3 statement
-	int rc = sqlite3_prepare_v2(gravity_db, querystr, -1, &table_stmt, NULL);
+	sqlite3_stmt *stmt = NULL;
+	int rc = sqlite3_prepare_v2(db, querystr, -1, &stmt, NULL);
 	if(rc != SQLITE_OK)
 	{
 		logg("readGravity(%s) - SQL error prepare: %s", querystr, sqlite3_errstr(rc));
-		gravityDB_close();
-		return false;
+		sqlite3_finalize(stmt);
+		return NULL;
 	}
 
-	// Free allocated memory and return success
-	return true;
+	return stmt;
 }
 
 // Get a single domain from a running SELECT operation
@@ -1024,17 +824,17 @@ bool gravityDB_getTable(const unsigned char list)
 // errors). Errors are logged to pihole-FTL.log
 // This function is performance critical as it might
 // be called millions of times for large blocking lists
-inline const char* gravityDB_getDomain(int *rowid)
+inline const char* gravityDB_getDomain(sqlite3_stmt *stmt, int *rowid)
 {
 	// Perform step
-	const int rc = sqlite3_step(table_stmt);
+	const int rc = sqlite3_step(stmt);
 
 	// Valid row
 	if(rc == SQLITE_ROW)
 	{
-		const char* domain = (char*)sqlite3_column_text(table_stmt, 0);
+		const char* domain = (char*)sqlite3_column_text(stmt, 0);
 		if(rowid != NULL)
-			*rowid = sqlite3_column_int(table_stmt, 1);
+			*rowid = sqlite3_column_int(stmt, 1);
 		return domain;
 	}
 
@@ -1055,6 +855,13 @@ inline const char* gravityDB_getDomain(int *rowid)
 	return NULL;
 }
 
+// Get the comma-separated groups of the domain returned by the last call to
+// gravityDB_getDomain(). Only the regex tables provide them
+const char *gravityDB_getGroups(sqlite3_stmt *stmt)
+{
+	return (const char*)sqlite3_column_text(stmt, 2);
+}
+
 // Finalize statement of a gravity database transaction
 void gravityDB_finalizeTable(void)
 {
@@ -1069,14 +876,8 @@ void gravityDB_finalizeTable(void)
 // Get number of domains in a specified table of the gravity database
 // We return the constant DB_FAILED and log to pihole-FTL.log if we
 // encounter any error
-int gravityDB_count(const enum gravity_tables list)
+int gravityDB_count(sqlite3 *db, const enum gravity_tables list)
 {
-	if(!gravityDB_opened && !gravityDB_open())
-	{
-		logg("gravityDB_count(%d): Gravity database not available", list);
-		return DB_FAILED;
-	}
-
 	const char *querystr = NULL;
 	// Build query string to be used depending on list to be read
 	switch (list)
@@ -1093,6 +894,9 @@ int gravityDB_count(const enum gravity_tables list)
 		case EXACT_WHITELIST_TABLE:
 			querystr = "SELECT COUNT(DISTINCT domain) FROM vw_whitelist";
 			break;
+		case WILDCARD_BLACKLIST_TABLE:
+			querystr = "SELECT COUNT(DISTINCT domain) FROM "WILDCARD_BLACKLIST_FROM;
+			break;
 		case REGEX_BLACKLIST_TABLE:
 			querystr = "SELECT COUNT(DISTINCT domain) FROM vw_regex_blacklist";
 			break;
@@ -1101,7 +905,6 @@ int gravityDB_count(const enum gravity_tables list)
 			break;
 		case UNKNOWN_TABLE:
 			logg("Error: List type %u unknown!", list);
-			gravityDB_close();
 			return DB_FAILED;
 	}
 
@@ -1110,32 +913,31 @@ int gravityDB_count(const enum gravity_tables list)
 		     tablename[list], querystr);
 
 	// Prepare query
-	int rc = sqlite3_prepare_v2(gravity_db, querystr, -1, &table_stmt, NULL);
+	sqlite3_stmt *stmt = NULL;
+	int rc = sqlite3_prepare_v2(db, querystr, -1, &stmt, NULL);
 	if(rc != SQLITE_OK){
 		logg("gravityDB_count(%s) - SQL error prepare %s", querystr, sqlite3_errstr(rc));
-		gravityDB_finalizeTable();
-		gravityDB_close();
+		sqlite3_finalize(stmt);
 		return DB_FAILED;
 	}
 
 	// Perform query
-	rc = sqlite3_step(table_stmt);
+	rc = sqlite3_step(stmt);
 	if(rc != SQLITE_ROW){
 		logg("gravityDB_count(%s) - SQL error step %s", querystr, sqlite3_errstr(rc));
 		if(list == GRAVITY_TABLE)
 		{
 			logg("Count of gravity domains not available. Please run pihole -g");
 		}
-		gravityDB_finalizeTable();
-		gravityDB_close();
+		sqlite3_finalize(stmt);
 		return DB_FAILED;
 	}
 
 	// Get result when there was no error
-	const int result = sqlite3_column_int(table_stmt, 0);
+	const int result = sqlite3_column_int(stmt, 0);
 
 	// Finalize statement
-	gravityDB_finalizeTable();
+	sqlite3_finalize(stmt);
 
 	if(config.debug & DEBUG_DATABASE)
 	{
@@ -1216,12 +1018,9 @@ static enum db_result domain_in_list(const char *domain, sqlite3_stmt *stmt, con
 
 void gravityDB_reload_groups(clientsData* client)
 {
-	// Rebuild client table statements (possibly from a different group set)
-	gravityDB_finalize_client_statements(client);
-	gravityDB_prepare_client_statements(client);
-
-	// Reload regex for this client (possibly from a different group set)
-	reload_per_client_regex(client);
+	// Re-read groups of this client (possibly a different group set)
+	gravityDB_forget_client_groups(client);
+	resolve_client_groupset(client);
 }
 
 // Check if this client needs a rechecking of group membership
@@ -1241,101 +1040,71 @@ static void gravityDB_client_check_again(clientsData* client)
 	}
 }
 
-enum db_result in_whitelist(const char *domain, DNSCacheData *dns_cache, clientsData* client)
+// Get the group set of a client. Clients with the same groups share one group
+// set, its enabled regex filters and its cached blocking verdicts
+int gravityDB_get_groupset(clientsData *client)
 {
-	// If list statement is not ready and cannot be initialized (e.g. no
-	// access to the database), we return false to prevent an FTL crash
-	if(whitelist_stmt == NULL)
-		return LIST_NOT_AVAILABLE;
-
 	// Check if this client needs a rechecking of group membership
 	gravityDB_client_check_again(client);
 
-	// Get whitelist statement from vector of prepared statements if available
-	sqlite3_stmt *stmt = whitelist_stmt->get(whitelist_stmt, client->id);
+	return resolve_client_groupset(client);
+}
 
-	// If client statement is not ready and cannot be initialized (e.g. no access to
-	// the database), we return false (not in whitelist) to prevent an FTL crash
-	if(stmt == NULL && !gravityDB_prepare_client_statements(client))
+// Check if a domain is on one of the in-memory lists for any of the groups
+// of a client
+static enum db_result domain_in_index(indexedDomain *dom, clientsData *client,
+                                      const enum gravity_tables list)
+{
+	// If the groups of this client are not known and cannot be obtained (e.g.
+	// no access to the database), we return that the list is not available
+	// to prevent an FTL crash
+	const uint64_t *groups = get_groupset_bitmap(resolve_client_groupset(client));
+	if(groups == NULL)
 	{
 		logg("ERROR: Gravity database not available");
 		return LIST_NOT_AVAILABLE;
 	}
 
-	// Update statement if has just been initialized
-	if(stmt == NULL)
-		stmt = whitelist_stmt->get(whitelist_stmt, client->id);
+	const enum db_result result = domain_index_lookup(list, dom, groups);
 
-	// We have to check both the exact whitelist (using a prepared database statement)
-	// as well the compiled regex whitelist filters to check if the current domain is
-	// whitelisted.
-	enum db_result on_whitelist = domain_in_list(domain, stmt, "whitelist");
+	if(config.debug & DEBUG_DATABASE)
+		logg("domain_in_index(\"%s\", %s): %d", dom->domain, tablename[list], result);
+
+	return result;
+}
+
+enum db_result in_whitelist(indexedDomain *dom, DNSCacheData *dns_cache, clientsData* client)
+{
+	// We have to check both the exact whitelist (held in memory) as well
+	// the compiled regex whitelist filters to check if the current domain
+	// is whitelisted.
+	enum db_result on_whitelist = domain_in_index(dom, client, EXACT_WHITELIST_TABLE);
 
 	// For performance reasons, the regex evaluations is executed only if the
 	// exact whitelist lookup does not deliver a positive match. This is an
-	// optimization as the database lookup will most likely hit (a) more domains
+	// optimization as the exact lookup will most likely hit (a) more domains
 	// and (b) will be faster (given a sufficiently large number of regex
 	// whitelisting filters).
 	if(on_whitelist == NOT_FOUND)
-		on_whitelist = match_regex(domain, dns_cache, client->id, REGEX_WHITELIST, false) != -1;
+		on_whitelist = match_regex(dom->domain, dns_cache, client->groupsetID, REGEX_WHITELIST, false) != -1;
 
 	return on_whitelist;
 }
 
-enum db_result in_gravity(const char *domain, clientsData *client)
+enum db_result in_gravity(indexedDomain *dom, clientsData *client)
 {
-	// If list statement is not ready and cannot be initialized (e.g. no
-	// access to the database), we return false to prevent an FTL crash
-	if(gravity_stmt == NULL)
-		return LIST_NOT_AVAILABLE;
-
-	// Check if this client needs a rechecking of group membership
-	gravityDB_client_check_again(client);
-
-	// Get whitelist statement from vector of prepared statements
-	sqlite3_stmt *stmt = gravity_stmt->get(gravity_stmt, client->id);
-
-	// If client statement is not ready and cannot be initialized (e.g. no access to
-	// the database), we return false (not in gravity list) to prevent an FTL crash
-	if(stmt == NULL && !gravityDB_prepare_client_statements(client))
-	{
-		logg("ERROR: Gravity database not available");
-		return LIST_NOT_AVAILABLE;
-	}
-
-	// Update statement if has just been initialized
-	if(stmt == NULL)
-		stmt = gravity_stmt->get(gravity_stmt, client->id);
-
-	return domain_in_list(domain, stmt, "gravity");
+	return domain_in_index(dom, client, GRAVITY_TABLE);
 }
 
-enum db_result in_blacklist(const char *domain, clientsData *client)
+enum db_result in_blacklist(indexedDomain *dom, clientsData *client)
 {
-	// If list statement is not ready and cannot be initialized (e.g. no
-	// access to the database), we return false to prevent an FTL crash
-	if(blacklist_stmt == NULL)
-		return LIST_NOT_AVAILABLE;
-
-	// Check if this client needs a rechecking of group membership
-	gravityDB_client_check_again(client);
-
-	// Get whitelist statement from vector of prepared statements
-	sqlite3_stmt *stmt = blacklist_stmt->get(blacklist_stmt, client->id);
-
-	// If client statement is not ready and cannot be initialized (e.g. no access to
-	// the database), we return false (not in blacklist) to prevent an FTL crash
-	if(stmt == NULL && !gravityDB_prepare_client_statements(client))
-	{
-		logg("ERROR: Gravity database not available");
-		return LIST_NOT_AVAILABLE;
-	}
-
-	// Update statement if has just been initialized
-	if(stmt == NULL)
-		stmt = blacklist_stmt->get(blacklist_stmt, client->id);
+	return domain_in_index(dom, client, EXACT_BLACKLIST_TABLE);
+}
 
-	return domain_in_list(domain, stmt, "blacklist");
+// Check if the domain or one of its parent domains is on the wildcard blacklist
+enum db_result in_wildcard_blacklist(indexedDomain *dom, clientsData *client)
+{
+	return domain_in_index(dom, client, WILDCARD_BLACKLIST_TABLE);
 }
 
 bool in_auditlist(const char *domain)
@@ -1348,63 +1117,3 @@ bool in_auditlist(const char *domain)
 	// We check the domain_audit table for the given domain
 	return domain_in_list(domain, auditlist_stmt, "auditlist") == FOUND;
 }
-
-bool gravityDB_get_regex_client_groups(clientsData* client, const unsigned int numregex, const regexData *regex,
-                                       const unsigned char type, const char* table)
-{
-	if(config.debug & DEBUG_REGEX)
-		logg("Getting regex client groups for client with ID %i", client->id);
-
-	char *querystr = NULL;
-	if(!client->flags.found_group && !get_client_groupids(client))
-		return false;
-
-	// Group filtering
-	const char *groups = getstr(client->groupspos);
-	if(asprintf(&querystr, "SELECT id from %s WHERE group_id IN (%s);", table, groups) < 1)
-	{
-		logg("gravityDB_get_regex_client_groups(%s, %s) - asprintf() error", table, groups);
-		return false;
-	}
-
-	// Prepare query
-	sqlite3_stmt *query_stmt;
-	int rc = sqlite3_prepare_v2(gravity_db, querystr, -1, &query_stmt, NULL);
-	if(rc != SQLITE_OK){
-		logg("gravityDB_get_regex_client_groups(): %s - SQL error prepare: %s", querystr, sqlite3_errstr(rc));
-		gravityDB_close();
-		free(querystr);
-		return false;
-	}
-
-	// Perform query
-	if(config.debug & DEBUG_REGEX)
-		logg("Regex %s: Querying groups for client %s: \"%s\"", regextype[type], getstr(client->ippos), querystr);
-	while((rc = sqlite3_step(query_stmt)) == SQLITE_ROW)
-	{
-		const int result = sqlite3_column_int(query_stmt, 0);
-		for(unsigned int regexID = 0; regexID < numregex; regexID++)
-		{
-			if(regex[regexID].database_id == result)
-			{
-				// Regular expressions are stored in one array
-				if(type == REGEX_WHITELIST)
-					regexID += get_num_regex(REGEX_BLACKLIST);
-				set_per_client_regex(client->id, regexID, true);
-
-				if(config.debug & DEBUG_REGEX)
-					logg("Regex %s: Enabling regex with DB ID %i for client %s", regextype[type], result, getstr(client->ippos));
-
-				break;
-			}
-		}
-	}
-
-	// Finalize statement
-	sqlite3_finalize(query_stmt);
-
-	// Free allocated memory and return result
-	free(querystr);
-
-	return true;
-}
@@ -12,30 +12,59 @@
 
 // clientsData
 #include "../datastructure.h"
+// type sqlite3
+#include "sqlite3.h"
 // regexData
 #include "../regex_r.h"
 
+// gravity.db has no view for the wildcard blacklist, its domains are the
+// entries of the domainlist table with this type. Only enabled entries of
+// enabled groups are used, all queries of this list select from here
+#define WILDCARD_BLACKLIST_TYPE "4"
+#define WILDCARD_BLACKLIST_FROM "domainlist " \
+	"JOIN domainlist_by_group ON domainlist_by_group.domainlist_id = domainlist.id " \
+	"JOIN \"group\" ON \"group\".id = domainlist_by_group.group_id " \
+	"WHERE domainlist.enabled = 1 AND \"group\".enabled = 1 " \
+	"AND domainlist.type = "WILDCARD_BLACKLIST_TYPE
+
 // Table indices
-enum gravity_tables { GRAVITY_TABLE, EXACT_BLACKLIST_TABLE, EXACT_WHITELIST_TABLE, REGEX_BLACKLIST_TABLE, REGEX_WHITELIST_TABLE, UNKNOWN_TABLE } __attribute__ ((packed));
+enum gravity_tables { GRAVITY_TABLE, EXACT_BLACKLIST_TABLE, EXACT_WHITELIST_TABLE, WILDCARD_BLACKLIST_TABLE, REGEX_BLACKLIST_TABLE, REGEX_WHITELIST_TABLE, UNKNOWN_TABLE } __attribute__ ((packed));
+
+// A domain to be looked up on the in-memory lists, see domain_index_filter().
+// The filter is checked only once, all lookups of the domain share the result
+typedef struct {
+	const char *domain;
+	uint32_t hash;
+	unsigned int generation;
+	// Bitmask of the lists the domain has been looked up on
+	unsigned char lists;
+	// Passed the filter
+	bool candidate;
+	// Has an entry on one of the lists (possibly for other groups)
+	bool on_list;
+} indexedDomain;
 
 bool gravityDB_open(void);
 bool gravityDB_reopen(void);
 void gravityDB_forked(void);
 void gravityDB_reload_groups(clientsData* client);
-bool gravityDB_prepare_client_statements(clientsData* client);
+int gravityDB_get_groupset(clientsData *client);
+sqlite3 *gravityDB_open_private(void);
+bool gravityDB_prepare_lists(void);
+void gravityDB_publish_lists(void);
+void gravityDB_release_lists(void);
 void gravityDB_close(void);
-bool gravityDB_getTable(unsigned char list);
-const char* gravityDB_getDomain(int *rowid);
+sqlite3_stmt *gravityDB_getTable(sqlite3 *db, const unsigned char list);
+const char* gravityDB_getDomain(sqlite3_stmt *stmt, int *rowid);
+const char *gravityDB_getGroups(sqlite3_stmt *stmt);
 char* get_client_names_from_ids(const char *group_ids) __attribute__ ((malloc));
 void gravityDB_finalizeTable(void);
-int gravityDB_count(const enum gravity_tables list);
+int gravityDB_count(sqlite3 *db, const enum gravity_tables list);
 
-enum db_result in_gravity(const char *domain, clientsData *client);
-enum db_result in_blacklist(const char *domain, clientsData *client);
-enum db_result in_whitelist(const char *domain, DNSCacheData *dns_cache, clientsData *client);
+enum db_result in_gravity(indexedDomain *dom, clientsData *client);
+enum db_result in_blacklist(indexedDomain *dom, clientsData *client);
+enum db_result in_wildcard_blacklist(indexedDomain *dom, clientsData *client);
+enum db_result in_whitelist(indexedDomain *dom, DNSCacheData *dns_cache, clientsData *client);
 bool in_auditlist(const char *domain);
 
-bool gravityDB_get_regex_client_groups(clientsData* client, const unsigned int numregex, const regexData *regex,
-                                       const unsigned char type, const char* table);
-
 #endif //GRAVITY_H
@@ -23,8 +23,6 @@
 #include "../signals.h"
 // struct config
 #include "../config.h"
-// get_rate_limit_turnaround()
-#include "../gc.h"
 
 static const char *message_types[MAX_MESSAGE] =
 	{ "REGEX", "SUBNET", "HOSTNAME", "DNSMASQ_CONFIG", "RATE_LIMIT", "DNSMASQ_WARN", "LOAD", "SHMEM", "DISK" };
@@ -352,16 +350,14 @@ void logg_fatal_dnsmasq_message(const char *message)
 	cleanup(EXIT_FAILURE);
 }
 
-void logg_rate_limit_message(const char *clientIP, const unsigned int rate_limit_count)
+void logg_rate_limit_message(const char *clientIP, const unsigned int count, const unsigned int interval)
 {
-	const time_t turnaround = get_rate_limit_turnaround(rate_limit_count);
-
 	// Log to pihole-FTL.log
-	logg("Rate-limiting %s for at least %ld second%s",
-	     clientIP, turnaround, turnaround == 1 ? "" : "s");
+	logg("Rate-limiting %s as it made more than %u queries in %u second%s",
+	     clientIP, count, interval, interval == 1 ? "" : "s");
 
 	// Log to database
-	add_message(RATE_LIMIT_MESSAGE, true, clientIP, 2, config.rate_limit.count, config.rate_limit.interval);
+	add_message(RATE_LIMIT_MESSAGE, true, clientIP, 2, count, interval);
 }
 
 void logg_warn_dnsmasq_message(char *message)
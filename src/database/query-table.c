@@ -134,7 +134,8 @@ int DB_save_queries(sqlite3 *db)
 	time_t currenttimestamp = time(NULL);
 	time_t newlasttimestamp = 0;
 	long int queryID;
-	for(queryID = MAX(0, lastdbindex); queryID < counters->queries; queryID++)
+	const long int lastQueryID = counters->queries_head + counters->queries;
+	for(queryID = MAX(counters->queries_head, lastdbindex); queryID < lastQueryID; queryID++)
 	{
 		queriesData* query = getQuery(queryID, true);
 		if(!query)
@@ -222,7 +223,7 @@ int DB_save_queries(sqlite3 *db)
 		else if(query->status == QUERY_REGEX)
 		{
 			// Restore regex ID if applicable
-			const int cacheID = findCacheID(query->domainID, query->clientID, query->type);
+			const int cacheID = findCacheID(query->domainID, query->clientID, query->type, -1);
 			DNSCacheData *cache = getDNSCache(cacheID, true);
 			if(cache != NULL)
 				sqlite3_bind_int(stmt, 7, cache->black_regex_idx);
@@ -485,7 +486,7 @@ void DB_read_queries(void)
 		const int clientID = findClientID(clientIP, true, false);
 
 		// Set index for this query
-		const int queryIndex = counters->queries;
+		const int queryIndex = counters->queries_head + counters->queries;
 
 		// Store this query in memory
 		queriesData* query = getQuery(queryIndex, false);
@@ -555,7 +556,7 @@ void DB_read_queries(void)
 		else if(status == QUERY_REGEX)
 		{
 			// QUERY_REGEX: Set ID regex which was the reson for blocking
-			const int cacheID = findCacheID(query->domainID, query->clientID, query->type);
+			const int cacheID = findCacheID(query->domainID, query->clientID, query->type, -1);
 			DNSCacheData *cache = getDNSCache(cacheID, true);
 			// Only load if
 			//  a) we have a chace entry
@@ -629,7 +630,7 @@ void DB_read_queries(void)
 
 	// Update lastdbindex so that the next call to DB_save_queries()
 	// skips the queries that we just imported from the database
-	lastdbindex = counters->queries;
+	lastdbindex = counters->queries_head + counters->queries;
 
 	if( rc != SQLITE_DONE ){
 		logg("DB_read_queries() - SQL error step: %s", sqlite3_errstr(rc));
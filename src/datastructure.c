@@ -12,12 +12,10 @@
 #include "datastructure.h"
 #include "shmem.h"
 #include "log.h"
-// enum REGEX
+// enum REGEX, reload_groupset_regex()
 #include "regex_r.h"
-// reload_per_client_regex()
+// gravityDB_reopen()
 #include "database/gravity-db.h"
-// bool startup
-#include "main.h"
 // reset_aliasclient()
 #include "database/aliasclients.h"
 // config struct
@@ -42,31 +40,9 @@ void strtolower(char *str)
 
 int findQueryID(const int id)
 {
-	// Loop over all queries - we loop in reverse order (start from the most recent query and
-	// continuously walk older queries while trying to find a match. Ideally, we should always
-	// find the correct query with zero iterations, but it may happen that queries are processed
-	// asynchronously, e.g. for slow upstream relies to a huge amount of requests.
-	// We iterate from the most recent query down to at most MAXITER queries in the past to avoid
-	// iterating through the entire array of queries
-	// MAX(0, a) is used to return 0 in case a is negative (negative array indices are harmful)
-	const int until = MAX(0, counters->queries-MAXITER);
-	const int start = MAX(0, counters->queries-1);
-
-	// Check UUIDs of queries
-	for(int i = start; i >= until; i--)
-	{
-		const queriesData* query = getQuery(i, true);
-
-		// Check if the returned pointer is valid before trying to access it
-		if(query == NULL)
-			continue;
-
-		if(query->id == id)
-			return i;
-	}
-
-	// If not found
-	return -1;
+	// Queries are indexed by their dnsmasq ID in a shared hash map. If the
+	// same ID has been seen more than once, the most recent query is returned
+	return lookup_query_hash(id);
 }
 
 int findUpstreamID(const char * upstreamString, const in_port_t port)
@@ -121,31 +97,28 @@ int findUpstreamID(const char * upstreamString, const in_port_t port)
 
 int findDomainID(const char *domainString, const bool count)
 {
-	for(int domainID = 0; domainID < counters->domains; domainID++)
+	// Look up domain in the shared hash index
+	const int knownID = lookup_domain_hash(domainString, hashStr(domainString));
+	if(knownID > -1)
 	{
 		// Get domain pointer
-		domainsData* domain = getDomain(domainID, true);
+		domainsData* domain = getDomain(knownID, true);
 
 		// Check if the returned pointer is valid before trying to access it
-		if(domain == NULL)
-			continue;
-
-		// Quick test: Does the domain start with the same character?
-		if(getstr(domain->domainpos)[0] != domainString[0])
-			continue;
-
-		// If so, compare the full domain using strcmp
-		if(strcmp(getstr(domain->domainpos), domainString) == 0)
+		if(domain != NULL)
 		{
 			if(count)
 				domain->count++;
-			return domainID;
+			// Keep this domain during a running compaction
+			domain->referenced = true;
+			return knownID;
 		}
 	}
 
 	// If we did not return until here, then this domain is not known
-	// Store ID
-	const int domainID = counters->domains;
+	// Store ID, reuse the slot of a domain removed by compaction if possible
+	const int freeID = get_free_domain_slot();
+	const int domainID = freeID > -1 ? freeID : counters->domains;
 
 	// Get domain pointer
 	domainsData* domain = getDomain(domainID, false);
@@ -157,6 +130,7 @@ int findDomainID(const char *domainString, const bool count)
 
 	// Set magic byte
 	domain->magic = MAGICBYTE;
+	domain->referenced = true;
 	// Set its counter to 1 only if this domain is to be counted
 	// Domains only encountered during CNAME inspection are NOT counted here
 	domain->count = count ? 1 : 0;
@@ -164,34 +138,43 @@ int findDomainID(const char *domainString, const bool count)
 	domain->blockedcount = 0;
 	// Store domain name - no need to check for NULL here as it doesn't harm
 	domain->domainpos = addstr(domainString);
+	// Add domain to the hash index
+	add_domain_hash(domainID);
 	// Increase counter by one
-	counters->domains++;
+	if(freeID < 0)
+		counters->domains++;
 
 	return domainID;
 }
 
-int findClientID(const char *clientIP, const bool count, const bool aliasclient)
+// Convert a client string into the binary representation used by the client
+// hash index
+void get_client_addr(const char *clientIP, const bool aliasclient, clientAddr *addr)
 {
-	// Compare content of client against known client IP addresses
-	for(int clientID=0; clientID < counters->clients; clientID++)
+	memset(addr, 0, sizeof(*addr));
+	if(!aliasclient && inet_pton(AF_INET, clientIP, &addr->addr.in) == 1)
+		addr->family = AF_INET;
+	else if(!aliasclient && inet_pton(AF_INET6, clientIP, &addr->addr.in6) == 1)
+		addr->family = AF_INET6;
+	else
+		addr->family = AF_UNSPEC;
+}
+
+static int findClient(const clientAddr *addr, const char *clientIP, const bool count, const bool aliasclient)
+{
+	// Look up client in the shared hash index
+	const int knownID = lookup_client_hash(addr, clientIP);
+	if(knownID > -1)
 	{
 		// Get client pointer
-		clientsData* client = getClient(clientID, true);
+		clientsData* client = getClient(knownID, true);
 
 		// Check if the returned pointer is valid before trying to access it
-		if(client == NULL)
-			continue;
-
-		// Quick test: Does the clients IP start with the same character?
-		if(getstr(client->ippos)[0] != clientIP[0])
-			continue;
-
-		// If so, compare the full IP using strcmp
-		if(strcmp(getstr(client->ippos), clientIP) == 0)
+		if(client != NULL)
 		{
 			// Add one if count == true (do not add one, e.g., during ARP table processing)
 			if(count && !aliasclient) change_clientcount(client, 1, 0, -1, 0);
-			return clientID;
+			return knownID;
 		}
 	}
 
@@ -219,7 +202,19 @@ int findClientID(const char *clientIP, const bool count, const bool aliasclient)
 	// Initialize blocked count to zero
 	client->blockedcount = 0;
 	// Store client IP - no need to check for NULL here as it doesn't harm
-	client->ippos = addstr(clientIP);
+	// The string representation is only generated here when we were
+	// called with a binary address
+	if(clientIP == NULL)
+	{
+		char ipbuffer[INET6_ADDRSTRLEN] = { 0 };
+		inet_ntop(addr->family, &addr->addr, ipbuffer, sizeof(ipbuffer));
+		client->ippos = addstr(ipbuffer);
+	}
+	else
+		client->ippos = addstr(clientIP);
+	// Store binary address and add client to the hash index
+	client->addr = *addr;
+	add_client_hash(clientID);
 	// Initialize client hostname
 	// Due to the nature of us being the resolver,
 	// the actual resolving of the host name has
@@ -233,6 +228,7 @@ int findClientID(const char *clientIP, const bool count, const bool aliasclient)
 	// Configured groups are yet unknown
 	client->flags.found_group = false;
 	client->groupspos = 0u;
+	client->groupsetID = -1;
 	// Store time this client was added, we re-read group settings
 	// some time after adding a client to ensure we pick up possible
 	// group configuration though hostname, MAC address or interface
@@ -248,7 +244,7 @@ int findClientID(const char *clientIP, const bool count, const bool aliasclient)
 	client->aliasclient_id = -1;
 
 	// Initialize client-specific overTime data
-	memset(client->overTime, 0, sizeof(client->overTime));
+	reset_client_overTime(clientID);
 
 	// Store client ID
 	client->id = clientID;
@@ -256,16 +252,8 @@ int findClientID(const char *clientIP, const bool count, const bool aliasclient)
 	// Increase counter by one
 	counters->clients++;
 
-	// Get groups for this client and set enabled regex filters
-	// Note 1: We do this only after increasing the clients counter to
-	//         ensure sufficient shared memory is available in the
-	//         pre_client_regex object.
-	// Note 2: We don't do this before starting up is done as the gravity
-	//         database may not be available. All clients initialized
-	//         during history reading get their enabled regexs reloaded
-	//         in the initial call to FTL_reload_all_domainlists()
-	if(!startup && !aliasclient)
-		reload_per_client_regex(client);
+	// The groups of this client (and, hence, its enabled regex filters) are
+	// obtained when the client is checked for blocking for the first time
 
 	// Check if this client is managed by a alias-client
 	if(!aliasclient)
@@ -274,12 +262,24 @@ int findClientID(const char *clientIP, const bool count, const bool aliasclient)
 	return clientID;
 }
 
+int findClientID(const char *clientIP, const bool count, const bool aliasclient)
+{
+	clientAddr addr;
+	get_client_addr(clientIP, aliasclient, &addr);
+	return findClient(&addr, clientIP, count, aliasclient);
+}
+
+int findClientIDbyAddr(const clientAddr *addr, const bool count)
+{
+	return findClient(addr, NULL, count, false);
+}
+
 void change_clientcount(clientsData *client, int total, int blocked, int overTimeIdx, int overTimeMod)
 {
 		client->count += total;
 		client->blockedcount += blocked;
 		if(overTimeIdx > -1 && overTimeIdx < OVERTIME_SLOTS)
-			client->overTime[overTimeIdx] += overTimeMod;
+			change_client_overTime(client->id, overTimeIdx, overTimeMod);
 
 		// Also add counts to the conencted alias-client (if any)
 		if(client->flags.aliasclient)
@@ -294,34 +294,186 @@ void change_clientcount(clientsData *client, int total, int blocked, int overTim
 			aliasclient->count += total;
 			aliasclient->blockedcount += blocked;
 			if(overTimeIdx > -1 && overTimeIdx < OVERTIME_SLOTS)
-				aliasclient->overTime[overTimeIdx] += overTimeMod;
+				change_client_overTime(client->aliasclient_id, overTimeIdx, overTimeMod);
 		}
 }
 
-int findCacheID(int domainID, int clientID, enum query_types query_type)
+// Select a DNS cache entry to be reused using the CLOCK algorithm: the hand
+// sweeps over all entries giving recently used ones a second chance. The
+// protected entry is never evicted as the caller still uses it (e.g. during
+// CNAME inspection)
+static int evict_cache_entry(const int protectedID)
 {
-	// Compare content of client against known client IP addresses
-	for(int cacheID = 0; cacheID < counters->dns_cache_size; cacheID++)
+	while(true)
 	{
-		// Get cache pointer
+		const int cacheID = counters->dns_cache_hand;
+		counters->dns_cache_hand = (cacheID + 1) % counters->dns_cache_size;
+
 		DNSCacheData* dns_cache = getDNSCache(cacheID, true);
+		if(dns_cache == NULL || cacheID == protectedID)
+			continue;
 
-		// Check if the returned pointer is valid before trying to access it
-		if(dns_cache == NULL)
+		if(dns_cache->referenced)
+		{
+			// Give this entry a second chance
+			dns_cache->referenced = false;
+			continue;
+		}
+
+		// Remove evicted entry from the hash index
+		remove_dns_cache_hash(cacheID);
+		counters->dns_cache_stats.evictions++;
+		return cacheID;
+	}
+}
+
+int findGroupsetID(const size_t groupspos)
+{
+	// Group sets are few, a linear search is sufficient. Equal group strings
+	// are usually deduplicated in the string buffer so comparing positions
+	// catches most matches
+	const char *groups = getstr(groupspos);
+	int freeID = -1;
+	for(int groupsetID = 0; groupsetID < counters->groupsets; groupsetID++)
+	{
+		const groupsetsData *groupset = getGroupset(groupsetID, false);
+		if(groupset == NULL)
 			continue;
 
-		if(dns_cache->domainID == domainID &&
-		   dns_cache->clientID == clientID &&
-		   dns_cache->query_type == query_type)
+		// Remember the first released group set, it can be reused
+		if(groupset->magic != MAGICBYTE)
 		{
-			return cacheID;
+			if(freeID < 0)
+				freeID = groupsetID;
+			continue;
 		}
+
+		if(groupset->groupspos == groupspos ||
+		   strcmp(getstr(groupset->groupspos), groups) == 0)
+			return groupsetID;
 	}
 
-	// Get ID of new cache entry
-	const int cacheID = counters->dns_cache_size;
+	// This group set is not known so far, create a new one
+	const int groupsetID = freeID > -1 ? freeID : counters->groupsets;
 
-	// Get client pointer
+	// Get group set pointer
+	groupsetsData *groupset = getGroupset(groupsetID, false);
+	if(groupset == NULL)
+	{
+		logg("ERROR: Encountered serious memory error in findGroupsetID()");
+		return -1;
+	}
+
+	groupset->magic = MAGICBYTE;
+	groupset->groupspos = groupspos;
+
+	// Increase counter by one
+	if(freeID < 0)
+		counters->groupsets++;
+
+	if(config.debug & DEBUG_DATABASE)
+		logg("New group set %i: \"%s\"", groupsetID, groups);
+
+	// Enable the regex filters of this group set
+	reload_groupset_regex(groupsetID);
+
+	return groupsetID;
+}
+
+// Release group sets which are not used by any client anymore. Their slots
+// are reused by findGroupsetID(). Returns the number of released group sets
+int release_groupsets(void)
+{
+	if(counters->groupsets < 1)
+		return 0;
+
+	bool *used = calloc(counters->groupsets, sizeof(bool));
+	if(used == NULL)
+		return 0;
+
+	for(int clientID = 0; clientID < counters->clients; clientID++)
+	{
+		const clientsData *client = getClient(clientID, true);
+		if(client != NULL && client->groupsetID > -1 && client->groupsetID < counters->groupsets)
+			used[client->groupsetID] = true;
+	}
+
+	int released = 0;
+	for(int groupsetID = 0; groupsetID < counters->groupsets; groupsetID++)
+	{
+		groupsetsData *groupset = getGroupset(groupsetID, false);
+		if(groupset == NULL || groupset->magic != MAGICBYTE || used[groupsetID])
+			continue;
+
+		if(config.debug & DEBUG_DATABASE)
+			logg("Releasing group set %i: \"%s\"", groupsetID, getstr(groupset->groupspos));
+
+		groupset->magic = 0;
+		groupset->groupspos = 0u;
+		reset_groupset_regex(groupsetID);
+		released++;
+	}
+	free(used);
+
+	if(released == 0)
+		return 0;
+
+	// Verdicts cached for released group sets must not be used by group sets
+	// reusing their slots
+	for(int cacheID = 0; cacheID < counters->dns_cache_size; cacheID++)
+	{
+		DNSCacheData *dns_cache = getDNSCache(cacheID, true);
+		if(dns_cache == NULL || dns_cache->groupsetID < 0)
+			continue;
+
+		const groupsetsData *groupset = getGroupset(dns_cache->groupsetID, false);
+		if(groupset != NULL && groupset->magic != MAGICBYTE)
+			dns_cache->blocking_status = UNKNOWN_BLOCKED;
+	}
+
+	// Other processes drop what they derived from released group sets
+	counters->groupsets_released += released;
+
+	return released;
+}
+
+// Clients with the same groups share their cached blocking verdicts. Verdicts
+// of clients whose groups are not known are kept separately for each client
+int getCacheGroupset(const int clientID)
+{
+	const clientsData *client = getClient(clientID, true);
+	if(client != NULL && client->groupsetID > -1)
+		return client->groupsetID;
+	return -1 - clientID;
+}
+
+// Get the DNS cache entry of a domain for the group set of a client. When the
+// cache is full, an entry is evicted but never the one with ID protectedID
+// (use -1 if the caller does not hold on to another entry)
+int findCacheID(int domainID, int clientID, enum query_types query_type, const int protectedID)
+{
+	// Look up cache entry in the shared hash index
+	const int groupsetID = getCacheGroupset(clientID);
+	const int knownID = lookup_dns_cache_hash(domainID, groupsetID, query_type);
+	if(knownID > -1)
+	{
+		DNSCacheData* dns_cache = getDNSCache(knownID, true);
+		if(dns_cache != NULL)
+		{
+			dns_cache->referenced = true;
+			counters->dns_cache_stats.hits++;
+			return knownID;
+		}
+	}
+	counters->dns_cache_stats.misses++;
+
+	// Get ID of new cache entry, reuse an existing entry if the cache
+	// reached its maximum size
+	const bool evict = config.per_client_cache_size > 0 &&
+	                   (unsigned int)counters->dns_cache_size >= config.per_client_cache_size;
+	const int cacheID = evict ? evict_cache_entry(protectedID) : counters->dns_cache_size;
+
+	// Get cache pointer
 	DNSCacheData* dns_cache = getDNSCache(cacheID, false);
 
 	if(dns_cache == NULL)
@@ -334,16 +486,42 @@ int findCacheID(int domainID, int clientID, enum query_types query_type)
 	dns_cache->magic = MAGICBYTE;
 	dns_cache->blocking_status = UNKNOWN_BLOCKED;
 	dns_cache->domainID = domainID;
-	dns_cache->clientID = clientID;
+	dns_cache->groupsetID = groupsetID;
 	dns_cache->query_type = query_type;
 	dns_cache->force_reply = 0u;
+	dns_cache->black_regex_idx = -1;
+	dns_cache->referenced = true;
+
+	// Add new entry to the hash index
+	add_dns_cache_hash(cacheID);
 
 	// Increase counter by one
-	counters->dns_cache_size++;
+	if(!evict)
+		counters->dns_cache_size++;
 
 	return cacheID;
 }
 
+// Use a DNS cache entry whose ID the caller remembered from an earlier lookup
+// like findCacheID() would. Returns false if the entry has been reused for
+// another domain, group set or query type in the meantime
+bool touchCacheID(const int cacheID, const int domainID, const int clientID, const enum query_types query_type)
+{
+	if(cacheID < 0 || cacheID >= counters->dns_cache_size)
+		return false;
+
+	DNSCacheData* dns_cache = getDNSCache(cacheID, true);
+	if(dns_cache == NULL ||
+	   dns_cache->domainID != domainID ||
+	   dns_cache->groupsetID != getCacheGroupset(clientID) ||
+	   dns_cache->query_type != query_type)
+		return false;
+
+	dns_cache->referenced = true;
+	counters->dns_cache_stats.hits++;
+	return true;
+}
+
 bool isValidIPv4(const char *addr)
 {
 	struct sockaddr_in sa;
@@ -473,23 +651,32 @@ void FTL_reset_per_client_domain_data(void)
 // May only be called from the database thread
 void FTL_reload_all_domainlists(void)
 {
+	// Read gravity, the exact and wildcard lists and the regex filters from
+	// a private database connection without holding the lock. Queries are
+	// answered using the current lists in the meantime
+	gravityDB_prepare_lists();
+
 	lock_shm();
 
 	// (Re-)open gravity database connection
 	gravityDB_reopen();
 
-	// Reset number of blocked domains
-	counters->gravity = gravityDB_count(GRAVITY_TABLE);
-
-	// Read and compile possible regex filters
-	// only after having called gravityDB_open()
-	read_regex_from_database();
+	// Replace the lists and the regex filters. Queries hold the lock while
+	// they are processed, none of them is still using the previous lists
+	gravityDB_publish_lists();
 
 	// Reset FTL's internal DNS cache storing whether a specific domain
 	// has already been validated for a specific user
 	FTL_reset_per_client_domain_data();
 
+	// Pre-forked TCP workers still use the previous lists. They are
+	// replaced as soon as they are idle
+	counters->tcp_pool.generation++;
+
 	unlock_shm();
+
+	// Free the previous lists, no query can use them anymore
+	gravityDB_release_lists();
 }
 
 bool __attribute__ ((const)) is_blocked(const enum query_status status)
@@ -66,11 +66,24 @@ typedef struct {
 } upstreamsData;
 ASSERT_SIZEOF(upstreamsData, 640, 624, 624);
 
+// Binary client identifier used to index clients in shared memory. Alias-clients
+// and other identifiers which are not IP addresses use family AF_UNSPEC and are
+// compared by their string representation
+typedef struct {
+	sa_family_t family;
+	union {
+		struct in_addr in;
+		struct in6_addr in6;
+	} addr;
+} clientAddr;
+ASSERT_SIZEOF(clientAddr, 20, 20, 20);
+
+// Fields used on every query come first so they share a cache line. The
+// per-client overTime data is stored separately (see get_client_overTime())
 typedef struct {
 	unsigned char magic;
 	unsigned char reread_groups;
 	char hwlen;
-	unsigned char hwaddr[16]; // See DHCP_CHADDR_MAX in dnsmasq/dhcp-protocol.h
 	struct client_flags {
 		bool new:1;
 		bool found_group:1;
@@ -81,43 +94,73 @@ typedef struct {
 	int blockedcount;
 	int aliasclient_id;
 	unsigned int id;
-	unsigned int rate_limit;
+	int groupsetID;
+	// Theoretical arrival time of the next query [usec] (see ratelimit.c)
+	uint64_t rate_limit_tat;
+	size_t ippos;
+	clientAddr addr;
 	unsigned int numQueriesARP;
-	int overTime[OVERTIME_SLOTS];
 	size_t groupspos;
-	size_t ippos;
 	size_t namepos;
 	size_t ifacepos;
 	time_t lastQuery;
 	time_t firstSeen;
+	unsigned char hwaddr[16]; // See DHCP_CHADDR_MAX in dnsmasq/dhcp-protocol.h
 } clientsData;
-ASSERT_SIZEOF(clientsData, 696, 668, 668);
+ASSERT_SIZEOF(clientsData, 120, 96, 96);
+
+// Aggregate rate-limiting bucket shared by all clients of a subnet. Buckets
+// are stored in a fixed-size open-addressing table, see ratelimit.c
+typedef struct {
+	// Theoretical arrival time of the next query [usec]
+	uint64_t tat;
+	struct in6_addr addr;
+	sa_family_t family;
+	bool limited;
+} rateLimitBucket;
+ASSERT_SIZEOF(rateLimitBucket, 32, 28, 32);
 
 typedef struct {
 	unsigned char magic;
+	bool referenced;
 	int count;
 	int blockedcount;
 	size_t domainpos;
 } domainsData;
 ASSERT_SIZEOF(domainsData, 24, 16, 16);
 
+// Distinct set of groups. Clients with the same groups share one group set and,
+// hence, their enabled regex filters and cached blocking verdicts
+typedef struct {
+	unsigned char magic;
+	size_t groupspos;
+} groupsetsData;
+ASSERT_SIZEOF(groupsetsData, 16, 8, 8);
+
 typedef struct {
 	unsigned char magic;
 	enum domain_client_status blocking_status;
 	enum reply_type force_reply;
 	enum query_types query_type;
+	bool referenced; // CLOCK eviction: set when used, cleared by the clock hand
 	int domainID;
-	int clientID;
+	int groupsetID; // -1 - clientID for clients whose groups are not known
 	int black_regex_idx;
 } DNSCacheData;
-ASSERT_SIZEOF(DNSCacheData, 16, 16, 16);
+ASSERT_SIZEOF(DNSCacheData, 20, 20, 20);
 
 void strtolower(char *str);
 int findQueryID(const int id);
 int findUpstreamID(const char * upstream, const in_port_t port);
 int findDomainID(const char *domain, const bool count);
 int findClientID(const char *client, const bool count, const bool aliasclient);
-int findCacheID(int domainID, int clientID, enum query_types query_type);
+int findClientIDbyAddr(const clientAddr *addr, const bool count);
+void get_client_addr(const char *client, const bool aliasclient, clientAddr *addr);
+int findGroupsetID(const size_t groupspos);
+int release_groupsets(void);
+int getCacheGroupset(const int clientID);
+int findCacheID(int domainID, int clientID, enum query_types query_type, const int protectedID);
+bool touchCacheID(const int cacheID, const int domainID, const int clientID, const enum query_types query_type);
 bool isValidIPv4(const char *addr);
 bool isValidIPv6(const char *addr);
 
@@ -148,5 +191,7 @@ domainsData* _getDomain(int domainID, bool checkMagic, int line, const char * fu
 upstreamsData* _getUpstream(int upstreamID, bool checkMagic, int line, const char * function, const char * file);
 #define getDNSCache(cacheID, checkMagic) _getDNSCache(cacheID, checkMagic, __LINE__, __FUNCTION__, __FILE__)
 DNSCacheData* _getDNSCache(int cacheID, bool checkMagic, int line, const char * function, const char * file);
+#define getGroupset(groupsetID, checkMagic) _getGroupset(groupsetID, checkMagic, __LINE__, __FUNCTION__, __FILE__)
+groupsetsData* _getGroupset(int groupsetID, bool checkMagic, int line, const char * function, const char * file);
 
 #endif //DATASTRUCTURE_H
@@ -35,6 +35,32 @@ static char terminate = 0;
 
 static void set_dns_listeners(void);
 static void check_dns_listeners(time_t now);
+/************ Pi-hole modification ************/
+/* Pre-forked TCP workers. A worker occupies a process slot just like a child
+   forked for a single connection and sends its cache entries up the same
+   pipe. It is handed accepted connections over a control socket and replies
+   on it each time it is idle again. */
+#define TCP_POOL_LIFETIME 3600 /* secs until an idle worker is replaced */
+struct tcp_pool_job {
+  union mysockaddr tcp_addr;
+  struct in_addr netmask;
+  int auth_dns;
+  int log_id;
+};
+static struct {
+  int fd; /* our end of the control socket, -1 if the slot holds no worker */
+  int busy;
+  unsigned int generation;
+  time_t started;
+} tcp_pool[MAX_PROCS];
+static time_t tcp_pool_last_fill = 0;
+static void tcp_pool_fill(time_t now);
+static void tcp_pool_check(void);
+static void tcp_pool_report(void);
+static int tcp_pool_idle(void);
+static int tcp_pool_dispatch(int confd, struct irec *iface, union mysockaddr *tcp_addr);
+static void tcp_pool_forked(void);
+/**********************************************/
 static void sig_handler(int sig);
 static void async_event(int pipe, time_t now);
 static void fatal_event(struct event_desc *ev, char *msg);
@@ -1075,6 +1101,11 @@ int main_dnsmasq (int argc, char **argv)
   daemon->pipe_to_parent = -1;
   for (i = 0; i < MAX_PROCS; i++)
     daemon->tcp_pipes[i] = -1;
+
+  /************ Pi-hole modification ************/
+  for (i = 0; i < MAX_PROCS; i++)
+    tcp_pool[i].fd = -1;
+  /**********************************************/
   
 #ifdef HAVE_INOTIFY
   /* Using inotify, have to select a resolv file at startup */
@@ -1551,7 +1582,17 @@ static void async_event(int pipe, time_t now)
 	  else 
 	    for (i = 0 ; i < MAX_PROCS; i++)
 	      if (daemon->tcp_pids[i] == p)
-		daemon->tcp_pids[i] = 0;
+		{
+		  daemon->tcp_pids[i] = 0;
+		  /************ Pi-hole modification ************/
+		  if (tcp_pool[i].fd != -1)
+		    {
+		      close(tcp_pool[i].fd);
+		      tcp_pool[i].fd = -1;
+		      tcp_pool_report();
+		    }
+		  /**********************************************/
+		}
 	break;
 	
 #if defined(HAVE_SCRIPT)	
@@ -1794,11 +1835,21 @@ static void set_dns_listeners(void)
   for (rfl = daemon->rfl_poll; rfl; rfl = rfl->next)
     poll_listen(rfl->rfd->fd, POLLIN);
   
+  /************ Pi-hole modification ************/
+  tcp_pool_fill(dnsmasq_time());
+  /**********************************************/
+
   /* check to see if we have free tcp process slots. */
   for (i = MAX_PROCS - 1; i >= 0; i--)
     if (daemon->tcp_pids[i] == 0 && daemon->tcp_pipes[i] == -1)
       break;
 
+  /************ Pi-hole modification ************/
+  /* An idle pre-forked worker can take a connection, too */
+  if (i < 0)
+    i = tcp_pool_idle();
+  /**********************************************/
+
   for (listener = daemon->listeners; listener; listener = listener->next)
     {
       if (listener->fd != -1)
@@ -1822,6 +1873,12 @@ static void set_dns_listeners(void)
     for (i = 0; i < MAX_PROCS; i++)
       if (daemon->tcp_pipes[i] != -1)
 	poll_listen(daemon->tcp_pipes[i], POLLIN);
+
+  /************ Pi-hole modification ************/
+  for (i = 0; i < MAX_PROCS; i++)
+    if (tcp_pool[i].fd != -1)
+      poll_listen(tcp_pool[i].fd, POLLIN);
+  /**********************************************/
 }
 
 static void check_dns_listeners(time_t now)
@@ -1862,6 +1919,10 @@ static void check_dns_listeners(time_t now)
 	  close(daemon->tcp_pipes[i]);
 	  daemon->tcp_pipes[i] = -1;	
 	}
+
+  /************ Pi-hole modification ************/
+  tcp_pool_check();
+  /**********************************************/
 	
   for (listener = daemon->listeners; listener; listener = listener->next)
     {
@@ -1883,7 +1944,12 @@ static void check_dns_listeners(time_t now)
 	if (daemon->tcp_pids[i] == 0 && daemon->tcp_pipes[i] == -1)
 	  break;
 
-      if (listener->tcpfd != -1 && i >= 0 && poll_check(listener->tcpfd, POLLIN))
+      /************ Pi-hole modification ************/
+      /* An idle pre-forked worker can take a connection, too. i still
+	 holds the free process slot (if any) for forking. */
+      if (listener->tcpfd != -1 && (i >= 0 || tcp_pool_idle() >= 0) &&
+	  poll_check(listener->tcpfd, POLLIN))
+      /**********************************************/
 	{
 	  int confd, client_ok = 1;
 	  struct irec *iface = NULL;
@@ -1966,6 +2032,21 @@ static void check_dns_listeners(time_t now)
 	      shutdown(confd, SHUT_RDWR);
 	      close(confd);
 	    }
+	  /************ Pi-hole modification ************/
+	  else if (!option_bool(OPT_DEBUG) && tcp_pool_dispatch(confd, iface, &tcp_addr))
+	    {
+	      close(confd);
+
+	      /* The worker can use up to TCP_MAX_QUERIES ids, so skip that many. */
+	      daemon->log_id += TCP_MAX_QUERIES;
+	    }
+	  else if (!option_bool(OPT_DEBUG) && i < 0)
+	    {
+	      /* The idle worker went away and there is no free process slot */
+	      shutdown(confd, SHUT_RDWR);
+	      close(confd);
+	    }
+	  /**********************************************/
 	  else if (!option_bool(OPT_DEBUG) && pipe(pipefd) == 0 && (p = fork()) != 0)
 	    {
 	      close(pipefd[1]); /* parent needs read pipe end. */
@@ -1995,6 +2076,10 @@ static void check_dns_listeners(time_t now)
 		  /* i holds index of free slot */
 		  daemon->tcp_pids[i] = p;
 		  daemon->tcp_pipes[i] = pipefd[0];
+
+		  /************ Pi-hole modification ************/
+		  FTL_TCP_connection(false);
+		  /**********************************************/
 		}
 	      close(confd);
 
@@ -2034,6 +2119,10 @@ static void check_dns_listeners(time_t now)
 		  alarm(CHILD_LIFETIME);
 		  close(pipefd[0]); /* close read end in child. */
 		  daemon->pipe_to_parent = pipefd[1];
+
+		  /************ Pi-hole modification ************/
+		  tcp_pool_forked();
+		  /**********************************************/
 		}
 
 	      /* start with no upstream connections. */
@@ -2082,6 +2171,339 @@ static void check_dns_listeners(time_t now)
     }
 }
 
+/************ Pi-hole modification ************/
+/* Close our ends of the control sockets inherited by a child, otherwise
+   workers would not notice when we close them. */
+static void tcp_pool_forked(void)
+{
+  int i;
+
+  for (i = 0; i < MAX_PROCS; i++)
+    if (tcp_pool[i].fd != -1)
+      {
+	close(tcp_pool[i].fd);
+	tcp_pool[i].fd = -1;
+      }
+}
+
+static void tcp_pool_report(void)
+{
+  int i, workers = 0, busy = 0;
+
+  for (i = 0; i < MAX_PROCS; i++)
+    if (tcp_pool[i].fd != -1)
+      {
+	workers++;
+	if (tcp_pool[i].busy)
+	  busy++;
+      }
+
+  FTL_TCP_pool_status(workers, busy);
+}
+
+/* Return the slot of an idle worker which is up-to-date, or -1 if there is
+   none. */
+static int tcp_pool_idle(void)
+{
+  unsigned int generation = FTL_TCP_pool_generation();
+  int i;
+
+  for (i = 0; i < MAX_PROCS; i++)
+    if (tcp_pool[i].fd != -1 && !tcp_pool[i].busy && tcp_pool[i].generation == generation)
+      return i;
+
+  return -1;
+}
+
+/* Runs in a pre-forked worker: serve connections until we close the control
+   socket. */
+static void tcp_pool_worker(int fd)
+{
+  struct tcp_pool_job job;
+  unsigned char a = 1;
+
+  FTL_TCP_pool_worker_started();
+
+  while (1)
+    {
+      union {
+	struct cmsghdr align; /* this ensures alignment */
+	char control[CMSG_SPACE(sizeof(int))];
+      } control_u;
+      struct msghdr msg;
+      struct iovec iov;
+      struct cmsghdr *cmptr;
+      struct server *s;
+      struct irec *iface;
+      unsigned char *buff;
+      ssize_t n;
+      int confd = -1, flags;
+
+      memset(&msg, 0, sizeof(msg));
+      iov.iov_base = &job;
+      iov.iov_len = sizeof(job);
+      msg.msg_iov = &iov;
+      msg.msg_iovlen = 1;
+      msg.msg_control = control_u.control;
+      msg.msg_controllen = sizeof(control_u);
+
+      while ((n = recvmsg(fd, &msg, 0)) == -1 && errno == EINTR);
+
+      /* We closed the control socket, time to go. */
+      if (n <= 0)
+	break;
+
+      for (cmptr = CMSG_FIRSTHDR(&msg); cmptr; cmptr = CMSG_NXTHDR(&msg, cmptr))
+	if (cmptr->cmsg_level == SOL_SOCKET && cmptr->cmsg_type == SCM_RIGHTS)
+	  memcpy(&confd, CMSG_DATA(cmptr), sizeof(int));
+
+      if (confd != -1 && n == sizeof(job))
+	{
+	  /* Same as for a child forked for this connection only. */
+	  alarm(CHILD_LIFETIME);
+	  daemon->log_id = job.log_id;
+
+	  for (s = daemon->servers; s; s = s->next)
+	    s->tcpfd = -1;
+
+	  if ((flags = fcntl(confd, F_GETFL, 0)) != -1)
+	    while(retry_send(fcntl(confd, F_SETFL, flags & ~O_NONBLOCK)));
+
+	  /* Our copy of the interface list dates from when we were forked,
+	     find the interface by the local address of the connection. */
+	  for (iface = daemon->interfaces; iface; iface = iface->next)
+	    if (sockaddr_isequal(&iface->addr, &job.tcp_addr))
+	      break;
+
+	  FTL_TCP_worker_created(confd);
+	  FTL_iface(iface, NULL, 0);
+
+	  buff = tcp_request(confd, dnsmasq_time(), &job.tcp_addr, job.netmask, job.auth_dns);
+
+	  shutdown(confd, SHUT_RDWR);
+	  close(confd);
+
+	  if (buff)
+	    free(buff);
+
+	  for (s = daemon->servers; s; s = s->next)
+	    if (s->tcpfd != -1)
+	      {
+		shutdown(s->tcpfd, SHUT_RDWR);
+		close(s->tcpfd);
+		s->tcpfd = -1;
+	      }
+
+	  /* No flush_log() here, it closes the log for good. */
+	  alarm(0);
+	}
+      else if (confd != -1)
+	close(confd);
+
+      /* Tell the master we're idle again. */
+      while ((n = send(fd, &a, 1, 0)) == -1 && errno == EINTR);
+      if (n != 1)
+	break;
+    }
+
+  FTL_TCP_worker_terminating(true);
+  close(daemon->pipe_to_parent);
+  flush_log();
+  _exit(0);
+}
+
+/* Fork a worker into free process slot i. */
+static int tcp_pool_fork(int i, time_t now, unsigned int generation)
+{
+  int pipefd[2], ctrl[2];
+  pid_t p;
+
+  if (pipe(pipefd) != 0)
+    return 0;
+
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, ctrl) != 0)
+    {
+      close(pipefd[0]);
+      close(pipefd[1]);
+      return 0;
+    }
+
+  if ((p = fork()) == -1)
+    {
+      close(pipefd[0]);
+      close(pipefd[1]);
+      close(ctrl[0]);
+      close(ctrl[1]);
+      return 0;
+    }
+
+  if (p != 0)
+    {
+      close(pipefd[1]);
+      close(ctrl[1]);
+#ifdef HAVE_LINUX_NETWORK
+      /* See the comment re: netlink socket in check_dns_listeners(). */
+      unsigned char a;
+      read_write(pipefd[0], &a, 1, 1);
+#endif
+      daemon->tcp_pids[i] = p;
+      daemon->tcp_pipes[i] = pipefd[0];
+
+      fix_fd(ctrl[0]);
+      tcp_pool[i].fd = ctrl[0];
+      tcp_pool[i].busy = 0;
+      tcp_pool[i].generation = generation;
+      tcp_pool[i].started = now;
+
+      return 1;
+    }
+
+#ifdef HAVE_LINUX_NETWORK
+  {
+    unsigned char a = 0;
+
+    close(daemon->netlinkfd);
+    read_write(pipefd[1], &a, 1, 0);
+  }
+#endif
+  close(pipefd[0]);
+  close(ctrl[0]);
+  daemon->pipe_to_parent = pipefd[1];
+  tcp_pool_forked();
+
+  tcp_pool_worker(ctrl[1]);
+
+  return 0;
+}
+
+/* Replace outdated idle workers and fork new ones up to the configured pool
+   size. Forking is done at most once a second so workers failing right
+   away cannot keep us busy. */
+static void tcp_pool_fill(time_t now)
+{
+  unsigned int generation = FTL_TCP_pool_generation();
+  int i, workers = 0, changed = 0;
+  int size = option_bool(OPT_DEBUG) ? 0 : FTL_TCP_pool_size();
+
+  for (i = 0; i < MAX_PROCS; i++)
+    if (tcp_pool[i].fd != -1)
+      {
+	/* Closing the control socket makes the worker exit. */
+	if (!tcp_pool[i].busy &&
+	    (tcp_pool[i].generation != generation || workers >= size ||
+	     difftime(now, tcp_pool[i].started) > TCP_POOL_LIFETIME))
+	  {
+	    close(tcp_pool[i].fd);
+	    tcp_pool[i].fd = -1;
+	    changed = 1;
+	  }
+	else
+	  workers++;
+      }
+
+  if (workers < size && difftime(now, tcp_pool_last_fill) >= 1.0)
+    {
+      tcp_pool_last_fill = now;
+
+      for (i = 0; i < MAX_PROCS && workers < size; i++)
+	if (daemon->tcp_pids[i] == 0 && daemon->tcp_pipes[i] == -1 && tcp_pool[i].fd == -1)
+	  {
+	    if (!tcp_pool_fork(i, now, generation))
+	      break;
+	    workers++;
+	    changed = 1;
+	  }
+    }
+
+  if (changed)
+    tcp_pool_report();
+}
+
+/* Collect the replies of workers which are idle again. */
+static void tcp_pool_check(void)
+{
+  int i, changed = 0;
+
+  for (i = 0; i < MAX_PROCS; i++)
+    if (tcp_pool[i].fd != -1 && poll_check(tcp_pool[i].fd, POLLIN | POLLHUP))
+      {
+	unsigned char a;
+	ssize_t n;
+
+	while ((n = recv(tcp_pool[i].fd, &a, 1, 0)) == 1)
+	  tcp_pool[i].busy = 0;
+
+	/* The worker is gone, its process slot is freed once it has been
+	   reaped and its cache pipe is drained. */
+	if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+	  {
+	    close(tcp_pool[i].fd);
+	    tcp_pool[i].fd = -1;
+	  }
+
+	changed = 1;
+      }
+
+  if (changed)
+    tcp_pool_report();
+}
+
+/* Hand an accepted connection to an idle worker. Returns zero if there is
+   none. */
+static int tcp_pool_dispatch(int confd, struct irec *iface, union mysockaddr *tcp_addr)
+{
+  union {
+    struct cmsghdr align; /* this ensures alignment */
+    char control[CMSG_SPACE(sizeof(int))];
+  } control_u;
+  struct tcp_pool_job job;
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmptr;
+  int i;
+
+  memset(&job, 0, sizeof(job));
+  job.tcp_addr = *tcp_addr;
+  if (iface)
+    {
+      job.netmask = iface->netmask;
+      job.auth_dns = iface->dns_auth;
+    }
+  job.log_id = daemon->log_id;
+
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = &job;
+  iov.iov_len = sizeof(job);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control_u.control;
+  msg.msg_controllen = sizeof(control_u);
+  cmptr = CMSG_FIRSTHDR(&msg);
+  cmptr->cmsg_level = SOL_SOCKET;
+  cmptr->cmsg_type = SCM_RIGHTS;
+  cmptr->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmptr), &confd, sizeof(int));
+
+  while ((i = tcp_pool_idle()) != -1)
+    {
+      if (sendmsg(tcp_pool[i].fd, &msg, MSG_NOSIGNAL) == sizeof(job))
+	{
+	  tcp_pool[i].busy = 1;
+	  tcp_pool_report();
+	  FTL_TCP_connection(true);
+	  return 1;
+	}
+
+      /* The worker is gone. */
+      close(tcp_pool[i].fd);
+      tcp_pool[i].fd = -1;
+      tcp_pool_report();
+    }
+
+  return 0;
+}
+/**********************************************/
+
 #ifdef HAVE_DHCP
 int make_icmp_sock(void)
 {
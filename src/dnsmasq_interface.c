@@ -46,8 +46,10 @@
 #include <stddef.h>
 // get_edestr()
 #include "api/api_helper.h"
-// logg_rate_limit_message()
-#include "database/message-table.h"
+// rate_limit_query()
+#include "ratelimit.h"
+// domain_index_generation()
+#include "database/domain-index.h"
 
 // Private prototypes
 static const char *reply_status_str[QUERY_REPLY_MAX+1];
@@ -55,8 +57,8 @@ static void print_flags(const unsigned int flags);
 #define query_set_reply(flags, type, addr, query, response) _query_set_reply(flags, type, addr, query, response, __FILE__, __LINE__)
 static void _query_set_reply(const unsigned int flags, const enum reply_type reply, const union all_addr *addr, queriesData* query,
                              const struct timeval response, const char *file, const int line);
-#define FTL_check_blocking(queryID, domainID, clientID) _FTL_check_blocking(queryID, domainID, clientID, __FILE__, __LINE__)
-static bool _FTL_check_blocking(int queryID, int domainID, int clientID, const char* file, const int line);
+#define FTL_check_blocking(queryID, domainID, clientID, cacheID) _FTL_check_blocking(queryID, domainID, clientID, cacheID, __FILE__, __LINE__)
+static bool _FTL_check_blocking(int queryID, int domainID, int clientID, int cacheID, const char* file, const int line);
 static unsigned long converttimeval(const struct timeval time) __attribute__((const));
 static enum query_status detect_blocked_IP(const unsigned short flags, const union all_addr *addr, const queriesData *query, const domainsData *domain);
 static void query_blocked(queriesData* query, domainsData* domain, clientsData* client, const unsigned char new_status);
@@ -70,6 +72,11 @@ static void check_pihole_PTR(char *domain);
 #define query_set_dnssec(query, dnssec) _query_set_dnssec(query, dnssec, __FILE__, __LINE__)
 static void _query_set_dnssec(queriesData *query, const enum dnssec_status dnssec, const char *file, const int line);
 static char *get_ptrname(struct in_addr *addr);
+static void build_answer_templates(void);
+static int cname_memo_lookup(const char *domain, const uint32_t hash, const int clientID,
+                             const unsigned char query_type, int *cacheID);
+static void cname_memo_store(const uint32_t hash, const int domainID, const int clientID,
+                             const unsigned char query_type, const int cacheID);
 
 // Static blocking metadata
 static const char *blockingreason = "";
@@ -79,6 +86,45 @@ static int last_regex_idx = -1;
 static struct ptr_record *pihole_ptr = NULL;
 #define HOSTNAME "Pi-hole hostname"
 
+// Answer records of blocked replies, prebuilt for the configured blocking mode
+// by build_answer_templates() at startup and whenever the configuration is
+// reloaded. The owner name of each record is a compression pointer to the
+// question so the records can be copied into any reply. Only the address has
+// to be patched when replying with an IP address other than the null address
+#define A_RECORD_LEN (2 + 10 + INADDRSZ)
+#define AAAA_RECORD_LEN (2 + 10 + IN6ADDRSZ)
+enum answer_qtype { ANSWER_A, ANSWER_AAAA, ANSWER_ANY, ANSWER_OTHER, ANSWER_MAX };
+static struct {
+	// Flags of the reply for each type of question in the configured
+	// blocking mode, used unless a specific reply is forced
+	int flags[ANSWER_MAX];
+	// Records with the TTL of blocked domains [0] and of the local host
+	// names [1]
+	unsigned char a[2][A_RECORD_LEN];
+	unsigned char aaaa[2][AAAA_RECORD_LEN];
+} answer_templates = { { F_IPV4, F_IPV6, F_IPV4 | F_IPV6, F_NOERR }, {{ 0 }}, {{ 0 }} };
+
+// Fork-private index of deep CNAME inspection results for each CNAME target,
+// group set and query type. CDN domains are often reached through the same long
+// CNAME chains, each hop of which then needs a single lookup in here instead of
+// looking up the domain and its DNS cache entry. The verdict itself stays in
+// the referenced DNS cache entry. All entries are discarded when the lists, the
+// regex filters or group sets are reloaded or domain IDs change by compaction
+#define CNAME_MEMO_SIZE 4096u
+static struct {
+	uint32_t hash;
+	int domainID;
+	int groupsetID;
+	int cacheID;
+	unsigned char query_type;
+} cname_memo[CNAME_MEMO_SIZE] = {{ 0 }};
+static struct {
+	unsigned int generation;
+	unsigned int regex_change;
+	unsigned int compactions;
+	unsigned int groupsets_released;
+} cname_memo_epoch = { 0 };
+
 // Fork-private copy of the interface data the most recent query came from
 static struct {
 	bool haveIPv4;
@@ -153,6 +199,65 @@ void FTL_hook(unsigned int flags, char *name, union all_addr *addr, char *arg, i
 		FTL_reply(flags, name, addr, arg, id, path, line);
 }
 
+// Write an answer record with a compression pointer to the question and an
+// all-zero address
+static void build_answer_record(unsigned char *p, const unsigned short type,
+                                const unsigned long ttl, const unsigned short rdlen)
+{
+	PUTSHORT(sizeof(struct dns_header) | 0xc000, p);
+	PUTSHORT(type, p);
+	PUTSHORT(C_IN, p);
+	PUTLONG(ttl, p);
+	PUTSHORT(rdlen, p);
+	memset(p, 0, rdlen);
+}
+
+static void build_answer_templates(void)
+{
+	// Flags of the reply in the configured blocking mode
+	const int default_flags[ANSWER_MAX] = { F_IPV4, F_IPV6, F_IPV4 | F_IPV6, F_NOERR };
+	for(unsigned int i = 0; i < ANSWER_MAX; i++)
+	{
+		int flags = default_flags[i];
+		// If we block in NXDOMAIN mode, we set flags to NXDOMAIN
+		// (NEG will be added after setup_reply() in _FTL_make_answer())
+		if(config.blockingmode == MODE_NX)
+			flags = F_NXDOMAIN;
+		// If we block in NODATA mode or NODATA for AAAA queries, we apply
+		// the NOERROR response flag. This ensures we're sending an empty response
+		else if(config.blockingmode == MODE_NODATA ||
+		        (config.blockingmode == MODE_IP_NODATA_AAAA && (flags & F_IPV6)))
+			flags = F_NOERR;
+		answer_templates.flags[i] = flags;
+	}
+
+	for(unsigned int i = 0; i < 2; i++)
+	{
+		const unsigned long ttl = i == 0 ? config.block_ttl : daemon->local_ttl;
+		build_answer_record(answer_templates.a[i], T_A, ttl, INADDRSZ);
+		build_answer_record(answer_templates.aaaa[i], T_AAAA, ttl, IN6ADDRSZ);
+	}
+}
+
+// Copy a prebuilt answer record into the reply and fill in its address
+static bool add_answer_record(struct dns_header *header, char *limit, int *trunc,
+                              unsigned char **pp, const unsigned char *record,
+                              const size_t len, const void *addr, const size_t addrlen)
+{
+	if(*trunc || (limit != NULL && *pp + len > (unsigned char*)limit))
+	{
+		*trunc = 1;
+		return false;
+	}
+
+	memcpy(*pp, record, len - addrlen);
+	memcpy(*pp + len - addrlen, addr, addrlen);
+	*pp += len;
+	header->ancount = htons(ntohs(header->ancount) + 1);
+
+	return true;
+}
+
 // This is inspired by make_local_answer()
 size_t _FTL_make_answer(struct dns_header *header, char *limit, const size_t len, int *ede, const char *file, const int line)
 {
@@ -180,12 +285,22 @@ size_t _FTL_make_answer(struct dns_header *header, char *limit, const size_t len
 	GETSHORT(qtype, p);
 
 	// Set flags based on what we will reply with
+	enum answer_qtype answer_qtype = ANSWER_OTHER;
 	if(qtype == T_A)
+	{
 		flags = F_IPV4; // A type
+		answer_qtype = ANSWER_A;
+	}
 	else if(qtype == T_AAAA)
+	{
 		flags = F_IPV6; // AAAA type
+		answer_qtype = ANSWER_AAAA;
+	}
 	else if(qtype == T_ANY)
+	{
 		flags = F_IPV4 | F_IPV6; // ANY type
+		answer_qtype = ANSWER_ANY;
+	}
 	else
 		flags = F_NOERR; // empty record
 
@@ -255,21 +370,14 @@ size_t _FTL_make_answer(struct dns_header *header, char *limit, const size_t len
 	else
 	{
 		// Overwrite flags only if not replying with a forced reply
-		if(config.blockingmode == MODE_NX)
+		flags = answer_templates.flags[answer_qtype];
+		if(config.debug & DEBUG_FLAGS)
 		{
-			// If we block in NXDOMAIN mode, we set flags to NXDOMAIN
-			// (NEG will be added after setup_reply() below)
-			flags = F_NXDOMAIN;
-			if(config.debug & DEBUG_FLAGS)
+			if(config.blockingmode == MODE_NX)
 				logg("Configured blocking mode is NXDOMAIN");
-		}
-		else if(config.blockingmode == MODE_NODATA ||
-				(config.blockingmode == MODE_IP_NODATA_AAAA && (flags & F_IPV6)))
-		{
-			// If we block in NODATA mode or NODATA for AAAA queries, we apply
-			// the NOERROR response flag. This ensures we're sending an empty response
-			flags = F_NOERR;
-			if(config.debug & DEBUG_FLAGS)
+			else if(config.blockingmode == MODE_NODATA ||
+			        (config.blockingmode == MODE_IP_NODATA_AAAA &&
+			         (answer_qtype == ANSWER_AAAA || answer_qtype == ANSWER_ANY)))
 				logg("Configured blocking mode is NODATA%s",
 				     config.blockingmode == MODE_IP_NODATA_AAAA ? "-IPv6" : "");
 		}
@@ -280,7 +388,10 @@ size_t _FTL_make_answer(struct dns_header *header, char *limit, const size_t len
 	union all_addr redirect_addr4 = {{ 0 }}, redirect_addr6 = {{ 0 }};
 	if(last_regex_idx > -1)
 	{
+		// The regex filters may be replaced while the lock is not held
+		lock_shm_read();
 		redirecting = regex_get_redirect(last_regex_idx, &redirect_addr4.addr4, &redirect_addr6.addr6);
+		unlock_shm_read();
 		// Reset regex redirection forcing
 		last_regex_idx = -1;
 
@@ -341,10 +452,8 @@ size_t _FTL_make_answer(struct dns_header *header, char *limit, const size_t len
 		}
 
 		// Add A resource record
-		header->ancount = htons(ntohs(header->ancount) + 1);
-		if(add_resource_record(header, limit, &trunc, sizeof(struct dns_header),
-		                       &p, hostname ? daemon->local_ttl : config.block_ttl,
-		                       NULL, T_A, C_IN, (char*)"4", &addr->addr4))
+		if(add_answer_record(header, limit, &trunc, &p, answer_templates.a[hostname],
+		                     A_RECORD_LEN, &addr->addr4, INADDRSZ))
 			log_query(flags & ~F_IPV6, name, addr, (char*)blockingreason, 0);
 	}
 
@@ -369,10 +478,8 @@ size_t _FTL_make_answer(struct dns_header *header, char *limit, const size_t len
 		}
 
 		// Add AAAA resource record
-		header->ancount = htons(ntohs(header->ancount) + 1);
-		if(add_resource_record(header, limit, &trunc, sizeof(struct dns_header),
-		                       &p, hostname ? daemon->local_ttl : config.block_ttl,
-		                       NULL, T_AAAA, C_IN, (char*)"6", &addr->addr6))
+		if(add_answer_record(header, limit, &trunc, &p, answer_templates.aaaa[hostname],
+		                     AAAA_RECORD_LEN, &addr->addr6, IN6ADDRSZ))
 			log_query(flags & ~F_IPV4, name, addr, (char*)blockingreason, 0);
 	}
 
@@ -555,29 +662,41 @@ bool _FTL_new_query(const unsigned int flags, const char *name,
 	const sa_family_t family = addr ? addr->sa.sa_family : AF_INET;
 	in_port_t clientPort = daemon->port;
 	bool internal_query = false;
-	char clientIP[ADDRSTRLEN+1] = { 0 };
+	clientAddr client_addr = { 0 };
 	if(config.edns0_ecs && edns && edns->client_set)
 	{
 		// Use ECS provided client
-		strncpy(clientIP, edns->client, ADDRSTRLEN);
-		clientIP[ADDRSTRLEN] = '\0';
+		get_client_addr(edns->client, false, &client_addr);
 	}
 	else if(addr)
 	{
 		// Use original requestor
-		mysockaddr_extract_ip_port(addr, clientIP, &clientPort);
+		client_addr.family = family;
+		if(family == AF_INET)
+		{
+			client_addr.addr.in = addr->in.sin_addr;
+			clientPort = ntohs(addr->in.sin_port);
+		}
+		else
+		{
+			client_addr.addr.in6 = addr->in6.sin6_addr;
+			clientPort = ntohs(addr->in6.sin6_port);
+		}
 	}
 	else
 	{
 		// No client address available, this is an automatically generated (e.g.
-		// DNSSEC) query
+		// DNSSEC) query. It is accounted to the client "::"
 		internal_query = true;
-		strcpy(clientIP, "::");
+		client_addr.family = AF_INET6;
 	}
 
 	// Check if user wants to skip queries coming from localhost
 	if(config.ignore_localhost &&
-	   (strcmp(clientIP, "127.0.0.1") == 0 || strcmp(clientIP, "::1") == 0))
+	   ((client_addr.family == AF_INET &&
+	     client_addr.addr.in.s_addr == htonl(INADDR_LOOPBACK)) ||
+	    (client_addr.family == AF_INET6 &&
+	     IN6_IS_ADDR_LOOPBACK(&client_addr.addr.in6))))
 	{
 		free(domainString);
 		return false;
@@ -585,10 +704,13 @@ bool _FTL_new_query(const unsigned int flags, const char *name,
 
 	// Lock shared memory
 	lock_shm();
-	const int queryID = counters->queries;
+	const int queryID = counters->queries_head + counters->queries;
 
-	// Find client IP
-	const int clientID = findClientID(clientIP, true, false);
+	// Find client by its binary address (ECS-provided clients which are
+	// not valid IP addresses are looked up by their string)
+	const int clientID = client_addr.family == AF_UNSPEC ?
+	                     findClientID(edns->client, true, false) :
+	                     findClientIDbyAddr(&client_addr, true);
 
 	// Get client pointer
 	clientsData* client = getClient(clientID, true);
@@ -602,28 +724,16 @@ bool _FTL_new_query(const unsigned int flags, const char *name,
 		return false;
 	}
 
+	// String representation of the client's address
+	const char *clientIP = getstr(client->ippos);
+
 	// Interface name is only available for regular queries, not for
 	// automatically generated DNSSEC queries
 	const char *interface = internal_query ? "-" : next_iface.name;
 
-	// Check rate-limit for this client
-	if(!internal_query && config.rate_limit.count > 0 &&
-	   (++client->rate_limit > config.rate_limit.count  || client->flags.rate_limited))
+	// Check rate-limit for this client and its subnet
+	if(!internal_query && rate_limit_query(client))
 	{
-		if(!client->flags.rate_limited)
-		{
-			// Log the first rate-limited query for this client in
-			// this interval. We do not log the blocked domain for
-			// privacy reasons
-			logg_rate_limit_message(clientIP, client->rate_limit);
-			// Reset rate-limiting counter so we can count what
-			// comes within the adjacent interval
-			client->rate_limit = 0;
-		}
-
-		// Memorize this client needs rate-limiting
-		client->flags.rate_limited = true;
-
 		// Block this query
 		force_next_DNS_reply = REPLY_REFUSED;
 		blockingreason = "Rate-limiting";
@@ -725,6 +835,9 @@ bool _FTL_new_query(const unsigned int flags, const char *name,
 	// Query extended DNS error
 	query->ede = EDE_UNSET;
 
+	// Make this query findable by its dnsmasq ID
+	add_query_hash(queryID);
+
 	// Increase DNS queries counter
 	counters->queries++;
 
@@ -796,7 +909,7 @@ bool _FTL_new_query(const unsigned int flags, const char *name,
 	// Check if this should be blocked only for active queries
 	// (skipped for internally generated ones, e.g., DNSSEC)
 	if(!internal_query)
-		blockDomain = FTL_check_blocking(queryID, domainID, clientID);
+		blockDomain = FTL_check_blocking(queryID, domainID, clientID, -1);
 
 	// Free allocated memory
 	free(domainString);
@@ -1096,7 +1209,7 @@ inline static void set_dnscache_blockingstatus(DNSCacheData * dns_cache, clients
 	}
 }
 
-static bool check_domain_blocked(const char *domain, const int clientID,
+static bool check_domain_blocked(indexedDomain *dom, const int clientID,
                                  clientsData *client, queriesData *query, DNSCacheData *dns_cache,
                                  enum query_status *new_status, bool *db_okay)
 {
@@ -1104,8 +1217,10 @@ static bool check_domain_blocked(const char *domain, const int clientID,
 	if(query->flags.whitelisted)
 		return false;
 
+	const char *domain = dom->domain;
+
 	// Check domains against exact blacklist
-	enum db_result blacklist = in_blacklist(domain, client);
+	enum db_result blacklist = in_blacklist(dom, client);
 	if(blacklist == FOUND)
 	{
 		// Set new status
@@ -1120,7 +1235,7 @@ static bool check_domain_blocked(const char *domain, const int clientID,
 	}
 
 	// Check domains against gravity domains
-	enum db_result gravity = in_gravity(domain, client);
+	enum db_result gravity = in_gravity(dom, client);
 	if(gravity == FOUND)
 	{
 		// Set new status
@@ -1134,9 +1249,25 @@ static bool check_domain_blocked(const char *domain, const int clientID,
 		return FOUND;
 	}
 
+	// Check domain and its parent domains against the wildcard blacklist
+	enum db_result wildcard = in_wildcard_blacklist(dom, client);
+	if(wildcard == FOUND)
+	{
+		// Set new status
+		*new_status = QUERY_BLACKLIST;
+		blockingreason = "wildcard blacklisted";
+
+		// Mark domain as wildcard blacklisted for this client
+		set_dnscache_blockingstatus(dns_cache, client, WILDCARD_BLOCKED, domain);
+
+		// We block this domain
+		return true;
+	}
+
 	// Check if one of the database lookups returned that the database is
 	// currently busy
-	if(blacklist == LIST_NOT_AVAILABLE || gravity == LIST_NOT_AVAILABLE)
+	if(blacklist == LIST_NOT_AVAILABLE || gravity == LIST_NOT_AVAILABLE ||
+	   wildcard == LIST_NOT_AVAILABLE)
 	{
 		*db_okay = false;
 		// Handle reply to this query as configured
@@ -1175,7 +1306,7 @@ static bool check_domain_blocked(const char *domain, const int clientID,
 	// Check domain against blacklist regex filters
 	// Skipped when the domain is whitelisted or blocked by exact blacklist or gravity
 	int regex_idx = 0;
-	if((regex_idx = match_regex(domain, dns_cache, client->id, REGEX_BLACKLIST, false)) > -1)
+	if((regex_idx = match_regex(domain, dns_cache, client->groupsetID, REGEX_BLACKLIST, false)) > -1)
 	{
 		// Set new status
 		*new_status = QUERY_REGEX;
@@ -1248,7 +1379,9 @@ static bool special_domain(const queriesData *query, const char *domain)
 	return false;
 }
 
-static bool _FTL_check_blocking(int queryID, int domainID, int clientID, const char* file, const int line)
+// The DNS cache entry is looked up unless the caller already did and passes its
+// ID as cacheID (otherwise -1)
+static bool _FTL_check_blocking(int queryID, int domainID, int clientID, int cacheID, const char* file, const int line)
 {
 	if(get_and_clear_event(RELOAD_BLOCKINGMODE))
 	{
@@ -1272,8 +1405,13 @@ static bool _FTL_check_blocking(int queryID, int domainID, int clientID, const c
 		return false;
 	}
 
+	// Get the group set of this client before looking up the DNS cache as
+	// clients with the same groups share their cached verdicts
+	gravityDB_get_groupset(client);
+
 	// Get cache pointer
-	unsigned int cacheID = findCacheID(domainID, clientID, query->type);
+	if(cacheID < 0)
+		cacheID = findCacheID(domainID, clientID, query->type, -1);
 	DNSCacheData *dns_cache = getDNSCache(cacheID, true);
 	if(dns_cache == NULL)
 	{
@@ -1337,6 +1475,26 @@ static bool _FTL_check_blocking(int queryID, int domainID, int clientID, const c
 			}
 			break;
 
+		case WILDCARD_BLOCKED:
+			// Known as wildcard blacklisted, we
+			// return this result early, skipping
+			// all the lengthy tests below
+			blockingreason = "wildcard blacklisted";
+			if(config.debug & DEBUG_QUERIES)
+			{
+				logg("%s is known as %s", domainstr, blockingreason);
+			}
+
+			// Do not block if the entire query is to be permitted
+			// as something along the CNAME path hit the whitelist
+			if(!query->flags.whitelisted)
+			{
+				force_next_DNS_reply = dns_cache->force_reply;
+				query_blocked(query, domain, client, QUERY_BLACKLIST);
+				return true;
+			}
+			break;
+
 		case REGEX_BLOCKED:
 			// Known as regex blacklisted, we
 			// return this result early, skipping
@@ -1433,13 +1591,18 @@ static bool _FTL_check_blocking(int queryID, int domainID, int clientID, const c
 	domainstr = strdup(domainstr);
 	const char *blockedDomain = domainstr;
 
+	// The list filter is checked once for all lists
+	indexedDomain dom;
+	domain_index_filter(&dom, domainstr);
+
 	// Check whitelist (exact + regex) for match
-	query->flags.whitelisted = in_whitelist(domainstr, dns_cache, client) == FOUND;
+	query->flags.whitelisted = in_whitelist(&dom, dns_cache, client) == FOUND;
 
 	// Check blacklist (exact + regex) and gravity for queried domain
 	unsigned char new_status = QUERY_UNKNOWN;
 	bool db_okay = true;
-	bool blockDomain = check_domain_blocked(domainstr, clientID, client, query, dns_cache, &new_status, &db_okay);
+	bool blockDomain = check_domain_blocked(&dom, clientID, client, query, dns_cache, &new_status, &db_okay);
+	domain_index_count_filter(&dom);
 
 	// Check blacklist (exact + regex) and gravity for _esni.domain if enabled
 	// (defaulting to true)
@@ -1447,7 +1610,9 @@ static bool _FTL_check_blocking(int queryID, int domainID, int clientID, const c
 	   !query->flags.whitelisted && blockDomain == NOT_FOUND &&
 	    strlen(domainstr) > 6 && strncasecmp(domainstr, "_esni.", 6u) == 0)
 	{
-		blockDomain = check_domain_blocked(domainstr + 6u, clientID, client, query, dns_cache, &new_status, &db_okay);
+		indexedDomain esni;
+		domain_index_filter(&esni, domainstr + 6u);
+		blockDomain = check_domain_blocked(&esni, clientID, client, query, dns_cache, &new_status, &db_okay);
 
 		if(blockDomain)
 		{
@@ -1496,6 +1661,76 @@ static bool _FTL_check_blocking(int queryID, int domainID, int clientID, const c
 }
 
 
+// Slot of the CNAME target in the memo. The memo is emptied first if domain
+// IDs, verdicts or group sets may have changed since it was filled
+static unsigned int cname_memo_slot(const uint32_t hash, const int groupsetID,
+                                    const unsigned char query_type)
+{
+	const unsigned int generation = domain_index_generation();
+	if(cname_memo_epoch.generation != generation ||
+	   cname_memo_epoch.regex_change != counters->regex_change ||
+	   cname_memo_epoch.compactions != counters->compaction.runs ||
+	   cname_memo_epoch.groupsets_released != counters->groupsets_released)
+	{
+		memset(cname_memo, 0, sizeof(cname_memo));
+		cname_memo_epoch.generation = generation;
+		cname_memo_epoch.regex_change = counters->regex_change;
+		cname_memo_epoch.compactions = counters->compaction.runs;
+		cname_memo_epoch.groupsets_released = counters->groupsets_released;
+	}
+
+	return (hash ^ ((uint32_t)groupsetID * 2654435761u) ^ query_type) & (CNAME_MEMO_SIZE - 1u);
+}
+
+// Get the domain ID and the DNS cache entry of a CNAME target known from an
+// earlier reply. The cache entry is used like findCacheID() does on a hit.
+// Returns -1 if the target is not known or its cache entry was evicted
+static int cname_memo_lookup(const char *domain, const uint32_t hash, const int clientID,
+                             const unsigned char query_type, int *cacheID)
+{
+	const int groupsetID = getCacheGroupset(clientID);
+	const unsigned int slot = cname_memo_slot(hash, groupsetID, query_type);
+	if(cname_memo[slot].hash != hash ||
+	   cname_memo[slot].groupsetID != groupsetID ||
+	   cname_memo[slot].query_type != query_type)
+		return -1;
+
+	// Compare the domain itself as different domains may share a hash. Its
+	// slot may have been freed by compaction
+	domainsData *known = getDomain(cname_memo[slot].domainID, false);
+	if(known == NULL || known->magic != MAGICBYTE ||
+	   strcmp(getstr(known->domainpos), domain) != 0)
+		return -1;
+
+	if(!touchCacheID(cname_memo[slot].cacheID, cname_memo[slot].domainID, clientID, query_type))
+		return -1;
+
+	// Keep this domain during a running compaction
+	known->referenced = true;
+
+	*cacheID = cname_memo[slot].cacheID;
+	return cname_memo[slot].domainID;
+}
+
+// Memorize a CNAME target after it has been checked. Nothing is stored if the
+// DNS cache has no final verdict for this domain, e.g., when the gravity
+// database was not available
+static void cname_memo_store(const uint32_t hash, const int domainID, const int clientID,
+                             const unsigned char query_type, const int cacheID)
+{
+	const DNSCacheData *dns_cache = getDNSCache(cacheID, true);
+	if(dns_cache == NULL || dns_cache->blocking_status == UNKNOWN_BLOCKED)
+		return;
+
+	const int groupsetID = getCacheGroupset(clientID);
+	const unsigned int slot = cname_memo_slot(hash, groupsetID, query_type);
+	cname_memo[slot].hash = hash;
+	cname_memo[slot].domainID = domainID;
+	cname_memo[slot].groupsetID = groupsetID;
+	cname_memo[slot].cacheID = cacheID;
+	cname_memo[slot].query_type = query_type;
+}
+
 bool _FTL_CNAME(const char *domain, const struct crec *cpp, const int id, const char* file, const int line)
 {
 	if(config.debug & DEBUG_QUERIES)
@@ -1559,14 +1794,35 @@ bool _FTL_CNAME(const char *domain, const struct crec *cpp, const int id, const
 	char *child_domain = strdup(domain);
 	// Convert to lowercase for matching
 	strtolower(child_domain);
-	const int child_domainID = findDomainID(child_domain, false);
 
 	// Get client ID from the original query (the entire chain always
 	// belongs to the same client)
 	const int clientID = query->clientID;
 
+	// Targets are memorized per group set, so it has to be known first
+	clientsData *client = getClient(clientID, true);
+	if(client != NULL)
+		gravityDB_get_groupset(client);
+
+	// Targets seen before need a single lookup, all others are looked up
+	// in the domain table and the DNS cache
+	const uint32_t hash = hashStr(child_domain);
+	int target_cacheID = -1;
+	int child_domainID = cname_memo_lookup(child_domain, hash, clientID, query->type, &target_cacheID);
+	const bool known = child_domainID > -1;
+	if(!known)
+	{
+		child_domainID = findDomainID(child_domain, false);
+		target_cacheID = findCacheID(child_domainID, clientID, query->type, -1);
+	}
+	else if(config.debug & DEBUG_QUERIES)
+		logg("CNAME %s is a known target", child_domain);
+
 	// Check per-client blocking for the child domain
-	const bool block = FTL_check_blocking(queryID, child_domainID, clientID);
+	const bool block = FTL_check_blocking(queryID, child_domainID, clientID, target_cacheID);
+
+	if(!known && child_domainID > -1)
+		cname_memo_store(hash, child_domainID, clientID, query->type, target_cacheID);
 
 	// If we find during a CNAME inspection that we want to block the entire chain,
 	// the originally queried domain itself was not counted as blocked. We have to
@@ -1599,9 +1855,10 @@ bool _FTL_CNAME(const char *domain, const struct crec *cpp, const int id, const
 		}
 		else if(query->status == QUERY_REGEX)
 		{
-			// Get parent and child DNS cache entries
-			const int parent_cacheID = findCacheID(parent_domainID, clientID, query->type);
-			const int child_cacheID = findCacheID(child_domainID, clientID, query->type);
+			// Get parent and child DNS cache entries. Looking up the child
+			// must not evict the entry of the parent
+			const int parent_cacheID = findCacheID(parent_domainID, clientID, query->type, -1);
+			const int child_cacheID = findCacheID(child_domainID, clientID, query->type, parent_cacheID);
 
 			// Get cache pointers
 			DNSCacheData *parent_cache = getDNSCache(parent_cacheID, true);
@@ -1800,6 +2057,9 @@ void FTL_dnsmasq_reload(void)
 	// its own behalf (on initial reading, the config file is already opened)
 	get_blocking_mode(NULL);
 
+	// Rebuild the answers of blocked replies for the current blocking mode
+	build_answer_templates();
+
 	// Reread pihole-FTL.conf to see which debugging flags are set
 	read_debuging_settings(NULL);
 
@@ -1810,6 +2070,10 @@ void FTL_dnsmasq_reload(void)
 	// - Flush FTL's DNS cache
 	set_event(RELOAD_GRAVITY);
 
+	// Pre-forked TCP workers hold copies of the DNS cache and of the
+	// configuration. They are replaced as soon as they are idle
+	counters->tcp_pool.generation++;
+
 	// Print current set of capabilities if requested via debug flag
 	if(config.debug & DEBUG_CAPS)
 		check_capabilities();
@@ -2695,6 +2959,10 @@ void FTL_fork_and_bind_sockets(struct passwd *ent_pw)
 	// so they will not listen to real-time signals
 	handle_realtime_signals();
 
+	// Build the answers of blocked replies before the first query can
+	// arrive. Both pihole-FTL.conf and dnsmasq's config have been read
+	build_answer_templates();
+
 	// We will use the attributes object later to start all threads in
 	// detached mode
 	pthread_attr_t attr;
@@ -3089,6 +3357,32 @@ void FTL_TCP_worker_terminating(bool finished)
 	unlock_shm();
 }
 
+// Prepare a forked process for handling TCP connections. This is done only
+// once per process, pre-forked workers are prepared before their first
+// connection arrives
+static void prepare_TCP_worker(void)
+{
+	static bool prepared = false;
+	if(prepared)
+		return;
+	prepared = true;
+
+	// Reopen gravity database handle in this fork as the main process's
+	// handle isn't valid here
+	if(config.debug != 0)
+		logg("Reopening Gravity database for this fork");
+	gravityDB_forked();
+
+	// Children inherit file descriptors from their parents
+	// We don't need them in the forks, so we clean them up
+	if(config.debug != 0)
+		logg("Closing Telnet socket for this fork");
+	close_telnet_socket();
+	if(config.debug != 0)
+		logg("Closing Unix socket for this fork");
+	close_unix_socket(false);
+}
+
 // Called when a (forked) TCP worker is created
 // FTL forked to handle TCP connections with dedicated (forked) workers
 // SQLite3's mentions that carrying an open database connection across a
@@ -3146,20 +3440,52 @@ void FTL_TCP_worker_created(const int confd)
 		return;
 	}
 
-	// Reopen gravity database handle in this fork as the main process's
-	// handle isn't valid here
-	if(config.debug != 0)
-		logg("Reopening Gravity database for this fork");
-	gravityDB_forked();
+	prepare_TCP_worker();
+}
 
-	// Children inherit file descriptors from their parents
-	// We don't need them in the forks, so we clean them up
-	if(config.debug != 0)
-		logg("Closing Telnet socket for this fork");
-	close_telnet_socket();
-	if(config.debug != 0)
-		logg("Closing Unix socket for this fork");
-	close_unix_socket(false);
+// Called in a pre-forked TCP worker before it waits for its first connection.
+// Workers are prepared only once and then handle many connections
+void FTL_TCP_pool_worker_started(void)
+{
+	prepare_TCP_worker();
+
+	lock_shm();
+	counters->tcp_pool.started++;
+	unlock_shm();
+}
+
+// Number of pre-forked TCP workers to be kept ready
+int FTL_TCP_pool_size(void)
+{
+	return dnsmasq_debug ? 0 : (int)config.tcp_workers;
+}
+
+// Workers forked before the generation changed have to be replaced. A single
+// word is read without locking, a stale value merely delays replacing them
+unsigned int FTL_TCP_pool_generation(void)
+{
+	return __atomic_load_n(&counters->tcp_pool.generation, __ATOMIC_RELAXED);
+}
+
+// Report the utilization of the pool of TCP workers
+void FTL_TCP_pool_status(const int workers, const int busy)
+{
+	lock_shm();
+	counters->tcp_pool.workers = workers;
+	counters->tcp_pool.busy = busy;
+	unlock_shm();
+}
+
+// Count a TCP connection handed to a pre-forked worker or to a process forked
+// for this connection only
+void FTL_TCP_connection(const bool pooled)
+{
+	lock_shm();
+	if(pooled)
+		counters->tcp_pool.pooled++;
+	else
+		counters->tcp_pool.forked++;
+	unlock_shm();
 }
 
 bool FTL_unlink_DHCP_lease(const char *ipaddr)
@@ -46,6 +46,11 @@ void FTL_dnsmasq_reload(void);
 void FTL_fork_and_bind_sockets(struct passwd *ent_pw);
 void FTL_TCP_worker_created(const int confd);
 void FTL_TCP_worker_terminating(bool finished);
+void FTL_TCP_pool_worker_started(void);
+int FTL_TCP_pool_size(void) __attribute__ ((pure));
+unsigned int FTL_TCP_pool_generation(void);
+void FTL_TCP_pool_status(const int workers, const int busy);
+void FTL_TCP_connection(const bool pooled);
 
 bool FTL_unlink_DHCP_lease(const char *ipaddr);
 
@@ -17,7 +17,8 @@ enum memory_type {
 	DOMAINS,
 	OVERTIME,
 	DNS_CACHE,
-	STRINGS
+	STRINGS,
+	GROUPSETS
 } __attribute__ ((packed));
 
 enum dnssec_status {
@@ -124,7 +125,8 @@ enum domain_client_status {
 	REGEX_BLOCKED,
 	WHITELISTED,
 	SPECIAL_DOMAIN,
-	NOT_BLOCKED
+	NOT_BLOCKED,
+	WILDCARD_BLOCKED
 } __attribute__ ((packed));
 
 enum debug_flags {
@@ -20,12 +20,14 @@
 #include "signals.h"
 // data getter functions
 #include "datastructure.h"
-// logg_rate_limit_message()
+// log_resource_shortage()
 #include "database/message-table.h"
 // get_nprocs()
 #include <sys/sysinfo.h>
 // get_filepath_usage()
 #include "files.h"
+// INT_MAX
+#include <limits.h>
 
 // Resource checking interval
 // default: 300 seconds
@@ -33,46 +35,144 @@
 
 bool doGC = false;
 
-// Subtract rate-limitation count from individual client counters
-// As long as client->rate_limit is still larger than the allowed
-// maximum count, the rate-limitation will just continue
-static void reset_rate_limiting(void)
+// Remove the oldest query from the circular query buffer
+static void remove_oldest_query(void)
 {
-	for(int clientID = 0; clientID < counters->clients; clientID++)
+	const int queryID = counters->queries_head;
+
+	// Forget the dnsmasq ID of this query and wipe its memory
+	remove_query_hash(queryID);
+	queriesData *query = getQuery(queryID, false);
+	if(query != NULL)
+		memset(query, 0, sizeof(queriesData));
+
+	// Advance the head of the buffer
+	counters->queries_head++;
+	counters->queries_head_slot = (counters->queries_head_slot + 1) % counters->queries_MAX;
+	counters->queries--;
+}
+
+// Remove the oldest query from memory if it is older than mintime. Returns
+// false if there is no such query
+static bool expire_oldest_query(const time_t mintime)
+{
+	if(counters->queries < 1)
+		return false;
+
+	queriesData* query = getQuery(counters->queries_head, true);
+	if(query == NULL)
 	{
-		clientsData *client = getClient(clientID, true);
-		if(!client)
-			continue;
+		// Drop invalid entries
+		remove_oldest_query();
+		return true;
+	}
 
-		// Check if we are currently rate-limiting this client
-		if(client->flags.rate_limited)
-		{
-			const char *clientIP = getstr(client->ippos);
+	// Test if this query is too new
+	if(query->timestamp > mintime)
+		return false;
 
-			// Check if we want to continue rate limiting
-			if(client->rate_limit > config.rate_limit.count)
-			{
-				logg("Still rate-limiting %s as it made additional %d queries", clientIP, client->rate_limit);
-			}
-			// or if rate-limiting ends for this client now
-			else
-			{
-				logg("Ending rate-limitation of %s", clientIP);
-				client->flags.rate_limited = false;
-			}
-		}
+	// Adjust client counter (total and overTime)
+	clientsData* client = getClient(query->clientID, true);
+	const int timeidx = getOverTimeID(query->timestamp);
+	overTime[timeidx].total--;
+	if(client != NULL)
+		change_clientcount(client, -1, 0, timeidx, -1);
 
-		// Reset counter
-		client->rate_limit = 0;
+	// Adjust domain counter (no overTime information)
+	domainsData* domain = getDomain(query->domainID, true);
+	if(domain != NULL)
+		domain->count--;
+
+	// Get upstream pointer
+
+	// Change other counters according to status of this query
+	switch(query->status)
+	{
+		case QUERY_UNKNOWN:
+			// Unknown (?)
+			break;
+		case QUERY_FORWARDED: // (fall through)
+		case QUERY_RETRIED: // (fall through)
+		case QUERY_RETRIED_DNSSEC:
+			// Forwarded to an upstream DNS server
+			// Adjusting counters is done below in moveOverTimeMemory()
+			break;
+		case QUERY_CACHE:
+			// Answered from local cache _or_ local config
+			break;
+		case QUERY_GRAVITY: // Blocked by Pi-hole's blocking lists (fall through)
+		case QUERY_BLACKLIST: // Exact blocked (fall through)
+		case QUERY_REGEX: // Regex blocked (fall through)
+		case QUERY_EXTERNAL_BLOCKED_IP: // Blocked by upstream provider (fall through)
+		case QUERY_EXTERNAL_BLOCKED_NXRA: // Blocked by upstream provider (fall through)
+		case QUERY_EXTERNAL_BLOCKED_NULL: // Blocked by upstream provider (fall through)
+		case QUERY_GRAVITY_CNAME: // Gravity domain in CNAME chain (fall through)
+		case QUERY_REGEX_CNAME: // Regex blacklisted domain in CNAME chain (fall through)
+		case QUERY_BLACKLIST_CNAME: // Exactly blacklisted domain in CNAME chain (fall through)
+		case QUERY_DBBUSY: // Blocked because gravity database was busy
+			if(domain != NULL)
+				domain->blockedcount--;
+			if(client != NULL)
+				change_clientcount(client, 0, -1, -1, 0);
+			break;
+		case QUERY_IN_PROGRESS: // Don't have to do anything here
+		case QUERY_STATUS_MAX: // fall through
+		default:
+			/* That cannot happen */
+			break;
 	}
+
+	// Update reply counters
+	counters->reply[query->reply]--;
+
+	// Update type counters
+	if(query->type >= TYPE_A && query->type < TYPE_MAX)
+	{
+		counters->querytype[query->type-1]--;
+	}
+
+	// Set query again to UNKNOWN to reset the counters
+	query_set_status(query, QUERY_UNKNOWN);
+
+	// Finally, remove the last trace of this query
+	counters->status[QUERY_UNKNOWN]--;
+
+	// Free the memory of this query
+	remove_oldest_query();
+
+	return true;
 }
 
-static time_t lastRateLimitCleaner = 0;
-// Returns how many more seconds until the current rate-limiting interval is over
-time_t get_rate_limit_turnaround(const unsigned int rate_limit_count)
+// Run one slice of the garbage collection. At most config.gc_slice.queries
+// queries are removed and the slice ends after config.gc_slice.usec
+// microseconds (zero means no limit). Returns true once all queries older
+// than mintime have been removed
+static bool GC_slice(const time_t mintime, int *removed)
 {
-	const unsigned int how_often = rate_limit_count/config.rate_limit.count;
-	return (time_t)config.rate_limit.interval*how_often - (time(NULL) - lastRateLimitCleaner);
+	const double maxmsec = 1e-3 * config.gc_slice.usec;
+	for(unsigned int n = 0; config.gc_slice.queries == 0 || n < config.gc_slice.queries; n++)
+	{
+		if(config.gc_slice.usec > 0 && timer_elapsed_msec(GC_SLICE_TIMER) > maxmsec)
+			return false;
+
+		if(!expire_oldest_query(mintime))
+			return true;
+
+		// Count removed queries
+		(*removed)++;
+	}
+
+	return false;
+}
+
+// Record how long a garbage collection slice held the lock
+static void GC_slice_done(const double msec)
+{
+	const unsigned int usec = (unsigned int)(1e3*msec);
+	counters->gc_stats.slices++;
+	counters->gc_stats.last_usec = usec;
+	if(usec > counters->gc_stats.max_usec)
+		counters->gc_stats.max_usec = usec;
 }
 
 static void check_space(const char *file)
@@ -115,24 +215,12 @@ void *GC_thread(void *val)
 
 	// Remember when we last ran the actions
 	time_t lastGCrun = time(NULL) - time(NULL)%GCinterval;
-	lastRateLimitCleaner = time(NULL);
 	time_t lastResourceCheck = 0;
 
 	// Run as long as this thread is not canceled
 	while(!killed)
 	{
 		const time_t now = time(NULL);
-		if((unsigned int)(now - lastRateLimitCleaner) >= config.rate_limit.interval)
-		{
-			lastRateLimitCleaner = now;
-			lock_shm();
-			reset_rate_limiting();
-			unlock_shm();
-		}
-
-		// Intermediate cancellation-point
-		if(killed)
-			break;
 
 		// Check available resources
 		if(now - lastResourceCheck >= RCinterval)
@@ -169,121 +257,86 @@ void *GC_thread(void *val)
 				logg("GC starting, mintime: %s (%llu)", timestring, (long long)mintime);
 			}
 
-			// Process all queries
+			// Remove expired queries in slices, releasing the lock in
+			// between so queries can be processed meanwhile
 			int removed = 0;
-			for(long int i=0; i < counters->queries; i++)
+			const unsigned int slices = counters->gc_stats.slices;
+			while(!killed)
 			{
-				queriesData* query = getQuery(i, true);
-				if(query == NULL)
-					continue;
-
-				// Test if this query is too new
-				if(query->timestamp > mintime)
+				timer_start(GC_SLICE_TIMER);
+				const bool done = GC_slice(mintime, &removed);
+				if(done)
 					break;
 
-				// Adjust client counter (total and overTime)
-				clientsData* client = getClient(query->clientID, true);
-				const int timeidx = getOverTimeID(query->timestamp);
-				overTime[timeidx].total--;
-				if(client != NULL)
-					change_clientcount(client, -1, 0, timeidx, -1);
-
-				// Adjust domain counter (no overTime information)
-				domainsData* domain = getDomain(query->domainID, true);
-				if(domain != NULL)
-					domain->count--;
-
-				// Get upstream pointer
-
-				// Change other counters according to status of this query
-				switch(query->status)
-				{
-					case QUERY_UNKNOWN:
-						// Unknown (?)
-						break;
-					case QUERY_FORWARDED: // (fall through)
-					case QUERY_RETRIED: // (fall through)
-					case QUERY_RETRIED_DNSSEC:
-						// Forwarded to an upstream DNS server
-						// Adjusting counters is done below in moveOverTimeMemory()
-						break;
-					case QUERY_CACHE:
-						// Answered from local cache _or_ local config
-						break;
-					case QUERY_GRAVITY: // Blocked by Pi-hole's blocking lists (fall through)
-					case QUERY_BLACKLIST: // Exact blocked (fall through)
-					case QUERY_REGEX: // Regex blocked (fall through)
-					case QUERY_EXTERNAL_BLOCKED_IP: // Blocked by upstream provider (fall through)
-					case QUERY_EXTERNAL_BLOCKED_NXRA: // Blocked by upstream provider (fall through)
-					case QUERY_EXTERNAL_BLOCKED_NULL: // Blocked by upstream provider (fall through)
-					case QUERY_GRAVITY_CNAME: // Gravity domain in CNAME chain (fall through)
-					case QUERY_REGEX_CNAME: // Regex blacklisted domain in CNAME chain (fall through)
-					case QUERY_BLACKLIST_CNAME: // Exactly blacklisted domain in CNAME chain (fall through)
-					case QUERY_DBBUSY: // Blocked because gravity database was busy
-						if(domain != NULL)
-							domain->blockedcount--;
-						if(client != NULL)
-							change_clientcount(client, 0, -1, -1, 0);
-						break;
-					case QUERY_IN_PROGRESS: // Don't have to do anything here
-					case QUERY_STATUS_MAX: // fall through
-					default:
-						/* That cannot happen */
-						break;
-				}
-
-				// Update reply counters
-				counters->reply[query->reply]--;
-
-				// Update type counters
-				if(query->type >= TYPE_A && query->type < TYPE_MAX)
-				{
-					counters->querytype[query->type-1]--;
-				}
-
-				// Set query again to UNKNOWN to reset the counters
-				query_set_status(query, QUERY_UNKNOWN);
-
-				// Finally, remove the last trace of this query
-				counters->status[QUERY_UNKNOWN]--;
-
-				// Count removed queries
-				removed++;
+				GC_slice_done(timer_elapsed_msec(GC_SLICE_TIMER));
+				unlock_shm();
+				thread_sleepms(GC, GC_SLICE_PAUSE);
+				lock_shm();
 			}
 
-			// Only perform memory operations when we actually removed queries
-			if(removed > 0)
+			// Query IDs keep increasing as the oldest queries are removed
+			// from the head of the circular buffer. Rebase them before they
+			// can overflow
+			if(counters->queries_head > INT_MAX/2)
 			{
-				// Move memory forward to keep only what we want
-				// Note: for overlapping memory blocks, memmove() is a safer approach than memcpy()
-				// Example: (I = now invalid, X = still valid queries, F = free space)
-				//   Before: IIIIIIXXXXFF
-				//   After:  XXXXFFFFFFFF
-				queriesData *dest = getQuery(0, true);
-				queriesData *src = getQuery(removed, true);
-				if(dest && src)
-					memmove(dest, src, (counters->queries - removed)*sizeof(queriesData));
-
-				// Update queries counter
-				counters->queries -= removed;
-				// Update DB index as total number of queries reduced
-				lastdbindex -= removed;
-
-				// ensure remaining memory is zeroed out (marked as "F" in the above example)
-				queriesData *tail = getQuery(counters->queries, true);
-				if(tail)
-					memset(tail, 0, (counters->queries_MAX - counters->queries)*sizeof(queriesData));
+				const int offset = counters->queries_head;
+				counters->queries_head = 0;
+				lastdbindex = lastdbindex > offset ? lastdbindex - offset : 0;
+				rebuild_query_hash();
 			}
 
 			// Determine if overTime memory needs to get moved
 			moveOverTimeMemory(mintime);
 
+			counters->gc_stats.removed += removed;
+			GC_slice_done(timer_elapsed_msec(GC_SLICE_TIMER));
+
 			if(config.debug & DEBUG_GC)
-				logg("Notice: GC removed %i queries (took %.2f ms)", removed, timer_elapsed_msec(GC_TIMER));
+				logg("Notice: GC removed %i queries in %u slices (took %.2f ms)",
+				     removed, counters->gc_stats.slices - slices, timer_elapsed_msec(GC_TIMER));
 
 			// Release thread lock
 			unlock_shm();
 
+			// Reclaim memory of domains and strings which are no
+			// longer referenced by any query. Both are compacted in
+			// slices, releasing the lock in between
+			int domains_removed = 0;
+			size_t string_bytes = 0;
+			bool done = false;
+			while(!killed && !done)
+			{
+				lock_shm();
+				timer_start(GC_SLICE_TIMER);
+				done = compact_domains(&domains_removed);
+				GC_slice_done(timer_elapsed_msec(GC_SLICE_TIMER));
+				unlock_shm();
+				if(!done)
+					thread_sleepms(GC, GC_SLICE_PAUSE);
+			}
+			done = false;
+			while(!killed && !done)
+			{
+				lock_shm();
+				timer_start(GC_SLICE_TIMER);
+				done = compact_strings(&string_bytes);
+				GC_slice_done(timer_elapsed_msec(GC_SLICE_TIMER));
+				unlock_shm();
+				if(!done)
+					thread_sleepms(GC, GC_SLICE_PAUSE);
+			}
+
+			// Release group sets no client uses anymore
+			lock_shm();
+			timer_start(GC_SLICE_TIMER);
+			const int groupsets_released = release_groupsets();
+			GC_slice_done(timer_elapsed_msec(GC_SLICE_TIMER));
+			unlock_shm();
+
+			if(config.debug & DEBUG_GC)
+				logg("Notice: Compaction removed %i domains and reclaimed %zu bytes of strings, released %i group sets",
+				     domains_removed, string_bytes, groupsets_released);
+
 			// After storing data in the database for the next time,
 			// we should scan for old entries, which will then be deleted
 			// to free up pages in the database and prevent it from growing
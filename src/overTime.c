@@ -41,16 +41,7 @@ static void initSlot(const unsigned int index, const time_t timestamp)
 	overTime[index].forwarded = 0;
 
 	// Zero overTime counter for all known clients
-	for(int clientID = 0; clientID < counters->clients; clientID++)
-	{
-		// Get client pointer
-		clientsData* client = getClient(clientID, true);
-		if(client != NULL)
-		{
-			// Set overTime data to zero
-			client->overTime[index] = 0;
-		}
-	}
+	reset_clients_overTime_slot(index);
 
 	// Zero overTime counter for all known upstream destinations
 	for(int upstreamID = 0; upstreamID < counters->upstreams; upstreamID++)
@@ -189,26 +180,8 @@ void moveOverTimeMemory(const time_t mintime)
 		&overTime[moveOverTime],
 		remainingSlots*sizeof(*overTime));
 
-	// Correct time indices of queries. This is necessary because we just moved the slot this index points to
-	for(int queryID = 0; queryID < counters->queries; queryID++)
-	{
-		// Get query pointer
-		queriesData* query = getQuery(queryID, true);
-		if(query == NULL)
-			continue;
-	}
-
 	// Move client-specific overTime memory
-	for(int clientID = 0; clientID < counters->clients; clientID++)
-	{
-		clientsData *client = getClient(clientID, true);
-		if(!client)
-			continue;
-
-		memmove(&(client->overTime[0]),
-		        &(client->overTime[moveOverTime]),
-		        remainingSlots*sizeof(*client->overTime));
-	}
+	move_clients_overTime(moveOverTime);
 
 	// Process upstream data
 	for(int upstreamID = 0; upstreamID < counters->upstreams; upstreamID++)
@@ -0,0 +1,219 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Rate-limiting routines
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#include "FTL.h"
+#include "ratelimit.h"
+// struct config
+#include "config.h"
+// logg()
+#include "log.h"
+// counters, get_rate_limit_bucket()
+#include "shmem.h"
+// logg_rate_limit_message()
+#include "database/message-table.h"
+
+// Rate-limiting uses the generic cell rate algorithm (GCRA), a token bucket
+// which is refilled lazily. Each bucket only stores the theoretical arrival
+// time (TAT) of its next query. Every accepted query moves it forward by
+// interval/count, a query is refused if this would move it more than one
+// interval into the future. Hence, up to count queries are accepted at once
+// and, after that, one query every interval/count. Buckets are never reset,
+// a TAT in the past simply means the bucket is full
+
+// Number of slots probed when looking up a subnet bucket
+#define RATE_LIMIT_PROBES 16u
+
+// Time of the monotonic clock in microseconds. The clock is the same for all
+// processes so TCP workers can share the buckets
+static uint64_t now_usec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000000u + (uint64_t)ts.tv_nsec/1000u;
+}
+
+// Check if one more query conforms to a rate of count queries per interval
+// seconds. The new TAT is only stored in *next if it does
+static bool conforms(const uint64_t tat, const uint64_t now, const unsigned int count,
+                     const unsigned int interval, uint64_t *next)
+{
+	const uint64_t period = (uint64_t)interval*1000000u;
+	uint64_t increment = period/count;
+	if(increment == 0u)
+		increment = 1u;
+
+	const uint64_t start = tat > now ? tat : now;
+	if(start + increment > now + period)
+		return false;
+
+	*next = start + increment;
+	return true;
+}
+
+// Find the bucket of the subnet of a client. A bucket with a TAT in the past
+// carries no state, so it can be taken over by another subnet. Returns NULL if
+// all probed buckets are in use
+static rateLimitBucket *find_bucket(const clientAddr *addr, const uint64_t now)
+{
+	const bool ipv6 = addr->family == AF_INET6;
+	const unsigned int prefix = ipv6 ? config.rate_limit.subnet.prefix_v6 :
+	                                   config.rate_limit.subnet.prefix_v4;
+
+	// Mask the address of the client to get its subnet
+	struct in6_addr key = {{{ 0 }}};
+	if(ipv6)
+		memcpy(key.s6_addr, addr->addr.in6.s6_addr, 16);
+	else
+		memcpy(key.s6_addr, &addr->addr.in.s_addr, 4);
+	for(unsigned int i = prefix; i < 128u; i++)
+		key.s6_addr[i/8u] &= (uint8_t)~(1u << (7u - i % 8u));
+
+	// FNV-1a hash of the subnet
+	uint32_t hash = 2166136261u ^ addr->family;
+	for(unsigned int i = 0u; i < 16u; i++)
+	{
+		hash ^= key.s6_addr[i];
+		hash *= 16777619u;
+	}
+
+	rateLimitBucket *unused = NULL;
+	for(unsigned int i = 0u; i < RATE_LIMIT_PROBES; i++)
+	{
+		rateLimitBucket *bucket = get_rate_limit_bucket((hash + i) & (RATE_LIMIT_BUCKETS - 1u));
+		if(bucket == NULL)
+			return NULL;
+		if(bucket->family == addr->family &&
+		   memcmp(&bucket->addr, &key, sizeof(key)) == 0)
+			return bucket;
+		if(unused == NULL && (bucket->family == 0 || bucket->tat <= now))
+			unused = bucket;
+	}
+
+	if(unused != NULL)
+	{
+		unused->tat = 0u;
+		unused->addr = key;
+		unused->family = addr->family;
+		unused->limited = false;
+	}
+
+	return unused;
+}
+
+// Text representation of the subnet of a bucket
+static void bucket_subnet(const rateLimitBucket *bucket, char *buffer, const size_t len)
+{
+	char ip[INET6_ADDRSTRLEN] = { 0 };
+	inet_ntop(bucket->family, &bucket->addr, ip, sizeof(ip));
+	snprintf(buffer, len, "%s/%u", ip, bucket->family == AF_INET6 ?
+	         config.rate_limit.subnet.prefix_v6 : config.rate_limit.subnet.prefix_v4);
+}
+
+// Check if a query of this client has to be refused because the client or its
+// subnet exceeded their rate-limit. This has to be called while holding the
+// shared memory lock
+bool rate_limit_query(clientsData *client)
+{
+	const bool limit_client = config.rate_limit.count > 0;
+	const bool limit_subnet = config.rate_limit.subnet.count > 0 &&
+	                          (client->addr.family == AF_INET || client->addr.family == AF_INET6);
+	if(!limit_client && !limit_subnet)
+		return false;
+
+	const uint64_t now = now_usec();
+
+	uint64_t client_tat = client->rate_limit_tat;
+	const bool client_ok = !limit_client ||
+	                       conforms(client->rate_limit_tat, now, config.rate_limit.count,
+	                                config.rate_limit.interval, &client_tat);
+
+	rateLimitBucket *bucket = limit_subnet ? find_bucket(&client->addr, now) : NULL;
+	uint64_t subnet_tat = bucket != NULL ? bucket->tat : 0u;
+	const bool subnet_ok = bucket == NULL ||
+	                       conforms(bucket->tat, now, config.rate_limit.subnet.count,
+	                                config.rate_limit.subnet.interval, &subnet_tat);
+
+	if(client_ok && subnet_ok)
+	{
+		// Rate-limitation ends once the bucket has been refilled
+		// completely, i.e., the client stayed below its rate for long
+		// enough
+		if(client->flags.rate_limited && client->rate_limit_tat <= now)
+		{
+			logg("Ending rate-limitation of %s", getstr(client->ippos));
+			client->flags.rate_limited = false;
+		}
+		if(bucket != NULL && bucket->limited && bucket->tat <= now)
+		{
+			char subnet[INET6_ADDRSTRLEN + 4];
+			bucket_subnet(bucket, subnet, sizeof(subnet));
+			logg("Ending rate-limitation of subnet %s", subnet);
+			bucket->limited = false;
+		}
+
+		// Only accepted queries take tokens from the buckets
+		client->rate_limit_tat = client_tat;
+		if(bucket != NULL)
+			bucket->tat = subnet_tat;
+
+		return false;
+	}
+
+	counters->rate_limit.queries++;
+
+	// Log the first rate-limited query for this client or subnet. We do
+	// not log the blocked domain for privacy reasons
+	if(!client_ok && !client->flags.rate_limited)
+	{
+		client->flags.rate_limited = true;
+		counters->rate_limit.clients++;
+		logg_rate_limit_message(getstr(client->ippos), config.rate_limit.count,
+		                        config.rate_limit.interval);
+	}
+	if(!subnet_ok && !bucket->limited)
+	{
+		char subnet[INET6_ADDRSTRLEN + 4];
+		bucket_subnet(bucket, subnet, sizeof(subnet));
+		bucket->limited = true;
+		counters->rate_limit.subnets++;
+		logg_rate_limit_message(subnet, config.rate_limit.subnet.count,
+		                        config.rate_limit.subnet.interval);
+	}
+
+	return true;
+}
+
+// Number of clients whose rate is currently being limited
+unsigned int rate_limited_clients(void)
+{
+	const uint64_t now = now_usec();
+	unsigned int limited = 0u;
+	for(int clientID = 0; clientID < counters->clients; clientID++)
+	{
+		const clientsData *client = getClient(clientID, true);
+		if(client != NULL && client->flags.rate_limited && client->rate_limit_tat > now)
+			limited++;
+	}
+	return limited;
+}
+
+// Number of subnets whose rate is currently being limited
+unsigned int rate_limited_subnets(void)
+{
+	const uint64_t now = now_usec();
+	unsigned int limited = 0u;
+	for(unsigned int slot = 0u; slot < RATE_LIMIT_BUCKETS; slot++)
+	{
+		const rateLimitBucket *bucket = get_rate_limit_bucket(slot);
+		if(bucket != NULL && bucket->limited && bucket->tat > now)
+			limited++;
+	}
+	return limited;
+}
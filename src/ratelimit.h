@@ -0,0 +1,20 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Rate-limiting prototypes
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+// clientsData
+#include "datastructure.h"
+
+bool rate_limit_query(clientsData *client);
+unsigned int rate_limited_clients(void);
+unsigned int rate_limited_subnets(void);
+
+#endif //RATELIMIT_H
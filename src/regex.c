@@ -16,7 +16,7 @@
 // data getter functions
 #include "datastructure.h"
 #include "database/gravity-db.h"
-// add_per_client_regex_client()
+// add_groupset_regex()
 #include "shmem.h"
 #include "database/message-table.h"
 // init_shmem()
@@ -25,88 +25,70 @@
 #include "config.h"
 // cli_stuff()
 #include "args.h"
+// regex_set_match()
+#include "regex_set.h"
 
 const char *regextype[REGEX_MAX] = { "blacklist", "whitelist", "CLI" };
 
-static regexData *white_regex = NULL;
-static regexData *black_regex = NULL;
-static regexData   *cli_regex = NULL;
-static unsigned int num_regex[REGEX_MAX] = { 0 };
+// Compiled regex filters of all types
+typedef struct {
+	regexData *regex[REGEX_MAX];
+	// All supported regex of one type, matched together in a single pass
+	regexSet *sets[REGEX_MAX];
+	unsigned int num[REGEX_MAX];
+	// Identifies the filters and their order, see filters_checksum()
+	uint32_t checksum;
+} regexFilters;
+
+// Filters used for matching. A new generation is compiled by prepare_regex()
+// while the current one is still in use and replaces it in publish_regex().
+// The previous generation is freed by release_regex() once no query can use
+// it anymore
+static regexFilters no_filters;
+static regexFilters *filters = &no_filters;
+static regexFilters *next_filters = NULL;
+static regexFilters *old_filters = NULL;
 unsigned int regex_change = 0;
+// Stamp of cached per-domain results: regex_change and the filter checksum
+static uint64_t regex_stamp = 0u;
+
+static void recompile_regex(const bool announce);
 
 static inline regexData *get_regex_ptr(const enum regex_type regexid)
 {
-	switch (regexid)
-	{
-		case REGEX_BLACKLIST:
-			return black_regex;
-		case REGEX_WHITELIST:
-			return white_regex;
-		case REGEX_CLI:
-			return cli_regex;
-		case REGEX_MAX: // Fall through
-		default: // This is not possible
-			return NULL;
-	}
-}
-
-static inline void free_regex_ptr(const enum regex_type regexid)
-{
-	regexData **regex;
-	switch (regexid)
-	{
-		case REGEX_BLACKLIST:
-			regex = &black_regex;
-			break;
-		case REGEX_WHITELIST:
-			regex = &white_regex;
-			break;
-		case REGEX_CLI:
-			regex = &cli_regex;
-			break;
-		case REGEX_MAX: // Fall through
-		default: // This is not possible
-			return;
-	}
-
-	// Free pointer (if not already NULL)
-	if(*regex != NULL)
-	{
-		free(*regex);
-		*regex = NULL;
-	}
+	return regexid < REGEX_MAX ? filters->regex[regexid] : NULL;
 }
 
 static __attribute__ ((pure)) regexData *get_regex_ptr_from_id(unsigned int regexID)
 {
 	unsigned int maxi;
 	enum regex_type regex_type;
-	if(regexID < num_regex[REGEX_BLACKLIST])
+	if(regexID < filters->num[REGEX_BLACKLIST])
 	{
 		// Regex blacklist
 		regex_type = REGEX_BLACKLIST;
-		maxi = num_regex[REGEX_BLACKLIST];
+		maxi = filters->num[REGEX_BLACKLIST];
 	}
 	else
 	{
 		// Subtract regex blacklist
-		regexID -= num_regex[REGEX_BLACKLIST];
+		regexID -= filters->num[REGEX_BLACKLIST];
 
 		// Check for regex whitelist
-		if(regexID < num_regex[REGEX_WHITELIST])
+		if(regexID < filters->num[REGEX_WHITELIST])
 		{
 			// Regex whitelist
 			regex_type = REGEX_WHITELIST;
-			maxi = num_regex[REGEX_WHITELIST];
+			maxi = filters->num[REGEX_WHITELIST];
 		}
 		else
 		{
 			// Subtract regex whitelist
-			regexID -= num_regex[REGEX_WHITELIST];
+			regexID -= filters->num[REGEX_WHITELIST];
 
 			// CLI regex
 			regex_type = REGEX_CLI;
-			maxi = num_regex[REGEX_CLI];
+			maxi = filters->num[REGEX_CLI];
 		}
 	}
 
@@ -124,21 +106,144 @@ unsigned int __attribute__((pure)) get_num_regex(const enum regex_type regexid)
 	{
 		unsigned int num = 0;
 		for(unsigned int i = 0; i < REGEX_MAX; i++)
-			num += num_regex[i];
+			num += filters->num[i];
 		return num;
 	}
 
 	// else: specific regex type
-	return num_regex[regexid];
+	return filters->num[regexid];
+}
+
+// Extract the longest literal string which has to be part of every string
+// matched by the regex (case-insensitively). This is used to skip regex which
+// cannot match before calling into TRE. Returns NULL if there is no such
+// literal of at least two characters or the regex is too complex to tell
+static char *required_literal(const char *rgx)
+{
+	const size_t len = strlen(rgx);
+	char run[len + 1u], best[len + 1u];
+	size_t runlen = 0u, bestlen = 0u;
+	unsigned int depth = 0u;
+	bool appended = false;
+
+	const char *p = rgx;
+	while(*p != '\0')
+	{
+		// Literal character found (if any)
+		int c = -1;
+		bool quantifier = false;
+		if(*p == '|' && depth == 0u)
+		{
+			// Top-level alternatives make every literal optional
+			return NULL;
+		}
+		else if(*p == '*' || *p == '+' || *p == '?' || *p == '{')
+		{
+			quantifier = true;
+			if(*p == '{')
+				while(*p != '\0' && *p != '}')
+					p++;
+			if(*p != '\0')
+				p++;
+		}
+		else if(*p == '\\')
+		{
+			p++;
+			if(*p == '\0' || *p == 'Q')
+				return NULL;
+			else if(*p == 'x' && p[1] == '{')
+				while(*p != '\0' && *p != '}')
+					p++;
+			else if(*p == 'x')
+				for(unsigned int i = 0; i < 2u && isxdigit(p[1]); i++)
+					p++;
+			else if(!isalnum(*p) && *p != '<' && *p != '>')
+				c = *p;
+			if(*p != '\0')
+				p++;
+		}
+		else if(*p == '[')
+		{
+			// Skip bracket expression
+			p++;
+			if(*p == '^')
+				p++;
+			if(*p == ']')
+				p++;
+			while(*p != '\0' && *p != ']')
+			{
+				if(*p == '[' && (p[1] == ':' || p[1] == '.' || p[1] == '='))
+				{
+					const char end = p[1];
+					for(p += 2; *p != '\0' && !(p[0] == end && p[1] == ']'); p++);
+					if(*p != '\0')
+						p++;
+				}
+				if(*p != '\0')
+					p++;
+			}
+			if(*p != '\0')
+				p++;
+		}
+		else if(*p == '(' && p[1] == '?')
+		{
+			// TRE extensions may change how the rest is parsed
+			return NULL;
+		}
+		else if(*p == '(')
+		{
+			depth++;
+			p++;
+		}
+		else if(*p == ')' && depth > 0u)
+		{
+			depth--;
+			p++;
+		}
+		else if(*p == '.' || *p == '^' || *p == '$')
+			p++;
+		else
+			c = *p++;
+
+		if(c > -1 && depth == 0u)
+		{
+			// Extend the current literal
+			run[runlen++] = tolower(c);
+			appended = true;
+			continue;
+		}
+
+		// Anything else ends the current literal. A quantifier also
+		// makes the preceding character optional
+		if(quantifier && appended)
+			runlen--;
+		if(runlen > bestlen)
+		{
+			memcpy(best, run, runlen);
+			bestlen = runlen;
+		}
+		runlen = 0u;
+		appended = false;
+	}
+
+	if(runlen > bestlen)
+	{
+		memcpy(best, run, runlen);
+		bestlen = runlen;
+	}
+	if(bestlen < 2u)
+		return NULL;
+	best[bestlen] = '\0';
+	return strdup(best);
 }
 
 #define FTL_REGEX_SEP ";"
 /* Compile regular expressions into data structures that can be used with
    regexec() to match against a string */
-static bool compile_regex(const char *regexin, const enum regex_type regexid, const int dbidx)
+static bool compile_regex(regexFilters *f, const char *regexin, const enum regex_type regexid, const int dbidx)
 {
-	regexData *regex = get_regex_ptr(regexid);
-	int index = num_regex[regexid]++;
+	regexData *regex = f->regex[regexid];
+	int index = f->num[regexid]++;
 
 	// Extract possible Pi-hole extensions
 	char rgxbuf[strlen(regexin) + 1u];
@@ -299,81 +404,196 @@ static bool compile_regex(const char *regexin, const enum regex_type regexid, co
 	regex[index].string = strdup(regexin);
 	regex[index].available = true;
 
+	// Add regex to the combined matcher of this type if it can handle it.
+	// Regex it does not support are still matched individually by TRE
+	if(f->sets[regexid] == NULL)
+		f->sets[regexid] = regex_set_new();
+	if(f->sets[regexid] != NULL)
+		regex[index].in_set = regex_set_add(f->sets[regexid], rgxbuf, index);
+	if(config.debug & DEBUG_REGEX)
+		logg("   This regex is %smatched by the combined matcher",
+		     regex[index].in_set ? "" : "NOT ");
+
+	// Regex matched individually are only tried if the input contains the
+	// literal they require
+	if(!regex[index].in_set)
+		regex[index].literal = required_literal(rgxbuf);
+	if(config.debug & DEBUG_REGEX && regex[index].literal != NULL)
+		logg("   This regex is only tried on strings containing \"%s\"",
+		     regex[index].literal);
+
 	return true;
 }
 
-int match_regex(const char *input, DNSCacheData* dns_cache, const int clientID,
-                const enum regex_type regexid, const bool regextest)
+// Match input against all regex of a type. Bit i of matched is set if regex i
+// matches the input, taking ;invert into account. Other Pi-hole extensions
+// depend on the query and have to be checked by the caller
+static void match_all_regex(const char *input, const enum regex_type regexid,
+                            uint64_t *matched, const unsigned int words)
 {
-	int match_idx = -1;
 	regexData *regex = get_regex_ptr(regexid);
 #ifdef USE_TRE_REGEX
 	regmatch_t match[1] = {{ 0 }}; // This also disables any sub-matching
 #endif
 
-	// Check if we need to recompile regex because they were changed in
-	// another fork. If this is the case, reload everything (regex
-	// themselves as well as per-client enabled/disabled state)
-	if(regex_change != counters->regex_change)
-	{
-		logg("Reloading externally changed regular expressions");
-		read_regex_from_database();
-		// Update regex pointer as it will have changed (free_regex has
-		// been called)
-		regex = get_regex_ptr(regexid);
-	}
+	// Match all regex supported by the combined matcher at once, only the
+	// remaining ones have to be tried one after another below
+	const bool use_set = regex_set_match(filters->sets[regexid], input, matched, words);
+	if(!use_set)
+		memset(matched, 0, words*sizeof(uint64_t));
+
+	// Lower-case copy of the input, compared against required literals
+	char lower[strlen(input) + 1u];
+	size_t i = 0u;
+	for(; input[i] != '\0'; i++)
+		lower[i] = tolower(input[i]);
+	lower[i] = '\0';
 
-	// Loop over all configured regex filters of this type
-	for(unsigned int index = 0; index < num_regex[regexid]; index++)
+	for(unsigned int index = 0; index < filters->num[regexid]; index++)
 	{
-		// Only check regex which have been successfully compiled ...
-		if(!regex[index].available)
-		{
-			if(config.debug & DEBUG_REGEX)
-			{
-				logg("Regex %s (%u, DB ID %d) \"%s\" is NOT AVAILABLE",
-				     regextype[regexid], index, regex[index].database_id,
-				     regex[index].string);
-			}
+		if(!regex[index].available || (use_set && regex[index].in_set))
 			continue;
-		}
-		// ... and are enabled for this client
-		int regexID = index;
-		if(regexid == REGEX_WHITELIST)
-			regexID += num_regex[REGEX_BLACKLIST];
-		else if(regexid == REGEX_CLI)
-			regexID += num_regex[REGEX_BLACKLIST] +
-			           num_regex[REGEX_WHITELIST];
-
-		// Only use regular expressions enabled for this client
-		// We allow clientID = -1 to get all regex (for testing)
-		if(clientID >= 0 && !get_per_client_regex(clientID, regexID))
-		{
-			if(config.debug & DEBUG_REGEX)
-			{
-				clientsData* client = getClient(clientID, true);
-				if(client != NULL)
-				{
-					logg("Regex %s (%u, DB ID %d) \"%s\" NOT ENABLED for client %s",
-					     regextype[regexid], index, regex[index].database_id,
-					     regex[index].string, getstr(client->ippos));
-				}
-			}
+
+		// Skip regex whose required literal is not part of the input
+		if(regex[index].literal != NULL && strstr(lower, regex[index].literal) == NULL)
 			continue;
-		}
 
 		// Try to match the compiled regular expression against input
 		if(config.debug & DEBUG_REGEX)
 			logg("Executing: index = %d, preg = %p, str = \"%s\", pmatch = %p", index, &regex[index].regex, input, &match);
 #ifdef USE_TRE_REGEX
-		int retval = tre_regexec(&regex[index].regex, input, 0, match, 0);
+		const int retval = tre_regexec(&regex[index].regex, input, 0, match, 0);
 #else
-		int retval = regexec(&regex[index].regex, input, 0, NULL, 0);
+		const int retval = regexec(&regex[index].regex, input, 0, NULL, 0);
 #endif
 		// regexec() returns REG_OK for a successful match or REG_NOMATCH for failure.
-		if ((retval == REG_OK && !regex[index].ext.inverted) ||
-		    (retval == REG_NOMATCH && regex[index].ext.inverted))
+		if(retval == REG_OK)
+			matched[index / 64u] |= 1ull << (index % 64u);
+	}
+
+	// Inverted regex match if the pattern does not match, regex which
+	// failed to compile never match
+	for(unsigned int index = 0; index < filters->num[regexid]; index++)
+	{
+		if(!regex[index].available)
+			matched[index / 64u] &= ~(1ull << (index % 64u));
+		else if(regex[index].ext.inverted)
+			matched[index / 64u] ^= 1ull << (index % 64u);
+	}
+}
+
+// Get 64 bits of a bitset starting at an arbitrary bit
+static inline uint64_t get_bits64(const uint64_t *bits, const unsigned int start)
+{
+	const unsigned int word = start / 64u, shift = start % 64u;
+	if(shift == 0u)
+		return bits[word];
+	return (bits[word] >> shift) | (bits[word + 1u] << (64u - shift));
+}
+
+// Log why regex are not considered for the current input
+static void debug_regex(const char *input, const enum regex_type regexid, const uint64_t *matched,
+                        const uint64_t *enabled, const unsigned int offset, const int groupsetID)
+{
+	const regexData *regex = get_regex_ptr(regexid);
+	for(unsigned int index = 0; index < filters->num[regexid]; index++)
+	{
+		const uint64_t bit = 1ull << (index % 64u);
+		if(!regex[index].available)
+			logg("Regex %s (%u, DB ID %d) \"%s\" is NOT AVAILABLE",
+			     regextype[regexid], index, regex[index].database_id,
+			     regex[index].string);
+		else if(enabled != NULL && !(enabled[(offset + index) / 64u] & (1ull << ((offset + index) % 64u))))
+			logg("Regex %s (%u, DB ID %d) \"%s\" NOT ENABLED for group set %d",
+			     regextype[regexid], index, regex[index].database_id,
+			     regex[index].string, groupsetID);
+		else if(!(matched[index / 64u] & bit))
+			logg("Regex %s (%u, DB ID %i) NO match: \"%s\" vs. \"%s\"",
+			     regextype[regexid], index, regex[index].database_id,
+			     input, regex[index].string);
+	}
+}
+
+// Get the cached results of all regex of a type for a domain. The row of a
+// domain holds the blacklist results followed by the whitelist results, each
+// preceded by the regex_stamp they were computed for
+static uint64_t *get_regex_cache(const int domainID, const enum regex_type regexid)
+{
+	if(regexid == REGEX_CLI)
+		return NULL;
+	const unsigned int black = filters->num[REGEX_BLACKLIST] / 64u + 1u;
+	const unsigned int white = filters->num[REGEX_WHITELIST] / 64u + 1u;
+	uint64_t *row = get_domain_regex(domainID, 2u + black + white);
+	if(row == NULL)
+		return NULL;
+	return regexid == REGEX_WHITELIST ? row + 1u + black : row;
+}
+
+int match_regex(const char *input, DNSCacheData* dns_cache, const int groupsetID,
+                const enum regex_type regexid, const bool regextest)
+{
+	int match_idx = -1;
+	regexData *regex = get_regex_ptr(regexid);
+
+	// Check if we need to recompile regex because they were changed in
+	// another fork. If this is the case, reload everything (regex
+	// themselves as well as per-group-set enabled/disabled state)
+	if(regex_change != counters->regex_change)
+	{
+		logg("Reloading externally changed regular expressions");
+		recompile_regex(false);
+		// Update regex pointer as it will have changed
+		regex = get_regex_ptr(regexid);
+	}
+
+	// Which regex match does not depend on the client, hence, the results
+	// are computed only once per domain and list reload and shared between
+	// all clients and query types
+	const unsigned int words = filters->num[regexid] / 64u + 1u;
+	uint64_t buffer[words];
+	uint64_t *cache = NULL;
+	if(dns_cache != NULL && filters->num[regexid] > 0)
+		cache = get_regex_cache(dns_cache->domainID, regexid);
+	const uint64_t *matched = cache != NULL ? cache + 1u : buffer;
+	if(cache == NULL || cache[0] != regex_stamp)
+	{
+		match_all_regex(input, regexid, cache != NULL ? cache + 1u : buffer, words);
+		if(cache != NULL)
+			cache[0] = regex_stamp;
+	}
+	else if(config.debug & DEBUG_REGEX)
+		logg("Using cached %s regex results for \"%s\"", regextype[regexid], input);
+
+	// Regex enabled for this group set. We use all regex when testing
+	const uint64_t *enabled = NULL;
+	if(!regextest && groupsetID > -1)
+		enabled = get_groupset_regex(groupsetID);
+	if(!regextest && enabled == NULL)
+		return -1;
+
+	// Position of the first regex of this type in the group set bitset
+	unsigned int offset = 0u;
+	if(regexid == REGEX_WHITELIST)
+		offset = filters->num[REGEX_BLACKLIST];
+	else if(regexid == REGEX_CLI)
+		offset = filters->num[REGEX_BLACKLIST] + filters->num[REGEX_WHITELIST];
+
+	if(config.debug & DEBUG_REGEX)
+		debug_regex(input, regexid, matched, enabled, offset, groupsetID);
+
+	// Only regex which match and are enabled have to be looked at, walk
+	// them in order
+	for(unsigned int w = 0; w < words && (match_idx == -1 || regextest); w++)
+	{
+		uint64_t candidates = matched[w];
+		if(enabled != NULL)
+			candidates &= get_bits64(enabled, offset + 64u*w);
+
+		while(candidates != 0 && (match_idx == -1 || regextest))
 		{
+			const unsigned int index = 64u*w + __builtin_ctzll(candidates);
+			candidates &= candidates - 1u;
+
 			// Check possible additional regex settings
 			if(dns_cache != NULL)
 			{
@@ -404,7 +624,6 @@ int match_regex(const char *input, DNSCacheData* dns_cache, const int clientID,
 			// Print match message when in regex debug mode
 			if(config.debug & DEBUG_REGEX)
 			{
-				// Approximate regex matching mode
 				logg("Regex %s (%u, DB ID %i) >> MATCH: \"%s\" vs. \"%s\"",
 				     regextype[regexid], index, regex[index].database_id,
 				     input, regex[index].string);
@@ -430,19 +649,6 @@ int match_regex(const char *input, DNSCacheData* dns_cache, const int clientID,
 				     cli_bold(), regex[index].string, cli_normal(),
 				     regex[index].database_id);
 			}
-			else
-			{
-				// Only check the first match when not in regex-test mode
-				break;
-			}
-		}
-
-		// Print no match message when in regex debug mode
-		if(config.debug & DEBUG_REGEX && match_idx == -1)
-		{
-			logg("Regex %s (%u, DB ID %i) NO match: \"%s\" vs. \"%s\"",
-			     regextype[regexid], index, regex[index].database_id,
-			     input, regex[index].string);
 		}
 	}
 
@@ -450,35 +656,16 @@ int match_regex(const char *input, DNSCacheData* dns_cache, const int clientID,
 	return match_idx;
 }
 
-static void free_regex(void)
+static void free_filters(regexFilters *f)
 {
-	// Return early if we don't use any regex filters
-	if(white_regex == NULL &&
-	   black_regex == NULL &&
-	     cli_regex == NULL)
-	{
-		if(config.debug & DEBUG_DATABASE)
-			logg("Not using any regex filters, nothing to free or reset");
+	// The initial (empty) filters are not allocated
+	if(f == NULL || f == &no_filters)
 		return;
-	}
 
-	// Reset client configuration
-	if(config.debug & DEBUG_DATABASE)
-		logg("Resetting per-client regex settings");
-	for(int clientID = 0; clientID < counters->clients; clientID++)
-	{
-		reset_per_client_regex(clientID);
-	}
-
-	// Free regex datastructure
 	// Loop over regex types
 	for(enum regex_type regexid = REGEX_BLACKLIST; regexid < REGEX_MAX; regexid++)
 	{
-		regexData *regex = get_regex_ptr(regexid);
-
-		// Reset counter for number of regex
-		const unsigned int oldcount = num_regex[regexid];
-		num_regex[regexid] = 0;
+		regexData *regex = f->regex[regexid];
 
 		// Exit early if the regex has already been freed (or has never been used)
 		if(regex == NULL)
@@ -487,12 +674,15 @@ static void free_regex(void)
 		if(config.debug & DEBUG_DATABASE)
 		{
 			logg("Going to free %i entries in %s regex struct",
-			     oldcount, regextype[regexid]);
+			     f->num[regexid], regextype[regexid]);
 		}
 
 		// Loop over entries with this regex type
-		for(unsigned int index = 0; index < oldcount; index++)
+		for(unsigned int index = 0; index < f->num[regexid]; index++)
 		{
+			if(regex[index].groups != NULL)
+				free(regex[index].groups);
+
 			if(!regex[index].available)
 				continue;
 
@@ -500,10 +690,9 @@ static void free_regex(void)
 
 			// Also free buffered regex strings
 			if(regex[index].string != NULL)
-			{
 				free(regex[index].string);
-				regex[index].string = NULL;
-			}
+			if(regex[index].literal != NULL)
+				free(regex[index].literal);
 		}
 
 		if(config.debug & DEBUG_DATABASE)
@@ -512,36 +701,127 @@ static void free_regex(void)
 		}
 
 		// Free array with regex datastructure
-		free_regex_ptr(regexid);
+		free(regex);
+
+		// Free combined matcher
+		regex_set_free(f->sets[regexid]);
+	}
+
+	free(f);
+}
+
+static int cmp_group_id(const void *a, const void *b)
+{
+	const int ga = *(const int*)a, gb = *(const int*)b;
+	return ga < gb ? -1 : ga > gb;
+}
+
+// Parse a comma-separated list of group IDs into a sorted array. Returns NULL
+// if there are no groups
+static int *parse_group_ids(const char *groups, unsigned int *num)
+{
+	*num = 0u;
+	if(groups == NULL || *groups == '\0')
+		return NULL;
+
+	unsigned int size = 1u;
+	for(const char *p = groups; *p != '\0'; p++)
+		if(*p == ',')
+			size++;
+
+	int *ids = calloc(size, sizeof(int));
+	if(ids == NULL)
+	{
+		logg("ERROR: Memory allocation failed in parse_group_ids()");
+		return NULL;
+	}
+
+	const char *p = groups;
+	while(*p != '\0' && *num < size)
+	{
+		char *end = NULL;
+		const long group_id = strtol(p, &end, 10);
+		if(end == p)
+		{
+			// Skip unexpected characters
+			p++;
+			continue;
+		}
+		ids[(*num)++] = (int)group_id;
+		p = end;
+	}
+
+	qsort(ids, *num, sizeof(int), cmp_group_id);
+	return ids;
+}
+
+// Check if a regex is enabled for any of the (sorted) groups
+static bool __attribute__ ((pure)) regex_in_groups(const regexData *regex, const int *groups,
+                                                   const unsigned int num_groups)
+{
+	unsigned int i = 0u, j = 0u;
+	while(i < regex->num_groups && j < num_groups)
+	{
+		if(regex->groups[i] == groups[j])
+			return true;
+		else if(regex->groups[i] < groups[j])
+			i++;
+		else
+			j++;
 	}
+	return false;
 }
 
 // This function does three things:
 //   1. Allocate additional memory if required
-//   2. Reset all regex to false for this client
-//   3. Load regex enabled/disabled state
-void reload_per_client_regex(clientsData *client)
+//   2. Reset all regex to false for this group set
+//   3. Enable the regex of the groups of this group set
+// The groups of the regex filters are read when compiling them, the database is
+// not accessed here
+void reload_groupset_regex(const int groupsetID)
 {
 	// Ensure there is enough memory in the shared memory object
-	add_per_client_regex(client->id);
+	add_groupset_regex(groupsetID);
 
 	// Zero-initialize (or wipe previous) regex
-	reset_per_client_regex(client->id);
-
-	// Load regex per-group regex blacklist for this client
-	if(num_regex[REGEX_BLACKLIST] > 0)
-		gravityDB_get_regex_client_groups(client, num_regex[REGEX_BLACKLIST],
-		                                  black_regex, REGEX_BLACKLIST,
-		                                  "vw_regex_blacklist");
-
-	// Load regex per-group regex whitelist for this client
-	if(num_regex[REGEX_WHITELIST] > 0)
-		gravityDB_get_regex_client_groups(client, num_regex[REGEX_WHITELIST],
-		                                  white_regex, REGEX_WHITELIST,
-		                                  "vw_regex_whitelist");
+	reset_groupset_regex(groupsetID);
+
+	// Released group sets have no regex enabled
+	const groupsetsData *groupset = getGroupset(groupsetID, false);
+	if(groupset == NULL || groupset->magic != MAGICBYTE)
+		return;
+
+	unsigned int num_groups = 0u;
+	int *groups = parse_group_ids(getstr(groupset->groupspos), &num_groups);
+	if(groups == NULL)
+		return;
+
+	if(config.debug & DEBUG_REGEX)
+		logg("Getting regex groups for group set with ID %i", groupsetID);
+
+	// Regular expressions are stored in one array, the whitelist follows the
+	// blacklist
+	unsigned int regexID = 0u;
+	for(enum regex_type regexid = REGEX_BLACKLIST; regexid < REGEX_CLI; regexid++)
+	{
+		const regexData *regex = filters->regex[regexid];
+		for(unsigned int index = 0; index < filters->num[regexid]; index++, regexID++)
+		{
+			if(!regex_in_groups(&regex[index], groups, num_groups))
+				continue;
+
+			set_groupset_regex(groupsetID, regexID, true);
+
+			if(config.debug & DEBUG_REGEX)
+				logg("Regex %s: Enabling regex with DB ID %i for group set %i",
+				     regextype[regexid], regex[index].database_id, groupsetID);
+		}
+	}
+
+	free(groups);
 }
 
-static void read_regex_table(const enum regex_type regexid)
+static void read_regex_table(regexFilters *f, sqlite3 *db, const enum regex_type regexid)
 {
 	// Get table ID
 	const enum gravity_tables tableID = (regexid == REGEX_BLACKLIST) ? REGEX_BLACKLIST_TABLE : REGEX_WHITELIST_TABLE;
@@ -550,8 +830,8 @@ static void read_regex_table(const enum regex_type regexid)
 		logg("Reading regex %s from database", regextype[regexid]);
 
 	// Get number of lines in the regex table
-	num_regex[regexid] = 0;
-	int count = gravityDB_count(tableID);
+	f->num[regexid] = 0;
+	int count = gravityDB_count(db, tableID);
 
 	if(count == 0)
 	{
@@ -564,22 +844,18 @@ static void read_regex_table(const enum regex_type regexid)
 	}
 
 	// Allocate memory for regex
-	regexData *regex = NULL;
-	if(regexid == REGEX_BLACKLIST)
-	{
-		black_regex = calloc(count, sizeof(regexData));
-		regex = black_regex;
-	}
-	else
+	regexData *regex = f->regex[regexid] = calloc(count, sizeof(regexData));
+	if(regex == NULL)
 	{
-		white_regex = calloc(count, sizeof(regexData));
-		regex = white_regex;
+		logg("ERROR: Memory allocation failed when reading %s regex", regextype[regexid]);
+		return;
 	}
 
 	// Connect to regex table
-	if(!gravityDB_getTable(tableID))
+	sqlite3_stmt *stmt = gravityDB_getTable(db, tableID);
+	if(stmt == NULL)
 	{
-		logg("read_regex_from_database(): Error getting %s regex table from database",
+		logg("read_regex_table(): Error getting %s regex table from database",
 		     regextype[regexid]);
 		return;
 	}
@@ -587,14 +863,14 @@ static void read_regex_table(const enum regex_type regexid)
 	// Walk database table
 	const char *domain = NULL;
 	int rowid = 0;
-	while((domain = gravityDB_getDomain(&rowid)) != NULL)
+	while((domain = gravityDB_getDomain(stmt, &rowid)) != NULL)
 	{
 		// Avoid buffer overflow if database table changed
 		// since we counted its entries
-		if(num_regex[regexid] >= (unsigned int)count)
+		if(f->num[regexid] >= (unsigned int)count)
 		{
 			logg("INFO: read_regex_table(%s) exiting early to avoid overflow (%d/%d).",
-			     regextype[regexid], num_regex[regexid], count);
+			     regextype[regexid], f->num[regexid], count);
 			break;
 		}
 
@@ -611,63 +887,132 @@ static void read_regex_table(const enum regex_type regexid)
 		if(config.debug & DEBUG_REGEX)
 		{
 			logg("Compiling %s regex %i (DB ID %i): %s",
-			     regextype[regexid], num_regex[regexid], rowid, domain);
+			     regextype[regexid], f->num[regexid], rowid, domain);
 		}
 
-		compile_regex(domain, regexid, rowid);
-		regex[num_regex[regexid]-1].database_id = rowid;
+		compile_regex(f, domain, regexid, rowid);
+		regexData *compiled = &regex[f->num[regexid]-1];
+		compiled->database_id = rowid;
 
-		// Signal other forks that the regex data has changed and should be updated
-		regex_change = ++counters->regex_change;
+		// Remember the groups this regex is enabled for
+		compiled->groups = parse_group_ids(gravityDB_getGroups(stmt), &compiled->num_groups);
 	}
 
-	// Finalize statement and close gravity database handle
-	gravityDB_finalizeTable();
+	// Finalize statement
+	sqlite3_finalize(stmt);
 
 	if(config.debug & DEBUG_DATABASE)
 	{
 		logg("Read %i %s regex entries",
-		     num_regex[regexid],
+		     f->num[regexid],
 		     regextype[regexid]);
 	}
 }
 
-void read_regex_from_database(void)
+// Checksum of the database IDs and strings of all filters in the order they
+// are numbered. Processes which compiled their filters from different states of
+// the database number them differently and must not use each other's cached
+// results even if they saw the same regex_change
+static uint32_t __attribute__ ((pure)) filters_checksum(const regexFilters *f)
 {
-	// Free regex filters
-	// This routine is safe to be called even when there
-	// are no regex filters at the moment
-	free_regex();
+	uint32_t hash = 2166136261u;
+	for(enum regex_type regexid = REGEX_BLACKLIST; regexid < REGEX_CLI; regexid++)
+	{
+		for(unsigned int index = 0; index < f->num[regexid]; index++)
+		{
+			const regexData *regex = &f->regex[regexid][index];
+			hash = (hash ^ (uint32_t)regex->database_id) * 16777619u;
+			if(regex->string != NULL)
+				hash = (hash ^ hashStr(regex->string)) * 16777619u;
+		}
+		hash = (hash ^ f->num[regexid]) * 16777619u;
+	}
+	return hash;
+}
 
+// Read and compile the regex filters without touching the filters currently
+// used for matching. They are used once publish_regex() is called
+void prepare_regex(sqlite3 *db)
+{
 	// Start timer for regex compilation analysis
 	timer_start(REGEX_TIMER);
 
+	regexFilters *f = calloc(1, sizeof(regexFilters));
+	if(f == NULL)
+	{
+		logg("ERROR: Memory allocation failed in prepare_regex()");
+		return;
+	}
+
 	// Read and compile regex blacklist
-	read_regex_table(REGEX_BLACKLIST);
+	read_regex_table(f, db, REGEX_BLACKLIST);
 
 	// Read and compile regex whitelist
-	read_regex_table(REGEX_WHITELIST);
+	read_regex_table(f, db, REGEX_WHITELIST);
 
-	// Loop over all clients and ensure we have enough space and load
-	// per-client regex data, not all of the regex read and compiled above
-	// will also be used by all clients
-	if(config.debug & DEBUG_DATABASE)
-		logg("Loading per-client regex data");
-	for(int clientID = 0; clientID < counters->clients; clientID++)
+	f->checksum = filters_checksum(f);
+
+	// Replace filters which have been prepared but not published
+	free_filters(next_filters);
+	next_filters = f;
+
+	// Print message to FTL's log after reloading regex filters
+	logg("Compiled %i whitelist and %i blacklist regex filters in %.1f msec",
+	     f->num[REGEX_WHITELIST], f->num[REGEX_BLACKLIST],
+	     timer_elapsed_msec(REGEX_TIMER));
+}
+
+// Replace the current regex filters by the prepared ones (if any) and load
+// which of them are enabled for the known group sets. The caller has to hold
+// the shared memory lock. Other processes recompile their filters when
+// announce is true
+void publish_regex(const bool announce)
+{
+	if(next_filters != NULL)
 	{
-		// Get client pointer
-		clientsData *client = getClient(clientID, true);
-		// Skip invalid and alias-clients
-		if(client == NULL || client->flags.aliasclient)
-			continue;
+		// The previous generation has to be released before publishing again
+		free_filters(old_filters);
+		old_filters = filters;
+		__atomic_store_n(&filters, next_filters, __ATOMIC_RELEASE);
+		next_filters = NULL;
+	}
+
+	// Cached regex results of the previous generation are invalid now
+	regex_change = announce ? ++counters->regex_change : counters->regex_change;
+	regex_stamp = (uint64_t)regex_change << 32 | filters->checksum;
 
-		reload_per_client_regex(client);
+	// Loop over all group sets and ensure we have enough space and load
+	// per-group-set regex data, not all of the regex compiled will also be
+	// used by all clients
+	if(config.debug & DEBUG_DATABASE)
+		logg("Loading per-group-set regex data");
+	for(int groupsetID = 0; groupsetID < counters->groupsets; groupsetID++)
+		reload_groupset_regex(groupsetID);
+}
+
+// Free the regex filters replaced by publish_regex()
+void release_regex(void)
+{
+	free_filters(old_filters);
+	old_filters = NULL;
+}
+
+// Recompile the regex filters at once while holding the shared memory lock
+static void recompile_regex(const bool announce)
+{
+	sqlite3 *db = gravityDB_open_private();
+	if(db != NULL)
+	{
+		prepare_regex(db);
+		sqlite3_close(db);
 	}
+	publish_regex(announce);
+	release_regex();
+}
 
-	// Print message to FTL's log after reloading regex filters
-	logg("Compiled %i whitelist and %i blacklist regex filters for %i clients in %.1f msec",
-	     num_regex[REGEX_WHITELIST], num_regex[REGEX_BLACKLIST],
-	     counters->clients, timer_elapsed_msec(REGEX_TIMER));
+void read_regex_from_database(void)
+{
+	recompile_regex(true);
 }
 
 int regex_test(const bool debug_mode, const bool quiet, const char *domainin, const char *regexin)
@@ -692,12 +1037,17 @@ int regex_test(const bool debug_mode, const bool quiet, const char *domainin, co
 		logg("%s Loading regex filters from database...", cli_info());
 		timer_start(REGEX_TIMER);
 		log_ctrl(false, true); // Temporarily re-enable terminal output for error logging
-		read_regex_table(REGEX_BLACKLIST);
-		read_regex_table(REGEX_WHITELIST);
+		sqlite3 *db = gravityDB_open_private();
+		if(db != NULL)
+		{
+			read_regex_table(filters, db, REGEX_BLACKLIST);
+			read_regex_table(filters, db, REGEX_WHITELIST);
+			sqlite3_close(db);
+		}
 		log_ctrl(false, !quiet); // Re-apply quiet option after compilation
 		logg("    Compiled %i black- and %i whitelist regex filters in %.3f msec\n",
-		     num_regex[REGEX_BLACKLIST],
-		     num_regex[REGEX_WHITELIST],
+		     filters->num[REGEX_BLACKLIST],
+		     filters->num[REGEX_WHITELIST],
 		     timer_elapsed_msec(REGEX_TIMER));
 
 		// Check user-provided domain against all loaded regular blacklist expressions
@@ -718,12 +1068,12 @@ int regex_test(const bool debug_mode, const bool quiet, const char *domainin, co
 	{
 		// Compile CLI regex
 		logg("%s Compiling regex filter...", cli_info());
-		cli_regex = calloc(1, sizeof(regexData));
+		filters->regex[REGEX_CLI] = calloc(1, sizeof(regexData));
 
 		// Compile CLI regex
 		timer_start(REGEX_TIMER);
 		log_ctrl(false, true); // Temporarily re-enable terminal output for error logging
-		if(!compile_regex(regexin, REGEX_CLI, -1))
+		if(!compile_regex(filters, regexin, REGEX_CLI, -1))
 			return EXIT_FAILURE;
 		log_ctrl(false, !quiet); // Re-apply quiet option after compilation
 		logg("    Compiled regex filter in %.3f msec\n", timer_elapsed_msec(REGEX_TIMER));
@@ -747,7 +1097,7 @@ static int __attribute__ ((pure)) regex_id_from_database_id(const int dbID)
 	// Get number of defined regular expressions
 	unsigned int sum_regex = 0;
 	for(unsigned int i = 0; i < REGEX_MAX; i++)
-		sum_regex += num_regex[i];
+		sum_regex += filters->num[i];
 
 	// Find internal ID of regular expression with this database ID
 	for(unsigned int i = 0; i < sum_regex; i++)
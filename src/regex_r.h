@@ -31,6 +31,7 @@ extern const char *regextype[];
 
 typedef struct {
 	bool available :1;
+	bool in_set :1;
 	struct {
 		bool inverted :1;
 		bool query_type_inverted :1;
@@ -42,18 +43,24 @@ typedef struct {
 		struct in6_addr addr6;
 	} ext;
 	int database_id;
+	unsigned int num_groups;
 	char *string;
+	char *literal;
+	int *groups;
 	regex_t regex;
 } regexData;
 
-ASSERT_SIZEOF(regexData, 56, 44, 44);
+ASSERT_SIZEOF(regexData, 80, 56, 56);
 
 unsigned int get_num_regex(const enum regex_type regexid) __attribute__((pure));
-int match_regex(const char *input, DNSCacheData* dns_cache, const int clientID,
+int match_regex(const char *input, DNSCacheData* dns_cache, const int groupsetID,
                 const enum regex_type regexid, const bool regextest);
 void allocate_regex_client_enabled(clientsData *client, const int clientID);
-void reload_per_client_regex(clientsData *client);
+void reload_groupset_regex(const int groupsetID);
 void read_regex_from_database(void);
+void prepare_regex(sqlite3 *db);
+void publish_regex(const bool announce);
+void release_regex(void);
 bool regex_get_redirect(const int regexID, struct in_addr *addr4, struct in6_addr *addr6);
 
 int regex_test(const bool debug_mode, const bool quiet, const char *domainin, const char *regexin);
@@ -0,0 +1,1181 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Combined multi-pattern regex matcher
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#include "FTL.h"
+#include "regex_set.h"
+// logg()
+#include "log.h"
+// struct config
+#include "config.h"
+// isalnum(), etc.
+#include <ctype.h>
+
+// Patterns longer than this or needing more NFA states (e.g. because of large
+// bounded repetitions) are left to TRE
+#define PATTERN_MAX_LENGTH 4096u
+#define PATTERN_MAX_STATES 4096u
+// Maximum nesting depth of groups
+#define PATTERN_MAX_DEPTH 64u
+// Largest repetition count accepted by TRE (RE_DUP_MAX)
+#define PATTERN_DUP_MAX 255
+// The lazily built DFA is thrown away and started over once it exceeds these
+// limits. This bounds the memory used by pathological sets of patterns
+#define DFA_MAX_STATES 4096u
+#define DFA_MAX_MEMBERS (1u << 20)
+
+// Every NFA state either consumes one character out of a set (NFA_CHAR), is an
+// epsilon transition (NFA_SPLIT, NFA_EPS), an assertion (NFA_BOL, NFA_EOL) or
+// marks the end of a pattern (NFA_MATCH)
+enum nfa_type { NFA_CHAR, NFA_SPLIT, NFA_EPS, NFA_BOL, NFA_EOL, NFA_MATCH } __attribute__ ((packed));
+
+typedef struct {
+	enum nfa_type type;
+	unsigned int arg; // Character set (NFA_CHAR) or pattern ID (NFA_MATCH)
+	int out;
+	int out1;         // Second target of NFA_SPLIT
+} nfaState;
+
+typedef struct {
+	uint64_t bits[4];
+} charSet;
+
+// A DFA state is the set of NFA states the automaton can be in. The states
+// reached by (re-)starting all patterns at the current position are part of
+// every DFA state and are not stored explicitly
+typedef struct {
+	uint32_t hash;
+	unsigned int members; // Offset into the member pool
+	unsigned int count;
+	int accept;           // Patterns matched so far (offset into the accept pool)
+	int eol_accept;       // Patterns matched if the input ends here
+} dfaState;
+
+struct regexSet {
+	// NFA of all patterns
+	nfaState *nfa;
+	unsigned int nfa_count;
+	unsigned int nfa_size;
+	int *starts;
+	unsigned int num_starts;
+	unsigned int starts_size;
+	charSet *charsets;
+	uint32_t *charset_table;
+	unsigned int num_charsets;
+	unsigned int charsets_size;
+	unsigned int patterns;
+	unsigned int words;
+	bool dirty;
+
+	// Input bytes which cannot be told apart by any pattern share a class
+	unsigned char classes[256];
+	unsigned char class_rep[256];
+	unsigned int num_classes;
+
+	// States reached by starting all patterns (without ^ matching)
+	bool *restart;
+	int *restart_next[256];
+	unsigned int restart_next_count[256];
+	uint64_t *restart_accept;
+	uint64_t *restart_eol;
+
+	// Lazily built DFA
+	dfaState *states;
+	unsigned int num_states;
+	unsigned int states_size;
+	int *trans;
+	int *members;
+	unsigned int members_len;
+	unsigned int members_size;
+	uint64_t *accepts;
+	unsigned int accepts_len;
+	unsigned int accepts_size;
+	uint32_t table[2*DFA_MAX_STATES];
+	int begin;
+	unsigned int flushes;
+
+	// Scratch space
+	unsigned int *mark;
+	unsigned int mark_gen;
+	int *stack;
+	int *scratch;
+};
+
+// Abstract syntax tree of a pattern while parsing
+enum ast_type { AST_EMPTY, AST_SET, AST_CAT, AST_ALT, AST_REPEAT, AST_BOL, AST_EOL } __attribute__ ((packed));
+
+typedef struct {
+	enum ast_type type;
+	int left;
+	int right;
+	int min;
+	int max; // -1 = unbounded
+	unsigned int set;
+} astNode;
+
+typedef struct {
+	regexSet *set;
+	const unsigned char *re;
+	astNode *nodes;
+	unsigned int count;
+	unsigned int size;
+	unsigned int depth;
+	unsigned int nfa_base;
+} parseCtx;
+
+static inline bool charset_has(const charSet *cs, const unsigned char c)
+{
+	return (cs->bits[c >> 6] >> (c & 63u)) & 1u;
+}
+
+static inline void charset_add(charSet *cs, const unsigned char c)
+{
+	cs->bits[c >> 6] |= 1ull << (c & 63u);
+}
+
+static uint32_t __attribute__ ((pure)) hash_ints(const int *v, const unsigned int n)
+{
+	// FNV-1a
+	uint32_t hash = 2166136261u;
+	for(unsigned int i = 0; i < n; i++)
+	{
+		hash ^= (uint32_t)v[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+// Store a character set, identical sets are stored only once
+static int add_charset(regexSet *set, const charSet *cs)
+{
+	// The table is kept at most half full
+	if(2u*(set->num_charsets + 1u) > set->charsets_size)
+	{
+		const unsigned int size = set->charsets_size > 0 ? 2u*set->charsets_size : 64u;
+		charSet *charsets = realloc(set->charsets, size*sizeof(charSet));
+		uint32_t *table = calloc(size, sizeof(uint32_t));
+		if(charsets == NULL || table == NULL)
+		{
+			if(charsets != NULL)
+				set->charsets = charsets;
+			if(table != NULL)
+				free(table);
+			return -1;
+		}
+		set->charsets = charsets;
+		if(set->charset_table != NULL)
+			free(set->charset_table);
+		set->charset_table = table;
+		set->charsets_size = size;
+		for(unsigned int i = 0; i < set->num_charsets; i++)
+		{
+			uint32_t j = hash_ints((const int*)set->charsets[i].bits, 8u) & (size - 1u);
+			while(table[j] != 0)
+				j = (j + 1u) & (size - 1u);
+			table[j] = i + 1u;
+		}
+	}
+
+	const uint32_t mask = set->charsets_size - 1u;
+	uint32_t j = hash_ints((const int*)cs->bits, 8u) & mask;
+	for(; set->charset_table[j] != 0; j = (j + 1u) & mask)
+	{
+		const unsigned int i = set->charset_table[j] - 1u;
+		if(memcmp(&set->charsets[i], cs, sizeof(charSet)) == 0)
+			return i;
+	}
+	set->charsets[set->num_charsets] = *cs;
+	set->charset_table[j] = ++set->num_charsets;
+	return set->num_charsets - 1;
+}
+
+static int new_node(parseCtx *ctx, const enum ast_type type, const int left, const int right)
+{
+	if(ctx->count == ctx->size)
+	{
+		const unsigned int size = ctx->size > 0 ? 2u*ctx->size : 64u;
+		astNode *nodes = realloc(ctx->nodes, size*sizeof(astNode));
+		if(nodes == NULL)
+			return -1;
+		ctx->nodes = nodes;
+		ctx->size = size;
+	}
+	astNode *node = &ctx->nodes[ctx->count];
+	node->type = type;
+	node->left = left;
+	node->right = right;
+	node->min = 0;
+	node->max = 0;
+	node->set = 0;
+	return ctx->count++;
+}
+
+// Add a character set node. Patterns are matched case-insensitively, hence, the
+// set is extended by the other case of all letters before it is (optionally)
+// inverted. This is what TRE does for REG_ICASE
+static int set_node(parseCtx *ctx, charSet *cs, const bool negate)
+{
+	for(unsigned int c = 0; c < 256; c++)
+	{
+		if(!charset_has(cs, c))
+			continue;
+		if(isupper(c))
+			charset_add(cs, tolower(c));
+		else if(islower(c))
+			charset_add(cs, toupper(c));
+	}
+	if(negate)
+		for(unsigned int i = 0; i < 4; i++)
+			cs->bits[i] = ~cs->bits[i];
+
+	const int id = add_charset(ctx->set, cs);
+	if(id < 0)
+		return -1;
+	const int node = new_node(ctx, AST_SET, -1, -1);
+	if(node < 0)
+		return -1;
+	ctx->nodes[node].set = id;
+	return node;
+}
+
+static int literal_node(parseCtx *ctx, const unsigned char c)
+{
+	charSet cs = {{ 0 }};
+	charset_add(&cs, c);
+	return set_node(ctx, &cs, false);
+}
+
+// Escaped characters are the only ones TRE matches case-sensitively
+static int escaped_node(parseCtx *ctx, const unsigned char c)
+{
+	charSet cs = {{ 0 }};
+	charset_add(&cs, c);
+	const int id = add_charset(ctx->set, &cs);
+	const int node = id < 0 ? -1 : new_node(ctx, AST_SET, -1, -1);
+	if(node > -1)
+		ctx->nodes[node].set = id;
+	return node;
+}
+
+// Character classes as known to TRE
+static bool add_class(charSet *cs, const char *name, const size_t len)
+{
+	static const struct {
+		const char *name;
+		int (*func)(int);
+	} classes[] = {
+		{ "alnum", isalnum }, { "alpha", isalpha }, { "blank", isblank },
+		{ "cntrl", iscntrl }, { "digit", isdigit }, { "graph", isgraph },
+		{ "lower", islower }, { "print", isprint }, { "punct", ispunct },
+		{ "space", isspace }, { "upper", isupper }, { "xdigit", isxdigit }
+	};
+
+	for(unsigned int i = 0; i < sizeof(classes)/sizeof(classes[0]); i++)
+	{
+		if(strlen(classes[i].name) != len || strncmp(classes[i].name, name, len) != 0)
+			continue;
+		for(unsigned int c = 0; c < 256; c++)
+			if(classes[i].func(c))
+				charset_add(cs, c);
+		return true;
+	}
+	return false;
+}
+
+// Parse a bracket expression, the opening bracket has already been consumed
+static int parse_bracket(parseCtx *ctx)
+{
+	charSet cs = {{ 0 }};
+	bool negate = false;
+	const unsigned char *re = ctx->re;
+	if(*re == '^')
+	{
+		negate = true;
+		re++;
+	}
+
+	const unsigned char *start = re;
+	while(true)
+	{
+		if(*re == '\0')
+			return -1;
+		else if(*re == ']' && re > start)
+		{
+			re++;
+			break;
+		}
+		else if(re[1] == '-' && re[2] != '\0' && re[2] != ']')
+		{
+			// Range
+			if(re[0] > re[2])
+				return -1;
+			for(unsigned int c = re[0]; c <= re[2]; c++)
+				charset_add(&cs, c);
+			re += 3;
+		}
+		else if(re[0] == '[' && (re[1] == '.' || re[1] == '='))
+		{
+			// Collating elements and equivalence classes are not
+			// supported by TRE
+			return -1;
+		}
+		else if(re[0] == '[' && re[1] == ':')
+		{
+			// Character class
+			const unsigned char *end = re + 2;
+			while(*end != '\0' && *end != ':')
+				end++;
+			if(end[0] != ':' || end[1] != ']' ||
+			   !add_class(&cs, (const char*)re + 2, end - re - 2))
+				return -1;
+			re = end + 2;
+		}
+		else
+		{
+			// Two ranges must not share an endpoint
+			if(*re == '-' && re[1] != ']' && re != start)
+				return -1;
+			charset_add(&cs, *re++);
+		}
+	}
+
+	ctx->re = re;
+	return set_node(ctx, &cs, negate);
+}
+
+static int parse_alt(parseCtx *ctx);
+
+static int parse_atom(parseCtx *ctx)
+{
+	const unsigned char c = *ctx->re;
+	switch(c)
+	{
+		case '\0':
+		case '|':
+			// Empty expression
+			return new_node(ctx, AST_EMPTY, -1, -1);
+
+		case '*':
+		case '+':
+		case '?':
+		case '{':
+			// Repetition of nothing
+			return -1;
+
+		case '(':
+		{
+			// "(?...)" extensions are not supported
+			if(ctx->re[1] == '?' || ++ctx->depth > PATTERN_MAX_DEPTH)
+				return -1;
+			ctx->re++;
+			const int node = parse_alt(ctx);
+			if(node < 0 || *ctx->re != ')')
+				return -1;
+			ctx->re++;
+			ctx->depth--;
+			return node;
+		}
+
+		case ')':
+			// Empty expression closing the current group, otherwise
+			// this is a literal
+			if(ctx->depth > 0)
+				return new_node(ctx, AST_EMPTY, -1, -1);
+			ctx->re++;
+			return literal_node(ctx, c);
+
+		case '[':
+			ctx->re++;
+			return parse_bracket(ctx);
+
+		case '.':
+		{
+			charSet cs;
+			memset(&cs, 0xff, sizeof(cs));
+			ctx->re++;
+			return set_node(ctx, &cs, false);
+		}
+
+		case '^':
+			ctx->re++;
+			return new_node(ctx, AST_BOL, -1, -1);
+
+		case '$':
+			ctx->re++;
+			return new_node(ctx, AST_EOL, -1, -1);
+
+		case '\\':
+		{
+			const unsigned char e = ctx->re[1];
+			charSet cs = {{ 0 }};
+			bool negate = false;
+			if(e == '\0')
+				return -1;
+			ctx->re += 2;
+			switch(e)
+			{
+				// Macros known to TRE
+				case 't': return literal_node(ctx, '\t');
+				case 'n': return literal_node(ctx, '\n');
+				case 'r': return literal_node(ctx, '\r');
+				case 'f': return literal_node(ctx, '\f');
+				case 'a': return literal_node(ctx, '\a');
+				case 'e': return literal_node(ctx, '\033');
+				case 'W':
+					negate = true;
+					// fall through
+				case 'w':
+					add_class(&cs, "alnum", 5);
+					charset_add(&cs, '_');
+					return set_node(ctx, &cs, negate);
+				case 'S':
+					negate = true;
+					// fall through
+				case 's':
+					add_class(&cs, "space", 5);
+					return set_node(ctx, &cs, negate);
+				case 'D':
+					negate = true;
+					// fall through
+				case 'd':
+					add_class(&cs, "digit", 5);
+					return set_node(ctx, &cs, negate);
+
+				// Word boundaries, hexadecimal characters and literal
+				// mode are not supported
+				case 'b':
+				case 'B':
+				case '<':
+				case '>':
+				case 'x':
+				case 'Q':
+					return -1;
+
+				default:
+					// Back references are not supported
+					if(isdigit(e))
+						return -1;
+					// Escaped character
+					return escaped_node(ctx, e);
+			}
+		}
+
+		default:
+			ctx->re++;
+			return literal_node(ctx, c);
+	}
+}
+
+static int parse_int(parseCtx *ctx)
+{
+	if(!isdigit(*ctx->re))
+		return -1;
+	int value = 0;
+	while(isdigit(*ctx->re))
+	{
+		if(value <= PATTERN_DUP_MAX)
+			value = 10*value + (*ctx->re - '0');
+		ctx->re++;
+	}
+	return value;
+}
+
+static int parse_piece(parseCtx *ctx)
+{
+	int atom = parse_atom(ctx);
+	while(atom > -1 && (*ctx->re == '*' || *ctx->re == '+' ||
+	                    *ctx->re == '?' || *ctx->re == '{'))
+	{
+		// Anchors and empty expressions cannot be repeated
+		const enum ast_type type = ctx->nodes[atom].type;
+		if(type == AST_BOL || type == AST_EOL || type == AST_EMPTY)
+			return -1;
+
+		int min = 0, max = -1;
+		const unsigned char c = *ctx->re++;
+		if(c == '+')
+			min = 1;
+		else if(c == '?')
+			max = 1;
+		else if(c == '{')
+		{
+			// Bound "{n}", "{n,}" or "{n,m}"
+			min = parse_int(ctx);
+			max = min;
+			if(*ctx->re == ',')
+			{
+				ctx->re++;
+				max = isdigit(*ctx->re) ? parse_int(ctx) : -1;
+			}
+			if(min < 0 || *ctx->re != '}' || min > PATTERN_DUP_MAX ||
+			   max > PATTERN_DUP_MAX || (max > -1 && min > max))
+				return -1;
+			ctx->re++;
+		}
+
+		// Minimal repetitions match the same strings as greedy ones.
+		// TRE rejects "**", "*+", "{1}*", etc.
+		if(*ctx->re == '?')
+			ctx->re++;
+		else if(*ctx->re == '*' || *ctx->re == '+')
+			return -1;
+
+		const int node = new_node(ctx, AST_REPEAT, atom, -1);
+		if(node < 0)
+			return -1;
+		ctx->nodes[node].min = min;
+		ctx->nodes[node].max = max;
+		atom = node;
+	}
+	return atom;
+}
+
+static int parse_branch(parseCtx *ctx)
+{
+	int result = new_node(ctx, AST_EMPTY, -1, -1);
+	bool empty = true;
+	while(result > -1 && *ctx->re != '\0' && *ctx->re != '|' &&
+	      !(*ctx->re == ')' && ctx->depth > 0))
+	{
+		const int piece = parse_piece(ctx);
+		if(piece < 0)
+			return -1;
+		result = empty ? piece : new_node(ctx, AST_CAT, result, piece);
+		empty = false;
+	}
+	return result;
+}
+
+static int parse_alt(parseCtx *ctx)
+{
+	int left = parse_branch(ctx);
+	while(left > -1 && *ctx->re == '|')
+	{
+		ctx->re++;
+		const int right = parse_branch(ctx);
+		if(right < 0)
+			return -1;
+		left = new_node(ctx, AST_ALT, left, right);
+	}
+	return left;
+}
+
+static int new_state(parseCtx *ctx, const enum nfa_type type, const unsigned int arg,
+                     const int out, const int out1)
+{
+	regexSet *set = ctx->set;
+	if(set->nfa_count - ctx->nfa_base >= PATTERN_MAX_STATES)
+		return -1;
+	if(set->nfa_count == set->nfa_size)
+	{
+		const unsigned int size = set->nfa_size > 0 ? 2u*set->nfa_size : 256u;
+		nfaState *nfa = realloc(set->nfa, size*sizeof(nfaState));
+		if(nfa == NULL)
+			return -1;
+		set->nfa = nfa;
+		set->nfa_size = size;
+	}
+	nfaState *state = &set->nfa[set->nfa_count];
+	state->type = type;
+	state->arg = arg;
+	state->out = out;
+	state->out1 = out1;
+	return set->nfa_count++;
+}
+
+// Generate the NFA for an AST node. The NFA is built backwards, out is the
+// state following the node. Returns the first state of the node
+static int gen(parseCtx *ctx, const int node, const int out)
+{
+	// Copy the node as the array is not modified but new_state() may move
+	// the NFA
+	const astNode n = ctx->nodes[node];
+	switch(n.type)
+	{
+		case AST_EMPTY:
+			return out;
+		case AST_SET:
+			return new_state(ctx, NFA_CHAR, n.set, out, -1);
+		case AST_BOL:
+			return new_state(ctx, NFA_BOL, 0, out, -1);
+		case AST_EOL:
+			return new_state(ctx, NFA_EOL, 0, out, -1);
+		case AST_CAT:
+		{
+			const int right = gen(ctx, n.right, out);
+			return right < 0 ? -1 : gen(ctx, n.left, right);
+		}
+		case AST_ALT:
+		{
+			const int left = gen(ctx, n.left, out);
+			const int right = left < 0 ? -1 : gen(ctx, n.right, out);
+			return right < 0 ? -1 : new_state(ctx, NFA_SPLIT, 0, left, right);
+		}
+		case AST_REPEAT:
+		{
+			int r = out, min = n.min;
+			if(n.max < 0)
+			{
+				// Loop back from the end of the child to its start
+				const int loop = new_state(ctx, NFA_SPLIT, 0, -1, out);
+				const int start = loop < 0 ? -1 : gen(ctx, n.left, loop);
+				if(start < 0)
+					return -1;
+				ctx->set->nfa[loop].out = start;
+				if(min == 0)
+					return loop;
+				r = start;
+				min--;
+			}
+			else
+			{
+				// Optional copies of the child
+				for(int i = min; i < n.max; i++)
+				{
+					const int start = gen(ctx, n.left, r);
+					r = start < 0 ? -1 : new_state(ctx, NFA_SPLIT, 0, start, out);
+					if(r < 0)
+						return -1;
+				}
+			}
+			// Mandatory copies of the child
+			for(int i = 0; i < min && r > -1; i++)
+				r = gen(ctx, n.left, r);
+			return r;
+		}
+	}
+	return -1;
+}
+
+regexSet *regex_set_new(void)
+{
+	regexSet *set = calloc(1, sizeof(regexSet));
+	if(set != NULL)
+		set->begin = -1;
+	return set;
+}
+
+// Free everything derived from the NFA
+static void free_dfa(regexSet *set)
+{
+	void **ptrs[] = { (void**)&set->restart, (void**)&set->restart_accept,
+	                  (void**)&set->restart_eol, (void**)&set->states,
+	                  (void**)&set->trans, (void**)&set->members,
+	                  (void**)&set->accepts, (void**)&set->mark,
+	                  (void**)&set->stack, (void**)&set->scratch };
+	for(unsigned int i = 0; i < sizeof(ptrs)/sizeof(ptrs[0]); i++)
+	{
+		if(*ptrs[i] != NULL)
+			free(*ptrs[i]);
+		*ptrs[i] = NULL;
+	}
+	for(unsigned int i = 0; i < 256; i++)
+	{
+		if(set->restart_next[i] != NULL)
+			free(set->restart_next[i]);
+		set->restart_next[i] = NULL;
+	}
+	set->num_states = set->states_size = 0;
+	set->members_len = set->members_size = 0;
+	set->accepts_len = set->accepts_size = 0;
+	set->begin = -1;
+}
+
+void regex_set_free(regexSet *set)
+{
+	if(set == NULL)
+		return;
+	free_dfa(set);
+	if(set->nfa != NULL)
+		free(set->nfa);
+	if(set->starts != NULL)
+		free(set->starts);
+	if(set->charsets != NULL)
+		free(set->charsets);
+	if(set->charset_table != NULL)
+		free(set->charset_table);
+	free(set);
+}
+
+// Try to add a pattern to the set. Returns false if the pattern uses features
+// not supported here, it has to be matched by TRE in this case
+bool regex_set_add(regexSet *set, const char *pattern, const unsigned int id)
+{
+	if(strlen(pattern) > PATTERN_MAX_LENGTH)
+		return false;
+
+	parseCtx ctx = { .set = set, .re = (const unsigned char*)pattern, .nfa_base = set->nfa_count };
+	const int root = parse_alt(&ctx);
+	int start = -1;
+	if(root > -1 && *ctx.re == '\0')
+	{
+		const int match = new_state(&ctx, NFA_MATCH, id, -1, -1);
+		start = match < 0 ? -1 : gen(&ctx, root, match);
+	}
+	if(ctx.nodes != NULL)
+		free(ctx.nodes);
+
+	if(start > -1 && set->num_starts == set->starts_size)
+	{
+		const unsigned int size = set->starts_size > 0 ? 2u*set->starts_size : 64u;
+		int *starts = realloc(set->starts, size*sizeof(int));
+		if(starts != NULL)
+		{
+			set->starts = starts;
+			set->starts_size = size;
+		}
+		else
+			start = -1;
+	}
+
+	if(start < 0)
+	{
+		// Remove what has been generated for this pattern
+		set->nfa_count = ctx.nfa_base;
+		return false;
+	}
+
+	set->starts[set->num_starts++] = start;
+	if(id >= set->patterns)
+		set->patterns = id + 1u;
+	set->dirty = true;
+	return true;
+}
+
+static void next_mark_gen(regexSet *set)
+{
+	if(++set->mark_gen == 0)
+	{
+		memset(set->mark, 0, set->nfa_count*sizeof(unsigned int));
+		set->mark_gen = 1;
+	}
+}
+
+// Add the states reachable from s through epsilon transitions to the scratch
+// list. States already marked in the current generation are skipped. Only
+// states consuming a character, matching or waiting for the end of the input
+// are added
+static void closure(regexSet *set, const int s, const bool bol, unsigned int *n)
+{
+	unsigned int sp = 0;
+	set->stack[sp++] = s;
+	while(sp > 0)
+	{
+		const int i = set->stack[--sp];
+		if(i < 0 || set->mark[i] == set->mark_gen)
+			continue;
+		set->mark[i] = set->mark_gen;
+
+		const nfaState *state = &set->nfa[i];
+		switch(state->type)
+		{
+			case NFA_SPLIT:
+				set->stack[sp++] = state->out1;
+				// fall through
+			case NFA_EPS:
+				set->stack[sp++] = state->out;
+				break;
+			case NFA_BOL:
+				if(bol)
+					set->stack[sp++] = state->out;
+				break;
+			case NFA_CHAR:
+			case NFA_EOL:
+			case NFA_MATCH:
+				set->scratch[(*n)++] = i;
+				break;
+		}
+	}
+}
+
+// Collect the patterns matched when the input ends in a state with the given
+// members
+static void eol_closure(regexSet *set, const int *members, const unsigned int count,
+                        const bool bol, uint64_t *accept)
+{
+	next_mark_gen(set);
+	for(unsigned int k = 0; k < count; k++)
+	{
+		if(set->nfa[members[k]].type != NFA_EOL)
+			continue;
+
+		unsigned int sp = 0;
+		set->stack[sp++] = set->nfa[members[k]].out;
+		while(sp > 0)
+		{
+			const int i = set->stack[--sp];
+			if(i < 0 || set->mark[i] == set->mark_gen)
+				continue;
+			set->mark[i] = set->mark_gen;
+
+			const nfaState *state = &set->nfa[i];
+			switch(state->type)
+			{
+				case NFA_SPLIT:
+					set->stack[sp++] = state->out1;
+					// fall through
+				case NFA_EPS:
+				case NFA_EOL:
+					set->stack[sp++] = state->out;
+					break;
+				case NFA_BOL:
+					if(bol)
+						set->stack[sp++] = state->out;
+					break;
+				case NFA_MATCH:
+					accept[state->arg / 64u] |= 1ull << (state->arg % 64u);
+					break;
+				case NFA_CHAR:
+					break;
+			}
+		}
+	}
+}
+
+static int cmp_int(const void *a, const void *b)
+{
+	return *(const int*)a - *(const int*)b;
+}
+
+// Remove the restart states from the scratch list and sort the remaining ones
+static unsigned int canonical(regexSet *set, unsigned int n)
+{
+	unsigned int m = 0;
+	for(unsigned int k = 0; k < n; k++)
+		if(!set->restart[set->scratch[k]])
+			set->scratch[m++] = set->scratch[k];
+	qsort(set->scratch, m, sizeof(int), cmp_int);
+	return m;
+}
+
+// Store a set of patterns in the accept pool. Returns -1 if the set is empty
+static int store_accept(regexSet *set, const uint64_t *bits)
+{
+	bool empty = true;
+	for(unsigned int i = 0; i < set->words; i++)
+		if(bits[i] != 0)
+			empty = false;
+	if(empty)
+		return -1;
+
+	if(set->accepts_len + set->words > set->accepts_size)
+	{
+		const unsigned int size = set->accepts_size > 0 ? 2u*set->accepts_size : 64u*set->words;
+		uint64_t *accepts = realloc(set->accepts, size*sizeof(uint64_t));
+		if(accepts == NULL)
+			return -2;
+		set->accepts = accepts;
+		set->accepts_size = size;
+	}
+	const int offset = set->accepts_len;
+	memcpy(&set->accepts[offset], bits, set->words*sizeof(uint64_t));
+	set->accepts_len += set->words;
+	return offset;
+}
+
+// Forget the entire DFA, it is built again as needed
+static void flush_dfa(regexSet *set)
+{
+	set->num_states = 0;
+	set->members_len = 0;
+	set->accepts_len = 0;
+	set->begin = -1;
+	memset(set->table, 0, sizeof(set->table));
+	set->flushes++;
+
+	if(config.debug & DEBUG_REGEX)
+		logg("Regex set: DFA exceeded its limits, starting over (%u times)", set->flushes);
+}
+
+// Add a DFA state for the members in the scratch list unless it already exists
+static int add_state(regexSet *set, const unsigned int n, const bool begin)
+{
+	const uint32_t hash = hash_ints(set->scratch, n);
+	const uint32_t mask = sizeof(set->table)/sizeof(set->table[0]) - 1u;
+	uint32_t j = hash & mask;
+	if(!begin)
+	{
+		for(; set->table[j] != 0; j = (j + 1u) & mask)
+		{
+			const dfaState *state = &set->states[set->table[j] - 1u];
+			if(state->hash == hash && state->count == n &&
+			   memcmp(&set->members[state->members], set->scratch, n*sizeof(int)) == 0)
+				return set->table[j] - 1u;
+		}
+	}
+
+	if(set->num_states == DFA_MAX_STATES || set->members_len + n > DFA_MAX_MEMBERS)
+	{
+		flush_dfa(set);
+		j = hash & mask;
+		while(set->table[j] != 0)
+			j = (j + 1u) & mask;
+	}
+
+	// Ensure there is enough space
+	if(set->num_states == set->states_size)
+	{
+		const unsigned int size = set->states_size > 0 ? 2u*set->states_size : 64u;
+		dfaState *states = realloc(set->states, size*sizeof(dfaState));
+		if(states != NULL)
+			set->states = states;
+		int *trans = realloc(set->trans, (size_t)size*set->num_classes*sizeof(int));
+		if(trans != NULL)
+			set->trans = trans;
+		if(states == NULL || trans == NULL)
+			return -1;
+		set->states_size = size;
+	}
+	if(set->members == NULL || set->members_len + n > set->members_size)
+	{
+		unsigned int size = set->members_size > 0 ? 2u*set->members_size : 1024u;
+		while(size < set->members_len + n)
+			size *= 2u;
+		int *members = realloc(set->members, size*sizeof(int));
+		if(members == NULL)
+			return -1;
+		set->members = members;
+		set->members_size = size;
+	}
+
+	const int id = set->num_states;
+	dfaState *state = &set->states[id];
+	state->hash = hash;
+	state->members = set->members_len;
+	state->count = n;
+	memcpy(&set->members[set->members_len], set->scratch, n*sizeof(int));
+	set->members_len += n;
+	memset(&set->trans[(size_t)id*set->num_classes], 0xff, set->num_classes*sizeof(int));
+
+	// Patterns matched in this state
+	uint64_t bits[set->words];
+	memcpy(bits, set->restart_accept, sizeof(bits));
+	const int *members = &set->members[state->members];
+	for(unsigned int k = 0; k < n; k++)
+	{
+		const nfaState *nfa = &set->nfa[members[k]];
+		if(nfa->type == NFA_MATCH)
+			bits[nfa->arg / 64u] |= 1ull << (nfa->arg % 64u);
+	}
+	state->accept = store_accept(set, bits);
+
+	// Patterns matched if the input ends in this state
+	memcpy(bits, set->restart_eol, sizeof(bits));
+	eol_closure(set, members, n, begin, bits);
+	if(begin)
+	{
+		// ^ may still match at the beginning of an empty input
+		unsigned int r = 0;
+		for(unsigned int i = 0; i < set->nfa_count; i++)
+			if(set->restart[i])
+				set->scratch[r++] = i;
+		eol_closure(set, set->scratch, r, true, bits);
+	}
+	state->eol_accept = store_accept(set, bits);
+	if(state->accept < -1 || state->eol_accept < -1)
+		return -1;
+
+	if(!begin)
+		set->table[j] = id + 1u;
+	set->num_states++;
+	return id;
+}
+
+static int begin_state(regexSet *set)
+{
+	next_mark_gen(set);
+	unsigned int n = 0;
+	for(unsigned int i = 0; i < set->num_starts; i++)
+		closure(set, set->starts[i], true, &n);
+	n = canonical(set, n);
+	set->begin = add_state(set, n, true);
+	return set->begin;
+}
+
+// Compute the states reached from the restart states for a class (once)
+static bool restart_next(regexSet *set, const unsigned int cls)
+{
+	if(set->restart_next[cls] != NULL)
+		return true;
+
+	const unsigned char rep = set->class_rep[cls];
+	next_mark_gen(set);
+	unsigned int n = 0;
+	for(unsigned int i = 0; i < set->nfa_count; i++)
+	{
+		const nfaState *state = &set->nfa[i];
+		if(set->restart[i] && state->type == NFA_CHAR &&
+		   charset_has(&set->charsets[state->arg], rep))
+			closure(set, state->out, false, &n);
+	}
+	n = canonical(set, n);
+
+	// Allocate at least one element to tell "empty" from "not computed"
+	set->restart_next[cls] = calloc(n + 1u, sizeof(int));
+	if(set->restart_next[cls] == NULL)
+		return false;
+	memcpy(set->restart_next[cls], set->scratch, n*sizeof(int));
+	set->restart_next_count[cls] = n;
+	return true;
+}
+
+// Compute the transition of a DFA state for a class
+static int dfa_next(regexSet *set, const int from, const unsigned int cls)
+{
+	if(!restart_next(set, cls))
+		return -1;
+
+	const unsigned char rep = set->class_rep[cls];
+	next_mark_gen(set);
+	unsigned int n = 0;
+	const dfaState *state = &set->states[from];
+	for(unsigned int k = 0; k < state->count; k++)
+	{
+		const nfaState *nfa = &set->nfa[set->members[state->members + k]];
+		if(nfa->type == NFA_CHAR && charset_has(&set->charsets[nfa->arg], rep))
+			closure(set, nfa->out, false, &n);
+	}
+	for(unsigned int k = 0; k < set->restart_next_count[cls]; k++)
+	{
+		const int i = set->restart_next[cls][k];
+		if(set->mark[i] != set->mark_gen)
+		{
+			set->mark[i] = set->mark_gen;
+			set->scratch[n++] = i;
+		}
+	}
+	n = canonical(set, n);
+
+	const unsigned int flushes = set->flushes;
+	const int to = add_state(set, n, false);
+	// Remember the transition unless the DFA has been flushed meanwhile
+	if(to > -1 && flushes == set->flushes)
+		set->trans[(size_t)from*set->num_classes + cls] = to;
+	return to;
+}
+
+// Prepare matching after patterns have been added
+static bool finalize(regexSet *set)
+{
+	free_dfa(set);
+	set->words = (set->patterns + 63u) / 64u;
+
+	// Split the input bytes into classes that are treated the same by
+	// every character set
+	memset(set->classes, 0, sizeof(set->classes));
+	set->num_classes = 1;
+	for(unsigned int i = 0; i < set->num_charsets; i++)
+	{
+		int newid[256];
+		memset(newid, 0xff, sizeof(newid));
+		unsigned int num = set->num_classes;
+		for(unsigned int c = 0; c < 256; c++)
+		{
+			if(!charset_has(&set->charsets[i], c))
+				continue;
+			const unsigned char old = set->classes[c];
+			if(newid[old] < 0)
+				newid[old] = num++;
+			set->classes[c] = newid[old];
+		}
+		// Renumber to keep the class IDs small
+		memset(newid, 0xff, sizeof(newid));
+		num = 0;
+		for(unsigned int c = 0; c < 256; c++)
+		{
+			const unsigned char old = set->classes[c];
+			if(newid[old] < 0)
+			{
+				newid[old] = num;
+				set->class_rep[num++] = c;
+			}
+			set->classes[c] = newid[old];
+		}
+		set->num_classes = num;
+	}
+	if(set->num_charsets == 0)
+		set->class_rep[0] = 0;
+
+	set->restart = calloc(set->nfa_count, sizeof(bool));
+	set->restart_accept = calloc(set->words, sizeof(uint64_t));
+	set->restart_eol = calloc(set->words, sizeof(uint64_t));
+	set->mark = calloc(set->nfa_count, sizeof(unsigned int));
+	set->stack = calloc(2u*set->nfa_count + 1u, sizeof(int));
+	set->scratch = calloc(set->nfa_count + 1u, sizeof(int));
+	if(set->restart == NULL || set->restart_accept == NULL || set->restart_eol == NULL ||
+	   set->mark == NULL || set->stack == NULL || set->scratch == NULL)
+	{
+		free_dfa(set);
+		return false;
+	}
+	set->mark_gen = 0;
+
+	// Restart states, they are implicitly part of every DFA state
+	next_mark_gen(set);
+	unsigned int n = 0;
+	for(unsigned int i = 0; i < set->num_starts; i++)
+		closure(set, set->starts[i], false, &n);
+	for(unsigned int k = 0; k < n; k++)
+	{
+		const nfaState *nfa = &set->nfa[set->scratch[k]];
+		set->restart[set->scratch[k]] = true;
+		if(nfa->type == NFA_MATCH)
+			set->restart_accept[nfa->arg / 64u] |= 1ull << (nfa->arg % 64u);
+	}
+	eol_closure(set, set->scratch, n, false, set->restart_eol);
+
+	memset(set->table, 0, sizeof(set->table));
+	set->dirty = false;
+
+	if(config.debug & DEBUG_REGEX)
+		logg("Regex set: %u patterns, %u NFA states, %u character sets, %u byte classes",
+		     set->num_starts, set->nfa_count, set->num_charsets, set->num_classes);
+
+	return true;
+}
+
+static inline void add_accept(const regexSet *set, const int accept, uint64_t *matched)
+{
+	if(accept < 0)
+		return;
+	for(unsigned int i = 0; i < set->words; i++)
+		matched[i] |= set->accepts[accept + i];
+}
+
+// Match the input against all patterns at once. Bit i of matched is set if
+// the pattern with ID i matched. Returns false if matching was not possible
+// (memory allocation failed), the patterns have to be matched by TRE then
+bool regex_set_match(regexSet *set, const char *input, uint64_t *matched, const unsigned int words)
+{
+	memset(matched, 0, words*sizeof(uint64_t));
+	if(set == NULL || set->num_starts == 0)
+		return true;
+	if(set->dirty && !finalize(set))
+		return false;
+	if(words < set->words)
+		return false;
+
+	int state = set->begin > -1 ? set->begin : begin_state(set);
+	if(state < 0)
+		return false;
+	add_accept(set, set->states[state].accept, matched);
+
+	for(const unsigned char *p = (const unsigned char*)input; *p != '\0'; p++)
+	{
+		const unsigned int cls = set->classes[*p];
+		int next = set->trans[(size_t)state*set->num_classes + cls];
+		if(next < 0 && (next = dfa_next(set, state, cls)) < 0)
+			return false;
+		state = next;
+		add_accept(set, set->states[state].accept, matched);
+	}
+	add_accept(set, set->states[state].eol_accept, matched);
+
+	return true;
+}
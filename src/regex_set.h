@@ -0,0 +1,27 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Combined multi-pattern regex matcher prototypes
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+#ifndef REGEX_SET_H
+#define REGEX_SET_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// A set of regular expressions matched together in a single pass over the
+// input. Patterns are compiled into one NFA which is evaluated through a lazily
+// built DFA. Only the subset of POSIX ERE understood by this matcher is added,
+// everything else has to be matched by TRE as before
+typedef struct regexSet regexSet;
+
+regexSet *regex_set_new(void) __attribute__ ((malloc));
+void regex_set_free(regexSet *set);
+bool regex_set_add(regexSet *set, const char *pattern, const unsigned int id);
+bool regex_set_match(regexSet *set, const char *input, uint64_t *matched, const unsigned int words);
+
+#endif //REGEX_SET_H
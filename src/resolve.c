@@ -420,6 +420,16 @@ static void resolveClients(const bool onlynew, const bool force_refreshing)
 		bool newflag = client->flags.new;
 		size_t ippos = client->ippos;
 		size_t oldnamepos = client->namepos;
+		// String positions become invalid when the garbage collection
+		// compacts the shared string buffer
+		const unsigned int compactions = counters->compaction.runs;
+		if(counters->compaction.string_end > 0)
+		{
+			// Strings are being moved right now, try again next time
+			skipped++;
+			unlock_shm();
+			continue;
+		}
 
 		// Only try to resolve host names of clients which were recently active if we are re-resolving
 		// Limit for a "recently active" client is two hours ago
@@ -505,6 +515,14 @@ static void resolveClients(const bool onlynew, const bool force_refreshing)
 			continue;
 		}
 
+		// Try again next time if strings have been moved in the meantime
+		if(counters->compaction.runs != compactions)
+		{
+			skipped++;
+			unlock_shm();
+			continue;
+		}
+
 		// Store obtained host name (may be unchanged)
 		client->namepos = newnamepos;
 		// Mark entry as not new
@@ -550,6 +568,16 @@ static void resolveUpstreams(const bool onlynew)
 		bool newflag = upstream->new;
 		size_t ippos = upstream->ippos;
 		size_t oldnamepos = upstream->namepos;
+		// String positions become invalid when the garbage collection
+		// compacts the shared string buffer
+		const unsigned int compactions = counters->compaction.runs;
+		if(counters->compaction.string_end > 0)
+		{
+			// Strings are being moved right now, try again next time
+			skipped++;
+			unlock_shm();
+			continue;
+		}
 
 		// Only try to resolve host names of upstream servers which were recently active
 		// Limit for a "recently active" upstream server is two hours ago
@@ -596,6 +624,14 @@ static void resolveUpstreams(const bool onlynew)
 			continue;
 		}
 
+		// Try again next time if strings have been moved in the meantime
+		if(counters->compaction.runs != compactions)
+		{
+			skipped++;
+			unlock_shm();
+			continue;
+		}
+
 		// Store obtained host name (may be unchanged)
 		upstream->namepos = newnamepos;
 		// Mark entry as not new
@@ -18,6 +18,8 @@
 #include "datastructure.h"
 // get_num_regex()
 #include "regex_r.h"
+// timer_elapsed_msec()
+#include "timers.h"
 // NAME_MAX
 #include <limits.h>
 // gettid
@@ -30,7 +32,7 @@
 #include "database/message-table.h"
 
 /// The version of shared memory used
-#define SHARED_MEMORY_VERSION 14
+#define SHARED_MEMORY_VERSION 30
 
 /// The name of the shared memory. Use this when connecting to the shared memory.
 #define SHMEM_PATH "/dev/shm"
@@ -42,9 +44,18 @@
 #define SHARED_QUERIES_NAME "FTL-queries"
 #define SHARED_UPSTREAMS_NAME "FTL-upstreams"
 #define SHARED_OVERTIME_NAME "FTL-overTime"
+#define SHARED_CLIENTS_OVERTIME_NAME "FTL-clients-overTime"
 #define SHARED_SETTINGS_NAME "FTL-settings"
 #define SHARED_DNS_CACHE "FTL-dns-cache"
-#define SHARED_PER_CLIENT_REGEX "FTL-per-client-regex"
+#define SHARED_GROUPSET_REGEX "FTL-groupset-regex"
+#define SHARED_GROUPSETS_NAME "FTL-groupsets"
+#define SHARED_DOMAIN_REGEX "FTL-domain-regex"
+#define SHARED_DOMAINS_HASH_NAME "FTL-domains-hash"
+#define SHARED_CLIENTS_HASH_NAME "FTL-clients-hash"
+#define SHARED_QUERIES_HASH_NAME "FTL-queries-hash"
+#define SHARED_DNS_CACHE_HASH_NAME "FTL-dns-cache-hash"
+#define SHARED_STRINGS_HASH_NAME "FTL-strings-hash"
+#define SHARED_RATE_LIMIT_NAME "FTL-rate-limit"
 
 // Allocation step for FTL-strings bucket. This is somewhat special as we use
 // this as a general-purpose storage which should always be large enough. If,
@@ -65,9 +76,18 @@ static SharedMemory shm_clients = { 0 };
 static SharedMemory shm_queries = { 0 };
 static SharedMemory shm_upstreams = { 0 };
 static SharedMemory shm_overTime = { 0 };
+static SharedMemory shm_clients_overTime = { 0 };
 static SharedMemory shm_settings = { 0 };
 static SharedMemory shm_dns_cache = { 0 };
-static SharedMemory shm_per_client_regex = { 0 };
+static SharedMemory shm_groupset_regex = { 0 };
+static SharedMemory shm_groupsets = { 0 };
+static SharedMemory shm_domain_regex = { 0 };
+static SharedMemory shm_domains_hash = { 0 };
+static SharedMemory shm_clients_hash = { 0 };
+static SharedMemory shm_queries_hash = { 0 };
+static SharedMemory shm_dns_cache_hash = { 0 };
+static SharedMemory shm_strings_hash = { 0 };
+static SharedMemory shm_rate_limit = { 0 };
 
 static SharedMemory *sharedMemories[] = { &shm_lock,
                                           &shm_strings,
@@ -77,9 +97,18 @@ static SharedMemory *sharedMemories[] = { &shm_lock,
                                           &shm_queries,
                                           &shm_upstreams,
                                           &shm_overTime,
+                                          &shm_clients_overTime,
                                           &shm_settings,
                                           &shm_dns_cache,
-                                          &shm_per_client_regex };
+                                          &shm_groupset_regex,
+                                          &shm_groupsets,
+                                          &shm_domain_regex,
+                                          &shm_domains_hash,
+                                          &shm_clients_hash,
+                                          &shm_queries_hash,
+                                          &shm_dns_cache_hash,
+                                          &shm_strings_hash,
+                                          &shm_rate_limit };
 #define NUM_SHMEM (sizeof(sharedMemories)/sizeof(SharedMemory*))
 
 // Variable size array structs
@@ -88,18 +117,35 @@ static clientsData *clients = NULL;
 static domainsData *domains = NULL;
 static upstreamsData *upstreams = NULL;
 static DNSCacheData *dns_cache = NULL;
+static groupsetsData *groupsets = NULL;
+// Per-client overTime data. This is a column-major matrix with one row of
+// clients_MAX entries per overTime slot
+static int *clientsOverTime = NULL;
+
+// Entry of an open-addressing hash index. The full hash is stored alongside
+// the ID so most non-matching entries can be skipped without dereferencing
+// the object they point to. Unused slots have a negative ID
+typedef struct {
+	uint32_t hash;
+	int id;
+} hashEntry;
+ASSERT_SIZEOF(hashEntry, 8, 8, 8);
 
 typedef struct {
 	struct {
 		pthread_mutex_t outer;
 		pthread_mutex_t inner;
+		pthread_rwlock_t rw;
 	} lock;
 	struct {
 		volatile pid_t pid;
 		volatile pid_t tid;
 	} owner;
+	volatile bool writer;
 } ShmLock;
 static ShmLock *shmLock = NULL;
+// Whether the current thread holds the shared (read-only) SHM lock
+static __thread bool read_locked = false;
 static ShmSettings *shmSettings = NULL;
 
 static int pagesize;
@@ -109,6 +155,18 @@ static size_t get_optimal_object_size(const size_t objsize, const size_t minsize
 
 // Private prototypes
 static void *enlarge_shmem_struct(const char type);
+static void ensure_domain_hash_size(void);
+static void ensure_client_hash_size(void);
+static void ensure_query_hash_size(void);
+static void ensure_dns_cache_hash_size(void);
+static void rebuild_domain_hash(void);
+static void rebuild_dns_cache_hash(void);
+static int lookup_string_hash(const char *str, const uint32_t hash) __attribute__ ((pure));
+static void add_string_hash(const size_t pos);
+static void ensure_string_hash_size(void);
+static void rebuild_string_hash(void);
+static void enlarge_clients_overTime(const int oldMAX);
+static void clear_domain_regex(const int from, const int to);
 
 static int get_dev_shm_usage(char buffer[64])
 {
@@ -176,12 +234,18 @@ static char *__attribute__ ((malloc)) str_replace(const char *input,
 	return copy;
 }
 
+// Check if a string contains characters which have to be escaped
+static bool __attribute__ ((pure)) str_needs_escape(const char *input)
+{
+	return strchr(input, ' ') != NULL;
+}
+
 char *__attribute__ ((malloc)) str_escape(const char *input, unsigned int *N)
 {
 	// If no escaping is done, this routine returns the original pointer
 	// and N stays 0
 	*N = 0;
-	if(strchr(input, ' ') != NULL)
+	if(str_needs_escape(input))
 	{
 		// Replace any spaces by ~ if we find them in the domain name
 		// This is necessary as our telnet API uses space delimiters
@@ -228,8 +292,20 @@ size_t addstr(const char *input)
 		return 0;
 	}
 
+	// Most strings do not contain any characters that need to be escaped,
+	// only copy the string if they do
+	char *copy = NULL;
+	const char *str = input;
+	unsigned int N = 0;
+	if(str_needs_escape(input))
+	{
+		str = copy = str_escape(input, &N);
+		if(copy == NULL)
+			return 0;
+	}
+
 	// Get string length, add terminating character
-	size_t len = strlen(input) + 1;
+	size_t len = strlen(str) + 1;
 	const size_t avail_mem = shm_strings.size - shmSettings->next_str_pos;
 
 	// If this is an empty string (only the terminating character is present),
@@ -251,25 +327,52 @@ size_t addstr(const char *input)
 		len = avail_mem;
 	}
 
-	unsigned int N = 0;
-	char *str = str_escape(input, &N);
-
 	if(N > 0)
 		logg("INFO: FTL escaped %u characters in \"%s\"", N, str);
 
+	// A shortened string is looked up in the form it is stored in, otherwise
+	// it would never match its stored copy
+	if(str[len - 1] != '\0')
+	{
+		if(copy == NULL && (str = copy = strdup(input)) == NULL)
+			return 0;
+		copy[len - 1] = '\0';
+	}
+
+	// Identical strings are stored only once. Strings which compact_strings()
+	// has yet to move are not reused as it would miss the new position
+	const int known = lookup_string_hash(str, hashStr(str));
+	if(known > -1 && ((unsigned int)known < counters->compaction.string_cursor ||
+	                  (unsigned int)known >= counters->compaction.string_end))
+	{
+		if(config.debug & DEBUG_SHMEM)
+			logg("Reusing \"%s\" at position %i", str, known);
+		if(copy != NULL)
+			free(copy);
+		return known;
+	}
+
 	// Debugging output
 	if(config.debug & DEBUG_SHMEM)
 		logg("Adding \"%s\" (len %zu) to buffer. next_str_pos is %u", str, len, shmSettings->next_str_pos);
 
-	// Copy the C string pointed by str into the shared string buffer
-	strncpy(&((char*)shm_strings.ptr)[shmSettings->next_str_pos], str, len);
-	free(str);
+	// Copy the C string pointed by str into the shared string buffer. Ensure
+	// it is terminated even if it had to be shortened
+	const size_t pos = shmSettings->next_str_pos;
+	char *dest = &((char*)shm_strings.ptr)[pos];
+	strncpy(dest, str, len);
+	dest[len - 1] = '\0';
+	if(copy != NULL)
+		free(copy);
 
 	// Increment string length counter
 	shmSettings->next_str_pos += len;
 
+	// Add string to the hash index
+	add_string_hash(pos);
+
 	// Return start of stored string
-	return (shmSettings->next_str_pos - len);
+	return pos;
 }
 
 const char *getstr(const size_t pos)
@@ -284,6 +387,869 @@ const char *getstr(const size_t pos)
 	}
 }
 
+// 32-bit FNV-1a hash of a string
+uint32_t __attribute__ ((pure)) hashStr(const char *s)
+{
+	uint32_t hash = 2166136261u;
+	while(*s)
+	{
+		hash ^= (unsigned char)*s++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+// 32-bit FNV-1a hash of a binary buffer
+static uint32_t __attribute__ ((pure)) hashBytes(const void *buf, const size_t len)
+{
+	const unsigned char *p = buf;
+	uint32_t hash = 2166136261u;
+	for(size_t i = 0; i < len; i++)
+	{
+		hash ^= p[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+// Hash a client address. Identifiers which are not IP addresses are hashed
+// by their string representation
+static uint32_t __attribute__ ((pure)) hashClient(const clientAddr *addr, const char *client)
+{
+	switch(addr->family)
+	{
+		case AF_INET:
+			return hashBytes(&addr->addr.in, sizeof(addr->addr.in));
+		case AF_INET6:
+			return hashBytes(&addr->addr.in6, sizeof(addr->addr.in6));
+		default:
+			return hashStr(client);
+	}
+}
+
+// Reset all slots of a hash index to unused
+static void clear_hash(SharedMemory *sharedMemory)
+{
+	hashEntry *table = (hashEntry*)sharedMemory->ptr;
+	const size_t size = sharedMemory->size / sizeof(hashEntry);
+	for(size_t i = 0; i < size; i++)
+	{
+		table[i].hash = 0u;
+		table[i].id = -1;
+	}
+}
+
+// Store an ID in a hash index using linear probing. The index size is always
+// a power of two and the index is never more than half full so there is
+// always a free slot to be found
+static void insert_hash(SharedMemory *sharedMemory, const uint32_t hash, const int id)
+{
+	hashEntry *table = (hashEntry*)sharedMemory->ptr;
+	const size_t mask = sharedMemory->size / sizeof(hashEntry) - 1u;
+	size_t i = hash & mask;
+	while(table[i].id > -1)
+		i = (i + 1u) & mask;
+	table[i].hash = hash;
+	table[i].id = id;
+}
+
+// Remove an ID from a hash index. Entries following the removed one in the
+// same probe sequence are shifted back so no tombstones are needed
+static void remove_hash(SharedMemory *sharedMemory, const uint32_t hash, const int id)
+{
+	hashEntry *table = (hashEntry*)sharedMemory->ptr;
+	const size_t mask = sharedMemory->size / sizeof(hashEntry) - 1u;
+
+	// Find the entry to be removed
+	size_t i = hash & mask;
+	while(table[i].id != id)
+	{
+		// Not in the index
+		if(table[i].id < 0)
+			return;
+		i = (i + 1u) & mask;
+	}
+
+	// Backward-shift deletion: move entries into the gap unless their
+	// home slot lies cyclically between the gap and their position
+	for(size_t j = (i + 1u) & mask; table[j].id > -1; j = (j + 1u) & mask)
+	{
+		const size_t home = table[j].hash & mask;
+		if(i <= j ? (i < home && home <= j) : (i < home || home <= j))
+			continue;
+		table[i] = table[j];
+		i = j;
+	}
+
+	table[i].hash = 0u;
+	table[i].id = -1;
+}
+
+// Double the size of a hash index. The caller has to re-insert all entries
+// afterwards as their positions depend on the size of the index
+static void enlarge_hash(SharedMemory *sharedMemory, int *counter)
+{
+	realloc_shm(sharedMemory, 2u*(*counter), sizeof(hashEntry), true);
+	*counter *= 2;
+	clear_hash(sharedMemory);
+}
+
+int lookup_domain_hash(const char *domain, const uint32_t hash)
+{
+	const hashEntry *table = (hashEntry*)shm_domains_hash.ptr;
+	const size_t mask = shm_domains_hash.size / sizeof(hashEntry) - 1u;
+	for(size_t i = hash & mask; table[i].id > -1; i = (i + 1u) & mask)
+	{
+		// Quick test: Does the hash match?
+		if(table[i].hash != hash)
+			continue;
+
+		// Get domain pointer
+		const domainsData *dom = getDomain(table[i].id, true);
+
+		// If so, compare the full domain using strcmp
+		if(dom != NULL && strcmp(getstr(dom->domainpos), domain) == 0)
+			return table[i].id;
+	}
+
+	// Not found
+	return -1;
+}
+
+void add_domain_hash(const int domainID)
+{
+	// More than one domain may be added while holding the lock (e.g. during
+	// CNAME inspection or when importing the history from the database)
+	ensure_domain_hash_size();
+
+	// Hash the stored string as it may have been escaped by addstr()
+	insert_hash(&shm_domains_hash, hashStr(getstr(domains[domainID].domainpos)), domainID);
+}
+
+static int lookup_string_hash(const char *str, const uint32_t hash)
+{
+	const char *buffer = (const char*)shm_strings.ptr;
+	const hashEntry *table = (hashEntry*)shm_strings_hash.ptr;
+	const size_t mask = shm_strings_hash.size / sizeof(hashEntry) - 1u;
+	for(size_t i = hash & mask; table[i].id > -1; i = (i + 1u) & mask)
+	{
+		// Quick test: Does the hash match?
+		if(table[i].hash != hash)
+			continue;
+
+		// If so, compare the full string
+		if(strcmp(&buffer[table[i].id], str) == 0)
+			return table[i].id;
+	}
+
+	// Not found
+	return -1;
+}
+
+static void add_string_hash(const size_t pos)
+{
+	ensure_string_hash_size();
+	insert_hash(&shm_strings_hash, hashStr(getstr(pos)), (int)pos);
+	counters->strings++;
+}
+
+// Re-index all strings. They are stored consecutively in the buffer, starting
+// after the empty string at position zero, with zeroed gaps in between
+static void rebuild_string_hash(void)
+{
+	clear_hash(&shm_strings_hash);
+	counters->strings = 0;
+	const char *buffer = (const char*)shm_strings.ptr;
+	for(size_t pos = 1; pos < shmSettings->next_str_pos; pos += strlen(&buffer[pos]) + 1)
+	{
+		// Skip gaps left behind by compact_strings()
+		if(buffer[pos] == '\0')
+			continue;
+		insert_hash(&shm_strings_hash, hashStr(&buffer[pos]), (int)pos);
+		counters->strings++;
+	}
+}
+
+// Keep the string hash index at most half full, rebuild it after resizing
+static void ensure_string_hash_size(void)
+{
+	if(2*(counters->strings + 1) <= counters->strings_hash_MAX)
+		return;
+
+	enlarge_hash(&shm_strings_hash, &counters->strings_hash_MAX);
+	rebuild_string_hash();
+}
+
+int lookup_client_hash(const clientAddr *addr, const char *client)
+{
+	// Non-IP identifiers can only be found by their string representation
+	if(addr->family == AF_UNSPEC && client == NULL)
+		return -1;
+
+	const uint32_t hash = hashClient(addr, client);
+	const hashEntry *table = (hashEntry*)shm_clients_hash.ptr;
+	const size_t mask = shm_clients_hash.size / sizeof(hashEntry) - 1u;
+	for(size_t i = hash & mask; table[i].id > -1; i = (i + 1u) & mask)
+	{
+		// Quick test: Does the hash match?
+		if(table[i].hash != hash)
+			continue;
+
+		// Get client pointer
+		const clientsData *cli = getClient(table[i].id, true);
+		if(cli == NULL || cli->addr.family != addr->family)
+			continue;
+
+		// If so, compare the full address (or the string for non-IP
+		// identifiers)
+		if((addr->family == AF_INET &&
+		    cli->addr.addr.in.s_addr == addr->addr.in.s_addr) ||
+		   (addr->family == AF_INET6 &&
+		    IN6_ARE_ADDR_EQUAL(&cli->addr.addr.in6, &addr->addr.in6)) ||
+		   (addr->family == AF_UNSPEC &&
+		    strcmp(getstr(cli->ippos), client) == 0))
+			return table[i].id;
+	}
+
+	// Not found
+	return -1;
+}
+
+void add_client_hash(const int clientID)
+{
+	// More than one client may be added while holding the lock (e.g. when
+	// importing the history from the database)
+	ensure_client_hash_size();
+
+	const clientsData *cli = &clients[clientID];
+	insert_hash(&shm_clients_hash, hashClient(&cli->addr, getstr(cli->ippos)), clientID);
+}
+
+// Keep the client hash index at most half full, rebuild it after resizing
+static void ensure_client_hash_size(void)
+{
+	if(2*(counters->clients + 1) <= counters->clients_hash_MAX)
+		return;
+
+	enlarge_hash(&shm_clients_hash, &counters->clients_hash_MAX);
+	for(int clientID = 0; clientID < counters->clients; clientID++)
+	{
+		const clientsData *cli = &clients[clientID];
+		if(cli->magic != MAGICBYTE)
+			continue;
+		insert_hash(&shm_clients_hash, hashClient(&cli->addr, getstr(cli->ippos)), clientID);
+	}
+}
+
+// Find the slot of the query with the given dnsmasq ID (or -1 if not found)
+static ssize_t find_query_slot(const int id, const uint32_t hash)
+{
+	const hashEntry *table = (hashEntry*)shm_queries_hash.ptr;
+	const size_t mask = shm_queries_hash.size / sizeof(hashEntry) - 1u;
+	for(size_t i = hash & mask; table[i].id > -1; i = (i + 1u) & mask)
+	{
+		// Quick test: Does the hash match?
+		if(table[i].hash != hash)
+			continue;
+
+		// If so, compare the dnsmasq ID of the query
+		const queriesData *query = getQuery(table[i].id, true);
+		if(query != NULL && query->id == id)
+			return i;
+	}
+
+	// Not found
+	return -1;
+}
+
+int lookup_query_hash(const int id)
+{
+	const ssize_t slot = find_query_slot(id, hashBytes(&id, sizeof(id)));
+	if(slot < 0)
+		return -1;
+
+	return ((hashEntry*)shm_queries_hash.ptr)[slot].id;
+}
+
+// Add query to the hash map. An older query with the same dnsmasq ID is
+// replaced so the most recent query is found
+static void insert_query_hash(const int queryID, const int id)
+{
+	const uint32_t hash = hashBytes(&id, sizeof(id));
+	const ssize_t slot = find_query_slot(id, hash);
+	if(slot < 0)
+		insert_hash(&shm_queries_hash, hash, queryID);
+	else
+		((hashEntry*)shm_queries_hash.ptr)[slot].id = queryID;
+}
+
+void add_query_hash(const int queryID)
+{
+	const queriesData *query = getQuery(queryID, true);
+	if(query == NULL)
+		return;
+
+	ensure_query_hash_size();
+	insert_query_hash(queryID, query->id);
+}
+
+// Remove query from the hash map. Nothing is done if a more recent query with
+// the same dnsmasq ID has already taken over the entry
+void remove_query_hash(const int queryID)
+{
+	const queriesData *query = getQuery(queryID, true);
+	if(query == NULL)
+		return;
+
+	const int id = query->id;
+	remove_hash(&shm_queries_hash, hashBytes(&id, sizeof(id)), queryID);
+}
+
+// Re-index all queries, this is necessary after the query IDs have been
+// changed. Queries imported from the database have no dnsmasq ID and are
+// skipped
+void rebuild_query_hash(void)
+{
+	clear_hash(&shm_queries_hash);
+	const int end = counters->queries_head + counters->queries;
+	for(int queryID = counters->queries_head; queryID < end; queryID++)
+	{
+		const queriesData *query = getQuery(queryID, false);
+		if(query == NULL || query->magic != MAGICBYTE || query->id == 0)
+			continue;
+		insert_query_hash(queryID, query->id);
+	}
+}
+
+// Keep the query hash map at most half full, rebuild it after resizing
+static void ensure_query_hash_size(void)
+{
+	if(2*(counters->queries + 1) <= counters->queries_hash_MAX)
+		return;
+
+	enlarge_hash(&shm_queries_hash, &counters->queries_hash_MAX);
+	rebuild_query_hash();
+}
+
+// Hash of the key identifying a DNS cache entry
+static uint32_t __attribute__ ((pure)) hashDNSCache(const int domainID, const int groupsetID, const enum query_types query_type)
+{
+	const int key[3] = { domainID, groupsetID, query_type };
+	return hashBytes(key, sizeof(key));
+}
+
+int lookup_dns_cache_hash(const int domainID, const int groupsetID, const enum query_types query_type)
+{
+	const uint32_t hash = hashDNSCache(domainID, groupsetID, query_type);
+	const hashEntry *table = (hashEntry*)shm_dns_cache_hash.ptr;
+	const size_t mask = shm_dns_cache_hash.size / sizeof(hashEntry) - 1u;
+	for(size_t i = hash & mask; table[i].id > -1; i = (i + 1u) & mask)
+	{
+		// Quick test: Does the hash match?
+		if(table[i].hash != hash)
+			continue;
+
+		// If so, compare the full key
+		const DNSCacheData *cache = getDNSCache(table[i].id, true);
+		if(cache != NULL &&
+		   cache->domainID == domainID &&
+		   cache->groupsetID == groupsetID &&
+		   cache->query_type == query_type)
+			return table[i].id;
+	}
+
+	// Not found
+	return -1;
+}
+
+void add_dns_cache_hash(const int cacheID)
+{
+	ensure_dns_cache_hash_size();
+
+	const DNSCacheData *cache = &dns_cache[cacheID];
+	insert_hash(&shm_dns_cache_hash, hashDNSCache(cache->domainID, cache->groupsetID, cache->query_type), cacheID);
+}
+
+void remove_dns_cache_hash(const int cacheID)
+{
+	const DNSCacheData *cache = &dns_cache[cacheID];
+	remove_hash(&shm_dns_cache_hash, hashDNSCache(cache->domainID, cache->groupsetID, cache->query_type), cacheID);
+}
+
+// Keep the DNS cache hash index at most half full, rebuild it after resizing
+static void ensure_dns_cache_hash_size(void)
+{
+	if(2*(counters->dns_cache_size + 1) <= counters->dns_cache_hash_MAX)
+		return;
+
+	enlarge_hash(&shm_dns_cache_hash, &counters->dns_cache_hash_MAX);
+	rebuild_dns_cache_hash();
+}
+
+// Re-index all DNS cache entries
+static void rebuild_dns_cache_hash(void)
+{
+	clear_hash(&shm_dns_cache_hash);
+	for(int cacheID = 0; cacheID < counters->dns_cache_size; cacheID++)
+	{
+		const DNSCacheData *cache = &dns_cache[cacheID];
+		if(cache->magic != MAGICBYTE || cache->domainID < 0)
+			continue;
+		insert_hash(&shm_dns_cache_hash, hashDNSCache(cache->domainID, cache->groupsetID, cache->query_type), cacheID);
+	}
+}
+
+// Keep the domain hash index at most half full, rebuild it after resizing
+static void ensure_domain_hash_size(void)
+{
+	if(2*(counters->domains + 1) <= counters->domains_hash_MAX)
+		return;
+
+	enlarge_hash(&shm_domains_hash, &counters->domains_hash_MAX);
+	rebuild_domain_hash();
+}
+
+// Re-index all domains
+static void rebuild_domain_hash(void)
+{
+	clear_hash(&shm_domains_hash);
+	for(int domainID = 0; domainID < counters->domains; domainID++)
+	{
+		if(domains[domainID].magic != MAGICBYTE)
+			continue;
+		insert_hash(&shm_domains_hash, hashStr(getstr(domains[domainID].domainpos)), domainID);
+	}
+}
+
+// Check whether the current garbage collection slice is used up after n steps.
+// The same budgets as for removing queries apply. Reading the clock is not
+// free, so the time is only checked every few steps
+static bool slice_used_up(const unsigned int n)
+{
+	if(config.gc_slice.queries > 0 && n >= config.gc_slice.queries)
+		return true;
+	return config.gc_slice.usec > 0 && n % 64u == 0u &&
+	       timer_elapsed_msec(GC_SLICE_TIMER) > 1e-3 * config.gc_slice.usec;
+}
+
+// A domain is dead if neither a query in memory nor anyone else has used it
+// since the current compaction run started
+static bool __attribute__ ((pure)) domain_is_dead(const int domainID)
+{
+	if(domainID < 0 || domainID >= counters->domains)
+		return true;
+	const domainsData *domain = &domains[domainID];
+	return domain->magic != MAGICBYTE ||
+	       (!domain->referenced && domain->count == 0 && domain->blockedcount == 0);
+}
+
+// State of the domain compaction run in progress. It is only ever run by the
+// garbage collection thread
+static struct {
+	enum { DOMAINS_IDLE, DOMAINS_CLEAR, DOMAINS_MARK, DOMAINS_CACHE, DOMAINS_SWEEP } phase;
+	int cursor;
+	int dead;
+	int cache_entries;
+} domain_run = { DOMAINS_IDLE, 0, 0, 0 };
+
+// Remove domains which are not used by any query in memory, together with their
+// DNS cache entries. Domain IDs are never changed, removed domains leave a
+// free slot behind which is reused by findDomainID(). The work is split into
+// slices, each call runs one of them. In between, findDomainID() flags every
+// domain it returns so it survives the current run:
+// 1. Clear the flags of all domains
+// 2. Flag all domains used by queries in memory
+// 3. Drop the DNS cache entries of domains which are still not flagged
+// 4. Free the domains which are still not flagged
+// Returns true once the run is complete and adds the number of removed domains
+// to *removed
+bool compact_domains(int *removed)
+{
+	unsigned int n = 0;
+	switch(domain_run.phase)
+	{
+		case DOMAINS_IDLE:
+			domain_run.cursor = 0;
+			domain_run.dead = 0;
+			domain_run.cache_entries = 0;
+			domain_run.phase = DOMAINS_CLEAR;
+			// fall through
+
+		case DOMAINS_CLEAR:
+			for(; domain_run.cursor < counters->domains; domain_run.cursor++, n++)
+			{
+				if(slice_used_up(n))
+					return false;
+				domains[domain_run.cursor].referenced = false;
+			}
+			// Queries are flagged from the oldest one as the head of the
+			// circular buffer only moves during garbage collection
+			domain_run.cursor = counters->queries_head;
+			domain_run.phase = DOMAINS_MARK;
+			// fall through
+
+		case DOMAINS_MARK:
+			// New queries can be added between slices, the end is re-read
+			for(; domain_run.cursor < counters->queries_head + counters->queries; domain_run.cursor++, n++)
+			{
+				if(slice_used_up(n))
+					return false;
+				const queriesData *query = getQuery(domain_run.cursor, true);
+				if(query == NULL)
+					continue;
+				if(query->domainID > -1 && query->domainID < counters->domains)
+					domains[query->domainID].referenced = true;
+				if(query->CNAME_domainID > -1 && query->CNAME_domainID < counters->domains)
+					domains[query->CNAME_domainID].referenced = true;
+			}
+			domain_run.cursor = 0;
+			domain_run.phase = DOMAINS_CACHE;
+			// fall through
+
+		case DOMAINS_CACHE:
+			// Dropped entries are no longer found. They stay in place and are
+			// reused by evict_cache_entry() once the cache is full
+			for(; domain_run.cursor < counters->dns_cache_size; domain_run.cursor++, n++)
+			{
+				if(slice_used_up(n))
+					return false;
+				DNSCacheData *cache = &dns_cache[domain_run.cursor];
+				if(cache->magic != MAGICBYTE || cache->domainID < 0 ||
+				   !domain_is_dead(cache->domainID))
+					continue;
+				remove_dns_cache_hash(domain_run.cursor);
+				cache->domainID = -1;
+				cache->blocking_status = UNKNOWN_BLOCKED;
+				cache->referenced = false;
+				domain_run.cache_entries++;
+			}
+			domain_run.cursor = 0;
+			domain_run.phase = DOMAINS_SWEEP;
+			// fall through
+
+		case DOMAINS_SWEEP:
+			for(; domain_run.cursor < counters->domains; domain_run.cursor++, n++)
+			{
+				if(slice_used_up(n))
+					return false;
+				const int domainID = domain_run.cursor;
+				domainsData *domain = &domains[domainID];
+				if(domain->magic != MAGICBYTE || !domain_is_dead(domainID))
+					continue;
+
+				remove_hash(&shm_domains_hash, hashStr(getstr(domain->domainpos)), domainID);
+				clear_domain_regex(domainID, domainID + 1);
+				memset(domain, 0, sizeof(domainsData));
+				counters->compaction.free_domains++;
+				if(domainID < counters->compaction.free_domain_hint)
+					counters->compaction.free_domain_hint = domainID;
+				domain_run.dead++;
+			}
+			break;
+	}
+
+	// Give free slots at the end back
+	while(counters->domains > 0 && domains[counters->domains - 1].magic != MAGICBYTE)
+	{
+		counters->domains--;
+		counters->compaction.free_domains--;
+	}
+	if(counters->compaction.free_domain_hint > counters->domains)
+		counters->compaction.free_domain_hint = counters->domains;
+
+	if(domain_run.dead > 0)
+		counters->compaction.runs++;
+	counters->compaction.domains += domain_run.dead;
+	counters->compaction.cache_entries += domain_run.cache_entries;
+	counters->compaction.domain_bytes += domain_run.dead*sizeof(domainsData);
+
+	*removed += domain_run.dead;
+	domain_run.phase = DOMAINS_IDLE;
+	return true;
+}
+
+// Get the first free domain slot, or -1 if there is none
+int get_free_domain_slot(void)
+{
+	if(counters->compaction.free_domains < 1)
+		return -1;
+
+	for(int domainID = counters->compaction.free_domain_hint; domainID < counters->domains; domainID++)
+	{
+		if(domains[domainID].magic == MAGICBYTE)
+			continue;
+		counters->compaction.free_domains--;
+		counters->compaction.free_domain_hint = domainID + 1;
+		return domainID;
+	}
+
+	// Not reached as long as the counter is correct
+	counters->compaction.free_domains = 0;
+	return -1;
+}
+
+// Fields of shared memory objects holding string positions. Group sets are
+// not among them as they take their positions from clients
+enum string_field { FIELD_DOMAIN, FIELD_CLIENT_IP, FIELD_CLIENT_NAME, FIELD_CLIENT_IFACE,
+                    FIELD_CLIENT_GROUPS, FIELD_UPSTREAM_IP, FIELD_UPSTREAM_NAME, FIELD_MAX };
+
+// Get a field holding a string position, NULL if the object does not exist
+static size_t *string_field(const enum string_field field, const int id)
+{
+	switch(field)
+	{
+		case FIELD_DOMAIN:
+			return id < counters->domains ? &domains[id].domainpos : NULL;
+		case FIELD_CLIENT_IP:
+			return id < counters->clients ? &clients[id].ippos : NULL;
+		case FIELD_CLIENT_NAME:
+			return id < counters->clients ? &clients[id].namepos : NULL;
+		case FIELD_CLIENT_IFACE:
+			return id < counters->clients ? &clients[id].ifacepos : NULL;
+		case FIELD_CLIENT_GROUPS:
+			return id < counters->clients ? &clients[id].groupspos : NULL;
+		case FIELD_UPSTREAM_IP:
+			return id < counters->upstreams ? &upstreams[id].ippos : NULL;
+		case FIELD_UPSTREAM_NAME:
+			return id < counters->upstreams ? &upstreams[id].namepos : NULL;
+		case FIELD_MAX:
+			break;
+	}
+	return NULL;
+}
+
+// A string position and one of the fields it was found in
+typedef struct {
+	size_t pos;
+	int id;
+	int next;
+	enum string_field field;
+} stringRef;
+
+// State of the string compaction run in progress. It is only ever run by the
+// garbage collection thread
+static struct {
+	enum { STRINGS_IDLE, STRINGS_COLLECT, STRINGS_MOVE } phase;
+	enum string_field field;
+	int id;
+	size_t rd;
+	size_t wr;
+	size_t live;
+	size_t reclaimed;
+	stringRef *refs;
+	unsigned int nrefs;
+	unsigned int size;
+	int *heads;
+	size_t mask;
+} string_run = { STRINGS_IDLE, FIELD_DOMAIN, 0, 0, 0, 0, 0, NULL, 0, 0, NULL, 0 };
+
+static void end_string_run(void)
+{
+	free(string_run.refs);
+	free(string_run.heads);
+	string_run.refs = NULL;
+	string_run.heads = NULL;
+	string_run.phase = STRINGS_IDLE;
+	counters->compaction.string_cursor = 0;
+	counters->compaction.string_end = 0;
+}
+
+// Remember where a string position was found. Returns false on memory errors
+static bool add_string_ref(const size_t pos, const enum string_field field, const int id)
+{
+	if(string_run.nrefs == string_run.size)
+	{
+		const unsigned int size = string_run.size > 0 ? 2u*string_run.size : 1024u;
+		stringRef *refs = realloc(string_run.refs, size*sizeof(stringRef));
+		if(refs == NULL)
+			return false;
+		string_run.refs = refs;
+		string_run.size = size;
+	}
+
+	// Count each string only once
+	int *head = &string_run.heads[pos & string_run.mask];
+	bool known = false;
+	for(int i = *head; i > -1 && !known; i = string_run.refs[i].next)
+		known = string_run.refs[i].pos == pos;
+	if(!known)
+		string_run.live += strlen(getstr(pos)) + 1;
+
+	stringRef *ref = &string_run.refs[string_run.nrefs];
+	ref->pos = pos;
+	ref->field = field;
+	ref->id = id;
+	ref->next = *head;
+	*head = string_run.nrefs++;
+	return true;
+}
+
+// Move the string at position from to position to, updating all fields and
+// group sets still holding it. Returns false if nothing holds it any longer
+static bool relocate_string(const size_t from, const size_t to)
+{
+	bool used = false;
+	for(int i = string_run.heads[from & string_run.mask]; i > -1; i = string_run.refs[i].next)
+	{
+		if(string_run.refs[i].pos != from)
+			continue;
+		size_t *pos = string_field(string_run.refs[i].field, string_run.refs[i].id);
+		if(pos == NULL || *pos != from)
+			continue;
+		*pos = to;
+		used = true;
+	}
+
+	// Group sets are few, a linear search is sufficient
+	for(int groupsetID = 0; groupsetID < counters->groupsets; groupsetID++)
+	{
+		if(groupsets[groupsetID].magic != MAGICBYTE || groupsets[groupsetID].groupspos != from)
+			continue;
+		groupsets[groupsetID].groupspos = to;
+		used = true;
+	}
+
+	return used;
+}
+
+// Remove strings which are no longer referenced by any domain, client, upstream
+// or group set from the shared string buffer. The remaining strings are moved
+// towards the front and all positions are updated. The work is split into
+// slices, each call runs one of them:
+// 1. Collect the positions stored in all domains, clients and upstreams
+// 2. Walk the buffer, moving used strings down and dropping all others
+// Strings added in between are appended behind the buffer as it was when the
+// run started. Strings which have not been moved yet are not reused by
+// addstr() so every position they are found at has been collected. The gap
+// left behind by moved strings is zeroed and skipped when re-indexing, a gap
+// which cannot be closed as strings were added meanwhile is closed by the next
+// run. Returns true once the run is complete and adds the number of reclaimed
+// bytes to *reclaimed
+bool compact_strings(size_t *reclaimed)
+{
+	unsigned int n = 0;
+	char *buffer = (char*)shm_strings.ptr;
+	const size_t end = counters->compaction.string_end;
+	switch(string_run.phase)
+	{
+		case STRINGS_IDLE:
+		{
+			if(shmSettings->next_str_pos <= 1u)
+				return true;
+
+			size_t buckets = 1024u;
+			while(buckets < 2u*((size_t)counters->domains + 4u*counters->clients + 2u*counters->upstreams))
+				buckets *= 2u;
+			string_run.heads = malloc(buckets*sizeof(int));
+			if(string_run.heads == NULL)
+				return true;
+			memset(string_run.heads, -1, buckets*sizeof(int));
+			string_run.mask = buckets - 1u;
+			string_run.nrefs = 0;
+			string_run.size = 0;
+			string_run.live = 1;
+			string_run.reclaimed = 0;
+			string_run.field = FIELD_DOMAIN;
+			string_run.id = 0;
+			counters->compaction.string_cursor = 1;
+			counters->compaction.string_end = shmSettings->next_str_pos;
+			string_run.phase = STRINGS_COLLECT;
+			return false;
+		}
+
+		case STRINGS_COLLECT:
+			for(; string_run.field < FIELD_MAX; string_run.field++, string_run.id = 0)
+			{
+				const size_t *pos;
+				for(; (pos = string_field(string_run.field, string_run.id)) != NULL; string_run.id++, n++)
+				{
+					if(slice_used_up(n))
+						return false;
+					if(*pos > 0 && *pos < end && !add_string_ref(*pos, string_run.field, string_run.id))
+					{
+						end_string_run();
+						return true;
+					}
+				}
+			}
+			for(int groupsetID = 0; groupsetID < counters->groupsets; groupsetID++)
+			{
+				const size_t pos = groupsets[groupsetID].groupspos;
+				if(groupsets[groupsetID].magic == MAGICBYTE && pos > 0 && pos < end &&
+				   !add_string_ref(pos, FIELD_MAX, groupsetID))
+				{
+					end_string_run();
+					return true;
+				}
+			}
+
+			// Compacting is only worth the effort if a sizeable fraction of
+			// the buffer can be reclaimed
+			if(end - string_run.live < end / COMPACT_MIN_FRACTION)
+			{
+				end_string_run();
+				return true;
+			}
+
+			// Positions become invalid from now on
+			counters->compaction.runs++;
+			string_run.rd = 1;
+			string_run.wr = 1;
+			string_run.phase = STRINGS_MOVE;
+			// fall through
+
+		case STRINGS_MOVE:
+			while(string_run.rd < end)
+			{
+				if(slice_used_up(n++))
+					return false;
+
+				// Skip gaps left behind by earlier runs
+				const size_t rd = string_run.rd, wr = string_run.wr;
+				if(buffer[rd] == '\0')
+				{
+					while(string_run.rd < end && buffer[string_run.rd] == '\0')
+						string_run.rd++;
+					counters->compaction.string_cursor = string_run.rd;
+					continue;
+				}
+
+				const size_t len = strlen(&buffer[rd]) + 1;
+				const uint32_t hash = hashStr(&buffer[rd]);
+				remove_hash(&shm_strings_hash, hash, (int)rd);
+				if(relocate_string(rd, wr))
+				{
+					if(wr != rd)
+					{
+						memmove(&buffer[wr], &buffer[rd], len);
+						memset(&buffer[wr + len], 0, rd - wr);
+					}
+					insert_hash(&shm_strings_hash, hash, (int)wr);
+					string_run.wr += len;
+				}
+				else
+				{
+					memset(&buffer[rd], 0, len);
+					counters->strings--;
+					string_run.reclaimed += len;
+				}
+				string_run.rd += len;
+				counters->compaction.string_cursor = string_run.rd;
+			}
+
+			// The gap can only be given back if no strings have been
+			// added behind it
+			if(shmSettings->next_str_pos == end)
+				shmSettings->next_str_pos = string_run.wr;
+			break;
+	}
+
+	counters->compaction.string_bytes += string_run.reclaimed;
+	*reclaimed += string_run.reclaimed;
+	end_string_run();
+	return true;
+}
+
 /// Create a mutex for shared memory
 static pthread_mutex_t create_mutex(void) {
 	logg("Creating mutex");
@@ -308,6 +1274,30 @@ static pthread_mutex_t create_mutex(void) {
 	return lock;
 }
 
+/// Initialize the reader/writer lock for shared memory
+static void init_rwlock(pthread_rwlock_t *lock) {
+	logg("Creating reader/writer lock");
+	pthread_rwlockattr_t lock_attr = {};
+
+	// Initialize the lock attributes
+	pthread_rwlockattr_init(&lock_attr);
+
+	// Allow the lock to be used by other processes
+	pthread_rwlockattr_setpshared(&lock_attr, PTHREAD_PROCESS_SHARED);
+
+#ifdef __GLIBC__
+	// Prefer writers so a busy API cannot starve the DNS resolver. This
+	// requires that readers never lock recursively
+	pthread_rwlockattr_setkind_np(&lock_attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+
+	// Initialize the lock
+	pthread_rwlock_init(lock, &lock_attr);
+
+	// Destroy the lock attributes since we're done with it
+	pthread_rwlockattr_destroy(&lock_attr);
+}
+
 static void remap_shm(void)
 {
 	// Remap shared object pointers which might have changed
@@ -320,18 +1310,34 @@ static void remap_shm(void)
 	realloc_shm(&shm_clients, counters->clients_MAX, sizeof(clientsData), false);
 	clients = (clientsData*)shm_clients.ptr;
 
+	realloc_shm(&shm_clients_overTime, (size_t)OVERTIME_SLOTS*counters->clients_MAX, sizeof(int), false);
+	clientsOverTime = (int*)shm_clients_overTime.ptr;
+
 	realloc_shm(&shm_upstreams, counters->upstreams_MAX, sizeof(upstreamsData), false);
 	upstreams = (upstreamsData*)shm_upstreams.ptr;
 
 	realloc_shm(&shm_dns_cache, counters->dns_cache_MAX, sizeof(DNSCacheData), false);
 	dns_cache = (DNSCacheData*)shm_dns_cache.ptr;
 
-	realloc_shm(&shm_per_client_regex, counters->per_client_regex_MAX, sizeof(bool), false);
-	// per-client-regex bools are not exposed by a global pointer
+	realloc_shm(&shm_groupset_regex, counters->groupset_regex_MAX, sizeof(bool), false);
+	// per-group-set regex bools are not exposed by a global pointer
+
+	realloc_shm(&shm_groupsets, counters->groupsets_MAX, sizeof(groupsetsData), false);
+	groupsets = (groupsetsData*)shm_groupsets.ptr;
+
+	realloc_shm(&shm_domain_regex, counters->domain_regex_MAX, sizeof(char), false);
+	// per-domain regex results are not exposed by a global pointer
 
 	realloc_shm(&shm_strings, counters->strings_MAX, sizeof(char), false);
 	// strings are not exposed by a global pointer
 
+	realloc_shm(&shm_domains_hash, counters->domains_hash_MAX, sizeof(hashEntry), false);
+	realloc_shm(&shm_clients_hash, counters->clients_hash_MAX, sizeof(hashEntry), false);
+	realloc_shm(&shm_queries_hash, counters->queries_hash_MAX, sizeof(hashEntry), false);
+	realloc_shm(&shm_dns_cache_hash, counters->dns_cache_hash_MAX, sizeof(hashEntry), false);
+	realloc_shm(&shm_strings_hash, counters->strings_hash_MAX, sizeof(hashEntry), false);
+	// hash indices are not exposed by a global pointer
+
 	// Update local counter to reflect that we absorbed this change
 	local_shm_counter = shmSettings->global_shm_counter;
 }
@@ -356,8 +1362,25 @@ void _lock_shm(const char* func, const int line, const char * file)
 		result = pthread_mutex_consistent(&shmLock->lock.outer);
 		if(result != 0)
 			logg("Failed to make outer SHM lock consistent: %s", strerror(result));
+
+		// The reader/writer lock is not robust. If the dead process
+		// also held its writer side, nobody else can be holding it and
+		// we can safely start over with a fresh lock
+		if(shmLock->writer)
+		{
+			logg("Owner of SHM writer lock died, resetting lock");
+			init_rwlock(&shmLock->lock.rw);
+			shmLock->writer = false;
+		}
 	}
 
+	// Wait until all readers are done. Remapping and resizing below
+	// changes the pointers the readers in this process are using
+	result = pthread_rwlock_wrlock(&shmLock->lock.rw);
+	if(result != 0)
+		logg("Error when obtaining SHM writer lock: %s", strerror(result));
+	shmLock->writer = true;
+
 	// Store lock owner after lock has been acquired and was made consistent (if required)
 	shmLock->owner.pid = getpid();
 	shmLock->owner.tid = gettid();
@@ -415,11 +1438,63 @@ void _unlock_shm(const char* func, const int line, const char * file)
 	if(result != 0)
 		logg("Failed to unlock inner SHM lock: %s", strerror(result));
 
+	shmLock->writer = false;
+	result = pthread_rwlock_unlock(&shmLock->lock.rw);
+	if(result != 0)
+		logg("Failed to unlock SHM writer lock: %s", strerror(result));
+
 	result = pthread_mutex_unlock(&shmLock->lock.outer);
 	if(result != 0)
 		logg("Failed to unlock outer SHM lock: %s", strerror(result));
 }
 
+// Obtain shared (read-only) SHMEM lock
+void _lock_shm_read(const char* func, const int line, const char * file)
+{
+	if(config.debug & DEBUG_LOCKS)
+		logg("Waiting for SHM read lock in %s() (%s:%i)", func, file, line);
+
+	int result = pthread_rwlock_rdlock(&shmLock->lock.rw);
+	if(result != 0)
+		logg("Error when obtaining SHM read lock: %s", strerror(result));
+
+	// Readers must not remap shared memory as other readers of this process
+	// may be using the current mappings. Fall back to the exclusive lock if
+	// this process has not yet absorbed the most recent resize
+	if(shmSettings != NULL &&
+	   local_shm_counter != shmSettings->global_shm_counter)
+	{
+		pthread_rwlock_unlock(&shmLock->lock.rw);
+		_lock_shm(func, line, file);
+		return;
+	}
+
+	read_locked = true;
+
+	if(config.debug & DEBUG_LOCKS)
+		logg("Obtained SHM read lock for %s() (%s:%i)", func, file, line);
+}
+
+// Release shared (read-only) SHM lock
+void _unlock_shm_read(const char* func, const int line, const char * file)
+{
+	// We obtained the exclusive lock instead, see above
+	if(!read_locked)
+	{
+		_unlock_shm(func, line, file);
+		return;
+	}
+
+	read_locked = false;
+	const int result = pthread_rwlock_unlock(&shmLock->lock.rw);
+
+	if(config.debug & DEBUG_LOCKS)
+		logg("Removed read lock in %s() (%s:%i)", func, file, line);
+
+	if(result != 0)
+		logg("Failed to unlock SHM read lock: %s", strerror(result));
+}
+
 // Return if we locked this mutex (PID and TID match)
 bool is_our_lock(void)
 {
@@ -444,6 +1519,8 @@ bool init_shmem(bool create_new)
 	{
 		shmLock->lock.outer = create_mutex();
 		shmLock->lock.inner = create_mutex();
+		init_rwlock(&shmLock->lock.rw);
+		shmLock->writer = false;
 	}
 
 	/****************************** shared counters struct ******************************/
@@ -508,6 +1585,13 @@ bool init_shmem(bool create_new)
 	if(create_new)
 		counters->clients_MAX = size;
 
+	/****************************** shared per-client overTime matrix ******************************/
+	// One row of clients_MAX entries for each overTime slot
+	shm_clients_overTime = create_shm(SHARED_CLIENTS_OVERTIME_NAME, OVERTIME_SLOTS*size*sizeof(int), create_new);
+	if(shm_clients_overTime.ptr == NULL)
+		return false;
+	clientsOverTime = (int*)shm_clients_overTime.ptr;
+
 	/****************************** shared upstreams struct ******************************/
 	size = get_optimal_object_size(sizeof(upstreamsData), 1);
 	// Try to create shared memory object
@@ -549,14 +1633,99 @@ bool init_shmem(bool create_new)
 	if(create_new)
 		counters->dns_cache_MAX = size;
 
-	/****************************** shared per-client regex buffer ******************************/
+	/****************************** shared per-group-set regex buffer ******************************/
+	size = pagesize; // Allocate one pagesize initially. This may be expanded later on
+	// Try to create shared memory object
+	shm_groupset_regex = create_shm(SHARED_GROUPSET_REGEX, size, create_new);
+	if(shm_groupset_regex.ptr == NULL)
+		return false;
+	if(create_new)
+		counters->groupset_regex_MAX = size;
+
+	/****************************** shared group sets struct ******************************/
+	size = get_optimal_object_size(sizeof(groupsetsData), 1);
+	// Try to create shared memory object
+	shm_groupsets = create_shm(SHARED_GROUPSETS_NAME, size*sizeof(groupsetsData), create_new);
+	if(shm_groupsets.ptr == NULL)
+		return false;
+	groupsets = (groupsetsData*)shm_groupsets.ptr;
+	if(create_new)
+		counters->groupsets_MAX = size;
+
+	/****************************** shared per-domain regex buffer ******************************/
 	size = pagesize; // Allocate one pagesize initially. This may be expanded later on
 	// Try to create shared memory object
-	shm_per_client_regex = create_shm(SHARED_PER_CLIENT_REGEX, size, create_new);
-	if(shm_per_client_regex.ptr == NULL)
+	shm_domain_regex = create_shm(SHARED_DOMAIN_REGEX, size, create_new);
+	if(shm_domain_regex.ptr == NULL)
+		return false;
+	if(create_new)
+		counters->domain_regex_MAX = size;
+
+	/****************************** shared domains hash index ******************************/
+	size = get_optimal_object_size(sizeof(hashEntry), 1);
+	// Try to create shared memory object
+	shm_domains_hash = create_shm(SHARED_DOMAINS_HASH_NAME, size*sizeof(hashEntry), create_new);
+	if(shm_domains_hash.ptr == NULL)
+		return false;
+	if(create_new)
+	{
+		counters->domains_hash_MAX = size;
+		clear_hash(&shm_domains_hash);
+	}
+
+	/****************************** shared clients hash index ******************************/
+	size = get_optimal_object_size(sizeof(hashEntry), 1);
+	// Try to create shared memory object
+	shm_clients_hash = create_shm(SHARED_CLIENTS_HASH_NAME, size*sizeof(hashEntry), create_new);
+	if(shm_clients_hash.ptr == NULL)
+		return false;
+	if(create_new)
+	{
+		counters->clients_hash_MAX = size;
+		clear_hash(&shm_clients_hash);
+	}
+
+	/****************************** shared queries hash map ******************************/
+	size = get_optimal_object_size(sizeof(hashEntry), 1);
+	// Try to create shared memory object
+	shm_queries_hash = create_shm(SHARED_QUERIES_HASH_NAME, size*sizeof(hashEntry), create_new);
+	if(shm_queries_hash.ptr == NULL)
+		return false;
+	if(create_new)
+	{
+		counters->queries_hash_MAX = size;
+		clear_hash(&shm_queries_hash);
+	}
+
+	/****************************** shared DNS cache hash index ******************************/
+	size = get_optimal_object_size(sizeof(hashEntry), 1);
+	// Try to create shared memory object
+	shm_dns_cache_hash = create_shm(SHARED_DNS_CACHE_HASH_NAME, size*sizeof(hashEntry), create_new);
+	if(shm_dns_cache_hash.ptr == NULL)
+		return false;
+	if(create_new)
+	{
+		counters->dns_cache_hash_MAX = size;
+		clear_hash(&shm_dns_cache_hash);
+	}
+
+	/****************************** shared strings hash index ******************************/
+	size = get_optimal_object_size(sizeof(hashEntry), 1);
+	// Try to create shared memory object
+	shm_strings_hash = create_shm(SHARED_STRINGS_HASH_NAME, size*sizeof(hashEntry), create_new);
+	if(shm_strings_hash.ptr == NULL)
 		return false;
 	if(create_new)
-		counters->per_client_regex_MAX = size;
+	{
+		counters->strings_hash_MAX = size;
+		clear_hash(&shm_strings_hash);
+	}
+
+	/****************************** shared rate-limiting buckets ******************************/
+	// This table has a fixed size, unused buckets are all zero
+	shm_rate_limit = create_shm(SHARED_RATE_LIMIT_NAME, RATE_LIMIT_BUCKETS*sizeof(rateLimitBucket), create_new);
+	if(shm_rate_limit.ptr == NULL)
+		return false;
 
 	return true;
 }
@@ -574,6 +1743,7 @@ void destroy_shmem(void)
 	// First, we destroy the mutex
 	if(shmLock != NULL)
 	{
+		pthread_rwlock_destroy(&shmLock->lock.rw);
 		pthread_mutex_destroy(&shmLock->lock.inner);
 		pthread_mutex_destroy(&shmLock->lock.outer);
 	}
@@ -706,6 +1876,12 @@ static void *enlarge_shmem_struct(const char type)
 			sizeofobj = 1;
 			counter = &counters->strings_MAX;
 			break;
+		case GROUPSETS:
+			sharedMemory = &shm_groupsets;
+			allocation_step = get_optimal_object_size(sizeof(groupsetsData), 1);
+			sizeofobj = sizeof(groupsetsData);
+			counter = &counters->groupsets_MAX;
+			break;
 		default:
 			logg("Invalid argument in enlarge_shmem_struct(%i)", type);
 			return 0;
@@ -889,13 +2065,30 @@ void shm_ensure_size(void)
 	if(counters->queries >= counters->queries_MAX-1)
 	{
 		// Have to reallocate shared memory
+		const int oldMAX = counters->queries_MAX;
 		queries = enlarge_shmem_struct(QUERIES);
 		if(queries == NULL)
 		{
 			logg("FATAL: Memory allocation failed! Exiting");
 			exit(EXIT_FAILURE);
 		}
+
+		// The query buffer is circular. If the stored queries wrap around
+		// the old end of the buffer, move the part starting at the head to
+		// the new end so the queries are consecutive again
+		const int head = counters->queries_head_slot;
+		if(head + counters->queries > oldMAX)
+		{
+			const int delta = counters->queries_MAX - oldMAX;
+			memmove(&queries[head + delta], &queries[head],
+			        (oldMAX - head)*sizeof(queriesData));
+			const int vacated = delta < oldMAX - head ? delta : oldMAX - head;
+			memset(&queries[head], 0, vacated*sizeof(queriesData));
+			counters->queries_head_slot += delta;
+		}
 	}
+	// The query hash map grows with the number of queries
+	ensure_query_hash_size();
 	if(counters->upstreams >= counters->upstreams_MAX-1)
 	{
 		// Have to reallocate shared memory
@@ -909,13 +2102,19 @@ void shm_ensure_size(void)
 	if(counters->clients >= counters->clients_MAX-1)
 	{
 		// Have to reallocate shared memory
+		const int oldMAX = counters->clients_MAX;
 		clients = enlarge_shmem_struct(CLIENTS);
 		if(clients == NULL)
 		{
 			logg("FATAL: Memory allocation failed! Exiting");
 			exit(EXIT_FAILURE);
 		}
+
+		// The per-client overTime matrix needs one more column per client
+		enlarge_clients_overTime(oldMAX);
 	}
+	// The client hash index grows with the number of clients
+	ensure_client_hash_size();
 	if(counters->domains >= counters->domains_MAX-1)
 	{
 		// Have to reallocate shared memory
@@ -926,6 +2125,8 @@ void shm_ensure_size(void)
 			exit(EXIT_FAILURE);
 		}
 	}
+	// The domain hash index grows with the number of domains
+	ensure_domain_hash_size();
 	if(counters->dns_cache_size >= counters->dns_cache_MAX-1)
 	{
 		// Have to reallocate shared memory
@@ -936,6 +2137,20 @@ void shm_ensure_size(void)
 			exit(EXIT_FAILURE);
 		}
 	}
+	// The DNS cache hash index grows with the number of cache entries
+	ensure_dns_cache_hash_size();
+	if(counters->groupsets >= counters->groupsets_MAX-1)
+	{
+		// Have to reallocate shared memory
+		groupsets = enlarge_shmem_struct(GROUPSETS);
+		if(groupsets == NULL)
+		{
+			logg("FATAL: Memory allocation failed! Exiting");
+			exit(EXIT_FAILURE);
+		}
+	}
+	// The string hash index grows with the number of distinct strings
+	ensure_string_hash_size();
 	if(shmSettings->next_str_pos + STRINGS_ALLOC_STEP >= shm_strings.size)
 	{
 		// Have to reallocate shared memory
@@ -947,56 +2162,102 @@ void shm_ensure_size(void)
 	}
 }
 
-void reset_per_client_regex(const int clientID)
+// Number of 64-bit words per group set in the regex bitset. There is one spare
+// word so 64 bits can be read starting at any regex. Rows are aligned to cache
+// lines
+static size_t __attribute__ ((pure)) groupset_regex_stride(void)
 {
-	const unsigned int num_regex_tot = get_num_regex(REGEX_MAX); // total number
-	for(unsigned int i = 0u; i < num_regex_tot; i++)
-	{
-		// Zero-initialize/reset (= false) all regex (white + black)
-		set_per_client_regex(clientID, i, false);
-	}
+	const size_t words = get_num_regex(REGEX_MAX) / 64u + 2u;
+	return (words + 7u) & ~(size_t)7u;
 }
 
-void add_per_client_regex(unsigned int clientID)
+static uint64_t *groupset_regex_row(const int groupsetID, const char *func)
 {
-	const unsigned int num_regex_tot = get_num_regex(REGEX_MAX); // total number
-	const size_t size = get_optimal_object_size(1, counters->clients * num_regex_tot);
-	if(size > shm_per_client_regex.size &&
-	   realloc_shm(&shm_per_client_regex, 1, size, true))
+	const size_t stride = groupset_regex_stride();
+	const size_t end = ((size_t)groupsetID + 1u) * stride * sizeof(uint64_t);
+	if(groupsetID < 0 || end > shm_groupset_regex.size)
 	{
-		reset_per_client_regex(clientID);
-		counters->per_client_regex_MAX = size;
+		logg("ERROR: %s(%d): Out of bounds (%zu > %zu)!",
+		     func, groupsetID, end, shm_groupset_regex.size);
+		return NULL;
 	}
+	return (uint64_t*)shm_groupset_regex.ptr + (size_t)groupsetID * stride;
 }
 
-bool get_per_client_regex(const int clientID, const int regexID)
+void reset_groupset_regex(const int groupsetID)
 {
-	const unsigned int num_regex_tot = get_num_regex(REGEX_MAX); // total number
-	const unsigned int id = clientID * num_regex_tot + regexID;
-	const size_t maxval = shm_per_client_regex.size / sizeof(bool);
-	if(id > maxval)
+	// Zero-initialize/reset (= false) all regex (white + black)
+	uint64_t *row = groupset_regex_row(groupsetID, __FUNCTION__);
+	if(row != NULL)
+		memset(row, 0, groupset_regex_stride() * sizeof(uint64_t));
+}
+
+void add_groupset_regex(const int groupsetID)
+{
+	const size_t rows = groupsetID < counters->groupsets ? counters->groupsets : groupsetID + 1;
+	const size_t size = get_optimal_object_size(1, rows * groupset_regex_stride() * sizeof(uint64_t));
+	if(size > shm_groupset_regex.size &&
+	   realloc_shm(&shm_groupset_regex, 1, size, true))
+		counters->groupset_regex_MAX = size;
+}
+
+// Get the bitset of regex enabled for a group set, bit i corresponds to regex i
+// (blacklist regex first, followed by the whitelist regex)
+const uint64_t *get_groupset_regex(const int groupsetID)
+{
+	return groupset_regex_row(groupsetID, __FUNCTION__);
+}
+
+void set_groupset_regex(const int groupsetID, const int regexID, const bool value)
+{
+	uint64_t *row = groupset_regex_row(groupsetID, __FUNCTION__);
+	if(row == NULL || regexID < 0)
+		return;
+	if(value)
+		row[regexID / 64] |= 1ull << (regexID % 64);
+	else
+		row[regexID / 64] &= ~(1ull << (regexID % 64));
+}
+
+// Per-domain buffer caching the results of all regex for a domain. Each row
+// consists of stride 64-bit words, the layout is up to the caller. Cached rows
+// are discarded when the stride changes, i.e., when the number of regex changed
+uint64_t *get_domain_regex(const int domainID, const unsigned int stride)
+{
+	if(domainID < 0 || domainID >= counters->domains || stride == 0u)
+		return NULL;
+
+	if((unsigned int)counters->domain_regex_stride != stride)
 	{
-		logg("ERROR: get_per_client_regex(%d, %d): Out of bounds (%d > %d * %d, shm_per_client_regex.size = %zd)!",
-		     clientID, regexID,
-		     id, counters->clients, num_regex_tot, maxval);
-		return false;
+		memset(shm_domain_regex.ptr, 0, shm_domain_regex.size);
+		counters->domain_regex_stride = stride;
 	}
-	return ((bool*) shm_per_client_regex.ptr)[id];
+
+	const size_t needed = ((size_t)domainID + 1u) * stride * sizeof(uint64_t);
+	if(needed > shm_domain_regex.size)
+	{
+		// Allocate enough space for all domains we have memory for
+		const size_t size = get_optimal_object_size(1, (size_t)counters->domains_MAX * stride * sizeof(uint64_t));
+		if(size < needed || !realloc_shm(&shm_domain_regex, 1, size, true))
+			return NULL;
+		counters->domain_regex_MAX = size;
+	}
+
+	return (uint64_t*)shm_domain_regex.ptr + (size_t)domainID * stride;
 }
 
-void set_per_client_regex(const int clientID, const int regexID, const bool value)
+// Forget cached regex results of domain IDs which are free again
+static void clear_domain_regex(const int from, const int to)
 {
-	const unsigned int num_regex_tot = get_num_regex(REGEX_MAX); // total number
-	const unsigned int id = clientID * num_regex_tot + regexID;
-	const size_t maxval = shm_per_client_regex.size / sizeof(bool);
-	if(id > maxval)
-	{
-		logg("ERROR: set_per_client_regex(%d, %d, %s): Out of bounds (%d > %d * %d, shm_per_client_regex.size = %zd)!",
-		     clientID, regexID, value ? "true" : "false",
-		     id, counters->clients, num_regex_tot, maxval);
+	const size_t stride = counters->domain_regex_stride;
+	const size_t row = stride * sizeof(uint64_t);
+	const size_t start = (size_t)from * row;
+	if(stride == 0u || start >= shm_domain_regex.size)
 		return;
-	}
-	((bool*) shm_per_client_regex.ptr)[id] = value;
+	size_t end = (size_t)to * row;
+	if(end > shm_domain_regex.size)
+		end = shm_domain_regex.size;
+	memset((char*)shm_domain_regex.ptr + start, 0, end - start);
 }
 
 static inline bool check_range(int ID, int MAXID, const char* type, int line, const char * function, const char * file)
@@ -1040,7 +2301,7 @@ queriesData* _getQuery(int queryID, bool checkMagic, int line, const char * func
 		return NULL;
 
 	// We are not in a locked situation, return a NULL pointer
-	if(config.debug & DEBUG_LOCKS && !is_our_lock())
+	if(config.debug & DEBUG_LOCKS && !is_our_lock() && !read_locked)
 	{
 		logg("ERROR: Tried to obtain query pointer without lock in %s() (%s:%i)!",
 		     function, file, line);
@@ -1048,9 +2309,23 @@ queriesData* _getQuery(int queryID, bool checkMagic, int line, const char * func
 		return NULL;
 	}
 
-	if(check_range(queryID, counters->queries_MAX, "query", line, function, file) &&
-	   check_magic(queryID, checkMagic, queries[queryID].magic, "query", line, function, file))
-		return &queries[queryID];
+	// Queries are stored in a circular buffer, the oldest query in memory
+	// (queries_head) is found at slot queries_head_slot
+	if(queryID < counters->queries_head ||
+	   queryID - counters->queries_head >= counters->queries_MAX)
+	{
+		if(config.debug)
+		{
+			logg("ERROR: Trying to access query ID %i, but valid range is [%i, %i)",
+			     queryID, counters->queries_head, counters->queries_head + counters->queries_MAX);
+			logg("       found in %s() (%s:%i)", function, file, line);
+		}
+		return NULL;
+	}
+	const int slot = (counters->queries_head_slot + (queryID - counters->queries_head)) % counters->queries_MAX;
+
+	if(check_magic(queryID, checkMagic, queries[slot].magic, "query", line, function, file))
+		return &queries[slot];
 	else
 		return NULL;
 }
@@ -1062,7 +2337,7 @@ clientsData* _getClient(int clientID, bool checkMagic, int line, const char * fu
 		return NULL;
 
 	// We are not in a locked situation, return a NULL pointer
-	if(config.debug & DEBUG_LOCKS && !is_our_lock())
+	if(config.debug & DEBUG_LOCKS && !is_our_lock() && !read_locked)
 	{
 		logg("ERROR: Tried to obtain client pointer without lock in %s() (%s:%i)!",
 		     function, file, line);
@@ -1084,7 +2359,7 @@ domainsData* _getDomain(int domainID, bool checkMagic, int line, const char * fu
 		return NULL;
 
 	// We are not in a locked situation, return a NULL pointer
-	if(config.debug & DEBUG_LOCKS && !is_our_lock())
+	if(config.debug & DEBUG_LOCKS && !is_our_lock() && !read_locked)
 	{
 		logg("ERROR: Tried to obtain domain pointer without lock in %s() (%s:%i)!",
 		     function, file, line);
@@ -1106,7 +2381,7 @@ upstreamsData* _getUpstream(int upstreamID, bool checkMagic, int line, const cha
 		return NULL;
 
 	// We are not in a locked situation, return a NULL pointer
-	if(config.debug & DEBUG_LOCKS && !is_our_lock())
+	if(config.debug & DEBUG_LOCKS && !is_our_lock() && !read_locked)
 	{
 		logg("ERROR: Tried to obtain upstream pointer without lock in %s() (%s:%i)!",
 		     function, file, line);
@@ -1128,7 +2403,7 @@ DNSCacheData* _getDNSCache(int cacheID, bool checkMagic, int line, const char *
 		return NULL;
 
 	// We are not in a locked situation, return a NULL pointer
-	if(config.debug & DEBUG_LOCKS && !is_our_lock())
+	if(config.debug & DEBUG_LOCKS && !is_our_lock() && !read_locked)
 	{
 		logg("ERROR: Tried to obtain cache pointer without lock in %s() (%s:%i)!",
 		     function, file, line);
@@ -1142,3 +2417,98 @@ DNSCacheData* _getDNSCache(int cacheID, bool checkMagic, int line, const char *
 	else
 		return NULL;
 }
+
+groupsetsData* _getGroupset(int groupsetID, bool checkMagic, int line, const char * function, const char * file)
+{
+	// This does not exist, we return a NULL pointer
+	if(groupsetID < 0)
+		return NULL;
+
+	// We are not in a locked situation, return a NULL pointer
+	if(config.debug & DEBUG_LOCKS && !is_our_lock() && !read_locked)
+	{
+		logg("ERROR: Tried to obtain group set pointer without lock in %s() (%s:%i)!",
+		     function, file, line);
+		generate_backtrace();
+		return NULL;
+	}
+
+	if(check_range(groupsetID, counters->groupsets_MAX, "group set", line, function, file) &&
+	   check_magic(groupsetID, checkMagic, groupsets[groupsetID].magic, "group set", line, function, file))
+		return &groupsets[groupsetID];
+	else
+		return NULL;
+}
+
+// Widen the per-client overTime matrix after the clients struct has been
+// enlarged. The rows are moved to their new positions starting with the last
+// one so no data is overwritten before it has been moved
+static void enlarge_clients_overTime(const int oldMAX)
+{
+	const int newMAX = counters->clients_MAX;
+	realloc_shm(&shm_clients_overTime, (size_t)OVERTIME_SLOTS*newMAX, sizeof(int), true);
+	clientsOverTime = (int*)shm_clients_overTime.ptr;
+
+	for(int slot = OVERTIME_SLOTS - 1; slot >= 0; slot--)
+	{
+		int *row = &clientsOverTime[slot*newMAX];
+		memmove(row, &clientsOverTime[slot*oldMAX], oldMAX*sizeof(int));
+		memset(&row[oldMAX], 0, (newMAX - oldMAX)*sizeof(int));
+	}
+}
+
+int get_client_overTime(const int clientID, const unsigned int slot)
+{
+	if(clientID < 0 || clientID >= counters->clients_MAX || slot >= OVERTIME_SLOTS)
+		return 0;
+	return clientsOverTime[slot*counters->clients_MAX + clientID];
+}
+
+void change_client_overTime(const int clientID, const unsigned int slot, const int value)
+{
+	if(clientID < 0 || clientID >= counters->clients_MAX || slot >= OVERTIME_SLOTS)
+		return;
+	clientsOverTime[slot*counters->clients_MAX + clientID] += value;
+}
+
+void reset_client_overTime(const int clientID)
+{
+	if(clientID < 0 || clientID >= counters->clients_MAX)
+		return;
+	for(unsigned int slot = 0; slot < OVERTIME_SLOTS; slot++)
+		clientsOverTime[slot*counters->clients_MAX + clientID] = 0;
+}
+
+// Zero one overTime slot of all clients
+void reset_clients_overTime_slot(const unsigned int slot)
+{
+	if(slot >= OVERTIME_SLOTS)
+		return;
+	memset(&clientsOverTime[slot*counters->clients_MAX], 0, counters->clients_MAX*sizeof(int));
+}
+
+// Move the overTime data of all clients by the given number of slots towards
+// the beginning. The freed slots at the end have to be reset by the caller
+void move_clients_overTime(const unsigned int slots)
+{
+	if(slots == 0 || slots >= OVERTIME_SLOTS)
+		return;
+	memmove(&clientsOverTime[0], &clientsOverTime[slots*counters->clients_MAX],
+	        (OVERTIME_SLOTS - slots)*counters->clients_MAX*sizeof(int));
+}
+
+rateLimitBucket *get_rate_limit_bucket(const unsigned int slot)
+{
+	if(slot >= RATE_LIMIT_BUCKETS)
+		return NULL;
+
+	// We are not in a locked situation, return a NULL pointer
+	if(config.debug & DEBUG_LOCKS && !is_our_lock() && !read_locked)
+	{
+		logg("ERROR: Tried to obtain rate-limit bucket pointer without lock!");
+		generate_backtrace();
+		return NULL;
+	}
+
+	return &((rateLimitBucket*)shm_rate_limit.ptr)[slot];
+}
@@ -37,6 +37,8 @@ ASSERT_SIZEOF(ShmSettings, 12, 12, 12);
 
 typedef struct {
 	int queries;
+	int queries_head;
+	int queries_head_slot;
 	int upstreams;
 	int clients;
 	int domains;
@@ -48,13 +50,65 @@ typedef struct {
 	int gravity;
 	int dns_cache_size;
 	int dns_cache_MAX;
-	int per_client_regex_MAX;
+	int groupset_regex_MAX;
+	int groupsets;
+	int groupsets_MAX;
+	int domain_regex_MAX;
+	int domain_regex_stride;
+	int domains_hash_MAX;
+	int clients_hash_MAX;
+	int queries_hash_MAX;
+	int dns_cache_hash_MAX;
+	int strings_hash_MAX;
+	int strings;
+	int dns_cache_hand;
 	unsigned int regex_change;
+	unsigned int groupsets_released;
+	struct {
+		unsigned int hits;
+		unsigned int misses;
+		unsigned int evictions;
+	} dns_cache_stats;
+	struct {
+		unsigned int slices;
+		unsigned int removed;
+		unsigned int last_usec;
+		unsigned int max_usec;
+	} gc_stats;
+	struct {
+		unsigned int runs;
+		unsigned int domains;
+		unsigned int cache_entries;
+		unsigned int domain_bytes;
+		unsigned int string_bytes;
+		int free_domains;
+		int free_domain_hint;
+		unsigned int string_cursor;
+		unsigned int string_end;
+	} compaction;
+	struct {
+		unsigned int hits;
+		unsigned int misses;
+		unsigned int false_positives;
+	} list_filter;
+	struct {
+		unsigned int queries;
+		unsigned int clients;
+		unsigned int subnets;
+	} rate_limit;
+	struct {
+		unsigned int workers;
+		unsigned int busy;
+		unsigned int started;
+		unsigned int pooled;
+		unsigned int forked;
+		unsigned int generation;
+	} tcp_pool;
 	int querytype[TYPE_MAX-1];
 	int status[QUERY_STATUS_MAX];
 	int reply[QUERY_REPLY_MAX];
 } countersStruct;
-ASSERT_SIZEOF(countersStruct, 240, 240, 240);
+ASSERT_SIZEOF(countersStruct, 408, 408, 408);
 
 extern countersStruct *counters;
 
@@ -103,6 +157,14 @@ void _unlock_shm(const char* func, const int line, const char* file);
 #define unlock_log() _unlock_log(__FUNCTION__, __LINE__, __FILE__)
 void _unlock_log(const char* func, const int line, const char * file);
 
+/// Block until a shared (read-only) lock can be obtained. Any number of readers
+/// may hold this lock at the same time, but never together with lock_shm().
+/// Readers must not modify shared memory and must not lock recursively
+#define lock_shm_read() _lock_shm_read(__FUNCTION__, __LINE__, __FILE__)
+void _lock_shm_read(const char* func, const int line, const char* file);
+#define unlock_shm_read() _unlock_shm_read(__FUNCTION__, __LINE__, __FILE__)
+void _unlock_shm_read(const char* func, const int line, const char* file);
+
 /// Block until a lock can be obtained
 
 bool init_shmem(bool create_new);
@@ -110,6 +172,34 @@ void destroy_shmem(void);
 size_t addstr(const char *str);
 const char *getstr(const size_t pos);
 
+// Reclaim memory of domains and strings which are no longer referenced. Each
+// call runs one slice and returns true once the compaction is complete
+bool compact_domains(int *removed);
+bool compact_strings(size_t *reclaimed);
+int get_free_domain_slot(void);
+
+// Hash function used for the shared-memory lookup indices
+uint32_t hashStr(const char *s) __attribute__ ((pure));
+
+// Shared-memory hash index mapping domain strings to domain IDs
+int lookup_domain_hash(const char *domain, const uint32_t hash);
+void add_domain_hash(const int domainID);
+
+// Shared-memory hash index mapping binary client addresses to client IDs
+int lookup_client_hash(const clientAddr *addr, const char *client);
+void add_client_hash(const int clientID);
+
+// Shared-memory hash map from dnsmasq IDs to query IDs
+int lookup_query_hash(const int id);
+void add_query_hash(const int queryID);
+void remove_query_hash(const int queryID);
+void rebuild_query_hash(void);
+
+// Shared-memory hash index mapping (domain, group set, type) to DNS cache IDs
+int lookup_dns_cache_hash(const int domainID, const int groupsetID, const enum query_types query_type);
+void add_dns_cache_hash(const int cacheID);
+void remove_dns_cache_hash(const int cacheID);
+
 /**
  * Escapes a string by replacing special characters, such as spaces
  * The input string is always duplicated, ensure to free it after use
@@ -121,17 +211,12 @@ char *str_escape(const char *input, unsigned int *N) __attribute__ ((malloc));
  */
 bool strcmp_escaped(const char *a, const char *b);
 
-/**
- * Create a new overTime client shared memory block.
- * This also updates `overTimeClientData`.
- */
-void newOverTimeClient(const int clientID);
-
-/**
- * Add a new overTime slot to each overTime client shared memory block.
- * This also updates `overTimeClientData`.
- */
-void addOverTimeClientSlot(void);
+// Per-client overTime data, stored in a matrix with one row per overTime slot
+int get_client_overTime(const int clientID, const unsigned int slot) __attribute__ ((pure));
+void change_client_overTime(const int clientID, const unsigned int slot, const int value);
+void reset_client_overTime(const int clientID);
+void reset_clients_overTime_slot(const unsigned int slot);
+void move_clients_overTime(const unsigned int slots);
 
 // Change ownership of shared memory objects
 void chown_all_shmem(struct passwd *ent_pw);
@@ -139,10 +224,17 @@ void chown_all_shmem(struct passwd *ent_pw);
 // Get details about shared memory used by FTL
 void log_shmem_details(void);
 
-// Per-client regex buffer storing whether or not a specific regex is enabled for a particular client
-void add_per_client_regex(unsigned int clientID);
-void reset_per_client_regex(const int clientID);
-bool get_per_client_regex(const int clientID, const int regexID);
-void set_per_client_regex(const int clientID, const int regexID, const bool value);
+// Per-group-set regex bitset storing whether or not a specific regex is enabled for a particular group set
+void add_groupset_regex(const int groupsetID);
+void reset_groupset_regex(const int groupsetID);
+const uint64_t *get_groupset_regex(const int groupsetID);
+void set_groupset_regex(const int groupsetID, const int regexID, const bool value);
+
+// Per-domain buffer caching the results of all regex for a particular domain
+uint64_t *get_domain_regex(const int domainID, const unsigned int stride);
+
+// Fixed-size table of per-subnet rate-limiting buckets
+#define RATE_LIMIT_BUCKETS 4096u
+rateLimitBucket *get_rate_limit_bucket(const unsigned int slot);
 
 #endif //SHARED_MEMORY_SERVER_H
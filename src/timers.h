@@ -15,8 +15,10 @@ enum timers {
 	DATABASE_WRITE_TIMER,
 	EXIT_TIMER,
 	GC_TIMER,
+	GC_SLICE_TIMER,
 	LISTS_TIMER,
 	REGEX_TIMER,
+	CLIENTS_TIMER,
 	ARP_TIMER,
 	LAST_TIMER
 	} __attribute__ ((packed));
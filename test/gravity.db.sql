@@ -208,6 +208,9 @@ INSERT INTO domainlist VALUES(14,3,'^regex-notA$;querytype=!A',1,1559928803,1559
 /* Other special domains */
 INSERT INTO domainlist VALUES(15,1,'blacklisted-group-disabled.com',1,1559928803,1559928803,'Entry disabled by a group');
 
+/* Wildcard blacklist */
+INSERT INTO domainlist VALUES(16,4,'*.wildcard.ftl',1,1559928803,1559928803,'');
+
 INSERT INTO adlist VALUES(1,'https://hosts-file.net/ad_servers.txt',1,1559928803,1559928803,'Migrated from /etc/pihole/adlists.list');
 
 INSERT INTO gravity VALUES('whitelisted.ftl',1);
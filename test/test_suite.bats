@@ -584,6 +584,69 @@
   [[ ${lines[2]} == "" ]]
 }
 
+@test "Per-client cache statistics are reported" {
+  run bash -c 'echo ">per-client-cache >quit" | nc -v 127.0.0.1 4711'
+  printf "%s\n" "${lines[@]}"
+  [[ ${lines[1]} == "size: "* ]]
+  [[ ${lines[2]} == "max: 65536" ]]
+  [[ ${lines[3]} == "hits: "* ]]
+  [[ ${lines[4]} == "misses: "* ]]
+  [[ ${lines[5]} == "evictions: 0" ]]
+  [[ ${lines[6]} == "group-sets: "* ]]
+  [[ ${lines[7]} == "" ]]
+}
+
+@test "Garbage collection statistics are reported" {
+  run bash -c 'echo ">gc-stats >quit" | nc -v 127.0.0.1 4711'
+  printf "%s\n" "${lines[@]}"
+  [[ ${lines[1]} == "slices: "* ]]
+  [[ ${lines[2]} == "removed: "* ]]
+  [[ ${lines[3]} == "last-slice-us: "* ]]
+  [[ ${lines[4]} == "max-lock-hold-us: "* ]]
+  [[ ${lines[5]} == "compactions: "* ]]
+  [[ ${lines[6]} == "removed-domains: "* ]]
+  [[ ${lines[7]} == "removed-cache-entries: "* ]]
+  [[ ${lines[8]} == "reclaimed-domain-bytes: "* ]]
+  [[ ${lines[9]} == "reclaimed-string-bytes: "* ]]
+  [[ ${lines[10]} == "" ]]
+}
+
+@test "Domain list filter statistics are reported" {
+  run bash -c 'echo ">list-filter >quit" | nc -v 127.0.0.1 4711'
+  printf "%s\n" "${lines[@]}"
+  [[ ${lines[1]} == "domains: "* ]]
+  [[ ${lines[2]} == "bytes: "* ]]
+  [[ ${lines[3]} == "bits-per-domain: "* ]]
+  [[ ${lines[4]} == "hits: "* ]]
+  [[ ${lines[5]} == "misses: "* ]]
+  [[ ${lines[6]} == "false-positives: "* ]]
+  [[ ${lines[7]} == "" ]]
+}
+
+@test "Rate-limiting statistics are reported" {
+  run bash -c 'echo ">rate-limit >quit" | nc -v 127.0.0.1 4711'
+  printf "%s\n" "${lines[@]}"
+  [[ ${lines[1]} == "refused-queries: "* ]]
+  [[ ${lines[2]} == "limited-clients: "* ]]
+  [[ ${lines[3]} == "limited-subnets: 0" ]]
+  [[ ${lines[4]} == "active-clients: "* ]]
+  [[ ${lines[5]} == "active-subnets: 0" ]]
+  [[ ${lines[6]} == "" ]]
+}
+
+@test "TCP connections are forked when the worker pool is disabled" {
+  run bash -c 'echo ">tcp-workers >quit" | nc -v 127.0.0.1 4711'
+  printf "%s\n" "${lines[@]}"
+  [[ ${lines[1]} == "pool-size: 0" ]]
+  [[ ${lines[2]} == "workers: 0" ]]
+  [[ ${lines[3]} == "busy: 0" ]]
+  [[ ${lines[4]} == "started: 0" ]]
+  [[ ${lines[5]} == "pooled-connections: 0" ]]
+  [[ ${lines[6]} == "forked-connections: "* ]]
+  [[ ${lines[6]} != "forked-connections: 0" ]]
+  [[ ${lines[7]} == "" ]]
+}
+
 @test "pihole-FTL.db schema is as expected" {
   run bash -c 'sqlite3 /etc/pihole/pihole-FTL.db .dump'
   printf "%s\n" "${lines[@]}"
@@ -1196,6 +1259,18 @@
   [[ "${lines[@]}" == *"EDNS(0) CLIENT SUBNET: Skipped ::1/128 (IPv6 loopback address)"* ]]
 }
 
+@test "Wildcard blacklist blocks domain and subdomains" {
+  run bash -c "dig wildcard.ftl @127.0.0.1 +short"
+  printf "%s\n" "${lines[@]}"
+  [[ ${lines[0]} == "0.0.0.0" ]]
+  run bash -c "dig a.b.wildcard.ftl @127.0.0.1 +short"
+  printf "%s\n" "${lines[@]}"
+  [[ ${lines[0]} == "0.0.0.0" ]]
+  run bash -c 'grep -c "wildcard blacklisted a.b.wildcard.ftl is 0.0.0.0" /var/log/pihole.log'
+  printf "%s\n" "${lines[@]}"
+  [[ ${lines[0]} == "1" ]]
+}
+
 @test "Embedded SQLite3 shell available and functional" {
   run bash -c './pihole-FTL sqlite3 -help'
   printf "%s\n" "${lines[@]}"
@@ -1234,3 +1309,46 @@
   printf "%s\n" "${lines[@]}"
   [[ "${lines[0]}" == "" ]]
 }
+
+# This test modifies gravity.db and reloads the lists, keep it behind all tests
+# using the lists
+@test "Domain list snapshot with an empty list is reused" {
+  sqlite3 /etc/pihole/gravity.db "UPDATE domainlist SET enabled = 0 WHERE type = 4;"
+  kill -HUP $(pidof pihole-FTL)
+  sleep 2
+  kill -HUP $(pidof pihole-FTL)
+  sleep 2
+  run bash -c 'grep -c "and 0 wildcard domains .* from snapshot .*shared)" /var/log/pihole-FTL.log'
+  printf "%s\n" "${lines[@]}"
+  [[ ${lines[0]} == "1" ]]
+  sqlite3 /etc/pihole/gravity.db "UPDATE domainlist SET enabled = 1 WHERE type = 4;"
+  kill -HUP $(pidof pihole-FTL)
+  sleep 2
+  run bash -c "dig c.wildcard.ftl @127.0.0.1 +short"
+  printf "%s\n" "${lines[@]}"
+  [[ ${lines[0]} == "0.0.0.0" ]]
+}
+
+# This test restarts FTL with the TCP worker pool enabled, keep it last
+@test "TCP worker pool handles connections" {
+  kill $(pidof pihole-FTL)
+  while pidof -s pihole-FTL > /dev/null; do sleep 1; done
+  echo "TCP_WORKERS=2" >> /etc/pihole/pihole-FTL.conf
+  su pihole -s /bin/sh -c /home/pihole/pihole-FTL
+  sleep 2
+  sed -i '/^TCP_WORKERS=/d' /etc/pihole/pihole-FTL.conf
+  run bash -c "dig gravity.ftl @127.0.0.1 +tcp +short"
+  printf "%s\n" "${lines[@]}"
+  [[ ${lines[0]} == "0.0.0.0" ]]
+  run bash -c 'echo ">tcp-workers >quit" | nc -v 127.0.0.1 4711'
+  printf "%s\n" "${lines[@]}"
+  [[ ${lines[1]} == "pool-size: 2" ]]
+  [[ ${lines[2]} == "workers: "* ]]
+  [[ ${lines[3]} == "busy: "* ]]
+  [[ ${lines[4]} == "started: "* ]]
+  [[ ${lines[4]} != "started: 0" ]]
+  [[ ${lines[5]} == "pooled-connections: "* ]]
+  [[ ${lines[5]} != "pooled-connections: 0" ]]
+  [[ ${lines[6]} == "forked-connections: "* ]]
+  [[ ${lines[7]} == "" ]]
+}